@@ -2,9 +2,8 @@
 #define BINARY_SENSOR
 
 #include "Sensor.hpp"
+#include "GPIOBackend.hpp"
 #include "types.h"
-#include <pigpio.h>
-#include <string>
 
 namespace RaspLatte{
   class BinarySensor : public Sensor<bool>{
@@ -13,45 +12,48 @@ namespace RaspLatte{
      * - Implement the read function that returns the sensor's state
      * - A way to attach a callback function to be run when the sensor changes state (i.e. a user presses a button) (FUTURE WORK)
      * - A debounce mechenism that limits the rate of switching (FUTURE WORK)
+     *
+     * read() is on the control loop's path so it never throws or allocates. A failed read returns the
+     * last good state and sets error() until a read succeeds.
      */
   public:
-    BinarySensor(const PinIndex p, const bool invert = false, const bool pull_down = false): p_(p), invert_(invert){
-      if (gpioInitialise() < 0){
-	throw "Could not start GPIO!";
-      }
-      
-      gpioSetMode(p_, PI_INPUT);
-      if (pull_down){
-	gpioSetPullUpDown(p_, PI_PUD_DOWN);
-      } else {
-	gpioSetPullUpDown(p_, PI_PUD_UP);
-      }
+    enum Error {READ_OK, READ_FAILED}; // Not OK, which curses defines
+    
+    BinarySensor(GPIOBackend * gpio, const PinIndex p, const bool invert = false, const bool pull_down = false):
+      gpio_(gpio), p_(p), invert_(invert){
+      // The backend is already running (see HardwareContext)
+      gpio_->setInput(p_, pull_down ? GPIOBackend::PULL_DOWN : GPIOBackend::PULL_UP);
 
-      int sensor_val = gpioRead(p_);
-      if (sensor_val==PI_BAD_GPIO){
-	std::string msg = "Bad GPIO pin for BinarySensor: Pin #";
-	msg += std::to_string(p_);
-	throw msg.c_str();
+      read();
+      if (error_ != READ_OK){
+	throw "Error: Bad GPIO pin for BinarySensor";
       }
     }
 
     virtual bool read() {
-      int sensor_val = gpioRead(p_);
-      if (sensor_val==PI_BAD_GPIO){
-	std::string msg = "Bad GPIO pin for BinarySensor: Pin #";
-	msg += std::to_string(p_);
-	throw msg.c_str();
+      int sensor_val = gpio_->read(p_);
+      if (sensor_val < 0){
+	error_ = READ_FAILED;
+	return state_;
       }
+      error_ = READ_OK;
       if (invert_){
-	return (sensor_val==0);
+	state_ = (sensor_val==0);
       } else {
-	return (sensor_val==1);
+	state_ = (sensor_val==1);
       }
+      return state_;
     }
+
+    /** Result of the last read() */
+    Error error(){ return error_; }
     
   private:
+    GPIOBackend * gpio_;
     const PinIndex p_;
     const bool invert_; 
+    bool state_ = false; /** Last good state */
+    Error error_ = READ_OK;
   };
 }
 #endif
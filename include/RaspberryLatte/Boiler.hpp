@@ -3,6 +3,10 @@
 
 #include "PID.hpp"
 #include "Clamp.hpp"
+#include "GainSchedule.hpp"
+#include "Clock.hpp"
+#include "GPIOBackend.hpp"
+#include "SafetySupervisor.hpp"
 #include "types.h"
 
 namespace RaspLatte{
@@ -20,6 +24,7 @@ namespace RaspLatte{
   
   class Boiler{
   private:
+    GPIOBackend * gpio_; /** The hardware the heater is attached to */
     Sensor<double> * temp_sensor_; /** A pointer to the sensor measuring the boiler's temp */
     double setpoint_; /** The setpoint being tracked by the boiler when active */
     PID ctrl_; /** A PID controller regulating the PWM output */
@@ -27,19 +32,47 @@ namespace RaspLatte{
     bool active_; /** A boolean indicating if the heater is on */
     unsigned int current_pwm_setting_ = 0; /** A record of the last pwm setting to check for changes */
     Clamp<double> setpoint_clamp_; /** A clamp object that clips the setpoint within reasionable bounds */
+    const GainSchedule * schedule_ = NULL; /** If set, gains are looked up here before every update */
+    HeaterGate * gate_ = NULL; /** If set, all heater output goes through here */
+    bool held_ = false; /** True while the gate is holding the heater off */
+
+    void writeHeater(unsigned int duty);
 
   public:
-    Boiler(Sensor<double> * temp_sensor, double setpoint, const PID::PIDGains * pid_gains, PinIndex heater_pin_idx,
-	   double min_setpoint = 0, double max_setpoint = 160);
+    Boiler(GPIOBackend * gpio, Sensor<double> * temp_sensor, double setpoint, const PID::PIDGains * pid_gains,
+	   PinIndex heater_pin_idx, double min_setpoint = 0, double max_setpoint = 160, Clock * clock = steadyClock());
 
     void turnOn();
     void turnOff();
-    double updateSetpoint(double setpoint, const PID::PIDGains * new_gains = NULL);
+    /**
+     * Change the setpoint and, if new_gains is given, the gains. Set bumpless to carry the
+     * controller output across the gain change instead of letting it jump.
+     */
+    double updateSetpoint(double setpoint, const PID::PIDGains * new_gains = NULL, bool bumpless = false);
+    
+    /**
+     * Use a gain schedule instead of fixed gains. Pass NULL to go back to the last fixed gains.
+     * The schedule must outlive the boiler or be cleared first.
+     */
+    void setGainSchedule(const GainSchedule * schedule){ schedule_ = schedule; }
+
+    /**
+     * Route the heater through a HeaterGate so a SafetySupervisor can cut it. While the gate is 
+     * tripped the controller is frozen, and it restarts cleanly once the gate is released.
+     */
+    void setHeaterGate(HeaterGate * gate){ gate_ = gate; }
+
+    /**
+     * Calls to update() closer together than this reuse the last output. 0.2s by default; lower it
+     * if the loop runs faster than 5Hz.
+     */
+    void setMinUpdateTimeSec(double t){ ctrl_.setMinUpdateTimeSec(t); }
     
-    void update(int feed_forward = 0);
+    void update(int feed_forward = 0, bool pump_on = false);
 
     double currentTemp();
     double currentPWM(){ return current_pwm_setting_; }
+    bool held(){ return held_; } /** True while the gate holds the heater off and the controller is frozen */
     double setpoint(){ return ctrl_.setpoint(); }
     double errorSlope() { return ctrl_.slope(); }
     double errorSum() { return ctrl_.errorSum(); }
@@ -0,0 +1,43 @@
+#ifndef BOILER_MODEL
+#define BOILER_MODEL
+
+#include "Simulation.hpp"
+
+#include <string>
+
+namespace RaspLatte{
+  /**
+   * A fitted model of one machine's boiler, as written by bin/boiler_ident. The plant parameters
+   * drive a BoilerPlant in the simulator and give the controller its pump feed-forward. Stored as
+   * "key = value" lines in the same syntax as the config file, '#' starting a comment:
+   *
+   *    model.nodes                               1 for a single lump, 2 with an element lump
+   *    model.heater_watts                        Element power. Assumed, the fit only gives ratios to it
+   *    model.heat_capacity  model.loss           Water and boiler J/C, loss to the room W/C
+   *    model.ambient                             Room temp in C
+   *    model.pump  model.inlet                   Heat taken by the inlet water W/C, inlet temp in C
+   *    model.element_capacity                    Element J/C (2 nodes only)
+   *    model.element_coupling                    Element to water W/C (2 nodes only)
+   *    model.dead_time                           Seconds before the water responds to the heater
+   *
+   * Any key not in the file keeps the value of BoilerPlant::defaultParams().
+   */
+  struct BoilerModel{
+    BoilerPlant::PlantParams plant = BoilerPlant::defaultParams();
+    double dead_time_sec = 0;
+
+    /** Parse text on top of model. On failure err describes the first problem and false is returned */
+    static bool parse(const std::string & text, BoilerModel & model, std::string & err);
+    static bool load(const std::string & path, BoilerModel & model, std::string & err);
+    /** Write the model with comment lines (each prefixed with '#') in front */
+    bool save(const std::string & path, const std::string & comment, std::string & err) const;
+    bool validate(std::string & err) const;
+
+    int nodes() const{ return (plant.element_capacity > 0 ? 2 : 1); }
+    /** Degrees above ambient per unit of heater fraction once settled */
+    double gain() const{ return plant.heater_watts/plant.loss_w_per_c; }
+    /** Duty (0 to 255) that replaces the heat the inlet water takes at temp while the pump runs */
+    double pumpFeedForward(double temp) const;
+  };
+}
+#endif
@@ -0,0 +1,89 @@
+#ifndef CASCADE_CONTROL
+#define CASCADE_CONTROL
+
+#include "Clock.hpp"
+#include "PID.hpp"
+#include "Sensor.hpp"
+#include "types.h"
+
+namespace RaspLatte{
+  /**
+   * The outer loop of a cascade: a PID on the group head temperature whose output is the boiler
+   * setpoint, which the boiler's own PID (the inner loop) then tracks. The output is the group
+   * setpoint plus an offset in [min_offset, max_offset]; offset is where it starts and the integral
+   * trims it from there, so the barista no longer has to guess it.
+   *
+   * The group head is slow, so the outer loop updates every period_sec while the inner loop runs
+   * every control tick. update() is called every tick and only reads the group sensor and runs the
+   * PID when an outer update is due, so a tick costs at most one sensor read and one PID update.
+   *
+   * Anti-windup: the outer integral is held while the inner loop can't follow it, that is while the
+   * heater is saturated, the boiler is more than TRACK_BAND_C off its setpoint, or the boiler is
+   * held off by the safety supervisor, each only in the direction the outer loop is pushing; and
+   * while the offset sits at one of its limits. A bad group reading holds the last boiler setpoint
+   * and the outer loop carries on from where it was once the sensor recovers.
+   */
+  class CascadeControl{
+  public:
+    typedef struct CascadeSettings_{
+      bool enabled;
+      PID::PIDGains gains; /** C of boiler offset per C of group error */
+      double period_sec; /** Time between outer updates */
+      double offset; /** Boiler setpoint above the group setpoint to start from, C */
+      double min_offset;
+      double max_offset;
+    } CascadeSettings;
+
+    /** Boiler error beyond which the inner loop counts as not tracking */
+    static constexpr double TRACK_BAND_C = 2;
+
+    /** Off. Starts 10C over and trims by 2C/C and 0.005C/(C s) within 0 to 20C, every 2s */
+    static CascadeSettings defaultSettings();
+
+    /** group_sensor reads MAX31855_TEMP_UNAVALIBLE when it has no good reading */
+    CascadeControl(CascadeSettings settings, Sensor<double> * group_sensor, Clock * clock = steadyClock());
+
+    /** New gains (bumpless), rate and limits */
+    void setSettings(CascadeSettings settings);
+
+    /** Start again from offset on the next update, e.g. on entering brew */
+    void reset();
+
+    /**
+     * Called every control tick. Returns the boiler setpoint for group_setpoint, recomputed if an
+     * outer update is due. inner_pwm and inner_error are the boiler's last output and error, and
+     * inner_held whether the boiler is held off.
+     */
+    double update(double group_setpoint, double inner_pwm, double inner_error, bool inner_held);
+
+    double groupTemp(){ return group_temp_; } /** Last good group reading */
+    double boilerSetpoint(){ return boiler_setpoint_; }
+    double offset(){ return boiler_setpoint_ - group_setpoint_; }
+    bool holding(){ return holding_; } /** Outer integral held at the last update */
+    bool faulted(){ return faulted_; } /** Last group reading was bad */
+    double errorSum(){ return outer_.errorSum(); }
+
+  private:
+    /** The last group reading, for the PID to read */
+    class Sample : public Sensor<double>{
+    public:
+      double read(){ return value; }
+      double value = 0;
+    };
+
+    CascadeSettings settings_;
+    Sensor<double> * group_sensor_;
+    Clock * clock_;
+    Sample sample_;
+    double group_setpoint_ = 0;
+    PID outer_;
+    bool started_ = false; /** The PID has been reset on a good reading */
+    bool due_ = true; /** Update on the next call whatever the time. Set by reset() */
+    TimePoint last_update_;
+    double group_temp_ = 0;
+    double boiler_setpoint_ = 0;
+    bool holding_ = false;
+    bool faulted_ = false;
+  };
+}
+#endif
@@ -0,0 +1,51 @@
+#ifndef CLOCK
+#define CLOCK
+
+#include "types.h"
+
+namespace RaspLatte{
+  /**
+   * Source of time for everything on the control path. Controllers ask their Clock instead of 
+   * std::chrono directly so a simulation can run them on virtual time.
+   */
+  class Clock{
+  public:
+    virtual TimePoint now() = 0;
+    virtual ~Clock(){};
+  };
+
+  /**
+   * Wall time from std::chrono::steady_clock. Used on the real machine.
+   */
+  class SteadyClock : public Clock{
+  public:
+    TimePoint now(){ return std::chrono::steady_clock::now(); }
+  };
+
+  /** A shared SteadyClock used as the default everywhere a Clock is optional */
+  inline Clock * steadyClock(){
+    static SteadyClock clock;
+    return &clock;
+  }
+
+  /**
+   * Time that only moves when told to. Starts at the TimePoint epoch.
+   */
+  class VirtualClock : public Clock{
+  public:
+    TimePoint now(){ return now_; }
+
+    /** Move time forward to t. Time never moves backwards. */
+    void advanceTo(TimePoint t){
+      if (t > now_) now_ = t;
+    }
+    
+    void advance(Duration d){
+      advanceTo(now_ + d);
+    }
+
+  private:
+    TimePoint now_;
+  };
+}
+#endif
@@ -0,0 +1,110 @@
+#ifndef CONFIG
+#define CONFIG
+
+#include "CascadeControl.hpp"
+#include "HeaterWaveform.hpp"
+#include "LoopRate.hpp"
+#include "PID.hpp"
+#include "SafetySupervisor.hpp"
+#include "SystemHealth.hpp"
+#include "pins.h"
+#include "types.h"
+
+#include <string>
+
+namespace RaspLatte{
+  /**
+   * GPIO assignments. Defaults come from pins.h. These are only read at startup.
+   */
+  struct PinConfig{
+    PinIndex pwr_switch = SWITCH_PIN_PWR;
+    PinIndex pump_switch = SWITCH_PIN_PMP;
+    PinIndex steam_switch = SWITCH_PIN_STM;
+    PinIndex pwr_light = LIGHT_PIN_PWR;
+    PinIndex pump_light = LIGHT_PIN_PMP;
+    PinIndex steam_light = LIGHT_PIN_STM;
+    PinIndex thermo_cs = CS_THERMO;
+    PinIndex group_cs = CS_GROUP; /** Only opened for cascade control */
+    PinIndex boiler_pwm = PWM_BOILER;
+
+    bool operator==(const PinConfig & o) const;
+  };
+
+  /**
+   * Everything that can be tuned without a rebuild. Read from a text file of "key = value" lines
+   * where '#' starts a comment. Any key not in the file keeps its default.
+   *
+   *    brew.setpoint   steam.setpoint        Setpoints in C
+   *    brew.p  brew.i  brew.d                Brew PID gains
+   *    steam.p steam.i steam.d               Steam PID gains
+   *    schedule.enabled                      1 to schedule gains (see GainSchedule::fromModeGains)
+   *    schedule.integral_band                Error where the scheduled Ki fades to 0
+   *    schedule.pump_kp_scale                Scheduled Kp multiplier while pumping
+   *    safety.<limit>                        SafetySupervisor limits (restart required)
+   *    cascade.enabled                       1 to hold the group head at brew.setpoint (see CascadeControl) (restart required)
+   *    cascade.p cascade.i cascade.d         Group head (outer loop) PID gains
+   *    cascade.period                        Seconds between outer loop updates
+   *    cascade.offset                        Boiler over group setpoint to start from, C
+   *    cascade.min_offset cascade.max_offset Limits of the boiler over group setpoint, C
+   *    loop.adaptive                         1 to vary the control loop rate (see LoopRate)
+   *    loop.fast_period loop.slow_period     Adaptive loop periods in seconds
+   *    loop.band loop.slope_band             Error (C) and slope (C/s) that make the loop run fast
+   *    safety.watchdog                       1 to arm the hardware watchdog (restart required)
+   *    archive.path                          Shot archive file. Unset to not record (restart required)
+   *    archive.machine_id                    Tags this machine's shots in a shared archive
+   *    model.path                            Boiler model from bin/boiler_ident (restart required)
+   *    capture.path                          Raw thermocouple frame capture. Unset to not capture (restart required)
+   *    power.heater_watts                    Heater rating, for a shared power budget (restart required)
+   *    heater.waveform                       1 to drive the heater with a waveform (see HeaterWaveform) (restart required)
+   *    heater.mains_hz heater.slot           Waveform slot: a mains half cycle, or slot seconds if mains_hz is 0
+   *    heater.pattern                        Waveform pattern length in seconds
+   *    health.sys_root health.proc_root      Where SystemHealth finds sysfs and procfs (restart required)
+   *    health.period health.throttle_temp    SystemHealth sample period and fallback throttle temp (restart required)
+   *    telemetry.address telemetry.port      Where the TelemetryServer listens (restart required). Loopback
+   *                                          only by default: anyone who can reach it can change setpoints
+   *    pins.<name>                           GPIO assignments (restart required)
+   *
+   * See doc/raspberrylatte.conf for an example.
+   */
+  struct MachineConfig{
+    static constexpr double MAX_SETPOINT = 160; /** Setpoints are in (0, MAX_SETPOINT]. The Boiler's default clamp */
+
+    uint64_t version = 0; /** Set when published so the control loop can spot a new config */
+    TempPair temps = {.brew = 95, .steam = 150};
+    ModePair<PID::PIDGains> gains = {.brew = {.p = 100, .i = 0.25, .d = 250},
+				     .steam = {.p = 100, .i = 0., .d = 250}};
+    PinConfig pins;
+
+    bool schedule_enabled = false; /** Use a GainSchedule built from the gains above */
+    double integral_band = 10; /** Error (C) at which the scheduled integral gain reaches 0 */
+    double pump_kp_scale = 1.5; /** Scheduled Kp multiplier while the pump runs */
+
+    SafetySupervisor::SafetyLimits safety = SafetySupervisor::defaultLimits(); /** Read at startup */
+    LoopRate::LoopRateSettings loop = LoopRate::defaultSettings();
+    CascadeControl::CascadeSettings cascade = CascadeControl::defaultSettings(); /** enabled is read at startup */
+    bool watchdog_enabled = false; /** Kick /dev/watchdog from the supervisor. Read at startup */
+
+    std::string archive_path; /** Where shots are recorded (see ShotArchiveWriter). Read at startup */
+    uint16_t machine_id = 0;
+    std::string model_path; /** Fitted boiler model (see BoilerModel). Read at startup */
+    std::string capture_path; /** Where raw thermocouple frames are captured (see FrameCapture). Read at startup */
+    double heater_watts = 1300; /** What the heater draws when on (see PowerScheduler). Read at startup */
+    HeaterWaveform::WaveformSettings heater_wave = HeaterWaveform::defaultSettings(); /** Read at startup */
+    SystemHealth::HealthSettings health = SystemHealth::defaultSettings(); /** Read at startup */
+    std::string telemetry_address = "127.0.0.1"; /** IPv4 address the TelemetryServer binds. Read at startup */
+    uint16_t telemetry_port = 8080; /** Read at startup */
+
+    /** 
+     * Parse text on top of the values already in config and validate the result. On failure 
+     * config may be partly updated, err describes the first problem, and false is returned.
+     */
+    static bool parse(const std::string & text, MachineConfig & config, std::string & err);
+
+    /** Read the file at path and parse it. */
+    static bool load(const std::string & path, MachineConfig & config, std::string & err);
+
+    /** Check the ranges of every field. */
+    bool validate(std::string & err) const;
+  };
+}
+#endif
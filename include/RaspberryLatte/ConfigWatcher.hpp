@@ -0,0 +1,54 @@
+#ifndef CONFIG_WATCHER
+#define CONFIG_WATCHER
+
+#include "Config.hpp"
+#include "RCUPointer.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace RaspLatte{
+  /**
+   * Watches a config file with inotify and, whenever it is written or replaced, parses and 
+   * validates it on a background thread. Good configs are published through an RCUPointer that
+   * the control loop checks once per tick. Bad configs are rejected and the last good one stays
+   * in place. Pin changes are ignored until restart since the hardware is already set up.
+   */
+  class ConfigWatcher{
+  public:
+    ConfigWatcher(const std::string & path, RCUPointer<MachineConfig> * target);
+
+    void start();
+    void stop();
+
+    /** Parse and publish the file now. Returns false if it was rejected. */
+    bool reload();
+
+    unsigned int reloads(){ return reloads_; }
+    unsigned int rejected(){ return rejected_; }
+    std::string lastError();
+    
+    ~ConfigWatcher();
+    
+  private:
+    std::string path_;
+    std::string dir_;
+    std::string name_;
+    RCUPointer<MachineConfig> * target_;
+
+    int inotify_fd_ = -1;
+    int stop_fd_ = -1;
+    std::thread thread_;
+
+    std::atomic<unsigned int> reloads_{0};
+    std::atomic<unsigned int> rejected_{0};
+    std::mutex err_mutex_;
+    std::string last_error_;
+
+    void loop();
+    void closeFds();
+  };
+}
+#endif
@@ -3,36 +3,80 @@
 
 #include "Boiler.hpp"
 #include "BinarySensor.hpp"
-#include "MAX31855.hpp"
-#include "pins.h"
+#include "BoilerModel.hpp"
+#include "CascadeControl.hpp"
+#include "Clock.hpp"
+#include "GPIOBackend.hpp"
+#include "HardwareContext.hpp"
+#include "LatencyHistogram.hpp"
+#include "LoopRate.hpp"
 #include "types.h"
-#include "RaspberryLatteUI.hpp"
+#include "Config.hpp"
+#include "GainSchedule.hpp"
+#include "MachineState.hpp"
+#include "MachineUI.hpp"
+#include "RCUPointer.hpp"
+#include "SafetySupervisor.hpp"
+#include "ShotArchive.hpp"
+#include "TrendHistory.hpp"
+#include "TripleBuffer.hpp"
+
+#include <atomic>
+#include <memory>
 
 namespace RaspLatte{
   typedef BinarySensor Switch;
 
   class EspressoMachine{
   private:
+    HardwareContext * hw_; /** Owns the backend and the devices. Brought up before the machine is built */
+    GPIOBackend * gpio_;
+    Clock * clock_;
+    PinConfig pins_;
     TempPair temps_;
+    ModePair<PID::PIDGains> K_; // Must be set before boiler_ is constructed
+
+    RCUPointer<MachineConfig> config_; /** Latest config, swapped in by a ConfigWatcher */
+    uint64_t config_version_; /** Version of the config last applied */
+    GainSchedule schedule_; /** Used by the boiler if the config enables gain scheduling */
+    bool scheduled_ = false; /** True if the boiler is using schedule_ */
     
-    MAX31855 boiler_temp_sensor_;
+    SafetySupervisor supervisor_; /** Owns the thermocouple and can cut the heater */
     Boiler boiler_;
-    RaspberryLatteUI ui_;
+    CascadeControl cascade_; /** Sets the boiler setpoint in brew if cascaded_ */
+    bool cascaded_; /** Brew holds the group head at the brew setpoint */
     
-    Switch pwr_switch_;
-    Switch pump_switch_;
-    Switch steam_switch_;
+    Switch * pwr_switch_;
+    Switch * pump_switch_;
+    Switch * steam_switch_;
 
     MachineMode current_mode_;
+    bool started_ = false; /** True once start() has made the first heater decision */
+    std::atomic<bool> stop_requested_{false};
+    bool mode_overridden_ = false; /** True if a remote client has forced the mode */
+    MachineMode mode_override_ = OFF;
 
-    const ModePair<PID::PIDGains> K_ = {.brew = {.p = 100, .i = 0.25, .d = 250},
-					.steam = {.p = 100, .i = 0., .d = 250}};
+    TimePoint start_time_;
+    MachineState state_;
+    TripleBuffer<MachineState> state_buffer_;
+    TrendHistory trend_; /** Added to with every published state */
+    TripleBuffer<MachineState> panel_state_; /** Only written once a panel is enabled */
+    std::unique_ptr<TripleBuffer<TrendHistory>> panel_trend_; /** Copies of trend_ for a panel, or NULL */
+    int64_t panel_second_ = -1; /** Second of the last trend copy */
+    CommandQueue commands_;
+    std::atomic<ShotRecorder *> recorder_{NULL}; /** May be attached from another thread */
+    BoilerModel model_; /** Fitted by bin/boiler_ident. Only used if has_model_ */
+    bool has_model_ = false;
+    static const size_t MAX_COMMANDS_PER_TICK = 32; /** Any more wait for the next loop */
+    static const int DEFAULT_PUMP_FEED_FORWARD = 128; /** Hand tuned duty added while pumping without a model */
+    LatencyHistogram wake_lateness_; /** How late run() woke for each tick */
+    LatencyHistogram tick_time_; /** How long each tick took */
+    LoopRate rate_; /** When the next tick is due */
+    TimePoint last_tick_; /** When tick() last ran, for poll() */
+    bool last_pwr_ = false; /** Switches as of the last tick, so poll() can tell they changed */
+    bool last_pump_ = false;
+    bool last_steam_ = false;
     
-    /*
-     * Update the current mode's setpoint by the increment. If mode is off, do nothing
-     */
-    void updateSetpoint(double increment);
-
     /*
      * Use the current state of the power and steam switch to get the curreent mode of the system
      */
@@ -44,18 +88,98 @@ namespace RaspLatte{
     void updateLights();
 
     /*
-     * Update internal paarameters based on the value of key
+     * Apply the config if a new one has been published. Gain changes are bumpless.
+     */
+    void applyConfig();
+
+    /*
+     * Rebuild the gain schedule from the current gains and setpoints, or turn it off
+     */
+    void updateGainSchedule(const MachineConfig & config);
+
+    /*
+     * Apply the config's loop rate settings
+     */
+    void setLoopRate(const MachineConfig & config);
+
+    /*
+     * Apply the commands queued since the last loop, in order
+     */
+    void handleCommands();
+
+    /*
+     * Copy the current state into the state buffer for other threads
+     */
+    void publishState();
+
+    /*
+     * Duty added to the PID output while the pump runs, to make up for the fresh water
      */
-    void handleKeyPress(int key);
+    int pumpFeedForward();
+
+    /*
+     * What the boiler should hold in the current mode: the setpoint, or under cascade control in
+     * brew, what the group head loop asks for. Runs the group head loop if it is due.
+     */
+    double boilerSetpoint();
     
   public:
-    EspressoMachine(double brew_temp, double steam_temp);
+    static constexpr double LOOP_PERIOD_SEC = 0.5; /** Pace of run() unless the config makes it adaptive */
+
+    /*
+     * The hardware must have been brought up (HardwareContext::bringUp) with the same pins as config,
+     * and with the group thermocouple if the config enables cascade control. Throws if it was not.
+     */
+    EspressoMachine(const MachineConfig & config, HardwareContext * hw, Clock * clock = steadyClock());
+
+    /*
+     * One pass of the control loop: apply config and remote changes, follow the switches, update
+     * the lights and boiler, and publish the state. Called by run() or by a simulation.
+     */
+    void tick();
+
+    /*
+     * Tick if one is due at the current loop rate or a switch has changed since the last one.
+     * Returns true if it ticked. Call it every pollPeriod(); reading the switches is cheap.
+     */
+    bool poll();
+
+    /*
+     * Time to the next tick at the current loop rate, and how often poll() should be called.
+     * Both are LOOP_PERIOD_SEC unless loop.adaptive is set in the config.
+     */
+    double tickPeriod(){ return rate_.period(); }
+    double pollPeriod(){ return rate_.pollPeriod(); }
+
+    /*
+     * Make the first heater decision without waiting for the UI. Marks "first decision" on the
+     * hardware context. run() calls this if it has not been called already.
+     */
+    void start();
 
     /*
-     * Runs a loop where the UI is refreshed, any keys are handled, and the 
-     * boiler is updated until 'q' is pressed. 
+     * Runs the control loop on the calling thread until stop() is called: a tick every period_sec,
+     * or polled every loop.fast_period if the config makes the loop rate adaptive.
      */
-    void run();
+    void run(double period_sec = LOOP_PERIOD_SEC);
+
+    /*
+     * For a front panel on a thread of its own. Call before run() starts; from then on each tick
+     * also publishes the state to panelState() and, once a second, copies the trend to panelTrend().
+     */
+    void enablePanel();
+
+    /*
+     * Runs ui on the calling thread, alongside run() on another, until it quits or stop() is
+     * called, then stops the machine. Throws if enablePanel() was not called.
+     */
+    void runPanel(MachineUI * ui);
+
+    /*
+     * Make run() and runPanel() return after the current pass. Safe to call from any thread or a
+     * signal handler.
+     */
+    void stop(){ stop_requested_.store(true, std::memory_order_relaxed); }
 
     /*
      * Getters
@@ -65,6 +189,61 @@ namespace RaspLatte{
     double setpoint();
     bool atSetpoint();
 
+    /*
+     * Hooks for the telemetry server. The state buffer has a single reader. Any thread may push commands.
+     */
+    TripleBuffer<MachineState> * stateBuffer(){ return &state_buffer_; }
+    CommandQueue * commands(){ return &commands_; }
+
+    /*
+     * The panel's own state and trend, once enablePanel() has been called. Single reader each.
+     */
+    TripleBuffer<MachineState> * panelState(){ return &panel_state_; }
+    TripleBuffer<TrendHistory> * panelTrend(){ return panel_trend_.get(); }
+
+    /*
+     * Hook for a ConfigWatcher. New configs published here are applied on the next loop.
+     */
+    RCUPointer<MachineConfig> * configPointer(){ return &config_; }
+
+    /*
+     * The safety supervisor. Call start() on it for the real machine, or poll() it from a simulation.
+     */
+    SafetySupervisor * supervisor(){ return &supervisor_; }
+
+    /*
+     * The boiler. Only touch it from the thread calling run(); a panel reads panelState() instead.
+     */
+    Boiler * boiler(){ return &boiler_; }
+
+    /*
+     * The group head loop, NULL unless the config enables cascade control. Same thread as boiler().
+     */
+    CascadeControl * cascade(){ return (cascaded_ ? &cascade_ : NULL); }
+
+    /*
+     * Min, max and mean of the boiler temperature, setpoint and PWM for hours back. Same thread as
+     * boiler(); a panel charts the copies in panelTrend().
+     */
+    const TrendHistory * trend(){ return &trend_; }
+
+    /*
+     * Record every shot here. Pass NULL to stop. Not owned. Any thread, so a recorder can be attached
+     * once the loop is running; it must outlive the loop or be detached after run() returns.
+     */
+    void setShotRecorder(ShotRecorder * recorder){ recorder_.store(recorder, std::memory_order_release); }
+
+    /*
+     * Use a fitted boiler model for the pump feed-forward instead of the hand tuned value
+     */
+    void setBoilerModel(const BoilerModel & model){ model_ = model; has_model_ = true; }
+
+    /*
+     * Loop timing of run(): how late each tick started and how long it took. Only read them once
+     * run() has returned.
+     */
+    const LatencyHistogram & wakeLateness(){ return wake_lateness_; }
+    const LatencyHistogram & tickTime(){ return tick_time_; }
     
     ~EspressoMachine();
   };
@@ -0,0 +1,102 @@
+#ifndef FRAME_CAPTURE
+#define FRAME_CAPTURE
+
+#include "Clock.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace RaspLatte{
+  /**
+   * Undecoded thermocouple frames and when each was read, in columns so the frames can go
+   * straight to decodeFrames(). Times are microseconds on the capturing machine's clock.
+   */
+  struct FrameColumns{
+    int64_t unix_ms_at_zero = 0; /** Unix time in ms when the clock read zero */
+    std::vector<int64_t> t_us;
+    std::vector<uint32_t> frames;
+    unsigned long dropped = 0; /** Frames the capture had no room for */
+  };
+
+  /**
+   * Records every raw frame the MAX31855 sends (see MAX31855::setCapture) to a file, leaving the
+   * decoding for later (see decodeFrames() and bin/frame_decode). A frame costs 12 bytes.
+   *
+   * record() is called on the thread reading the sensor and never allocates or blocks. Frames go
+   * into one of SLOTS preallocated blocks; full blocks are written by a background thread, and if
+   * it falls so far behind that no block is free frames are dropped and counted in the file.
+   *
+   * File format, native byte order: "RLFRAME1", int64 unix_ms_at_zero, then blocks of uint32
+   * count, uint32 frames dropped just before the block, int64 t_us[count], uint32 frame[count].
+   */
+  class FrameCapture{
+  public:
+    static const int BLOCK_FRAMES = 4096; /** About 7 minutes of frames at the supervisor's rate */
+    static const int SLOTS = 4;
+
+    /**
+     * unix_ms_at_zero is the Unix time in ms when clock read zero (see ShotRecorder::wallOffsetMs).
+     */
+    FrameCapture(const std::string & path, int64_t unix_ms_at_zero, Clock * clock = steadyClock());
+
+    /** Create the file, replacing any old one. Returns false and sets err on failure */
+    bool open(std::string & err);
+
+    /** Sensor side. Stores one frame stamped with the clock's time */
+    void record(uint32_t frame);
+
+    /** Run the writer on a background thread */
+    void start();
+    /** Stop the writer and write everything recorded so far. Call once nothing calls record() any more */
+    void stop();
+    /** Write full blocks on the calling thread. For simulations that don't start() */
+    void flush();
+
+    unsigned long captured(){ return captured_; }
+    unsigned long dropped(){ return dropped_; }
+
+    /** Read a whole capture file */
+    static bool load(const std::string & path, FrameColumns & cols, std::string & err);
+
+    ~FrameCapture();
+
+  private:
+    enum SlotState {FREE, FILLING, READY};
+    struct Slot{
+      std::atomic<int> state{FREE};
+      uint32_t n = 0;
+      uint32_t dropped_before = 0;
+      int64_t t_us[BLOCK_FRAMES];
+      uint32_t frames[BLOCK_FRAMES];
+    };
+
+    std::string path_;
+    int64_t unix_ms_at_zero_;
+    Clock * clock_;
+    FILE * file_ = NULL;
+    Slot * slots_;
+
+    // Sensor side
+    Slot * current_ = NULL;
+    uint32_t dropped_since_block_ = 0;
+
+    std::atomic<unsigned long> captured_{0};
+    std::atomic<unsigned long> dropped_{0};
+    bool write_failed_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+
+    void finish();
+    void loop();
+  };
+}
+#endif
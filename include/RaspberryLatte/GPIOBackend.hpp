@@ -0,0 +1,82 @@
+#ifndef GPIO_BACKEND
+#define GPIO_BACKEND
+
+#include "types.h"
+
+#include <cstdint>
+
+namespace RaspLatte{
+  /** One step of a waveform: the pin held at a level for us microseconds */
+  typedef struct WavePulse_{
+    bool on;
+    uint32_t us;
+  } WavePulse;
+
+  /**
+   * The GPIO and SPI operations the machine needs. Devices talk to hardware only through this 
+   * interface so the same code can drive the pigpio library (PigpioBackend) or a simulated 
+   * machine (SimulatedBackend).
+   */
+  class GPIOBackend{
+  public:
+    enum Pull {PULL_NONE, PULL_DOWN, PULL_UP};
+    
+    /** Start the backend. Safe to call more than once. Returns false on failure */
+    virtual bool initialise() = 0;
+
+    virtual void setInput(PinIndex p, Pull pull) = 0;
+    virtual void setOutput(PinIndex p) = 0;
+
+    /** Returns the level of the pin (0 or 1) or a negative number if the pin is invalid */
+    virtual int read(PinIndex p) = 0;
+    virtual void write(PinIndex p, bool level) = 0;
+
+    /** PWM with a duty cycle from 0 (off) to 255 (fully on) */
+    virtual void setPWMFrequency(PinIndex p, unsigned int hz) = 0;
+    virtual void pwm(PinIndex p, unsigned int duty) = 0;
+
+    /** Most pulses a waveform may have */
+    static const unsigned int MAX_WAVE_PULSES = 1000;
+
+    /**
+     * Play pulses on p from the start, over and over, timed by hardware rather than the CPU, until the
+     * next call replaces them. A count of 0 stops the waveform and leaves p low, as does pwm() on p.
+     * Returns false, having changed nothing, if the backend can't time waveforms.
+     */
+    virtual bool wave(PinIndex p, const WavePulse * pulses, unsigned int count){ return false; }
+
+    /** Returns a handle or a negative number on failure */
+    virtual int spiOpen(unsigned int channel, SPIBaud baud, unsigned int flags) = 0;
+    /** Returns the number of bytes read or a negative number on failure */
+    virtual int spiRead(int handle, char * buf, unsigned int count) = 0;
+    virtual void spiClose(int handle) = 0;
+
+    virtual ~GPIOBackend(){};
+  };
+
+  /**
+   * GPIOBackend on top of the pigpio library. Waveforms are sent by DMA. pigpio plays one at a time,
+   * so only one pin can have a waveform.
+   */
+  class PigpioBackend : public GPIOBackend{
+  public:
+    bool initialise();
+    void setInput(PinIndex p, Pull pull);
+    void setOutput(PinIndex p);
+    int read(PinIndex p);
+    void write(PinIndex p, bool level);
+    void setPWMFrequency(PinIndex p, unsigned int hz);
+    void pwm(PinIndex p, unsigned int duty);
+    bool wave(PinIndex p, const WavePulse * pulses, unsigned int count);
+    int spiOpen(unsigned int channel, SPIBaud baud, unsigned int flags);
+    int spiRead(int handle, char * buf, unsigned int count);
+    void spiClose(int handle);
+
+  private:
+    int wave_id_ = -1; /** The waveform playing, or -1 */
+    int wave_pin_ = -1;
+
+    void stopWave();
+  };
+}
+#endif
@@ -0,0 +1,73 @@
+#ifndef GAIN_SCHEDULE
+#define GAIN_SCHEDULE
+
+#include "PID.hpp"
+#include "types.h"
+
+#include <cstdint>
+
+namespace RaspLatte{
+  /**
+   * A table of PID gains keyed on the boiler temperature, the error magnitude, and the pump state.
+   * Gains between breakpoints are interpolated bilinearly and held constant beyond the ends.
+   *
+   * Both axes are resolved through precomputed index tables (breakpoint index and weight for
+   * every quantized value) so a lookup is a few array reads and a blend of four entries no
+   * matter how many breakpoints there are.
+   */
+  class GainSchedule{
+  public:
+    static const int MAX_POINTS = 8; /** Max breakpoints per axis */
+
+    GainSchedule();
+
+    /** 
+     * Set the breakpoints for each axis. Values must be ascending. All gains are reset to 0.
+     */
+    void setAxes(const double * temps, int n_temps, const double * errors, int n_errors);
+    void setGains(int temp_idx, int err_idx, bool pump_on, PID::PIDGains gains);
+
+    /** Precompute the lookup tables. Call after the axes and gains are set. */
+    void build();
+
+    /** Interpolated gains for a temperature, an error magnitude (>= 0), and the pump state */
+    PID::PIDGains lookup(double temp, double abs_err, bool pump_on) const;
+
+    /**
+     * The default schedule built from the per-mode gains:
+     * - Below the brew setpoint + 5C the brew gains are used, above the steam setpoint - 10C the
+     *   steam gains, and they blend in between. This replaces the step at a mode switch.
+     * - The integral gain fades out as the error grows to integral_band so the integral does not
+     *   wind up during warm-up and the first approach overshoots less.
+     * - While the pump runs Kp is scaled by pump_kp_scale to fight the cold inlet water.
+     */
+    static GainSchedule fromModeGains(const ModePair<PID::PIDGains> & gains, const TempPair & temps,
+				      double integral_band, double pump_kp_scale);
+    
+  private:
+    /** Quantization of the index tables */
+    static constexpr double TEMP_STEP = 0.25;
+    static constexpr double TEMP_MAX = 200;
+    static constexpr double ERR_STEP = 0.125;
+    static constexpr double ERR_MAX = 64;
+    static const int TEMP_CELLS = (int)(TEMP_MAX/TEMP_STEP) + 1;
+    static const int ERR_CELLS = (int)(ERR_MAX/ERR_STEP) + 1;
+
+    struct Cell{
+      uint8_t idx; /** Lower breakpoint */
+      float w; /** Weight of the upper breakpoint */
+    };
+    
+    double temps_[MAX_POINTS];
+    double errors_[MAX_POINTS];
+    int n_temps_ = 1;
+    int n_errors_ = 1;
+    PID::PIDGains gains_[2][MAX_POINTS][MAX_POINTS];
+
+    Cell temp_cells_[TEMP_CELLS];
+    Cell err_cells_[ERR_CELLS];
+
+    static void buildCells(const double * points, int n, double step, Cell * cells, int n_cells);
+  };
+}
+#endif
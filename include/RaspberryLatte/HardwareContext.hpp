@@ -0,0 +1,78 @@
+#ifndef HARDWARE_CONTEXT
+#define HARDWARE_CONTEXT
+
+#include "BinarySensor.hpp"
+#include "Config.hpp"
+#include "GPIOBackend.hpp"
+#include "MAX31855.hpp"
+#include "SafetySupervisor.hpp"
+#include "types.h"
+
+#include <ostream>
+#include <vector>
+
+namespace RaspLatte{
+  /**
+   * Owns the GPIO backend and the devices on it. The backend is initialised exactly once, here, and
+   * bringUp() starts the devices in dependency order:
+   * (a) The backend
+   * (b) Every output to a known state. The heater is forced off before anything else can fail
+   * (c) The thermocouples (SPI open and first conversion) and the switches, in parallel
+   * Devices assume the backend is already running and never initialise it themselves.
+   *
+   * Startup phases are timed from process start with mark() so a slow cold start shows up in
+   * the breakdown from printPhases().
+   */
+  class HardwareContext{
+  public:
+    typedef struct Phase_{
+      const char * name;
+      double end_ms; /** Milliseconds from process start to the end of the phase */
+    } Phase;
+
+    /** Fail the cold start check if the first heater decision takes longer than this */
+    static constexpr double FIRST_DECISION_TARGET_MS = 100;
+
+    /** With group_thermocouple, a second thermocouple on pins.group_cs is brought up too */
+    HardwareContext(GPIOBackend * gpio, const PinConfig & pins, bool group_thermocouple = false);
+
+    /** Initialise the backend and bring up every device. Throws if the hardware can't be started */
+    void bringUp();
+
+    GPIOBackend * gpio(){ return gpio_; }
+    HeaterGate * heaterGate(){ return heater_gate_; }
+    MAX31855 * thermocouple(){ return thermocouple_; }
+    MAX31855 * groupThermocouple(){ return group_thermocouple_; } /** NULL unless asked for */
+    BinarySensor * pwrSwitch(){ return pwr_switch_; }
+    BinarySensor * pumpSwitch(){ return pump_switch_; }
+    BinarySensor * steamSwitch(){ return steam_switch_; }
+
+    /** Record the end of a startup phase. The name must be a literal */
+    void mark(const char * phase);
+    /** When the named phase ended in ms from process start, or -1 if it has not */
+    double phaseEnd(const char * phase);
+    /** One line with the length of each phase */
+    void printPhases(std::ostream & out);
+
+    /** Milliseconds since the process started */
+    static double sinceProcessStart();
+
+    ~HardwareContext();
+
+  private:
+    GPIOBackend * gpio_;
+    PinConfig pins_;
+    bool want_group_;
+    bool up_ = false;
+
+    HeaterGate * heater_gate_ = NULL;
+    MAX31855 * thermocouple_ = NULL;
+    MAX31855 * group_thermocouple_ = NULL;
+    BinarySensor * pwr_switch_ = NULL;
+    BinarySensor * pump_switch_ = NULL;
+    BinarySensor * steam_switch_ = NULL;
+
+    std::vector<Phase> phases_;
+  };
+}
+#endif
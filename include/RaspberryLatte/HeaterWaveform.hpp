@@ -0,0 +1,68 @@
+#ifndef HEATER_WAVEFORM
+#define HEATER_WAVEFORM
+
+#include "Clock.hpp"
+#include "GPIOBackend.hpp"
+#include "types.h"
+
+#include <cstdint>
+
+namespace RaspLatte{
+  /**
+   * Turns the controller's duty (0 to 255, fraction and all) into an on/off pattern of whole slots
+   * that the backend plays by itself (GPIOBackend::wave), so nothing runs on the CPU between control
+   * ticks. With mains_hz set a slot is one half cycle of the mains: a zero-crossing SSR then switches
+   * the heater for whole half cycles.
+   *
+   * Slots are chosen by first order sigma-delta modulation: each slot adds the duty to an error and
+   * switches on when the error reaches half a slot. The error carries from one pattern to the next,
+   * so over time the mean output follows the duty to far finer than 8 bit PWM, which also drops
+   * the fraction. A new pattern starts as soon as it is set; set() works out from the clock how much
+   * of the last one played (part of it, or several times over) so early or late ticks don't bias the
+   * output.
+   */
+  class HeaterWaveform{
+  public:
+    typedef struct WaveformSettings_{
+      bool enabled;
+      double mains_hz; /** Slots are half cycles at this frequency. 0 for slots of slot_sec */
+      double slot_sec;
+      double pattern_sec; /** Length of one pattern. Best matched to the control loop period */
+    } WaveformSettings;
+
+    static const unsigned int MAX_SLOTS = GPIOBackend::MAX_WAVE_PULSES;
+
+    /** Off. 50Hz mains, 0.5s patterns (the fixed loop period) */
+    static WaveformSettings defaultSettings();
+
+    /** Slot length in seconds for these settings */
+    static double slotSec(const WaveformSettings & settings);
+
+    HeaterWaveform(GPIOBackend * gpio, PinIndex pin, WaveformSettings settings, Clock * clock = steadyClock());
+
+    /** Start a pattern for duty. Returns false if the backend can't play waveforms */
+    bool set(double duty);
+    /** Stop the waveform with the pin low and forget the carried error */
+    void stop();
+
+    unsigned int slots(){ return slots_; }
+    /** Duty of the pattern playing, 0 to 255 */
+    double patternDuty(){ return 255.*on_prefix_[slots_]/slots_; }
+
+  private:
+    GPIOBackend * gpio_;
+    PinIndex pin_;
+    Clock * clock_;
+    double slot_sec_;
+    uint32_t slot_us_;
+    unsigned int slots_;
+
+    bool playing_ = false;
+    TimePoint started_;
+    double fraction_ = 0; /** Duty of the pattern playing as a fraction */
+    double start_error_ = 0; /** Modulator error when it started */
+    uint16_t on_prefix_[MAX_SLOTS + 1] = {0}; /** On slots before each slot of the pattern */
+    WavePulse pulses_[MAX_SLOTS];
+  };
+}
+#endif
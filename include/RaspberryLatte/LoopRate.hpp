@@ -0,0 +1,44 @@
+#ifndef LOOP_RATE
+#define LOOP_RATE
+
+namespace RaspLatte{
+  /**
+   * Picks how long the control loop waits before its next tick. Fixed unless adaptive is set. When
+   * adaptive, the loop ticks every fast_period_sec while the pump runs or the error or its slope
+   * are out of their bands, and otherwise backs off, doubling the period every tick up to
+   * slow_period_sec. At the slow rate the loop is idle: the supervisor may sample less often too.
+   */
+  class LoopRate{
+  public:
+    typedef struct LoopRateSettings_{
+      bool adaptive;
+      double fast_period_sec;
+      double slow_period_sec;
+      double band; /** Error in C beyond which the loop runs fast */
+      double slope_band; /** Error slope in C/s beyond which the loop runs fast */
+    } LoopRateSettings;
+
+    /** Not adaptive. 20Hz when busy and 1Hz when idle once turned on */
+    static LoopRateSettings defaultSettings();
+
+    LoopRate(LoopRateSettings settings, double fixed_period_sec);
+
+    void setSettings(LoopRateSettings settings);
+
+    /** After a tick: pick the period to the next one. Returns it in seconds */
+    double update(double error, double slope, bool pump_on);
+
+    double period(){ return period_; }
+    bool adaptive(){ return settings_.adaptive; }
+    bool fast(){ return settings_.adaptive && period_ <= settings_.fast_period_sec; }
+    bool idle(){ return settings_.adaptive && period_ >= settings_.slow_period_sec; }
+    /** How often an adaptive loop should wake to check the switches between ticks */
+    double pollPeriod(){ return (settings_.adaptive ? settings_.fast_period_sec : fixed_); }
+
+  private:
+    LoopRateSettings settings_;
+    double fixed_;
+    double period_;
+  };
+}
+#endif
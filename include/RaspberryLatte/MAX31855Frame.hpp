@@ -0,0 +1,85 @@
+#ifndef MAX_31855_FRAME
+#define MAX_31855_FRAME
+
+#include <cstddef>
+#include <cstdint>
+
+#define MAX31855_ERR_OPEN_CIRCUIT 1
+#define MAX31855_ERR_GND_SHORT 2
+#define MAX31855_ERR_VCC_SHORT 4
+#define MAX31855_ERR_NO_DATA 16
+#define MAX31855_ERR_SPI_READ 32
+#define MAX31855_TEMP_UNAVALIBLE -1000
+
+namespace RaspLatte{
+  /**
+   * Decoding of the 32 bit frame the MAX31855 sends, shared by the live driver (MAX31855) and the
+   * batch decoder so the two can not disagree.
+   *
+   *     A      B     C    D    E      F    G   H   I   J
+   *   | 31 | 30-18 | 17 | 16 | 15 | 14-4 | 3 | 2 | 1 | 0
+   *
+   *   A-B Thermocouple temp, 14 bit two's complement in 0.25C
+   *   C   Reserved
+   *   D   Fault (any of H-J)
+   *   E-F Chip temp, 12 bit two's complement in 0.0625C
+   *   G   Reserved
+   *   H   Short to Vcc
+   *   I   Short to Gnd
+   *   J   Open circuit
+   *
+   * Sign extension is done with xor and subtract rather than a branch or a right shift of a
+   * negative number, so every function is branch-free, well defined and usable at compile time.
+   */
+  namespace MAX31855Frame{
+    /** Big endian bytes as read over SPI. Bytes are taken unsigned so the high bit does not sign extend */
+    constexpr uint32_t fromBytes(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3){
+      return ((uint32_t)b0 << 24) | ((uint32_t)b1 << 16) | ((uint32_t)b2 << 8) | b3;
+    }
+
+    /** MAX31855_ERR_* bits. An all zero frame means nothing answered */
+    constexpr uint8_t fault(uint32_t frame){
+      return (uint8_t)((frame & 0x7) | ((uint32_t)(frame == 0) << 4));
+    }
+
+    constexpr float thermoTemp(uint32_t frame){
+      return (float)((int32_t)((frame >> 18) ^ 0x2000) - 0x2000) * 0.25f;
+    }
+
+    constexpr float chipTemp(uint32_t frame){
+      return (float)((int32_t)(((frame >> 4) & 0xFFF) ^ 0x800) - 0x800) * 0.0625f;
+    }
+
+    /** What MAX31855::read() returns for the frame */
+    constexpr float reading(uint32_t frame){
+      return (fault(frame) ? (float)MAX31855_TEMP_UNAVALIBLE : thermoTemp(frame));
+    }
+
+    /** A frame with the given raw thermocouple and chip counts, for checking the decoders */
+    constexpr uint32_t pack(uint32_t thermo14, uint32_t chip12, uint32_t faults){
+      return ((thermo14 & 0x3FFF) << 18) | ((uint32_t)(faults != 0) << 16) | ((chip12 & 0xFFF) << 4) | (faults & 0x7);
+    }
+
+    // The conversion examples from the datasheet
+    static_assert(thermoTemp(pack(0x1900, 0, 0)) == 1600.0f, "MAX31855 thermocouple decode");
+    static_assert(thermoTemp(pack(0x0193, 0, 0)) == 100.75f, "MAX31855 thermocouple decode");
+    static_assert(thermoTemp(pack(0x3FFF, 0, 0)) == -0.25f, "MAX31855 thermocouple decode");
+    static_assert(thermoTemp(pack(0x3C18, 0, 0)) == -250.0f, "MAX31855 thermocouple decode");
+    static_assert(chipTemp(pack(0, 0x7F0, 0)) == 127.0f, "MAX31855 chip decode");
+    static_assert(chipTemp(pack(0, 0x649, 0)) == 100.5625f, "MAX31855 chip decode");
+    static_assert(chipTemp(pack(0, 0xFFF, 0)) == -0.0625f, "MAX31855 chip decode");
+    static_assert(chipTemp(pack(0, 0xC90, 0)) == -55.0f, "MAX31855 chip decode");
+    static_assert(fault(pack(0x0190, 0x190, MAX31855_ERR_VCC_SHORT)) == MAX31855_ERR_VCC_SHORT, "MAX31855 fault decode");
+    static_assert(fault(0) == MAX31855_ERR_NO_DATA && reading(0) == MAX31855_TEMP_UNAVALIBLE, "MAX31855 no data");
+    static_assert(fromBytes(0xFF, 0x00, 0x80, 0x01) == 0xFF008001u, "MAX31855 byte order");
+  }
+
+  /**
+   * Decode n frames at once into reading (as MAX31855::read() would give, MAX31855_TEMP_UNAVALIBLE
+   * on a fault), chip temp and fault arrays. Several frames are decoded per instruction with the
+   * compiler's portable vector types (SSE on x86, NEON on the Pi). The results are identical to
+   * the MAX31855Frame functions frame by frame. Any output may be NULL if not wanted.
+   */
+  void decodeFrames(const uint32_t * frames, size_t n, float * reading, float * chip, uint8_t * fault);
+}
+#endif
@@ -0,0 +1,105 @@
+#ifndef MPSC_QUEUE
+#define MPSC_QUEUE
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace RaspLatte{
+  /**
+   * A bounded lock-free queue with any number of producers and a single consumer. Each slot carries
+   * a sequence number saying whose turn it is. A producer claims the next position with one
+   * compare-and-swap on the tail, fills the slot, then hands it over by bumping its sequence; the
+   * consumer reads slots strictly in claim order, so every producer's items come out in the order
+   * they were pushed and all producers see one total order. Nothing allocates after construction.
+   *
+   * A producer that has claimed a slot but not yet filled it holds back everything behind it, so
+   * pop() may report empty for a moment while later items are ready. The consumer never waits on it.
+   */
+  template <typename T, size_t N>
+  class MPSCQueue{
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "MPSCQueue size must be a power of two");
+  public:
+    MPSCQueue(): tail_(0), head_(0){
+      for (size_t i = 0; i < N; i++) slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    /** Any thread. Returns false without waiting if the queue is full. */
+    bool push(const T & value){
+      size_t pos = tail_.load(std::memory_order_relaxed);
+      for (;;){
+	Slot & slot = slots_[pos & MASK];
+	intptr_t turn = (intptr_t)slot.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+	if (turn == 0){
+	  // Free and ours if no other producer takes the position first. On failure pos is reloaded.
+	  if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+	    slot.value = value;
+	    slot.seq.store(pos + 1, std::memory_order_release);
+	    return true;
+	  }
+	}
+	else if (turn < 0) return false; // The consumer has not freed this slot from the last lap
+	else pos = tail_.load(std::memory_order_relaxed); // Another producer got here first
+      }
+    }
+
+    /**
+     * Any thread. Pushes all n values, one after the other in the queue, or none of them and returns
+     * false if there isn't room for them all. For requests that must be applied whole.
+     */
+    bool pushAll(const T * values, size_t n){
+      if (n == 0) return true;
+      if (n > N) return false;
+      size_t pos = tail_.load(std::memory_order_relaxed);
+      for (;;){
+	intptr_t turn = (intptr_t)slots_[pos & MASK].seq.load(std::memory_order_acquire) - (intptr_t)pos;
+	if (turn == 0){
+	  // The consumer frees slots in order, so if the last one is free the ones before it are too
+	  size_t last = pos + n - 1;
+	  if ((intptr_t)slots_[last & MASK].seq.load(std::memory_order_acquire) - (intptr_t)last < 0) return false;
+	  if (tail_.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)){
+	    for (size_t i = 0; i < n; i++){
+	      Slot & slot = slots_[(pos + i) & MASK];
+	      slot.value = values[i];
+	      slot.seq.store(pos + i + 1, std::memory_order_release);
+	    }
+	    return true;
+	  }
+	}
+	else if (turn < 0) return false;
+	else pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+
+    /** Consumer thread only. Copies the oldest item into out, or returns false if there is none yet. */
+    bool pop(T & out){
+      Slot & slot = slots_[head_ & MASK];
+      if (slot.seq.load(std::memory_order_acquire) != head_ + 1) return false;
+      out = slot.value;
+      slot.seq.store(head_ + N, std::memory_order_release); // Free for the producer one lap later
+      head_++;
+      return true;
+    }
+
+    /** Consumer thread only. True if pop() would return an item, without taking it. */
+    bool ready(){
+      return slots_[head_ & MASK].seq.load(std::memory_order_acquire) == head_ + 1;
+    }
+
+    static constexpr size_t capacity(){ return N; }
+
+  private:
+    static const size_t MASK = N - 1;
+    static const size_t CACHE_LINE = 64;
+
+    struct Slot{
+      std::atomic<size_t> seq;
+      T value;
+    };
+
+    Slot slots_[N];
+    alignas(CACHE_LINE) std::atomic<size_t> tail_; /** Next position to claim. Shared by producers */
+    alignas(CACHE_LINE) size_t head_; /** Next position to read. Consumer only */
+  };
+}
+#endif
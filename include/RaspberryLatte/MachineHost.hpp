@@ -0,0 +1,90 @@
+#ifndef MACHINE_HOST
+#define MACHINE_HOST
+
+#include "EspressoMachine.hpp"
+#include "Simulation.hpp"
+
+#include <thread>
+#include <vector>
+
+namespace RaspLatte{
+  /**
+   * Runs several EspressoMachines in one process, each on its own control thread pinned to a core
+   * of its own. A machine's supervisor is started from its control thread, so it inherits the pin
+   * and a machine never competes with another for a core while there are cores to go round. Core
+   * SERVICE_CORE is left to the shared low priority work (telemetry, config, logging): call
+   * becomeServiceThread() on the thread that starts it and every thread it starts lands there.
+   *
+   * Machines are handed out to cores 1, 2, ... and wrap round if there are more machines than
+   * cores, at which point they share and adding one does cost the others.
+   */
+  class MachineHost{
+  public:
+    static const int SERVICE_CORE = 0;
+    static const int CONTROL_PRIORITY = 50; /** SCHED_FIFO, below the supervisor's */
+
+    /** Every machine runs a tick every period_sec */
+    MachineHost(double period_sec = EspressoMachine::LOOP_PERIOD_SEC);
+
+    /** Add a machine before start(). Its supervisor must not be running. Not owned */
+    void add(EspressoMachine * machine);
+
+    /** Start every machine's supervisor and control loop */
+    void start();
+    /** Stop every machine's control loop and then its supervisor */
+    void stop();
+
+    size_t size(){ return machines_.size(); }
+    /** The core machine i's threads are pinned to */
+    int core(size_t i){ return machines_[i].core; }
+
+    /** Cores this process may run on */
+    static int cores();
+    /** Pin the calling thread, and the threads it starts from now on, to a core */
+    static bool pinCurrentThread(int core);
+    /** Pin the calling thread to SERVICE_CORE at the lowest priority */
+    static void becomeServiceThread();
+
+    ~MachineHost();
+
+  private:
+    struct Hosted{
+      EspressoMachine * machine;
+      int core;
+      std::thread thread;
+    };
+
+    double period_sec_;
+    std::vector<Hosted> machines_;
+    bool running_ = false;
+
+    void control(Hosted * h);
+  };
+
+  /**
+   * An EspressoMachine on a simulated boiler, in real time for a host to run in place of hardware
+   * that is not there, or on a VirtualClock. The power switch is on and the pump and steam switches
+   * off, so it heats to the brew setpoint and holds it.
+   */
+  class SimulatedMachine{
+  public:
+    /** Use BoilerPlant::groupHeadParams() for a group head of its own, for cascade control */
+    SimulatedMachine(const MachineConfig & config, double initial_temp = 20, Clock * clock = steadyClock(),
+		     BoilerPlant::PlantParams params = BoilerPlant::defaultParams());
+
+    EspressoMachine * machine(){ return machine_; }
+    SimulatedBackend * gpio(){ return &gpio_; }
+    HeaterGate * heaterGate(){ return hw_.heaterGate(); }
+    BoilerPlant * plant(){ return &plant_; }
+
+    ~SimulatedMachine();
+
+  private:
+    MachineConfig config_;
+    BoilerPlant plant_;
+    SimulatedBackend gpio_;
+    HardwareContext hw_;
+    EspressoMachine * machine_;
+  };
+}
+#endif
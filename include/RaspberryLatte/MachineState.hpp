@@ -0,0 +1,47 @@
+#ifndef MACHINE_STATE
+#define MACHINE_STATE
+
+#include "MPSCQueue.hpp"
+#include "PID.hpp"
+#include "types.h"
+
+namespace RaspLatte{
+  /**
+   * A plain snapshot of everything a remote client might want to see. It is filled in once per
+   * loop by the EspressoMachine and handed to other threads through a TripleBuffer so they never
+   * touch the hardware or the controller directly.
+   */
+  struct MachineState{
+    uint32_t seq = 0; /** Incremented on every publish */
+    double time_s = 0; /** Seconds since the machine started running */
+    MachineMode mode = OFF;
+    bool mode_overridden = false; /** True if the mode was set remotely instead of from the switches */
+    bool pump_on = false;
+    double temp = 0;
+    double setpoint = 0;
+    double boiler_setpoint = 0; /** What the boiler is held at. Not the setpoint under cascade control */
+    double pwm = 0;
+    double error_sum = 0;
+    double slope = 0;
+    TempPair setpoints = {0, 0};
+    ModePair<PID::PIDGains> gains = {{0, 0, 0}, {0, 0, 0}};
+  };
+
+  /**
+   * Something a user wants changed, from the keyboard, a remote client or anything else. Commands
+   * are applied by the control loop in the order they were queued.
+   */
+  struct Command{
+    enum Type {ADJUST_SETPOINT, SET_SETPOINT, SET_GAINS, SET_MODE, CLEAR_MODE} type;
+    MachineMode mode; /** Which mode the setpoint/gains apply to, or the mode to force */
+    double setpoint; /** The new setpoint, or the change to it for ADJUST_SETPOINT */
+    PID::PIDGains gains;
+  };
+
+  /**
+   * Commands from any number of threads to the control loop, which drains it once per loop. Pushing
+   * never takes a lock, so no producer can stall the controller or another producer.
+   */
+  typedef MPSCQueue<Command, 256> CommandQueue;
+}
+#endif
@@ -0,0 +1,22 @@
+#ifndef MACHINE_UI
+#define MACHINE_UI
+
+namespace RaspLatte{
+  /**
+   * A front panel run by EspressoMachine::runPanel() on a thread of its own, while the control loop
+   * keeps its own pace on another. It shows what the loop publishes (panelState(), panelTrend())
+   * however it likes and turns user input into commands (EspressoMachine::commands()). It must not
+   * touch the boiler or the rest of the controller. Without one the machine runs headless.
+   */
+  class MachineUI{
+  public:
+    /** Called once, with the control loop already running. Slow setup belongs here */
+    virtual void init() = 0;
+
+    /** Wait a little for input, then update the display. Return false to quit */
+    virtual bool refresh() = 0;
+
+    virtual ~MachineUI(){}
+  };
+}
+#endif
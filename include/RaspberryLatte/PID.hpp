@@ -3,11 +3,10 @@
 
 #include "Sensor.hpp"
 #include "Clamp.hpp"
+#include "Clock.hpp"
 #include "types.h"
 
-#include <vector>
 #include <chrono>
-#include <curses.h>
 
 namespace RaspLatte{
   /**
@@ -30,8 +29,7 @@ namespace RaspLatte{
       /** A discrete integral class to handle the error sum in a PID controller*/
     public:
       DIntegral(){
-	// Starts with a data point at (t0,0)
-	prev_time_ = std::chrono::steady_clock::now();
+	// Starts with a data point at (epoch,0). The PID replaces it with a real first point
 	prev_val_ = 0;
       }
       
@@ -41,26 +39,38 @@ namespace RaspLatte{
       void addPoint(TimePoint t, double v);
       void setClamp(double min, double max);
       double area();
+      void setArea(double area);
       void resetArea();
+      /** Zero the area and start again from (t, v) */
+      void restart(TimePoint t, double v);
+      /** While held, points move the integral along without adding to the area */
+      void hold(bool on){ holding_ = on; }
       
     private:
       TimePoint prev_time_;
       double prev_val_;
       Clamp<double> clamp_;
       bool clamping_ = false;
+      bool holding_ = false;
       double area_ = 0;
     };
 
     /**
-     * Fits a slope to the data points taken within the last period_ seconds.
+     * Fits a slope to the points from the last period seconds, so the slope means the same thing
+     * however often the PID is updated. At least the last two points are always used. The points
+     * are kept in a fixed ring buffer of MAX_POINTS so adding one never allocates; past that the
+     * oldest are dropped.
      */
     class DDerivative{
     public:
+      static const int MAX_POINTS = 128; /** A 4.75s window at 20Hz and then some */
+      
       DDerivative(){
 	period_ = Duration(0.001);
       }
-      DDerivative(TimePoint t, double v): times_(1,t), vals_(1,v){
+      DDerivative(TimePoint t, double v){
 	period_ = Duration(0.001);
+	addPoint(t, v);
       }
       
       double addPoint(TimePoint t, double v);
@@ -69,17 +79,20 @@ namespace RaspLatte{
       double slope();
       
     private:
-      std::vector<TimePoint> times_;
-      std::vector<double> vals_;
+      TimePoint times_[MAX_POINTS];
+      double vals_[MAX_POINTS];
+      int next_ = 0; /** Slot the next point goes in */
+      int count_ = 0;
       Duration period_;
-      double slope_;
+      double slope_ = 0;
       
-      void cleanPoints();
       void updateSlope();
     };
 
     
   public:
+    static constexpr double OFFSET_DECAY_SEC = 30; /** Time constant of the offset left by a bumpless gain change */
+
     typedef struct PIDGains_{
       double p;
       double i;
@@ -87,27 +100,43 @@ namespace RaspLatte{
     } PIDGains;
 
     // ========================= Constructors =========================
-    PID(PIDGains gains, double * setpoint, Sensor<double> * sensor_ptr);
+    PID(PIDGains gains, double * setpoint, Sensor<double> * sensor_ptr, Clock * clock = steadyClock());
     
     // ============================ Setters  ===========================
     void setIntegralSumLimits(double min, double max);
     void setInputLimits(double min, double max);
     void setSlopePeriodSec(double period);
-    void setGains(PIDGains gains);
+    /** 
+     * Change the gains. If bumpless is set, the integral is adjusted so the output computed from the
+     * last update is the same under the new gains, so the heater does not jump on a retune. Whatever
+     * the integral can't take (Ki of 0, or past the integral limits) is held as an output offset that
+     * fades over OFFSET_DECAY_SEC and is cleared by reset().
+     */
+    void setGains(PIDGains gains, bool bumpless = false);
     void setMinUpdateTimeSec(double t);
+    /**
+     * Stop integrating the error until called again with false, for anti-windup decided outside
+     * the controller, e.g. while whatever it drives is saturated. The time held is skipped, not
+     * integrated later.
+     */
+    void setIntegralHold(bool hold){ int_sum_.hold(hold); }
     
     // ======================== Operation ============================
     void reset();
-    double update(int feed_forward = 0);
+    double update(double feed_forward = 0);
 
     // ========================= Getters ==============================
     double setpoint();
     double u();
     double errorSum();
     double slope();
+    PIDGains gains(){ return K_; }
+    double lastError(){ return last_err_; } /** Error at the last update */
+    double lastMeasurement(){ return *setpoint_ - last_err_; } /** Sensor reading at the last update */
     
   private:  
     Sensor<double> * sensor_;
+    Clock * clock_;
     PIDGains K_;
     double * setpoint_;
     double prev_setpoint_; // Used to check if value changed
@@ -119,6 +148,10 @@ namespace RaspLatte{
     DIntegral int_sum_;
     
     double u_ = 0;
+    double last_err_ = 0; /** Error at the last update. Used for bumpless gain changes */
+    double offset_ = 0; /** Output a bumpless gain change couldn't put in the integral */
+    bool started_ = false; /** False until reset() has taken the first reading */
+    bool fresh_ = false; /** True from reset() until the next update(), which is never skipped */
     Clamp<double> input_clamper_;
   };
 }
@@ -0,0 +1,91 @@
+#ifndef POWER_SCHEDULER
+#define POWER_SCHEDULER
+
+#include "types.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace RaspLatte{
+  class HeaterGate;
+
+  /**
+   * Shares one circuit between several heaters. Hardware PWM starts every heater's on-time at the
+   * same instant, so a few heaters at modest duty can still all draw at once and trip the breaker.
+   * Once a heater's HeaterGate is added here, its duty requests come to the scheduler instead and
+   * the scheduler switches the heater fully on or off itself, a slot at a time.
+   *
+   * At the start of every window the requests are laid out over the window's slots. Brew heaters
+   * are placed first, then steam. Each heater's on-time starts where the last one's ended and wraps
+   * round the window, so on-times are staggered rather than stacked. A slot is only given to a
+   * heater if the slot's total draw stays within max_watts, so a heater that does not fit gets less
+   * time and the peak never goes over the cap. Part slots are carried into the next window so the
+   * average duty matches the request.
+   *
+   * step() does one slot. It is called by the thread, or directly by a simulation.
+   */
+  class PowerScheduler{
+  public:
+    typedef struct PowerBudget_{
+      double max_watts; /** Peak draw allowed on the circuit. 0 to only stagger */
+      double window_sec; /** How often the slots are laid out again */
+      int slots; /** Slots per window. Each is the shortest time a heater is switched for */
+    } PowerBudget;
+
+    /** No cap, half second windows (the control loop's period) of 20ms slots (a mains cycle at 50Hz) */
+    static PowerBudget defaultBudget();
+
+    PowerScheduler(PowerBudget budget);
+
+    /** Schedule a heater. Call before start(). Returns its id */
+    int add(HeaterGate * gate, double watts);
+
+    /** Called by the heater's gate from any thread. Duty is out of 255. Takes effect next window */
+    void request(int id, unsigned int duty){ heaters_[id]->duty.store(duty, std::memory_order_relaxed); }
+    /** What the heat is for, which sets its priority. Called by the gate from any thread */
+    void setMode(int id, MachineMode mode){ heaters_[id]->mode.store(mode, std::memory_order_relaxed); }
+
+    /** Switch the heaters for one slot, laying out a new window first if one is due */
+    void step();
+
+    /** Run step() every slot on a high priority thread */
+    void start();
+    void stop();
+
+    double slotSec(){ return budget_.window_sec/budget_.slots; }
+    /** Highest total draw laid out in any slot so far */
+    double peakWatts(){ return peak_watts_; }
+    /** Fraction of the last window heater id was given */
+    double grantedDuty(int id);
+
+    ~PowerScheduler();
+
+  private:
+    struct Heater{
+      int id;
+      HeaterGate * gate;
+      double watts;
+      std::atomic<unsigned int> duty{0};
+      std::atomic<MachineMode> mode{OFF};
+      double carry = 0; /** Part of a slot owed from the last window */
+      std::vector<bool> on; /** Whether the heater is on in each slot of this window */
+      std::atomic<int> granted{0}; /** Slots given this window */
+      bool driven = false; /** Last state written to the gate */
+    };
+
+    PowerBudget budget_;
+    std::vector<Heater*> heaters_;
+    std::vector<Heater*> order_; /** heaters_ by priority. Sorted in place every window */
+    std::vector<double> load_; /** Watts laid out in each slot */
+    int slot_ = 0;
+    std::atomic<double> peak_watts_{0};
+
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+
+    void plan();
+    void loop();
+  };
+}
+#endif
@@ -0,0 +1,68 @@
+#ifndef RCU_POINTER
+#define RCU_POINTER
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace RaspLatte{
+  /**
+   * An RCU-style pointer with a single reader (the control loop) and a single writer. The reader
+   * gets the current object with one atomic load and never blocks. The writer swaps in a new object
+   * and keeps the old one until the reader reports a quiescent state, i.e. a point where it holds 
+   * no pointer from read(). Only then is the old object freed (always on the writer's thread).
+   */
+  template <typename T>
+  class RCUPointer{
+  public:
+    RCUPointer(T * initial): current_(initial){}
+
+    /** Reader side. The pointer is valid until the next call to quiescent(). */
+    const T * read(){
+      return current_.load(std::memory_order_acquire);
+    }
+
+    /** Reader side. Call once per loop when no pointer from read() is held. */
+    void quiescent(){
+      reader_epoch_.store(writer_epoch_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    /** Writer side. Take ownership of next and make it current. */
+    void publish(T * next){
+      T * old = current_.exchange(next, std::memory_order_acq_rel);
+      retired_.push_back({old, writer_epoch_.fetch_add(1, std::memory_order_acq_rel) + 1});
+      reclaim();
+    }
+
+    /** Writer side. Free any retired objects the reader can no longer see. */
+    void reclaim(){
+      uint64_t safe = reader_epoch_.load(std::memory_order_acquire);
+      auto it = retired_.begin();
+      while (it != retired_.end()){
+	if (it->epoch <= safe){
+	  delete it->ptr;
+	  it = retired_.erase(it);
+	} else {
+	  it++;
+	}
+      }
+    }
+
+    ~RCUPointer(){
+      for (Retired & r : retired_) delete r.ptr;
+      delete current_.load();
+    }
+    
+  private:
+    struct Retired{
+      T * ptr;
+      uint64_t epoch;
+    };
+
+    std::atomic<T*> current_;
+    std::atomic<uint64_t> writer_epoch_{0};
+    std::atomic<uint64_t> reader_epoch_{0};
+    std::vector<Retired> retired_;
+  };
+}
+#endif
@@ -3,34 +3,54 @@
 
 #include <curses.h>
 
-#include "CPUThermometer.hpp"
+#include "MachineState.hpp"
+#include "MachineUI.hpp"
+#include "SystemHealth.hpp"
+#include "TrendHistory.hpp"
 
 namespace RaspLatte{
   class EspressoMachine;
-  class Boiler;
-  
-  class RaspberryLatteUI{
+
+  /**
+   * The ncurses front panel. The arrow keys change the current mode's setpoint, 't' steps the trend
+   * chart through its resolutions and 'q' quits. The trend chart needs a terminal 38 lines high and
+   * is left out of a smaller one. It draws the state and trend the control loop publishes for it, so
+   * the machine must have had enablePanel() called. Only built into the full binary; the headless
+   * build leaves it and ncurses out.
+   */
+  class RaspberryLatteUI : public MachineUI{
   private:
     EspressoMachine * machine_;
-    Boiler * boiler_;
+    MachineState state_; /** Latest from the control loop */
+    TrendHistory trend_; /** Latest copy, a second old at most */
+    bool initialized_ = false;
 
     WINDOW * header_win_;
     WINDOW * general_win_;
     WINDOW * boiler_win_;
+    WINDOW * trend_win_ = NULL;
 
     int last_setpoint_slider_loc_ = 0;
-    CPUThermometer cpu_thermo_;
+    SystemHealth * health_; /** May be NULL */
+    int trend_level_ = 0; /** TrendHistory level charted */
     
     void updateGeneralWindow(bool init = true);
     void updateBoilerWindow(bool init = true);
+    void updateTrendWindow(bool init = true);
+    void handleKeyPress(int key);
+    /** Take whatever the control loop has published since the last call */
+    void readMachine();
   public:
-    RaspberryLatteUI(EspressoMachine * machine, Boiler * boiler);
+    /** health is shown on the general window if given. It should be sampling (SystemHealth::start) */
+    RaspberryLatteUI(EspressoMachine * machine, SystemHealth * health = NULL);
 
     void init();
     /**
-     * Wait 0.25 sec for key press and then update windows and return key
+     * Wait 0.5 sec for a key press, queue what it asks for and update the windows
      */
-    int refresh();
+    bool refresh();
+
+    ~RaspberryLatteUI();
   };
 }
 #endif
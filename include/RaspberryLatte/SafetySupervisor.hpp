@@ -0,0 +1,231 @@
+#ifndef SAFETY_SUPERVISOR
+#define SAFETY_SUPERVISOR
+
+#include "Clock.hpp"
+#include "GPIOBackend.hpp"
+#include "HeaterWaveform.hpp"
+#include "MAX31855.hpp"
+#include "PowerScheduler.hpp"
+#include "Sensor.hpp"
+#include "Watchdog.hpp"
+#include "types.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace RaspLatte{
+  /**
+   * The only way to the heater pin once a supervisor is in place. The boiler asks for a duty cycle
+   * and the supervisor can cut the output at any time. Both go through one mutex so a request can
+   * never land between the supervisor's cut and its check. With a PowerScheduler the requests go
+   * to it instead and it switches the heater through drive(). Otherwise, with a HeaterWaveform, the
+   * duty is played as a waveform, fraction and all.
+   */
+  class HeaterGate{
+  public:
+    HeaterGate(GPIOBackend * gpio, PinIndex pin): gpio_(gpio), pin_(pin){}
+
+    /** Request a duty cycle. Ignored while tripped. Only a waveform uses the fraction */
+    void set(double duty){
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (tripped_) return;
+      unsigned int d = (unsigned int)duty;
+      if (scheduler_ == NULL && wave_ != NULL){
+	if (!wave_->set(duty)){
+	  wave_.reset(); // The backend can't time waveforms. Back to PWM
+	  gpio_->pwm(pin_, d);
+	}
+	applied_ = d;
+	return;
+      }
+      if (d != applied_){
+	if (scheduler_ != NULL) scheduler_->request(scheduler_id_, d);
+	else gpio_->pwm(pin_, d);
+	applied_ = d;
+      }
+    }
+
+    /** Turn the heater off and hold it off until release() */
+    void trip(){
+      std::lock_guard<std::mutex> lock(mutex_);
+      tripped_ = true;
+      if (wave_ != NULL) wave_->stop();
+      gpio_->pwm(pin_, 0);
+      if (scheduler_ != NULL) scheduler_->request(scheduler_id_, 0);
+      applied_ = 0;
+    }
+
+    /** Allow set() again. The heater stays off until the next request */
+    void release(){
+      std::lock_guard<std::mutex> lock(mutex_);
+      tripped_ = false;
+    }
+
+    bool tripped(){ return tripped_; }
+
+    /** Play requests as a waveform from now on, unless a scheduler has the heater */
+    void setWaveform(HeaterWaveform::WaveformSettings settings, Clock * clock){
+      std::lock_guard<std::mutex> lock(mutex_);
+      wave_.reset(new HeaterWaveform(gpio_, pin_, settings, clock));
+    }
+
+    /** Called by PowerScheduler::add(). Requests go to the scheduler from now on */
+    void setScheduler(PowerScheduler * scheduler, int id){
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (scheduler != NULL && wave_ != NULL){
+	wave_->stop(); // The scheduler switches the heater itself
+	wave_.reset();
+      }
+      scheduler_ = scheduler;
+      scheduler_id_ = id;
+      if (scheduler_ != NULL) scheduler_->request(scheduler_id_, applied_);
+    }
+
+    /** Tell the scheduler, if any, what the heat is for. Brew is served before steam */
+    void setMode(MachineMode mode){
+      if (scheduler_ != NULL) scheduler_->setMode(scheduler_id_, mode);
+    }
+
+    /** The scheduler switching the heater fully on or off. Ignored while tripped */
+    void drive(bool on){
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (tripped_) return;
+      gpio_->pwm(pin_, (on ? 255 : 0));
+    }
+    
+  private:
+    GPIOBackend * gpio_;
+    PinIndex pin_;
+    std::mutex mutex_;
+    std::atomic<bool> tripped_{false};
+    unsigned int applied_ = 0;
+    PowerScheduler * scheduler_ = NULL;
+    int scheduler_id_ = 0;
+    std::unique_ptr<HeaterWaveform> wave_;
+  };
+
+  /**
+   * Watches the boiler independently of the control loop and the UI. The supervisor owns the
+   * thermocouple: it takes every sample (on its own thread in normal use) and checks it for
+   * (a) MAX31855 fault bits
+   * (b) An impossible rate of change (a glitch)
+   * (c) Boiler over-temperature
+   * (d) No good sample within the stale-data timeout
+   * (e) CPU over-temperature, if a CPU sensor is attached
+   * (f) No heartbeat from the control loop within its timeout
+   * Any of these cuts the heater through the HeaterGate in the same pass, so the reaction is
+   * bounded by one acquisition period. The heater is released once every check has passed for
+   * the recovery time. The control loop reads the latest good sample through sensor(). A missed
+   * sample leaves the last good one there until it is stale; a fault or stale data reads
+   * MAX31855_TEMP_UNAVALIBLE, and the heater is held off whenever it does.
+   *
+   * A WatchdogDevice, if attached, is kicked on every pass so a hung supervisor resets the Pi.
+   */
+  class SafetySupervisor{
+  public:
+    typedef struct SafetyLimits_{
+      double period_sec; /** Acquisition period */
+      double max_temp; /** Boiler over-temperature in C */
+      double max_rate; /** Largest believable change in C/s */
+      double stale_sec; /** Longest time without a good sample */
+      double cpu_max; /** CPU over-temperature in C */
+      double control_timeout_sec; /** Longest time without a control loop heartbeat */
+      double recovery_sec; /** Time all checks must pass before the heater is released */
+      double idle_period_sec; /** Acquisition period while the control loop is idle (see setIdle) */
+    } SafetyLimits;
+
+    static SafetyLimits defaultLimits();
+
+    enum Trip {NONE, SENSOR_FAULT, RATE_OF_CHANGE, OVER_TEMP, STALE_DATA, CPU_TEMP, CONTROL_STALL};
+    static const char * tripName(Trip trip);
+
+    /** Reaction time from the moment a condition was due to be caught to the heater being cut */
+    typedef struct ReactionStats_{
+      unsigned long trips;
+      double last_sec;
+      double max_sec;
+      double mean_sec;
+    } ReactionStats;
+
+    SafetySupervisor(MAX31855 * sensor, HeaterGate * gate, SafetyLimits limits, Clock * clock = steadyClock());
+
+    /** Optional inputs. Set before start() */
+    void setCPUSensor(Sensor<double> * cpu){ cpu_ = cpu; }
+    void setWatchdog(WatchdogDevice * watchdog){ watchdog_ = watchdog; }
+
+    /** Take one sample and run every check. Called by the thread, or directly by a simulation */
+    void poll();
+
+    /** Run poll() every period on a high priority thread */
+    void start();
+    void stop();
+
+    /**
+     * Sample every idle_period_sec instead of period_sec while the control loop says it is idle
+     * (see LoopRate). Takes effect from the next sample.
+     */
+    void setIdle(bool idle){ idle_.store(idle, std::memory_order_relaxed); }
+    /** Time to the next sample. A simulation polls at this period */
+    double periodSec(){ return (idle_.load(std::memory_order_relaxed) ? limits_.idle_period_sec : limits_.period_sec); }
+
+    /** Called by the control loop once per pass */
+    void heartbeat(){ heartbeat_s_ = seconds(clock_->now()); }
+
+    /** The supervised boiler temperature for the control loop */
+    Sensor<double> * sensor(){ return &sensor_; }
+    double temp(){ return temp_; }
+
+    Trip trip(){ return trip_; }
+    bool tripped(){ return gate_->tripped(); }
+    TimePoint lastTripTime();
+    ReactionStats reactionStats();
+
+    ~SafetySupervisor();
+    
+  private:
+    class SupervisedSensor : public Sensor<double>{
+    public:
+      SupervisedSensor(SafetySupervisor * s): s_(s){}
+      double read(){ return s_->temp_; }
+    private:
+      SafetySupervisor * s_;
+    };
+    
+    MAX31855 * thermo_;
+    HeaterGate * gate_;
+    SafetyLimits limits_;
+    Clock * clock_;
+    Sensor<double> * cpu_ = NULL;
+    WatchdogDevice * watchdog_ = NULL;
+    SupervisedSensor sensor_;
+
+    std::atomic<double> temp_{MAX31855_TEMP_UNAVALIBLE}; /** Latest good sample */
+    std::atomic<double> heartbeat_s_; /** Clock time of the last heartbeat in seconds */
+    std::atomic<Trip> trip_{NONE};
+    std::atomic<bool> idle_{false};
+
+    // Only touched by poll()
+    bool have_last_ = false;
+    double last_temp_ = 0;
+    TimePoint last_sample_time_;
+    TimePoint last_good_time_;
+    TimePoint last_cpu_check_;
+    bool cpu_hot_ = false;
+    bool recovering_ = false;
+    TimePoint good_since_;
+
+    std::mutex stats_mutex_;
+    ReactionStats stats_ = {0, 0, 0, 0};
+    TimePoint last_trip_time_;
+
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+
+    void loop();
+    void cut(Trip reason, TimePoint due, std::chrono::steady_clock::time_point wall_start);
+    static double seconds(TimePoint t){ return Duration(t.time_since_epoch()).count(); }
+  };
+}
+#endif
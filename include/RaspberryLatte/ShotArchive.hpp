@@ -0,0 +1,211 @@
+#ifndef SHOT_ARCHIVE
+#define SHOT_ARCHIVE
+
+#include "PID.hpp"
+#include "types.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace RaspLatte{
+  /**
+   * Summary of one shot. Stored in front of the shot's columns in the archive and again in the
+   * index file, so queries on settings and outcomes never have to touch the samples.
+   */
+  struct ShotMeta{
+    int64_t start_ms = 0; /** Unix time the pump started in ms */
+    uint32_t period_ms = 0; /** Nominal sample period */
+    uint32_t samples = 0;
+    uint16_t machine_id = 0;
+    uint8_t mode = BREW;
+    uint8_t flags = 0; /** FLAG_* */
+    double setpoint = 0; /** Setpoint when the pump started */
+    PID::PIDGains gains = {0, 0, 0};
+    float pump_sec = 0; /** How long the pump ran */
+    float mean_err = 0; /** Mean of temp - setpoint while the pump ran */
+    float min_temp = 0; /** Lowest temp while the pump ran */
+    float max_overshoot = 0; /** Highest temp - setpoint after the pump stopped (0 if never above) */
+
+    static const uint8_t FLAG_SCHEDULED = 1; /** Gain scheduling was on */
+    static const uint8_t FLAG_CUT_SHORT = 2; /** Recording stopped before the shot and its recovery ended */
+  };
+
+  /**
+   * One shot's time series, one vector per column. t_ms is relative to ShotMeta::start_ms.
+   */
+  struct ShotColumns{
+    std::vector<int64_t> t_ms;
+    std::vector<double> temp;
+    std::vector<double> setpoint;
+    std::vector<double> pwm;
+    std::vector<uint8_t> pump;
+    std::vector<double> weight; /** Grams on the scale. 0 without one */
+
+    enum Column {T = 1, TEMP = 2, SETPOINT = 4, PWM = 8, PUMP = 16, WEIGHT = 32, ALL = 63};
+  };
+
+  /**
+   * Appends shots to a columnar archive. Each shot is a block with its ShotMeta followed by one
+   * compressed column per series:
+   * (a) Time: delta-of-delta, zigzag, varint. A steady sample period costs one byte per sample.
+   * (b) Pump: delta, zigzag, varint
+   * (c) Temperature, setpoint, PWM and weight: Gorilla XOR float compression. A value that
+   *     repeats costs one bit, and thermocouple steps only a few bits more.
+   * Next to the archive, PATH.idx holds a fixed size (offset, ShotMeta) record per shot. It is
+   * only an accelerator; the reader rebuilds it from the archive if it is missing or short.
+   *
+   * All fields are little-endian, which is what both the Pi and a desktop are.
+   */
+  class ShotArchiveWriter{
+  public:
+    ShotArchiveWriter(const std::string & path);
+
+    /** Opens (or creates) the archive for appending. Returns false and sets err on failure */
+    bool open(std::string & err);
+
+    /**
+     * Append a shot. The summary fields of meta are filled in from the samples. n samples are read
+     * from each column array.
+     */
+    bool append(ShotMeta meta, uint32_t n, const int64_t * t_ms, const double * temp, const double * setpoint,
+		const double * pwm, const uint8_t * pump, const double * weight);
+    bool append(const ShotMeta & meta, const ShotColumns & cols);
+
+    uint64_t bytesWritten(){ return bytes_; }
+
+    ~ShotArchiveWriter();
+
+  private:
+    std::string path_;
+    FILE * data_ = NULL;
+    FILE * index_ = NULL;
+    uint64_t offset_ = 0; /** End of the archive file */
+    uint64_t bytes_ = 0;
+    std::string block_; /** Reused encode buffer */
+    std::string column_;
+  };
+
+  /**
+   * Reads an archive written by ShotArchiveWriter. The archive is mapped into memory and columns
+   * are decoded on demand so a query only pays for the columns it asks for.
+   */
+  class ShotArchiveReader{
+  public:
+    struct Entry{
+      uint64_t offset; /** Of the block in the archive */
+      ShotMeta meta;
+    };
+
+    ShotArchiveReader(const std::string & path);
+
+    /** Map the archive and load (or rebuild) the index. Returns false and sets err on failure */
+    bool open(std::string & err);
+
+    const std::vector<Entry> & shots(){ return shots_; }
+    /** True if the index file was missing or short and was rebuilt from the archive */
+    bool indexRebuilt(){ return rebuilt_; }
+    size_t archiveBytes(){ return size_; }
+
+    /**
+     * Decode the columns in mask (ShotColumns::Column bits) of a shot into cols. Vectors are
+     * resized to the sample count and keep their capacity between calls.
+     */
+    bool read(const Entry & shot, unsigned int mask, ShotColumns & cols);
+
+    ~ShotArchiveReader();
+
+  private:
+    std::string path_;
+    const uint8_t * base_ = NULL;
+    size_t size_ = 0;
+    std::vector<Entry> shots_;
+    bool rebuilt_ = false;
+
+    bool rebuildIndex(std::string & err);
+  };
+
+  /**
+   * Cuts the control loop's samples into shots and hands finished shots to a writer thread. A shot
+   * runs from the pump starting until POST_SHOT_SEC after it stops so the recovery is kept too.
+   *
+   * update() is called from the control loop and never allocates or blocks. Shots are recorded
+   * into one of SLOTS preallocated buffers; if the writer falls so far behind that none is free the
+   * shot is dropped and counted.
+   */
+  class ShotRecorder{
+  public:
+    static const int MAX_SAMPLES = 1024;
+    static const int SLOTS = 4;
+    static constexpr double POST_SHOT_SEC = 30;
+
+    /**
+     * unix_ms_at_zero is the Unix time in ms when the control clock read zero (see wallOffsetMs).
+     */
+    ShotRecorder(ShotArchiveWriter * writer, int64_t unix_ms_at_zero, uint16_t machine_id);
+
+    /** Unix ms at zero on clock, taken from the system clock */
+    static int64_t wallOffsetMs(Clock * clock);
+
+    /** Control loop side. Called once per tick */
+    void update(TimePoint t, bool pump_on, double temp, double setpoint, double pwm, double weight,
+		MachineMode mode, const PID::PIDGains & gains, bool scheduled);
+
+    /** Run the writer on a background thread */
+    void start();
+    /**
+     * Stop the writer thread, then finish the shot still being recorded, flagged FLAG_CUT_SHORT, and
+     * write it with any others waiting. Only once the control loop has stopped calling update().
+     */
+    void stop();
+    /** Write finished shots on the calling thread. For simulations that don't start() */
+    void flush();
+
+    unsigned long recorded(){ return recorded_; }
+    unsigned long dropped(){ return dropped_; }
+
+    ~ShotRecorder();
+
+  private:
+    enum SlotState {FREE, FILLING, READY};
+    struct Slot{
+      std::atomic<int> state{FREE};
+      ShotMeta meta;
+      uint32_t n = 0;
+      int64_t t_ms[MAX_SAMPLES];
+      double temp[MAX_SAMPLES];
+      double setpoint[MAX_SAMPLES];
+      double pwm[MAX_SAMPLES];
+      uint8_t pump[MAX_SAMPLES];
+      double weight[MAX_SAMPLES];
+    };
+
+    ShotArchiveWriter * writer_;
+    int64_t unix_ms_at_zero_;
+    uint16_t machine_id_;
+    Slot * slots_;
+
+    // Control loop side
+    Slot * current_ = NULL;
+    TimePoint shot_start_;
+    TimePoint pump_off_time_;
+    bool last_pump_ = false;
+
+    std::atomic<unsigned long> recorded_{0};
+    std::atomic<unsigned long> dropped_{0};
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+
+    void finish();
+    void loop();
+  };
+}
+#endif
@@ -0,0 +1,250 @@
+#ifndef SIMULATION
+#define SIMULATION
+
+#include "Clock.hpp"
+#include "GPIOBackend.hpp"
+#include "types.h"
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+namespace RaspLatte{
+  /**
+   * Thermal model of a boiler. The water and brass are one lump with a heat capacity, heated by the
+   * element, losing heat to the room, and cooled by fresh water while the pump runs. With an
+   * element_capacity the element is a second lump that heats the water through element_coupling,
+   * which gives the lag between the heater switching and the water responding. With a
+   * group_capacity the group head is a lump of its own, warmed by the water through group_coupling
+   * and by the water the pump pushes through it, and losing heat to the room.
+   * Inputs are held constant between calls to advance() and the model is solved exactly over each
+   * interval, so the result does not depend on how often it is stepped.
+   */
+  class BoilerPlant{
+  public:
+    typedef struct PlantParams_{
+      double heater_watts; /** Element power when fully on */
+      double heat_capacity; /** J/C of the water and boiler */
+      double loss_w_per_c; /** Loss to the room per degree above ambient */
+      double ambient; /** Room temp in C */
+      double pump_w_per_c; /** Heat taken by inlet water per degree above the inlet temp */
+      double inlet_temp; /** Inlet water temp in C */
+      double element_capacity; /** J/C of the element. 0 for a single lump */
+      double element_coupling; /** W/C from the element to the water */
+      double group_capacity; /** J/C of the group head. 0 to lump it in with the boiler */
+      double group_coupling; /** W/C from the water to the group head */
+      double group_loss_w_per_c; /** Group head loss to the room */
+    } PlantParams;
+
+    /** Roughly a single boiler machine like the Gaggia Classic */
+    static PlantParams defaultParams();
+    /** The same machine with its group head as a lump of its own */
+    static PlantParams groupHeadParams();
+
+    BoilerPlant(PlantParams params, double initial_temp);
+
+    /** Move the model forward by dt with the heater at heater_fraction (0 to 1) */
+    void advance(Duration dt, double heater_fraction, bool pump_on);
+
+    double temp(){ return temp_; }
+    double elementTemp(){ return (params_.element_capacity > 0 ? element_temp_ : temp_); }
+    double groupTemp(){ return (params_.group_capacity > 0 ? group_temp_ : temp_); }
+    bool hasGroupHead(){ return params_.group_capacity > 0; }
+    double heaterEnergy(){ return heater_joules_; } /** Energy used by the element in J */
+    
+  private:
+    PlantParams params_;
+    double temp_;
+    double element_temp_;
+    double group_temp_;
+    double heater_joules_ = 0;
+
+    /** group is the W/C the water loses to the group head, which is held at group_temp_ */
+    void advanceTwoNode(double dt, double heat, double pump, double group);
+    /** Move the group head on with the water at water_temp throughout */
+    void advanceGroup(double dt, double water_temp, double pump);
+  };
+
+  /**
+   * A GPIOBackend that stands in for a whole machine. Switch inputs are set by the caller, PWM on
+   * the heater pin drives a BoilerPlant, and SPI reads return MAX31855 frames encoding the plant's
+   * temperature. The plant is brought up to date with the clock on every access. Safe to share
+   * between a supervisor thread and a control thread, as on the real machine.
+   */
+  class SimulatedBackend : public GPIOBackend{
+  public:
+    SimulatedBackend(Clock * clock, BoilerPlant * plant, PinIndex heater_pin);
+
+    bool initialise(){ return true; }
+    void setInput(PinIndex p, Pull pull);
+    void setOutput(PinIndex p){}
+    int read(PinIndex p);
+    void write(PinIndex p, bool level);
+    void setPWMFrequency(PinIndex p, unsigned int hz){}
+    void pwm(PinIndex p, unsigned int duty);
+    bool wave(PinIndex p, const WavePulse * pulses, unsigned int count);
+    int spiOpen(unsigned int channel, SPIBaud baud, unsigned int flags){ return channel; }
+    int spiRead(int handle, char * buf, unsigned int count);
+    void spiClose(int handle){}
+
+    /** Set the level seen on an input pin */
+    void setInputLevel(PinIndex p, bool level);
+    /** Start or stop water flowing through the plant */
+    void setPump(bool on);
+    /** Make the thermocouple report MAX31855 fault bits (0 clears) */
+    void setThermocoupleFault(uint8_t fault){
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      fault_ = fault;
+    }
+    /** Make the next n SPI reads fail, as a disturbed transfer would */
+    void failSPIReads(unsigned int n){
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      spi_failures_ = n;
+    }
+    /** Read the plant's group head on this SPI channel instead of the boiler. -1 for none */
+    void setGroupChannel(int channel){
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      group_channel_ = channel;
+    }
+    /** Make the group head thermocouple report MAX31855 fault bits (0 clears) */
+    void setGroupFault(uint8_t fault){
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      group_fault_ = fault;
+    }
+
+    bool outputLevel(PinIndex p);
+    /** PWM duty, or the mean duty of a waveform rounded */
+    unsigned int pwmDuty(PinIndex p);
+    /** Seconds the heater has been on since the start, counting partial duty */
+    double heaterOnSec(){
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      sync();
+      return heater_on_sec_;
+    }
+    /** Thermocouple frames read over SPI so far */
+    unsigned long spiReads(){
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      return spi_reads_;
+    }
+    /** Bring the plant up to date with the clock. Done on every access, and before reading the plant directly */
+    void sync();
+
+  private:
+    Clock * clock_;
+    BoilerPlant * plant_;
+    PinIndex heater_pin_;
+    TimePoint last_sync_;
+    bool pump_on_ = false;
+    uint8_t fault_ = 0;
+    int group_channel_ = -1;
+    uint8_t group_fault_ = 0;
+    unsigned long spi_reads_ = 0;
+    unsigned int spi_failures_ = 0;
+    std::map<PinIndex, int> levels_;
+    std::map<PinIndex, unsigned int> duty_;
+    double heater_on_sec_ = 0;
+
+    /** A waveform played from start, as DMA would */
+    struct Wave{
+      std::vector<WavePulse> pulses;
+      double period_sec;
+      double on_sec; /** On time in one period */
+      TimePoint start;
+
+      /** On time in the first t seconds */
+      double onSec(double t) const;
+    };
+    std::map<PinIndex, Wave> waves_;
+    std::recursive_mutex mutex_; /** sync() is called from inside the other accessors */
+  };
+
+  /**
+   * A meter on the circuit feeding several simulated heaters. Hardware PWM starts every channel's
+   * on-time at the same instant, so every heater with any duty at all draws its full power at the
+   * top of each PWM period; that sum is the instantaneous peak. Call sample() whenever the outputs
+   * may have changed (after every control tick or scheduler slot).
+   */
+  class PowerMeter{
+  public:
+    /** Samples drawing more than limit_watts are counted. 0 for no limit */
+    PowerMeter(double limit_watts = 0): limit_(limit_watts){}
+
+    void add(SimulatedBackend * gpio, PinIndex heater_pin, double watts);
+
+    /** Read every heater now */
+    void sample();
+
+    /** Draw at the last sample */
+    double peakWatts(){ return peak_; }
+    /** Highest draw of any sample */
+    double maxWatts(){ return max_; }
+    /** Mean of the duty weighted draw over the samples */
+    double meanWatts(){ return (samples_ ? watt_sum_/samples_ : 0); }
+    unsigned long samples(){ return samples_; }
+    unsigned long samplesOverLimit(){ return over_; }
+
+  private:
+    struct Heater{
+      SimulatedBackend * gpio;
+      PinIndex pin;
+      double watts;
+    };
+    std::vector<Heater> heaters_;
+    double peak_ = 0;
+    double max_ = 0;
+    double watt_sum_ = 0;
+    unsigned long samples_ = 0;
+    double limit_;
+    unsigned long over_ = 0;
+  };
+
+  /**
+   * Discrete-event simulation driver. Events are kept in time order and the VirtualClock jumps
+   * straight to each one, so long runs take only as long as the work done at the events. Events
+   * at the same time run in the order they were scheduled, making every run repeatable.
+   * Optionally the run can be paced to wall time, giving the same results at real speed.
+   */
+  class Simulation{
+  public:
+    Simulation(VirtualClock * clock): clock_(clock){}
+
+    /** Run fn at time t (or now if t has passed) */
+    void at(TimePoint t, std::function<void()> fn);
+    /** Run fn sec seconds from now */
+    void after(double sec, std::function<void()> fn);
+    /** Run fn now and every period_sec seconds after */
+    void every(double period_sec, std::function<void()> fn);
+
+    /** Process events until the clock reaches end. The clock is left at end */
+    void runUntil(TimePoint end);
+    void runFor(double sec);
+
+    /** Sleep so simulated time keeps pace with wall time */
+    void setRealtime(bool realtime){ realtime_ = realtime; }
+
+    uint64_t eventsRun(){ return events_run_; }
+    
+  private:
+    struct Event{
+      TimePoint t;
+      uint64_t seq;
+      std::function<void()> fn;
+    };
+    struct Later{
+      bool operator()(const Event & a, const Event & b) const{
+	return a.t > b.t || (a.t == b.t && a.seq > b.seq);
+      }
+    };
+
+    VirtualClock * clock_;
+    std::priority_queue<Event, std::vector<Event>, Later> events_;
+    uint64_t next_seq_ = 0;
+    uint64_t events_run_ = 0;
+    bool realtime_ = false;
+
+    void periodic(TimePoint start, Duration period, uint64_t n, std::function<void()> fn);
+  };
+}
+#endif
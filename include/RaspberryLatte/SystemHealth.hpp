@@ -0,0 +1,126 @@
+#ifndef SYSTEM_HEALTH
+#define SYSTEM_HEALTH
+
+#include "Sensor.hpp"
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace RaspLatte{
+  /**
+   * Samples the health of the Pi on a low priority thread: CPU temperature, the firmware's throttle
+   * flags and clock, the load on each core from /proc/stat, and this process's resident memory and
+   * context switches. Every file is opened once and read with pread, so a sample never opens a file
+   * or allocates. The latest sample is published as a HealthSnapshot for the UI and logs.
+   *
+   * Throttling slows the control loop as much as anything running beside it, so it is flagged on
+   * its own: throttled is set while the firmware reports the clock capped or throttled, or, where it
+   * does not report (not a Pi), while the CPU is at or over throttle_temp. Changes are written to
+   * the log if one is set.
+   *
+   * It is also the CPU temperature Sensor for a SafetySupervisor. read() only loads the last sample.
+   *
+   * The sysfs and procfs roots are settings so a fake tree can stand in for them (see bin/health_check).
+   * Files that do not exist are reported as unknown rather than failing.
+   */
+  class SystemHealth : public Sensor<double>{
+  public:
+    static const int MAX_CORES = 8;
+
+    typedef struct HealthSettings_{
+      std::string sys_root; /** Usually /sys */
+      std::string proc_root; /** Usually /proc */
+      double period_sec; /** Time between samples */
+      double throttle_temp; /** CPU temperature taken as throttling where the firmware can't say */
+    } HealthSettings;
+
+    typedef struct HealthSnapshot_{
+      uint64_t seq; /** Samples taken. 0 until the first */
+      double cpu_temp; /** C, or -1 if unknown */
+      int throttle_flags; /** The firmware's get_throttled bits, or -1 if unknown */
+      bool throttled; /** Clock capped or throttled now. See the class comment */
+      unsigned int throttle_events; /** Times throttled has come on */
+      double freq_mhz; /** Core 0 clock, or 0 if unknown */
+      double max_freq_mhz;
+      int cores; /** Cores with a load below. 0 if /proc/stat is unreadable */
+      float core_load[MAX_CORES]; /** Busy fraction of each core since the last sample */
+      float load; /** Busy fraction of all cores */
+      long rss_kb; /** Resident memory of this process, or -1 if unknown */
+      unsigned long voluntary_switches; /** Context switches of this process since it started */
+      unsigned long involuntary_switches; /** Preemptions, which is what a busy core does to the loop */
+      double involuntary_per_sec; /** Since the last sample */
+    } HealthSnapshot;
+
+    /** Firmware get_throttled bits that mean the clock is held down now */
+    static const int THROTTLE_NOW_MASK = 0x2 | 0x4 | 0x8;
+
+    /** /sys and /proc, once a second, 80C */
+    static HealthSettings defaultSettings();
+
+    SystemHealth(HealthSettings settings = defaultSettings());
+
+    /** Take one sample now. The thread calls this every period_sec */
+    void sample();
+
+    /** Sample on a low priority thread */
+    void start();
+    void stop();
+
+    /** The latest sample */
+    HealthSnapshot snapshot();
+
+    /** Write a line here whenever throttling starts or stops. NULL for none. Not owned */
+    void setLog(FILE * log){ log_ = log; }
+
+    /** One line summary of a snapshot for logs, e.g. "cpu 52.1C load 12% rss 3.9MB preempt 3/s" */
+    static void format(const HealthSnapshot & s, char * buf, size_t len);
+
+    /** CPU temperature of the last sample in C, -1 if unknown. Cheap, for a SafetySupervisor */
+    double read(){ return cpu_temp_.load(std::memory_order_relaxed); }
+    bool throttled(){ return throttled_.load(std::memory_order_relaxed); }
+
+    ~SystemHealth();
+
+  private:
+    static const size_t BUF_BYTES = 4096; /** Enough for the status file and the cpu lines of /proc/stat */
+
+    HealthSettings settings_;
+    int temp_fd_ = -1;
+    int throttle_fd_ = -1;
+    int freq_fd_ = -1;
+    int max_freq_fd_ = -1;
+    int stat_fd_ = -1;
+    int status_fd_ = -1;
+    int stop_fd_ = -1;
+    char buf_[BUF_BYTES];
+
+    unsigned long long last_busy_[MAX_CORES + 1] = {0}; /** Per core then the total, for the next sample's loads */
+    unsigned long long last_total_[MAX_CORES + 1] = {0};
+    std::chrono::steady_clock::time_point last_sample_;
+
+    HealthSnapshot next_; /** Filled by sample(), then copied out under the mutex */
+    std::mutex mutex_;
+    HealthSnapshot published_;
+    std::atomic<double> cpu_temp_{-1};
+    std::atomic<bool> throttled_{false};
+    FILE * log_ = NULL;
+    std::thread thread_;
+
+    int openFile(const std::string & root, const char * path);
+    /** Read the whole of a kept open file into buf_. Returns the length, or -1 */
+    ssize_t readFile(int fd);
+    /** First number in a file, or fallback */
+    double readNumber(int fd, double fallback);
+    void readStat();
+    void readStatus();
+    void loop();
+  };
+}
+#endif
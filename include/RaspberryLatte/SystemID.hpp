@@ -0,0 +1,173 @@
+#ifndef SYSTEM_ID
+#define SYSTEM_ID
+
+#include "BoilerModel.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace RaspLatte{
+  /**
+   * A stretch of evenly sampled boiler data. heater[k] is the duty (0 to 1) applied from sample k to
+   * sample k+1 and pump[k] whether water flowed over the same interval.
+   */
+  struct ThermalSegment{
+    std::vector<double> temp;
+    std::vector<double> heater;
+    std::vector<uint8_t> pump;
+  };
+
+  /**
+   * Everything read from one log file. Samples are split into segments wherever the period jumps.
+   */
+  struct ThermalLog{
+    std::string name;
+    double period_sec = 0;
+    std::vector<ThermalSegment> segments;
+
+    /** Read a CSV written by bin/simulate --trace (t,temp,setpoint,pwm,pump) */
+    static bool loadTrace(const std::string & path, ThermalLog & log, std::string & err);
+    /** Read every shot of a shot archive. Each shot is a segment */
+    static bool loadArchive(const std::string & path, ThermalLog & log, std::string & err);
+
+    size_t samples() const;
+  };
+
+  /**
+   * Linear least squares from accumulated normal equations. Rows are added a block at a time as
+   * column arrays, so building X'X is a dot product per pair of columns over contiguous memory.
+   * Accumulators from different threads are combined with merge().
+   */
+  class LeastSquares{
+  public:
+    static const int MAX_PARAMS = 8;
+
+    LeastSquares(int params = 0);
+
+    /** Add n rows. cols[j][i] is regressor j of row i and y[i] its target */
+    void addRows(const double * const * cols, const double * y, size_t n);
+    void merge(const LeastSquares & o);
+
+    /**
+     * The same problem with only the regressors in use (n_use indices), for when a column turned
+     * out to be all zero in the data.
+     */
+    LeastSquares subset(const int * use, int n_use) const;
+
+    /**
+     * Solve for theta. cov gets the covariance of the estimates (params x params, row major), the
+     * residual variance times (X'X)^-1, and sse the sum of squared residuals. Returns false if
+     * there are too few rows or X'X is singular.
+     */
+    bool solve(double * theta, double * cov, double * sse) const;
+
+    int params() const{ return p_; }
+    size_t rows() const{ return n_; }
+    /** Sum of squares of regressor j over all rows */
+    double columnEnergy(int j) const{ return xtx_[j*MAX_PARAMS + j]; }
+
+  private:
+    int p_;
+    size_t n_ = 0;
+    double xtx_[MAX_PARAMS*MAX_PARAMS];
+    double xty_[MAX_PARAMS];
+    double yty_ = 0;
+  };
+
+  /**
+   * Fits two discrete models to the temperature step T[k+1] - T[k] for every dead time d up to the
+   * limit, keeping the d with the smallest residual:
+   *   First order plus dead time  a T[k] + b u[k-d] + c q[k] + e
+   *   Two node                    a1 T[k] + a2 T[k-1] + b1 u[k-d] + b2 u[k-d-1] + c1 q[k] + c2 q[k-1] + e
+   * where u is the heater fraction and q[k] = pump[k] (T[k] - inlet) the pump's cooling. The coefficients are then turned into physical
+   * parameters (BoilerModel) given the heater power, and the two node model into an element and a
+   * water lump. Some things the water temperature alone can't pin down, so they are assumed:
+   * the inlet temperature (the boiler is near the setpoint whenever the pump runs, so only the
+   * heat taken is seen) and how the heat capacity splits between the two lumps (water_share).
+   *
+   * Each log is cut into chunks and every holdout_every'th chunk is kept out of the fit and used to
+   * validate it. Confidence intervals assume independent residuals, which a logged loop does not
+   * quite give, so treat them as a lower bound on the uncertainty.
+   *
+   * Use one SystemID per thread, add() logs to it, and merge() them before fitting.
+   */
+  class SystemID{
+  public:
+    struct Options{
+      double period_sec = 0.5; /** Every log must have this sample period */
+      double max_dead_time_sec = 20;
+      double chunk_sec = 300; /** Length of the pieces logs are cut into for validation */
+      int holdout_every = 5; /** Keep every n'th chunk out of the fit. 0 to use every chunk */
+      double heater_watts = 1300;
+      double water_share = 0.8; /** Fraction of the heat capacity in the water lump (2 nodes) */
+      double inlet_temp = 20;
+      double filter_sec = 5; /** Time constant of the low pass filter run over the data first. 0 for none */
+    };
+
+    /** A physical parameter with the half width of its 95% confidence interval (NaN if unknown) */
+    struct Estimate{
+      const char * name;
+      const char * unit;
+      double value;
+      double ci95;
+    };
+
+    /** Sums over the held-out chunks, so results from several logs add up */
+    struct Validation{
+      size_t samples = 0;
+      double one_step_sse = 0; /** Predicting each sample from the measured one before */
+      double sim_sse = 0; /** Running the model from the start of each chunk on the inputs alone */
+
+      double oneStepRMSE() const;
+      double simRMSE() const;
+      void add(const Validation & o);
+    };
+
+    struct Fit{
+      int nodes = 0;
+      bool ok = false;
+      std::string err; /** Why the fit failed */
+      int delay = 0; /** Dead time in samples */
+      size_t rows = 0;
+      bool pump_fitted = false; /** The logs had pump samples */
+      double rmse = 0; /** One step residual over the training rows */
+      double theta[LeastSquares::MAX_PARAMS]; /** Discrete coefficients in the order given above */
+      std::vector<Estimate> estimates;
+      BoilerModel model;
+      Validation validation;
+    };
+
+    SystemID(const Options & opts);
+
+    /** Add a log's training rows. Returns false if its sample period does not match */
+    bool add(const ThermalLog & log);
+    void merge(const SystemID & o);
+    size_t rows() const;
+    /** Spread of the temperatures fitted to. The loss needs the boiler seen well away from one temperature */
+    double tempRange() const;
+
+    Fit fit(int nodes) const;
+    /** Score fit on the chunks of log held out of the fit */
+    Validation validate(const Fit & fit, const ThermalLog & log) const;
+
+    const Options & options() const{ return opts_; }
+
+  private:
+    Options opts_;
+    int max_delay_;
+    std::vector<LeastSquares> first_order_; /** Indexed by dead time in samples */
+    std::vector<LeastSquares> two_node_;
+    double min_temp_ = std::numeric_limits<double>::infinity();
+    double max_temp_ = -std::numeric_limits<double>::infinity();
+
+    /** Calls fn(segment, begin, end, held_out) for each chunk of log */
+    template <typename F>
+    void chunks(const ThermalLog & log, F fn) const;
+    void addRows(const std::vector<double> & temp, const std::vector<double> & heater,
+		 const std::vector<double> & pump, size_t begin, size_t end);
+    bool physical(int nodes, const double * theta, bool pump, BoilerModel & model, double * values) const;
+  };
+}
+#endif
@@ -0,0 +1,119 @@
+#ifndef TELEMETRY_SERVER
+#define TELEMETRY_SERVER
+
+#include "MachineState.hpp"
+#include "TripleBuffer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace RaspLatte{
+  /**
+   * A small HTTP/WebSocket server that lets remote clients (i.e. mobile apps) watch and adjust the
+   * machine. Everything runs on one background thread around a single epoll instance:
+   * (a) A REST API to read the state and change setpoints, gains, and the mode (see doc/telemetry_api.txt)
+   * (b) A WebSocket stream at /ws that pushes delta-encoded state frames at a fixed rate
+   *
+   * The control loop only ever writes into the TripleBuffer and reads from the CommandQueue,
+   * so serialization and network IO never cost it anything. Every client has a bounded output
+   * buffer and a client that falls behind is dropped rather than allowed to grow it.
+   *
+   * One server can front several machines (see addMachine()). Machine n is at /m/n/api/... and
+   * /m/n/ws; the plain paths are machine 0.
+   */
+  class TelemetryServer{
+  public:
+    typedef struct TelemetrySettings_{
+      const char * address; /** Address to bind. "127.0.0.1" for loopback only */
+      uint16_t port; /** Port to bind. 0 picks a free port (see port()) */
+      double frame_rate_hz; /** Rate at which state frames are pushed to WebSocket clients */
+      unsigned int max_clients; /** Connections beyond this are refused */
+      size_t client_buffer_bytes; /** Per-client output limit before the client is dropped. Also its socket send buffer */
+    } TelemetrySettings;
+
+    TelemetryServer(TripleBuffer<MachineState> * state, CommandQueue * commands, TelemetrySettings settings);
+
+    /** Serve another machine. Call before start(). Returns its index in the URL */
+    size_t addMachine(TripleBuffer<MachineState> * state, CommandQueue * commands);
+
+    /** Print a line per machine to out every period_sec, on the server thread. Call before start() */
+    void setStatusLog(FILE * out, double period_sec);
+
+    /** Start and stop the server thread */
+    void start();
+    void stop();
+
+    /** The port actually bound */
+    uint16_t port(){ return port_; }
+
+    /** Number of clients dropped for falling behind */
+    unsigned int droppedClients(){ return dropped_clients_; }
+
+    ~TelemetryServer();
+
+  private:
+    struct Client{
+      int fd;
+      bool websocket = false;
+      bool synced = false; /** Has received a keyframe */
+      bool closing = false; /** Close once the output buffer has drained */
+      bool want_write = false; /** Registered for EPOLLOUT */
+      size_t machine = 0; /** Which machine a WebSocket client is streaming */
+      std::string in;
+      std::string out;
+    };
+
+    /** One machine being served. Only touched on the server thread */
+    struct Endpoint{
+      TripleBuffer<MachineState> * state;
+      CommandQueue * commands;
+      MachineState latest;
+      bool have_state = false;
+      bool changed = false; /** latest has not been sent to WebSocket clients yet */
+      std::vector<float> last_fields; /** Field values of the last frame sent to WebSocket clients */
+    };
+
+    std::vector<Endpoint> machines_;
+    TelemetrySettings settings_;
+    FILE * log_out_ = NULL;
+    double log_period_sec_ = 0;
+    std::chrono::steady_clock::time_point last_log_;
+
+    int listen_fd_ = -1;
+    int epoll_fd_ = -1;
+    int timer_fd_ = -1;
+    int stop_fd_ = -1;
+    uint16_t port_ = 0;
+
+    std::thread thread_;
+    std::vector<Client*> clients_;
+    std::atomic<unsigned int> dropped_clients_{0};
+
+    void loop();
+    void acceptClients();
+    void broadcast();
+    void refresh(Endpoint & e);
+    void logStatus();
+
+    void handleReadable(Client * c);
+    void handleHTTP(Client * c);
+    /** Answer the first request in c->in and remove it. False if it isn't all there yet or c is closed */
+    bool handleHTTPRequest(Client * c);
+    void handleWebSocket(Client * c);
+    bool handleRequest(Client * c, Endpoint & e, const std::string & method, const std::string & path,
+		       const std::string & query);
+
+    void queue(Client * c, const std::string & data);
+    void flush(Client * c);
+    void closeClient(Client * c);
+    void closeFds();
+
+    std::string stateJSON(const Endpoint & e);
+    std::string encodeFrame(const Endpoint & e, bool keyframe);
+  };
+}
+#endif
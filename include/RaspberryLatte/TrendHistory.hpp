@@ -0,0 +1,76 @@
+#ifndef TREND_HISTORY
+#define TREND_HISTORY
+
+#include <cstdint>
+
+namespace RaspLatte{
+  /**
+   * The recent history of the boiler for a trend chart: min, max and mean of the temperature,
+   * setpoint and PWM in buckets of 1s, 10s and 1 minute. Each resolution is a ring of CAPACITY
+   * buckets, so it covers 4 minutes, 40 minutes and 4 hours. Memory is fixed whatever the uptime.
+   *
+   * add() folds a sample into the bucket now filling at each resolution: three compares and a sum
+   * per series, no allocation and no pass over older samples. A chart reads buckets, never samples.
+   * Buckets that no sample landed in (the loop stalled, or the temperature was unreadable) are kept
+   * as empty, so a ring is always evenly spaced in time.
+   *
+   * Single thread: the control loop adds and reads. A panel on another thread reads copies handed
+   * over once a second (EspressoMachine::panelTrend()).
+   */
+  class TrendHistory{
+  public:
+    static const int LEVELS = 3;
+    static const int CAPACITY = 240;
+    enum Series {TEMP, SETPOINT, PWM, SERIES};
+
+    typedef struct Aggregate_{
+      float min;
+      float max;
+      double sum;
+      uint32_t count; /** Samples in the bucket. 0 for none, when min, max and mean mean nothing */
+      double mean() const { return (count ? sum/count : 0); }
+    } Aggregate;
+
+    typedef struct Bucket_{
+      int64_t index; /** Start time of the bucket over the resolution */
+      Aggregate series[SERIES];
+    } Bucket;
+
+    /** Bucket width of a level in seconds: 1, 10, 60 */
+    static double resolution(int level);
+
+    TrendHistory(){ clear(); }
+
+    /**
+     * A sample at time_s seconds since the machine started. A temp of MAX31855_TEMP_UNAVALIBLE is
+     * left out of TEMP only. Samples earlier than the bucket now filling are counted in it.
+     */
+    void add(double time_s, double temp, double setpoint, double pwm);
+    void clear();
+
+    /** Buckets held at a level, the one now filling included. At most CAPACITY */
+    int size(int level) const { return levels_[level].count; }
+
+    /** age 0 is the bucket now filling, 1 the one before it and so on. age must be below size() */
+    const Bucket & bucket(int level, int age) const;
+
+    /**
+     * Lowest min and highest max of a series over the newest n buckets of a level. False if none of
+     * them has a sample.
+     */
+    bool range(int level, Series series, int n, double & lo, double & hi) const;
+
+  private:
+    typedef struct Level_{
+      Bucket ring[CAPACITY];
+      int head; /** Slot of the bucket now filling */
+      int count;
+    } Level;
+
+    Level levels_[LEVELS];
+
+    /** Close the bucket now filling and open the next one along */
+    static void advance(Level & level);
+  };
+}
+#endif
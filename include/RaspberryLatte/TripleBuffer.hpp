@@ -0,0 +1,45 @@
+#ifndef TRIPLE_BUFFER
+#define TRIPLE_BUFFER
+
+#include <atomic>
+
+namespace RaspLatte{
+  /**
+   * A wait-free single-writer/single-reader mailbox. The writer always owns one slot, the reader 
+   * owns another, and the third is exchanged between them with a single atomic swap. The writer 
+   * never waits on the reader so publishing from the control loop has a fixed, tiny cost, and the 
+   * reader always sees the most recent complete value (intermediate values may be skipped).
+   */
+  template <typename T>
+  class TripleBuffer{
+  public:
+    TripleBuffer(): back_(0), front_(1), middle_(2){}
+
+    /** Copy value into the back slot and publish it. Only call from the writer thread. */
+    void write(const T & value){
+      buffers_[back_] = value;
+      back_ = middle_.exchange(back_ | DIRTY, std::memory_order_acq_rel) & INDEX;
+    }
+
+    /** 
+     * If a value was published since the last call, copy it into out and return true. Otherwise
+     * out is untouched and false is returned. Only call from the reader thread.
+     */
+    bool read(T & out){
+      if (!(middle_.load(std::memory_order_acquire) & DIRTY)) return false;
+      front_ = middle_.exchange(front_, std::memory_order_acq_rel) & INDEX;
+      out = buffers_[front_];
+      return true;
+    }
+
+  private:
+    static const unsigned int INDEX = 0x3;
+    static const unsigned int DIRTY = 0x4;
+
+    T buffers_[3];
+    unsigned int back_;
+    unsigned int front_;
+    std::atomic<unsigned int> middle_;
+  };
+}
+#endif
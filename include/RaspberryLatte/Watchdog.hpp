@@ -0,0 +1,62 @@
+#ifndef WATCHDOG
+#define WATCHDOG
+
+#include "Clock.hpp"
+
+#include <string>
+
+namespace RaspLatte{
+  /**
+   * A hardware watchdog that resets the system unless it is kicked regularly.
+   */
+  class WatchdogDevice{
+  public:
+    /** Arm the watchdog with a timeout in seconds. Returns false on failure */
+    virtual bool open(unsigned int timeout_sec) = 0;
+    virtual void kick() = 0;
+    /** Disarm the watchdog (if the driver allows it) and release it */
+    virtual void close() = 0;
+    virtual ~WatchdogDevice(){};
+  };
+
+  /**
+   * The Linux watchdog driver (i.e. /dev/watchdog, bcm2835_wdt on the Pi)
+   */
+  class LinuxWatchdog : public WatchdogDevice{
+  public:
+    LinuxWatchdog(const std::string & path = "/dev/watchdog"): path_(path){}
+    bool open(unsigned int timeout_sec);
+    void kick();
+    void close();
+    ~LinuxWatchdog(){ close(); }
+    
+  private:
+    std::string path_;
+    int fd_ = -1;
+  };
+
+  /**
+   * Stand-in for the hardware watchdog. Tracks kicks against a Clock and reports if it would
+   * have fired.
+   */
+  class SimulatedWatchdog : public WatchdogDevice{
+  public:
+    SimulatedWatchdog(Clock * clock): clock_(clock){}
+    bool open(unsigned int timeout_sec);
+    void kick();
+    void close(){ armed_ = false; }
+
+    /** True if the watchdog has gone longer than its timeout without a kick */
+    bool expired();
+    unsigned long kicks(){ return kicks_; }
+
+  private:
+    Clock * clock_;
+    bool armed_ = false;
+    bool fired_ = false;
+    Duration timeout_;
+    TimePoint last_kick_;
+    unsigned long kicks_ = 0;
+  };
+}
+#endif
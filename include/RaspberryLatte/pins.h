@@ -10,6 +10,7 @@
 #define LIGHT_PIN_STM 22 // GPIO 22
 
 #define CS_THERMO 0      // GPIO 24
+#define CS_GROUP 1       // Group head thermocouple, if fitted (see cascade.enabled)
 
 #define PWM_BOILER 26     // GPIO 14
 #endif
@@ -1,25 +1,23 @@
 #include "../../include/RaspberryLatte/Boiler.hpp"
 
+#include <cmath>
 #include <iostream>
-#include <pigpio.h>
 
 namespace RaspLatte{  
-  Boiler::Boiler(Sensor<double> * temp_sensor, double setpoint, const PID::PIDGains * pid_gains, PinIndex heater_pin_idx,
-		 double min_setpoint, double max_setpoint):
-    temp_sensor_(temp_sensor), setpoint_(setpoint), ctrl_(*pid_gains, &setpoint_, temp_sensor_), heater_pin_(heater_pin_idx),
-    active_(false), setpoint_clamp_(min_setpoint, max_setpoint){
-    if (gpioInitialise() < 0) throw "Could not start GPIO!";
-
+  Boiler::Boiler(GPIOBackend * gpio, Sensor<double> * temp_sensor, double setpoint, const PID::PIDGains * pid_gains,
+		 PinIndex heater_pin_idx, double min_setpoint, double max_setpoint, Clock * clock):
+    gpio_(gpio), temp_sensor_(temp_sensor), setpoint_(setpoint), ctrl_(*pid_gains, &setpoint_, temp_sensor_, clock),
+    heater_pin_(heater_pin_idx), active_(false), setpoint_clamp_(min_setpoint, max_setpoint){
     // Set defaults
     ctrl_.setMinUpdateTimeSec(0.20); //Don't update the PID faster than 5Hz
     ctrl_.setIntegralSumLimits(0, 100);
     ctrl_.setInputLimits(0, 255);
-    ctrl_.setSlopePeriodSec(1.1);
+    ctrl_.setSlopePeriodSec(4.75); // The last ten updates at the usual 0.5s loop
 
-    gpioSetPWMfrequency(heater_pin_, 20); //Set the Pwm to operate at 20Hz
+    gpio_->setPWMFrequency(heater_pin_, 20); //Set the Pwm to operate at 20Hz
     
     //Assume not active until first update called
-    gpioPWM(heater_pin_, 0);
+    gpio_->pwm(heater_pin_, 0);
     current_pwm_setting_ = 0;
   }
 
@@ -31,23 +29,49 @@ namespace RaspLatte{
 
   void Boiler::turnOff(){
     active_ = false;
-    gpioPWM(heater_pin_, 0);
+    writeHeater(0);
     current_pwm_setting_ = 0;
   }
+
+  void Boiler::writeHeater(unsigned int duty){
+    if (gate_ != NULL) gate_->set(duty);
+    else gpio_->pwm(heater_pin_, duty);
+  }
   
-  double Boiler::updateSetpoint(double setpoint, const PID::PIDGains * gains){
-    if (gains != NULL) ctrl_.setGains(*gains);
+  double Boiler::updateSetpoint(double setpoint, const PID::PIDGains * gains, bool bumpless){
+    if (gains != NULL) ctrl_.setGains(*gains, bumpless);
     setpoint_clamp_.clamp(setpoint);
     setpoint_ = setpoint;
     return setpoint;
   }
   
-  void Boiler::update(int feed_forward){
+  void Boiler::update(int feed_forward, bool pump_on){
     //If machine is on, get input and apply to heater
     if(active_){
-      unsigned int pwm_output = ctrl_.update(feed_forward);
-      if(pwm_output != current_pwm_setting_){ // Only update PWM setting if value changed.
-	gpioPWM(heater_pin_, pwm_output);
+      if (gate_ != NULL && gate_->tripped()){
+	// Heater is cut. Don't let the controller wind up on readings it can't act on
+	held_ = true;
+	current_pwm_setting_ = 0;
+	return;
+      }
+      if (held_){
+	held_ = false;
+	ctrl_.reset();
+      }
+      if (schedule_ != NULL){
+	// Schedule on the last reading so this costs no extra sensor read. Bumpless so the output
+	// only moves because the error did.
+	PID::PIDGains k = schedule_->lookup(ctrl_.lastMeasurement(), std::fabs(ctrl_.lastError()), pump_on);
+	PID::PIDGains current = ctrl_.gains();
+	if (k.p != current.p || k.i != current.i || k.d != current.d) ctrl_.setGains(k, true);
+      }
+      double output = ctrl_.update(feed_forward);
+      unsigned int pwm_output = output;
+      if (gate_ != NULL){
+	gate_->set(output); // The gate skips unchanged values itself, and a waveform uses the fraction
+	current_pwm_setting_ = pwm_output;
+      } else if(pwm_output != current_pwm_setting_){ // Only update PWM setting if value changed.
+	gpio_->pwm(heater_pin_, pwm_output);
 	current_pwm_setting_ = pwm_output;
       }
     }
@@ -56,6 +80,6 @@ namespace RaspLatte{
   double Boiler::currentTemp(){ return temp_sensor_->read(); }
   
   Boiler::~Boiler(){
-    gpioPWM(heater_pin_, 0);
+    gpio_->pwm(heater_pin_, 0);
   }
 }
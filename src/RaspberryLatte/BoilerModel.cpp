@@ -0,0 +1,134 @@
+#include "../../include/RaspberryLatte/BoilerModel.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace RaspLatte{
+  namespace {
+    std::string trim(const std::string & s){
+      size_t start = s.find_first_not_of(" \t\r");
+      if (start == std::string::npos) return "";
+      size_t end = s.find_last_not_of(" \t\r");
+      return s.substr(start, end - start + 1);
+    }
+  }
+
+  bool BoilerModel::parse(const std::string & text, BoilerModel & model, std::string & err){
+    std::istringstream lines(text);
+    std::string line;
+    int line_num = 0;
+    int nodes = model.nodes();
+    while (std::getline(lines, line)){
+      line_num++;
+      line = trim(line.substr(0, line.find('#')));
+      if (line.empty()) continue;
+
+      size_t eq = line.find('=');
+      if (eq == std::string::npos){
+	err = "line " + std::to_string(line_num) + ": expected key = value";
+	return false;
+      }
+      std::string key = trim(line.substr(0, eq));
+      std::string value = trim(line.substr(eq + 1));
+      char * end;
+      double v = strtod(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || !std::isfinite(v)){
+	err = "line " + std::to_string(line_num) + ": '" + value + "' is not a number";
+	return false;
+      }
+
+      BoilerPlant::PlantParams & p = model.plant;
+      if (key == "model.nodes"){
+	if (v != 1 && v != 2){
+	  err = "line " + std::to_string(line_num) + ": model.nodes must be 1 or 2";
+	  return false;
+	}
+	nodes = (int)v;
+      }
+      else if (key == "model.heater_watts") p.heater_watts = v;
+      else if (key == "model.heat_capacity") p.heat_capacity = v;
+      else if (key == "model.loss") p.loss_w_per_c = v;
+      else if (key == "model.ambient") p.ambient = v;
+      else if (key == "model.pump") p.pump_w_per_c = v;
+      else if (key == "model.inlet") p.inlet_temp = v;
+      else if (key == "model.element_capacity") p.element_capacity = v;
+      else if (key == "model.element_coupling") p.element_coupling = v;
+      else if (key == "model.dead_time") model.dead_time_sec = v;
+      else {
+	err = "line " + std::to_string(line_num) + ": unknown key " + key;
+	return false;
+      }
+    }
+    if (nodes == 1) model.plant.element_capacity = 0;
+    else if (model.plant.element_capacity <= 0){
+      err = "a 2 node model needs model.element_capacity";
+      return false;
+    }
+    return model.validate(err);
+  }
+
+  bool BoilerModel::load(const std::string & path, BoilerModel & model, std::string & err){
+    std::ifstream file(path);
+    if (!file){
+      err = "could not open " + path;
+      return false;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return parse(text.str(), model, err);
+  }
+
+  bool BoilerModel::save(const std::string & path, const std::string & comment, std::string & err) const{
+    FILE * f = fopen(path.c_str(), "w");
+    if (f == NULL){
+      err = "could not open " + path + " for writing";
+      return false;
+    }
+    std::istringstream lines(comment);
+    std::string line;
+    while (std::getline(lines, line)) fprintf(f, "# %s\n", line.c_str());
+    const BoilerPlant::PlantParams & p = plant;
+    fprintf(f, "model.nodes = %d\n", nodes());
+    fprintf(f, "model.heater_watts = %.6g\n", p.heater_watts);
+    fprintf(f, "model.heat_capacity = %.6g\n", p.heat_capacity);
+    fprintf(f, "model.loss = %.6g\n", p.loss_w_per_c);
+    fprintf(f, "model.ambient = %.6g\n", p.ambient);
+    fprintf(f, "model.pump = %.6g\n", p.pump_w_per_c);
+    fprintf(f, "model.inlet = %.6g\n", p.inlet_temp);
+    if (nodes() == 2){
+      fprintf(f, "model.element_capacity = %.6g\n", p.element_capacity);
+      fprintf(f, "model.element_coupling = %.6g\n", p.element_coupling);
+    }
+    fprintf(f, "model.dead_time = %.6g\n", dead_time_sec);
+    if (fclose(f) != 0){
+      err = "could not write " + path;
+      return false;
+    }
+    return true;
+  }
+
+  bool BoilerModel::validate(std::string & err) const{
+    const BoilerPlant::PlantParams & p = plant;
+    if (!(p.heater_watts > 0 && p.heat_capacity > 0 && p.loss_w_per_c > 0)){
+      err = "heater_watts, heat_capacity and loss must be positive";
+      return false;
+    }
+    if (!(p.pump_w_per_c >= 0 && dead_time_sec >= 0)){
+      err = "pump and dead_time must not be negative";
+      return false;
+    }
+    if (p.element_capacity > 0 && !(p.element_coupling > 0)){
+      err = "element_coupling must be positive";
+      return false;
+    }
+    return true;
+  }
+
+  double BoilerModel::pumpFeedForward(double temp) const{
+    double watts = plant.pump_w_per_c*(temp - plant.inlet_temp);
+    return std::fmin(std::fmax(255*watts/plant.heater_watts, 0), 255);
+  }
+}
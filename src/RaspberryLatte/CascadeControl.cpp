@@ -0,0 +1,77 @@
+#include "../../include/RaspberryLatte/CascadeControl.hpp"
+
+#include "../../include/RaspberryLatte/MAX31855Frame.hpp"
+
+namespace RaspLatte{
+  CascadeControl::CascadeSettings CascadeControl::defaultSettings(){
+    return {.enabled = false, .gains = {.p = 2, .i = 0.005, .d = 0}, .period_sec = 2, .offset = 10,
+	    .min_offset = 0, .max_offset = 20};
+  }
+
+  CascadeControl::CascadeControl(CascadeSettings settings, Sensor<double> * group_sensor, Clock * clock):
+    settings_(settings), group_sensor_(group_sensor), clock_(clock),
+    outer_(settings.gains, &group_setpoint_, &sample_, clock){
+    // The outer loop keeps its own time, so the PID updates whenever asked
+    outer_.setMinUpdateTimeSec(0);
+    outer_.setSlopePeriodSec(10*settings_.period_sec);
+    outer_.setInputLimits(settings_.min_offset, settings_.max_offset);
+  }
+
+  void CascadeControl::setSettings(CascadeSettings settings){
+    settings_ = settings;
+    outer_.setGains(settings_.gains, true);
+    outer_.setSlopePeriodSec(10*settings_.period_sec);
+    outer_.setInputLimits(settings_.min_offset, settings_.max_offset);
+  }
+
+  void CascadeControl::reset(){
+    started_ = false;
+    due_ = true;
+  }
+
+  double CascadeControl::update(double group_setpoint, double inner_pwm, double inner_error, bool inner_held){
+    TimePoint now = clock_->now();
+    if (!due_ && Duration(now - last_update_).count() < settings_.period_sec){
+      // The group setpoint can change between updates. Keep the offset.
+      boiler_setpoint_ += group_setpoint - group_setpoint_;
+      group_setpoint_ = group_setpoint;
+      return boiler_setpoint_;
+    }
+    last_update_ = now;
+    bool restarted = due_;
+    due_ = false;
+
+    double temp = group_sensor_->read();
+    group_setpoint_ = group_setpoint;
+    if (temp == MAX31855_TEMP_UNAVALIBLE){
+      // Hold the boiler where it is, or start from offset after a reset. The sensor is still only
+      // tried every period.
+      if (restarted) boiler_setpoint_ = group_setpoint + settings_.offset;
+      faulted_ = true;
+      return boiler_setpoint_;
+    }
+    bool recovered = faulted_;
+    faulted_ = false;
+    group_temp_ = temp;
+    sample_.value = temp;
+    bool fresh = !started_;
+    if (fresh){
+      outer_.reset();
+      started_ = true;
+    }
+
+    // Hold the integral where the inner loop can't do what the outer one is asking for, and over a
+    // fault so the time without readings isn't integrated
+    double err = group_setpoint - temp;
+    double last = outer_.u();
+    bool up = (err > 0);
+    bool inner_stuck = (up ? inner_pwm >= 255 || inner_error > TRACK_BAND_C || inner_held
+			: inner_pwm <= 0 || inner_error < -TRACK_BAND_C);
+    bool at_limit = !fresh && (up ? last >= settings_.max_offset : last <= settings_.min_offset);
+    holding_ = inner_stuck || at_limit || recovered;
+    outer_.setIntegralHold(holding_);
+
+    boiler_setpoint_ = group_setpoint + outer_.update(settings_.offset);
+    return boiler_setpoint_;
+  }
+}
@@ -0,0 +1,244 @@
+#include "../../include/RaspberryLatte/Config.hpp"
+
+#include <arpa/inet.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace RaspLatte{
+  namespace {
+    const PinIndex MAX_GPIO = 53;
+
+    std::string trim(const std::string & s){
+      size_t start = s.find_first_not_of(" \t\r");
+      if (start == std::string::npos) return "";
+      size_t end = s.find_last_not_of(" \t\r");
+      return s.substr(start, end - start + 1);
+    }
+
+    bool validGains(const PID::PIDGains & k){
+      return std::isfinite(k.p) && std::isfinite(k.i) && std::isfinite(k.d) && k.p >= 0 && k.i >= 0 && k.d >= 0;
+    }
+  }
+
+  bool PinConfig::operator==(const PinConfig & o) const{
+    return pwr_switch == o.pwr_switch && pump_switch == o.pump_switch && steam_switch == o.steam_switch
+      && pwr_light == o.pwr_light && pump_light == o.pump_light && steam_light == o.steam_light
+      && thermo_cs == o.thermo_cs && group_cs == o.group_cs && boiler_pwm == o.boiler_pwm;
+  }
+  
+  bool MachineConfig::parse(const std::string & text, MachineConfig & config, std::string & err){
+    std::istringstream lines(text);
+    std::string line;
+    int line_num = 0;
+    while (std::getline(lines, line)){
+      line_num++;
+      line = trim(line.substr(0, line.find('#')));
+      if (line.empty()) continue;
+
+      size_t eq = line.find('=');
+      if (eq == std::string::npos){
+	err = "line " + std::to_string(line_num) + ": expected key = value";
+	return false;
+      }
+      std::string key = trim(line.substr(0, eq));
+      std::string value = trim(line.substr(eq + 1));
+      // The only text values
+      if (key == "archive.path"){
+	config.archive_path = value;
+	continue;
+      }
+      if (key == "model.path"){
+	config.model_path = value;
+	continue;
+      }
+      if (key == "capture.path"){
+	config.capture_path = value;
+	continue;
+      }
+      if (key == "health.sys_root"){
+	config.health.sys_root = value;
+	continue;
+      }
+      if (key == "health.proc_root"){
+	config.health.proc_root = value;
+	continue;
+      }
+      if (key == "telemetry.address"){
+	config.telemetry_address = value;
+	continue;
+      }
+      char * end;
+      double v = strtod(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || !std::isfinite(v)){
+	err = "line " + std::to_string(line_num) + ": '" + value + "' is not a number";
+	return false;
+      }
+
+      if (key == "brew.setpoint") config.temps.brew = v;
+      else if (key == "steam.setpoint") config.temps.steam = v;
+      else if (key == "brew.p") config.gains.brew.p = v;
+      else if (key == "brew.i") config.gains.brew.i = v;
+      else if (key == "brew.d") config.gains.brew.d = v;
+      else if (key == "steam.p") config.gains.steam.p = v;
+      else if (key == "steam.i") config.gains.steam.i = v;
+      else if (key == "steam.d") config.gains.steam.d = v;
+      else if (key == "schedule.enabled") config.schedule_enabled = (v != 0);
+      else if (key == "schedule.integral_band") config.integral_band = v;
+      else if (key == "schedule.pump_kp_scale") config.pump_kp_scale = v;
+      else if (key == "safety.period") config.safety.period_sec = v;
+      else if (key == "safety.max_temp") config.safety.max_temp = v;
+      else if (key == "safety.max_rate") config.safety.max_rate = v;
+      else if (key == "safety.stale_sec") config.safety.stale_sec = v;
+      else if (key == "safety.cpu_max") config.safety.cpu_max = v;
+      else if (key == "safety.control_timeout") config.safety.control_timeout_sec = v;
+      else if (key == "safety.recovery_sec") config.safety.recovery_sec = v;
+      else if (key == "safety.idle_period") config.safety.idle_period_sec = v;
+      else if (key == "cascade.enabled") config.cascade.enabled = (v != 0);
+      else if (key == "cascade.p") config.cascade.gains.p = v;
+      else if (key == "cascade.i") config.cascade.gains.i = v;
+      else if (key == "cascade.d") config.cascade.gains.d = v;
+      else if (key == "cascade.period") config.cascade.period_sec = v;
+      else if (key == "cascade.offset") config.cascade.offset = v;
+      else if (key == "cascade.min_offset") config.cascade.min_offset = v;
+      else if (key == "cascade.max_offset") config.cascade.max_offset = v;
+      else if (key == "loop.adaptive") config.loop.adaptive = (v != 0);
+      else if (key == "loop.fast_period") config.loop.fast_period_sec = v;
+      else if (key == "loop.slow_period") config.loop.slow_period_sec = v;
+      else if (key == "loop.band") config.loop.band = v;
+      else if (key == "loop.slope_band") config.loop.slope_band = v;
+      else if (key == "safety.watchdog") config.watchdog_enabled = (v != 0);
+      else if (key == "power.heater_watts") config.heater_watts = v;
+      else if (key == "heater.waveform") config.heater_wave.enabled = (v != 0);
+      else if (key == "heater.mains_hz") config.heater_wave.mains_hz = v;
+      else if (key == "heater.slot") config.heater_wave.slot_sec = v;
+      else if (key == "heater.pattern") config.heater_wave.pattern_sec = v;
+      else if (key == "health.period") config.health.period_sec = v;
+      else if (key == "health.throttle_temp") config.health.throttle_temp = v;
+      else if (key == "archive.machine_id"){
+	if (v < 0 || v > 65535 || v != std::floor(v)){
+	  err = "line " + std::to_string(line_num) + ": archive.machine_id must be an integer in [0, 65535]";
+	  return false;
+	}
+	config.machine_id = (uint16_t)v;
+      }
+      else if (key == "telemetry.port"){
+	if (v < 1 || v > 65535 || v != std::floor(v)){
+	  err = "line " + std::to_string(line_num) + ": telemetry.port must be an integer in [1, 65535]";
+	  return false;
+	}
+	config.telemetry_port = (uint16_t)v;
+      }
+      else if (key.compare(0, 5, "pins.") == 0){
+	if (v < 0 || v > MAX_GPIO || v != std::floor(v)){
+	  err = "line " + std::to_string(line_num) + ": bad GPIO index for " + key;
+	  return false;
+	}
+	PinIndex p = (PinIndex)v;
+	if (key == "pins.pwr_switch") config.pins.pwr_switch = p;
+	else if (key == "pins.pump_switch") config.pins.pump_switch = p;
+	else if (key == "pins.steam_switch") config.pins.steam_switch = p;
+	else if (key == "pins.pwr_light") config.pins.pwr_light = p;
+	else if (key == "pins.pump_light") config.pins.pump_light = p;
+	else if (key == "pins.steam_light") config.pins.steam_light = p;
+	else if (key == "pins.thermo_cs") config.pins.thermo_cs = p;
+	else if (key == "pins.group_cs") config.pins.group_cs = p;
+	else if (key == "pins.boiler_pwm") config.pins.boiler_pwm = p;
+	else {
+	  err = "line " + std::to_string(line_num) + ": unknown key " + key;
+	  return false;
+	}
+      }
+      else {
+	err = "line " + std::to_string(line_num) + ": unknown key " + key;
+	return false;
+      }
+    }
+    return config.validate(err);
+  }
+
+  bool MachineConfig::load(const std::string & path, MachineConfig & config, std::string & err){
+    std::ifstream file(path);
+    if (!file){
+      err = "could not open " + path;
+      return false;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return parse(text.str(), config, err);
+  }
+
+  bool MachineConfig::validate(std::string & err) const{
+    if (!(temps.brew > 0 && temps.brew <= MAX_SETPOINT && temps.steam > 0 && temps.steam <= MAX_SETPOINT)){
+      err = "setpoints must be in (0, " + std::to_string((int)MAX_SETPOINT) + "]";
+      return false;
+    }
+    if (!validGains(gains.brew) || !validGains(gains.steam)){
+      err = "gains must be finite and non-negative";
+      return false;
+    }
+    if (!(integral_band > 0 && pump_kp_scale > 0)){
+      err = "schedule.integral_band and schedule.pump_kp_scale must be positive";
+      return false;
+    }
+    const SafetySupervisor::SafetyLimits & s = safety;
+    if (!(s.period_sec > 0 && s.max_temp > 0 && s.max_rate > 0 && s.stale_sec >= s.period_sec && s.cpu_max > 0
+	  && s.control_timeout_sec > 0 && s.recovery_sec >= 0)){
+      err = "safety limits must be positive and safety.stale_sec at least safety.period";
+      return false;
+    }
+    // One missed sample while idle must not look stale
+    if (!(s.idle_period_sec >= s.period_sec && 2*s.idle_period_sec <= s.stale_sec)){
+      err = "safety.idle_period must be at least safety.period and at most half safety.stale_sec";
+      return false;
+    }
+    if (!(loop.fast_period_sec > 0 && loop.slow_period_sec >= loop.fast_period_sec
+	  && loop.slow_period_sec < s.control_timeout_sec && loop.band > 0 && loop.slope_band > 0)){
+      err = "loop periods and bands must be positive, and loop.slow_period between loop.fast_period and safety.control_timeout";
+      return false;
+    }
+    const CascadeControl::CascadeSettings & c = cascade;
+    if (!(validGains(c.gains) && c.period_sec > 0 && c.min_offset <= c.offset && c.offset <= c.max_offset)){
+      err = "cascade gains must be finite and non-negative, cascade.period positive and cascade.offset within its limits";
+      return false;
+    }
+    if (c.enabled && pins.group_cs == pins.thermo_cs){
+      err = "cascade control needs the group thermocouple on its own chip select (pins.group_cs)";
+      return false;
+    }
+    if (!(heater_watts > 0)){
+      err = "power.heater_watts must be positive";
+      return false;
+    }
+    // The slot must be at least a microsecond and a pattern at least one slot and at most MAX_SLOTS
+    double slot = HeaterWaveform::slotSec(heater_wave);
+    if (!(heater_wave.mains_hz >= 0 && slot >= 1e-6 && heater_wave.pattern_sec >= slot
+	  && heater_wave.pattern_sec <= slot*HeaterWaveform::MAX_SLOTS)){
+      err = "heater.mains_hz must be non-negative, the slot positive and heater.pattern from one to "
+	+ std::to_string(HeaterWaveform::MAX_SLOTS) + " slots";
+      return false;
+    }
+    if (!(health.period_sec > 0 && health.throttle_temp > 0)){
+      err = "health.period and health.throttle_temp must be positive";
+      return false;
+    }
+    in_addr addr;
+    if (inet_pton(AF_INET, telemetry_address.c_str(), &addr) != 1){
+      err = "telemetry.address must be an IPv4 address, e.g. 127.0.0.1";
+      return false;
+    }
+    PinIndex outputs[] = {pins.pwr_light, pins.pump_light, pins.steam_light, pins.boiler_pwm};
+    PinIndex inputs[] = {pins.pwr_switch, pins.pump_switch, pins.steam_switch};
+    for (PinIndex out : outputs){
+      for (PinIndex in : inputs){
+	if (out == in){
+	  err = "GPIO " + std::to_string(out) + " is used as both an input and an output";
+	  return false;
+	}
+      }
+    }
+    return true;
+  }
+}
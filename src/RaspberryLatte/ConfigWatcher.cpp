@@ -0,0 +1,108 @@
+#include "../../include/RaspberryLatte/ConfigWatcher.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace RaspLatte{
+  ConfigWatcher::ConfigWatcher(const std::string & path, RCUPointer<MachineConfig> * target): path_(path), target_(target){
+    size_t slash = path_.find_last_of('/');
+    dir_ = (slash == std::string::npos ? "." : path_.substr(0, slash));
+    name_ = (slash == std::string::npos ? path_ : path_.substr(slash + 1));
+
+    // Watch the directory rather than the file so editors that save by renaming are caught too.
+    // The destructor doesn't run for a constructor that throws, so close what is open first.
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotify_fd_ < 0 || stop_fd_ < 0){
+      closeFds();
+      throw "Error: Could not set up config watcher.";
+    }
+    if (inotify_add_watch(inotify_fd_, dir_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+      closeFds();
+      throw "Error: Could not watch config directory.";
+    }
+  }
+
+  void ConfigWatcher::start(){
+    if (!thread_.joinable()) thread_ = std::thread(&ConfigWatcher::loop, this);
+  }
+
+  void ConfigWatcher::stop(){
+    if (!thread_.joinable()) return;
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) < 0) return;
+    thread_.join();
+  }
+
+  bool ConfigWatcher::reload(){
+    const MachineConfig * current = target_->read();
+    MachineConfig * next = new MachineConfig(); // Start from defaults. The file is the full description
+    std::string err;
+    if (!MachineConfig::load(path_, *next, err)){
+      delete next;
+      rejected_++;
+      std::lock_guard<std::mutex> lock(err_mutex_);
+      last_error_ = err;
+      return false;
+    }
+
+    std::string warning;
+    if (!(next->pins == current->pins)){
+      next->pins = current->pins;
+      warning = "pin changes take effect after a restart";
+    }
+    next->version = current->version + 1;
+    target_->publish(next);
+    reloads_++;
+
+    std::lock_guard<std::mutex> lock(err_mutex_);
+    last_error_ = warning;
+    return true;
+  }
+
+  std::string ConfigWatcher::lastError(){
+    std::lock_guard<std::mutex> lock(err_mutex_);
+    return last_error_;
+  }
+
+  void ConfigWatcher::loop(){
+    alignas(inotify_event) char buf[4096];
+    pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+    while (true){
+      // Wake at least once a second so retired configs get freed even if nothing changes
+      int n = poll(fds, 2, 1000);
+      if (n < 0) continue;
+      if (fds[1].revents & POLLIN) return;
+      target_->reclaim();
+      if (!(fds[0].revents & POLLIN)) continue;
+
+      bool changed = false;
+      ssize_t len;
+      while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0){
+	for (char * p = buf; p < buf + len; ){
+	  inotify_event * ev = (inotify_event*)p;
+	  if (ev->len > 0 && name_ == ev->name) changed = true;
+	  p += sizeof(inotify_event) + ev->len;
+	}
+      }
+      if (changed) reload();
+    }
+  }
+
+  void ConfigWatcher::closeFds(){
+    int * fds[] = {&inotify_fd_, &stop_fd_};
+    for (int * fd : fds){
+      if (*fd >= 0) close(*fd);
+      *fd = -1;
+    }
+  }
+
+  ConfigWatcher::~ConfigWatcher(){
+    stop();
+    closeFds();
+  }
+}
@@ -1,32 +1,31 @@
 #include "../../include/RaspberryLatte/EspressoMachine.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
 namespace RaspLatte{
   
   bool EspressoMachine::atSetpoint(){
-    return ((boiler_temp_sensor_.read() < 1.05*setpoint()) & (boiler_temp_sensor_.read() > .95*setpoint()));
-  }
-
-  void EspressoMachine::updateSetpoint(double increment){
-    if (current_mode_==BREW) {
-      temps_.brew += increment;
-      boiler_.updateSetpoint(temps_.brew);
-    }
-    else if (current_mode_==STEAM) {
-      temps_.steam += increment;
-      boiler_.updateSetpoint(temps_.steam);
-    }
+    double temp = (cascaded_ && current_mode_ == BREW ? cascade_.groupTemp() : supervisor_.temp());
+    return ((temp < 1.05*setpoint()) & (temp > .95*setpoint()));
   }
 
   void EspressoMachine::updateMode(){
+    // Only restart the controller coming from off. Between brew and steam the integral is kept
+    // and the gain change is bumpless so the heater output does not jump.
+    bool was_on = (current_mode_ != OFF);
     current_mode_ = currentMode();
+    hw_->heaterGate()->setMode(current_mode_);
     switch(current_mode_){
     case STEAM:
-      boiler_.updateSetpoint(temps_.steam, &K_.steam);
-      boiler_.turnOn();
+      boiler_.updateSetpoint(temps_.steam, &K_.steam, was_on);
+      if (!was_on) boiler_.turnOn();
       break;
     case BREW:
-      boiler_.updateSetpoint(temps_.brew, &K_.brew);
-      boiler_.turnOn();
+      cascade_.reset();
+      boiler_.updateSetpoint(boilerSetpoint(), &K_.brew, was_on);
+      if (!was_on) boiler_.turnOn();
       break;
     case OFF:
       boiler_.turnOff();
@@ -34,61 +33,242 @@ namespace RaspLatte{
   }
     
   void EspressoMachine::updateLights(){
-    gpioWrite(LIGHT_PIN_PWR, current_mode_ != OFF);
-    gpioWrite(LIGHT_PIN_PMP, ((current_mode_ == BREW) & atSetpoint()));
-    gpioWrite(LIGHT_PIN_STM, ((current_mode_ == STEAM) & atSetpoint()));
+    gpio_->write(pins_.pwr_light, current_mode_ != OFF);
+    gpio_->write(pins_.pump_light, ((current_mode_ == BREW) & atSetpoint()));
+    gpio_->write(pins_.steam_light, ((current_mode_ == STEAM) & atSetpoint()));
     return;
   }
     
-  void EspressoMachine::handleKeyPress(int key){
-    switch(key){
-    case KEY_UP:
-      updateSetpoint(1);
-      break;
-    case KEY_DOWN:
-      updateSetpoint(-1);
-      break;
-    case KEY_LEFT:
-      updateSetpoint(-0.25);
-      break;
-    case KEY_RIGHT:
-      updateSetpoint(0.25);
-      break;
-    default:
-      break;
+  void EspressoMachine::applyConfig(){
+    const MachineConfig * config = config_.read();
+    if (config->version != config_version_){
+      config_version_ = config->version;
+      temps_ = config->temps;
+      K_ = config->gains;
+      updateGainSchedule(*config);
+      setLoopRate(*config);
+      cascade_.setSettings(config->cascade);
+      if (current_mode_ != OFF){
+	boiler_.updateSetpoint(boilerSetpoint(), (current_mode_ == BREW ? &K_.brew : &K_.steam), true);
+      }
+    }
+    config_.quiescent(); // Done with config. The watcher may free older versions now
+  }
+
+  void EspressoMachine::updateGainSchedule(const MachineConfig & config){
+    scheduled_ = config.schedule_enabled;
+    if (config.schedule_enabled){
+      schedule_ = GainSchedule::fromModeGains(K_, temps_, config.integral_band, config.pump_kp_scale);
+      boiler_.setGainSchedule(&schedule_);
+    } else {
+      boiler_.setGainSchedule(NULL);
+    }
+  }
+
+  void EspressoMachine::setLoopRate(const MachineConfig & config){
+    rate_.setSettings(config.loop);
+    // The PID reuses its output for updates closer together than this, which would waste the fast rate
+    boiler_.setMinUpdateTimeSec(config.loop.adaptive ? config.loop.fast_period_sec/2 : 0.2);
+  }
+
+  void EspressoMachine::handleCommands(){
+    bool retuned = false;
+    Command req;
+    for (size_t n = 0; n < MAX_COMMANDS_PER_TICK && commands_.pop(req); n++){
+      switch(req.type){
+      case Command::ADJUST_SETPOINT:
+      case Command::SET_SETPOINT: {
+	double * temp = (req.mode == BREW ? &temps_.brew : (req.mode == STEAM ? &temps_.steam : NULL));
+	if (temp == NULL) break;
+	// Any thread can queue a command, so hold the range a config may set. Nothing at or below 0.
+	double v = (req.type == Command::ADJUST_SETPOINT ? *temp + req.setpoint : req.setpoint);
+	if (!(v > 0)) break;
+	*temp = std::min(v, MachineConfig::MAX_SETPOINT);
+	if (req.mode == current_mode_) boiler_.updateSetpoint(boilerSetpoint());
+	break;
+      }
+      case Command::SET_GAINS:
+	if (req.mode == BREW) K_.brew = req.gains;
+	else if (req.mode == STEAM) K_.steam = req.gains;
+	if (req.mode == current_mode_){
+	  boiler_.updateSetpoint(boilerSetpoint(), (current_mode_ == BREW ? &K_.brew : &K_.steam), true);
+	}
+	break;
+      case Command::SET_MODE:
+	mode_overridden_ = true;
+	mode_override_ = req.mode;
+	break;
+      case Command::CLEAR_MODE:
+	mode_overridden_ = false;
+	break;
+      }
+      retuned |= (req.type != Command::SET_MODE && req.type != Command::CLEAR_MODE);
+    }
+    if (retuned) updateGainSchedule(*config_.read());
+  }
+
+  void EspressoMachine::publishState(){
+    state_.seq++;
+    state_.time_s = Duration(clock_->now() - start_time_).count();
+    state_.mode = current_mode_;
+    state_.mode_overridden = mode_overridden_;
+    state_.pump_on = pump_switch_->read();
+    state_.temp = boiler_.currentTemp();
+    state_.setpoint = setpoint();
+    state_.boiler_setpoint = boiler_.setpoint();
+    state_.pwm = boiler_.currentPWM();
+    state_.error_sum = boiler_.errorSum();
+    state_.slope = boiler_.errorSlope();
+    state_.setpoints = temps_;
+    state_.gains = K_;
+    state_buffer_.write(state_);
+    // What the water is actually chasing, which under cascade control isn't the brew setpoint
+    trend_.add(state_.time_s, state_.temp, boiler_.setpoint(), state_.pwm);
+    if (panel_trend_){
+      panel_state_.write(state_);
+      // The chart's finest column is a second, so that's as often as the whole trend is copied
+      int64_t second = trend_.bucket(0, 0).index;
+      if (second != panel_second_){
+	panel_second_ = second;
+	panel_trend_->write(trend_);
+      }
     }
   }
+
+  int EspressoMachine::pumpFeedForward(){
+    if (!has_model_) return DEFAULT_PUMP_FEED_FORWARD;
+    // The water is held at the setpoint, so that is what the inlet water has to be heated to
+    return (int)std::lround(model_.pumpFeedForward(boiler_.setpoint()));
+  }
+
+  double EspressoMachine::boilerSetpoint(){
+    if (!cascaded_ || current_mode_ != BREW) return setpoint();
+    return cascade_.update(temps_.brew, boiler_.currentPWM(), boiler_.setpoint() - boiler_.currentTemp(), boiler_.held());
+  }
    
-  EspressoMachine::EspressoMachine(double brew_temp, double steam_temp):
-    temps_{.brew=brew_temp, .steam=steam_temp}, boiler_temp_sensor_(CS_THERMO),
-    boiler_(&boiler_temp_sensor_, temps_.brew, &(K_.brew), PWM_BOILER),
-    ui_(this, &boiler_), pwr_switch_(SWITCH_PIN_PWR, false, true),
-    pump_switch_(SWITCH_PIN_PMP, true), steam_switch_(SWITCH_PIN_STM, true)
+  EspressoMachine::EspressoMachine(const MachineConfig & config, HardwareContext * hw, Clock * clock):
+    hw_(hw), gpio_(hw->gpio()), clock_(clock), pins_(config.pins), temps_(config.temps), K_(config.gains),
+    config_(new MachineConfig(config)), config_version_(config.version),
+    supervisor_(hw->thermocouple(), hw->heaterGate(), config.safety, clock_),
+    boiler_(gpio_, supervisor_.sensor(), temps_.brew, &(K_.brew), pins_.boiler_pwm, 0, MachineConfig::MAX_SETPOINT, clock_),
+    cascade_(config.cascade, hw->groupThermocouple(), clock_), cascaded_(config.cascade.enabled),
+    pwr_switch_(hw->pwrSwitch()), pump_switch_(hw->pumpSwitch()),
+    steam_switch_(hw->steamSwitch()), rate_(config.loop, LOOP_PERIOD_SEC)
   {
-    current_mode_ = OFF; // Keep machine off until run() is called
+    if (cascaded_ && hw_->groupThermocouple() == NULL){
+      throw "Error: Cascade control needs the group thermocouple brought up.";
+    }
+    current_mode_ = OFF; // Keep machine off until the first tick
+    start_time_ = clock_->now();
+    last_tick_ = start_time_;
+    boiler_.setHeaterGate(hw_->heaterGate());
+    if (config.heater_wave.enabled) hw_->heaterGate()->setWaveform(config.heater_wave, clock_);
+    updateGainSchedule(config);
+    setLoopRate(config);
+    hw_->mark("controller");
   }
 
-  void EspressoMachine::run(){
-    ui_.init();
-    int key_press;
-    while((key_press = ui_.refresh()) != 'q'){
-      if (currentMode() != current_mode_) updateMode();
-      updateLights();
-      if (current_mode_ != OFF){
-	handleKeyPress(key_press);
-	if (pump_switch_.read()){
-	  boiler_.update(128);
-	}
-	else {
-	  boiler_.update();
-	}
+  void EspressoMachine::tick(){
+    supervisor_.heartbeat();
+    applyConfig();
+    handleCommands();
+    if (currentMode() != current_mode_) updateMode();
+    updateLights();
+    bool pump_on = pump_switch_->read();
+    if (cascaded_ && current_mode_ == BREW){
+      double sp = boilerSetpoint();
+      if (sp != boiler_.setpoint()) boiler_.updateSetpoint(sp);
+    }
+    if (current_mode_ != OFF){
+      if (pump_on){
+	boiler_.update(pumpFeedForward(), true);
+      }
+      else {
+	boiler_.update();
+      }
+    }
+    ShotRecorder * recorder = recorder_.load(std::memory_order_acquire);
+    if (recorder != NULL && current_mode_ != OFF){
+      recorder->update(clock_->now(), pump_on, boiler_.currentTemp(), setpoint(), boiler_.currentPWM(), 0,
+		       current_mode_, (current_mode_ == BREW ? K_.brew : K_.steam), scheduled_);
+    }
+    publishState();
+
+    // Off is settled: nothing to control
+    bool on = (current_mode_ != OFF);
+    rate_.update((on ? boiler_.setpoint() - boiler_.currentTemp() : 0), (on ? boiler_.errorSlope() : 0), on && pump_on);
+    supervisor_.setIdle(rate_.idle());
+    last_tick_ = clock_->now();
+    last_pwr_ = pwr_switch_->read();
+    last_pump_ = pump_on;
+    last_steam_ = steam_switch_->read();
+  }
+
+  bool EspressoMachine::poll(){
+    bool due = Duration(clock_->now() - last_tick_).count() >= rate_.period();
+    if (!due && pwr_switch_->read() == last_pwr_ && pump_switch_->read() == last_pump_
+	&& steam_switch_->read() == last_steam_ && !commands_.ready()) return false;
+    tick();
+    return true;
+  }
+
+  void EspressoMachine::start(){
+    if (started_) return;
+    started_ = true;
+    start_time_ = clock_->now();
+    tick();
+    hw_->mark("first decision");
+  }
+
+  void EspressoMachine::enablePanel(){
+    if (panel_trend_) return;
+    panel_trend_.reset(new TripleBuffer<TrendHistory>);
+    // So the panel has something to show before the next tick
+    panel_state_.write(state_);
+    panel_trend_->write(trend_);
+  }
+
+  void EspressoMachine::runPanel(MachineUI * ui){
+    if (!panel_trend_) throw "Error: A panel needs enablePanel() before the control loop starts.";
+    ui->init();
+    hw_->mark("ui");
+    while (!stop_requested_.load(std::memory_order_relaxed) && ui->refresh()){}
+    stop();
+  }
+
+  void EspressoMachine::run(double period_sec){
+    start();
+    // Fixed rate on the wall clock, which is all run() is ever used with. An adaptive loop wakes at
+    // its fast rate and only ticks when poll() says so.
+    bool adaptive = rate_.adaptive();
+    if (adaptive) period_sec = rate_.pollPeriod();
+    std::chrono::steady_clock::duration period =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(Duration(period_sec));
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    while (!stop_requested_.load(std::memory_order_relaxed)){
+      next += period;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (next < now) next = now; // Fell behind. Carry on from here rather than catching up in a burst
+      std::this_thread::sleep_until(next);
+      std::chrono::steady_clock::time_point woke = std::chrono::steady_clock::now();
+      if (adaptive){
+	if (!poll()) continue;
       }
+      else tick();
+      wake_lateness_.record(Duration(woke - next).count());
+      tick_time_.record(Duration(std::chrono::steady_clock::now() - woke).count());
     }
   }
 
   MachineMode EspressoMachine::currentMode(){
-    if(pwr_switch_.read()){
-      if(steam_switch_.read()){
+    // Can't tell if the power switch is on. Fail safe with the heater off.
+    bool pwr_on = pwr_switch_->read();
+    if (pwr_switch_->error() != BinarySensor::READ_OK) return OFF;
+    if(pwr_on){
+      // The power switch always wins but a remote client may pick the mode while it is on
+      if(mode_overridden_){
+	return mode_override_;
+      } else if(steam_switch_->read()){
 	return STEAM;
       } else {
 	return BREW;
@@ -99,7 +279,7 @@ namespace RaspLatte{
     }
   }
   
-  bool EspressoMachine::pumpOn() { return pump_switch_.read(); }
+  bool EspressoMachine::pumpOn() { return pump_switch_->read(); }
   double EspressoMachine::setpoint(){
     if (current_mode_ == STEAM){
       return temps_.steam;
@@ -109,9 +289,8 @@ namespace RaspLatte{
   }
     
   EspressoMachine::~EspressoMachine(){
-    gpioWrite(LIGHT_PIN_PWR, 0);
-    gpioWrite(LIGHT_PIN_PMP, 0);
-    gpioWrite(LIGHT_PIN_STM, 0);
-    endwin();
+    gpio_->write(pins_.pwr_light, 0);
+    gpio_->write(pins_.pump_light, 0);
+    gpio_->write(pins_.steam_light, 0);
   }
 }
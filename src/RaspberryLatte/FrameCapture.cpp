@@ -0,0 +1,151 @@
+#include "../../include/RaspberryLatte/FrameCapture.hpp"
+
+#include <cstring>
+
+namespace RaspLatte{
+  namespace {
+    const char CAPTURE_MAGIC[8] = {'R','L','F','R','A','M','E','1'};
+  }
+
+  FrameCapture::FrameCapture(const std::string & path, int64_t unix_ms_at_zero, Clock * clock):
+    path_(path), unix_ms_at_zero_(unix_ms_at_zero), clock_(clock), slots_(new Slot[SLOTS]){}
+
+  bool FrameCapture::open(std::string & err){
+    file_ = fopen(path_.c_str(), "wb");
+    if (file_ == NULL){
+      err = "could not open " + path_ + " for writing";
+      return false;
+    }
+    fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), file_);
+    fwrite(&unix_ms_at_zero_, sizeof(unix_ms_at_zero_), 1, file_);
+    if (fflush(file_) != 0){
+      err = "could not write " + path_;
+      return false;
+    }
+    return true;
+  }
+
+  void FrameCapture::record(uint32_t frame){
+    if (current_ == NULL){
+      for (int i = 0; i < SLOTS && current_ == NULL; i++){
+	int expected = FREE;
+	if (slots_[i].state.compare_exchange_strong(expected, FILLING)) current_ = &slots_[i];
+      }
+      if (current_ == NULL){
+	dropped_since_block_++;
+	dropped_++;
+	return;
+      }
+      current_->n = 0;
+      current_->dropped_before = dropped_since_block_;
+      dropped_since_block_ = 0;
+    }
+    Slot & s = *current_;
+    s.t_us[s.n] = std::chrono::duration_cast<std::chrono::microseconds>(clock_->now().time_since_epoch()).count();
+    s.frames[s.n] = frame;
+    captured_++;
+    if (++s.n == (uint32_t)BLOCK_FRAMES) finish();
+  }
+
+  void FrameCapture::finish(){
+    current_->state.store(READY, std::memory_order_release);
+    current_ = NULL;
+    ready_.notify_one();
+  }
+
+  void FrameCapture::flush(){
+    // Oldest block first. Slots are claimed in index order after each other's release, so the
+    // ready ones are written in order of their first frame.
+    for (;;){
+      Slot * oldest = NULL;
+      for (int i = 0; i < SLOTS; i++){
+	Slot & s = slots_[i];
+	if (s.state.load(std::memory_order_acquire) != READY) continue;
+	if (oldest == NULL || s.t_us[0] < oldest->t_us[0]) oldest = &s;
+      }
+      if (oldest == NULL) return;
+      Slot & s = *oldest;
+      if (file_ != NULL && !write_failed_){
+	uint32_t header[2] = {s.n, s.dropped_before};
+	bool ok = (fwrite(header, sizeof(header), 1, file_) == 1);
+	ok &= (fwrite(s.t_us, sizeof(int64_t), s.n, file_) == s.n);
+	ok &= (fwrite(s.frames, sizeof(uint32_t), s.n, file_) == s.n);
+	ok &= (fflush(file_) == 0);
+	write_failed_ = !ok; // A torn block would make the rest of the file unreadable. Stop here.
+      }
+      s.state.store(FREE, std::memory_order_release);
+    }
+  }
+
+  void FrameCapture::start(){
+    if (running_) return;
+    running_ = true;
+    thread_ = std::thread(&FrameCapture::loop, this);
+  }
+
+  void FrameCapture::stop(){
+    if (running_){
+      running_ = false;
+      ready_.notify_one();
+      thread_.join();
+    }
+    if (current_ != NULL && current_->n > 0) finish();
+    flush();
+  }
+
+  void FrameCapture::loop(){
+    while (running_){
+      {
+	// The sensor side notifies without the lock so a missed wakeup is caught by the timeout
+	std::unique_lock<std::mutex> lock(mutex_);
+	ready_.wait_for(lock, std::chrono::seconds(1));
+      }
+      flush();
+    }
+  }
+
+  bool FrameCapture::load(const std::string & path, FrameColumns & cols, std::string & err){
+    FILE * f = fopen(path.c_str(), "rb");
+    if (f == NULL){
+      err = "could not open " + path;
+      return false;
+    }
+    char magic[sizeof(CAPTURE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0
+	|| fread(&cols.unix_ms_at_zero, sizeof(cols.unix_ms_at_zero), 1, f) != 1){
+      err = path + " is not a frame capture";
+      fclose(f);
+      return false;
+    }
+    cols.t_us.clear();
+    cols.frames.clear();
+    cols.dropped = 0;
+    uint32_t header[2];
+    while (fread(header, sizeof(header), 1, f) == 1){
+      size_t at = cols.frames.size(), n = header[0];
+      if (n > (size_t)BLOCK_FRAMES){
+	err = path + " has a corrupt block at frame " + std::to_string(at);
+	fclose(f);
+	return false;
+      }
+      cols.dropped += header[1];
+      cols.t_us.resize(at + n);
+      cols.frames.resize(at + n);
+      if (fread(cols.t_us.data() + at, sizeof(int64_t), n, f) != n
+	  || fread(cols.frames.data() + at, sizeof(uint32_t), n, f) != n){
+	// The machine stopped mid-write. Keep the complete blocks.
+	cols.t_us.resize(at);
+	cols.frames.resize(at);
+	break;
+      }
+    }
+    fclose(f);
+    return true;
+  }
+
+  FrameCapture::~FrameCapture(){
+    stop();
+    if (file_ != NULL) fclose(file_);
+    delete [] slots_;
+  }
+}
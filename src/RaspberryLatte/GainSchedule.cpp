@@ -0,0 +1,96 @@
+#include "../../include/RaspberryLatte/GainSchedule.hpp"
+
+#include <cmath>
+
+namespace RaspLatte{
+  GainSchedule::GainSchedule(){
+    temps_[0] = 0;
+    errors_[0] = 0;
+    for (int p = 0; p < 2; p++){
+      for (int t = 0; t < MAX_POINTS; t++){
+	for (int e = 0; e < MAX_POINTS; e++) gains_[p][t][e] = {0, 0, 0};
+      }
+    }
+    build();
+  }
+
+  void GainSchedule::setAxes(const double * temps, int n_temps, const double * errors, int n_errors){
+    n_temps_ = (n_temps > MAX_POINTS ? MAX_POINTS : (n_temps < 1 ? 1 : n_temps));
+    n_errors_ = (n_errors > MAX_POINTS ? MAX_POINTS : (n_errors < 1 ? 1 : n_errors));
+    for (int i = 0; i < n_temps_; i++) temps_[i] = temps[i];
+    for (int i = 0; i < n_errors_; i++) errors_[i] = errors[i];
+    for (int p = 0; p < 2; p++){
+      for (int t = 0; t < MAX_POINTS; t++){
+	for (int e = 0; e < MAX_POINTS; e++) gains_[p][t][e] = {0, 0, 0};
+      }
+    }
+  }
+
+  void GainSchedule::setGains(int temp_idx, int err_idx, bool pump_on, PID::PIDGains gains){
+    if (temp_idx < 0 || temp_idx >= n_temps_ || err_idx < 0 || err_idx >= n_errors_) return;
+    gains_[pump_on][temp_idx][err_idx] = gains;
+  }
+
+  void GainSchedule::buildCells(const double * points, int n, double step, Cell * cells, int n_cells){
+    int idx = 0;
+    for (int c = 0; c < n_cells; c++){
+      double x = c*step;
+      while (idx < n - 2 && x >= points[idx+1]) idx++;
+      if (n == 1 || x <= points[0]){
+	cells[c] = {0, 0};
+      } else if (x >= points[n-1]){
+	cells[c] = {(uint8_t)(n-2), 1};
+      } else {
+	cells[c] = {(uint8_t)idx, (float)((x - points[idx])/(points[idx+1] - points[idx]))};
+      }
+    }
+  }
+
+  void GainSchedule::build(){
+    buildCells(temps_, n_temps_, TEMP_STEP, temp_cells_, TEMP_CELLS);
+    buildCells(errors_, n_errors_, ERR_STEP, err_cells_, ERR_CELLS);
+  }
+
+  PID::PIDGains GainSchedule::lookup(double temp, double abs_err, bool pump_on) const{
+    int ti = (int)std::lround(temp/TEMP_STEP);
+    int ei = (int)std::lround(abs_err/ERR_STEP);
+    ti = (ti < 0 ? 0 : (ti >= TEMP_CELLS ? TEMP_CELLS-1 : ti));
+    ei = (ei < 0 ? 0 : (ei >= ERR_CELLS ? ERR_CELLS-1 : ei));
+    const Cell & tc = temp_cells_[ti];
+    const Cell & ec = err_cells_[ei];
+
+    // Neighbouring breakpoints. A single point axis uses the same one twice.
+    int t0 = tc.idx, t1 = (n_temps_ > 1 ? tc.idx + 1 : tc.idx);
+    int e0 = ec.idx, e1 = (n_errors_ > 1 ? ec.idx + 1 : ec.idx);
+    const PID::PIDGains (&g)[MAX_POINTS][MAX_POINTS] = gains_[pump_on];
+
+    double w00 = (1 - tc.w)*(1 - ec.w), w01 = (1 - tc.w)*ec.w, w10 = tc.w*(1 - ec.w), w11 = tc.w*ec.w;
+    return {w00*g[t0][e0].p + w01*g[t0][e1].p + w10*g[t1][e0].p + w11*g[t1][e1].p,
+	    w00*g[t0][e0].i + w01*g[t0][e1].i + w10*g[t1][e0].i + w11*g[t1][e1].i,
+	    w00*g[t0][e0].d + w01*g[t0][e1].d + w10*g[t1][e0].d + w11*g[t1][e1].d};
+  }
+
+  GainSchedule GainSchedule::fromModeGains(const ModePair<PID::PIDGains> & gains, const TempPair & temps,
+					   double integral_band, double pump_kp_scale){
+    double lo = temps.brew + 5;
+    double hi = temps.steam - 10;
+    if (hi <= lo) hi = lo + 1;
+    double band = (integral_band > 0 ? integral_band : 1);
+    const double temp_axis[2] = {lo, hi};
+    const double err_axis[3] = {0, band/2, band};
+    const double i_scale[3] = {1, 1, 0}; // Full integral near the setpoint, none far from it
+
+    GainSchedule schedule;
+    schedule.setAxes(temp_axis, 2, err_axis, 3);
+    for (int pump = 0; pump < 2; pump++){
+      for (int t = 0; t < 2; t++){
+	const PID::PIDGains & k = (t == 0 ? gains.brew : gains.steam);
+	for (int e = 0; e < 3; e++){
+	  schedule.setGains(t, e, pump, {k.p * (pump ? pump_kp_scale : 1), k.i * i_scale[e], k.d});
+	}
+      }
+    }
+    schedule.build();
+    return schedule;
+  }
+}
@@ -0,0 +1,107 @@
+#include "../../include/RaspberryLatte/HardwareContext.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+namespace RaspLatte{
+  namespace {
+    // Taken during static initialisation, which is as close to process start as the program gets
+    const std::chrono::steady_clock::time_point process_start = std::chrono::steady_clock::now();
+  }
+
+  double HardwareContext::sinceProcessStart(){
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - process_start).count();
+  }
+
+  HardwareContext::HardwareContext(GPIOBackend * gpio, const PinConfig & pins, bool group_thermocouple):
+    gpio_(gpio), pins_(pins), want_group_(group_thermocouple){
+    phases_.reserve(16);
+  }
+
+  void HardwareContext::bringUp(){
+    if (up_) return;
+    if (!gpio_->initialise()){
+      throw "Could not start GPIO!";
+    }
+    mark("gpio");
+
+    // Heater off first so nothing below can leave it running, then the lights
+    gpio_->setOutput(pins_.boiler_pwm);
+    gpio_->setPWMFrequency(pins_.boiler_pwm, 20);
+    gpio_->pwm(pins_.boiler_pwm, 0);
+    heater_gate_ = new HeaterGate(gpio_, pins_.boiler_pwm);
+    PinIndex lights[] = {pins_.pwr_light, pins_.pump_light, pins_.steam_light};
+    for (PinIndex p : lights){
+      gpio_->setOutput(p);
+      gpio_->write(p, 0);
+    }
+    mark("outputs");
+
+    // The thermocouple and the switches don't depend on each other
+    const char * thermo_err = NULL;
+    std::thread thermo([this, &thermo_err](){
+	try {
+	  thermocouple_ = new MAX31855(gpio_, pins_.thermo_cs);
+	  thermocouple_->read(); // Have the first conversion in hand before the supervisor asks
+	  if (want_group_){
+	    group_thermocouple_ = new MAX31855(gpio_, pins_.group_cs);
+	    group_thermocouple_->read();
+	  }
+	} catch (const char * e) {
+	  thermo_err = e;
+	}
+      });
+    const char * switch_err = NULL;
+    try {
+      pwr_switch_ = new BinarySensor(gpio_, pins_.pwr_switch, false, true);
+      pump_switch_ = new BinarySensor(gpio_, pins_.pump_switch, true);
+      steam_switch_ = new BinarySensor(gpio_, pins_.steam_switch, true);
+    } catch (const char * e) {
+      switch_err = e;
+    }
+    thermo.join();
+    if (thermo_err) throw thermo_err;
+    if (switch_err) throw switch_err;
+    mark("sensors");
+    up_ = true;
+  }
+
+  void HardwareContext::mark(const char * phase){
+    phases_.push_back({phase, sinceProcessStart()});
+  }
+
+  double HardwareContext::phaseEnd(const char * phase){
+    for (const Phase & p : phases_){
+      if (!strcmp(p.name, phase)) return p.end_ms;
+    }
+    return -1;
+  }
+
+  void HardwareContext::printPhases(std::ostream & out){
+    auto ms = [](double t){ return std::round(t*100)/100; };
+    double prev = 0;
+    out<<"Startup:";
+    for (size_t i = 0; i < phases_.size(); i++){
+      out<<(i ? ", " : " ")<<phases_[i].name<<" "<<ms(phases_[i].end_ms - prev)<<"ms";
+      prev = phases_[i].end_ms;
+    }
+    double first = phaseEnd("first decision");
+    if (first >= 0) out<<". First heater decision "<<ms(first)<<"ms after start";
+    out<<"\n";
+  }
+
+  HardwareContext::~HardwareContext(){
+    // Heater off before anything else goes away
+    if (heater_gate_ != NULL){
+      heater_gate_->trip();
+      delete heater_gate_;
+    }
+    delete steam_switch_;
+    delete pump_switch_;
+    delete pwr_switch_;
+    delete thermocouple_;
+    delete group_thermocouple_;
+  }
+}
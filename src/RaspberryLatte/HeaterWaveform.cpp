@@ -0,0 +1,70 @@
+#include "../../include/RaspberryLatte/HeaterWaveform.hpp"
+
+#include <cmath>
+
+namespace RaspLatte{
+  HeaterWaveform::WaveformSettings HeaterWaveform::defaultSettings(){
+    return {.enabled = false, .mains_hz = 50, .slot_sec = 0.01, .pattern_sec = 0.5};
+  }
+
+  double HeaterWaveform::slotSec(const WaveformSettings & settings){
+    return (settings.mains_hz > 0 ? 0.5/settings.mains_hz : settings.slot_sec);
+  }
+
+  HeaterWaveform::HeaterWaveform(GPIOBackend * gpio, PinIndex pin, WaveformSettings settings, Clock * clock):
+    gpio_(gpio), pin_(pin), clock_(clock){
+    slot_us_ = (uint32_t)std::lround(slotSec(settings)*1e6);
+    if (slot_us_ == 0) throw "Error: Heater waveform slots must be at least 1us.";
+    slot_sec_ = slot_us_/1e6;
+    long slots = std::lround(settings.pattern_sec/slot_sec_);
+    slots_ = (unsigned int)(slots < 1 ? 1 : (slots > (long)MAX_SLOTS ? MAX_SLOTS : slots));
+  }
+
+  bool HeaterWaveform::set(double duty){
+    TimePoint now = clock_->now();
+    double error = 0;
+    if (playing_){
+      // Settle the error over the slots that played: first order, so it is the start error plus the
+      // duty asked for less the slots that were on
+      double played = std::floor(Duration(now - started_).count()/slot_sec_ + 1e-6); // A tick on a slot edge counts it
+      if (played < 0) played = 0;
+      double repeats = std::floor(played/slots_);
+      unsigned int partial = (unsigned int)(played - repeats*slots_);
+      double on = repeats*on_prefix_[slots_] + on_prefix_[partial];
+      error = start_error_ + played*fraction_ - on;
+      error = std::fmax(-(double)slots_, std::fmin(error, (double)slots_)); // A stalled loop owes at most a pattern
+    }
+
+    double fraction = duty/255;
+    fraction = (fraction < 0 ? 0 : (fraction > 1 ? 1 : fraction));
+    // A repeated pattern leaves up to a slot of error each time. Spread anything beyond the
+    // modulator's own half slot over the whole pattern rather than paying it back in the first
+    // slots: a pattern that repeats would pay it twice, and the next would swing back further.
+    double e = std::fmax(-0.5, std::fmin(error, 0.5));
+    double spread = fraction + (error - e)/slots_;
+    spread = (spread < 0 ? 0 : (spread > 1 ? 1 : spread));
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < slots_; i++){
+      e += spread;
+      bool on = (e >= 0.5);
+      if (on) e -= 1;
+      on_prefix_[i + 1] = on_prefix_[i] + on;
+      if (count > 0 && pulses_[count - 1].on == on) pulses_[count - 1].us += slot_us_;
+      else pulses_[count++] = {on, slot_us_};
+    }
+    if (!gpio_->wave(pin_, pulses_, count)){
+      playing_ = false;
+      return false;
+    }
+    playing_ = true;
+    started_ = now;
+    fraction_ = fraction;
+    start_error_ = error;
+    return true;
+  }
+
+  void HeaterWaveform::stop(){
+    gpio_->wave(pin_, NULL, 0);
+    playing_ = false;
+  }
+}
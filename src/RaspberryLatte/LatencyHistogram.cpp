@@ -0,0 +1,57 @@
+#include "../../include/RaspberryLatte/LatencyHistogram.hpp"
+
+#include <cmath>
+
+namespace RaspLatte{
+  int LatencyHistogram::bucket(uint64_t us){
+    if (us < SUB_BUCKETS) return (int)us;
+    // The top bit picks the power of two, the three bits under it the eighth
+    int top = 63 - __builtin_clzll(us);
+    int b = SUB_BUCKETS*(top - 2) + (int)((us >> (top - 3)) & (SUB_BUCKETS - 1));
+    return (b < BUCKETS ? b : BUCKETS - 1);
+  }
+
+  uint64_t LatencyHistogram::bucketTop(int b){
+    if (b < SUB_BUCKETS) return b;
+    int top = b/SUB_BUCKETS + 2;
+    uint64_t width = 1ull << (top - 3);
+    return (uint64_t)(SUB_BUCKETS + b%SUB_BUCKETS)*width + width - 1;
+  }
+
+  void LatencyHistogram::record(double sec){
+    uint64_t us = (sec > 0 ? (uint64_t)std::llround(sec*1e6) : 0);
+    buckets_[bucket(us)]++;
+    count_++;
+    sum_us_ += us;
+    if (us > max_us_) max_us_ = us;
+  }
+
+  void LatencyHistogram::clear(){
+    for (int b = 0; b < BUCKETS; b++) buckets_[b] = 0;
+    count_ = 0;
+    max_us_ = 0;
+    sum_us_ = 0;
+  }
+
+  void LatencyHistogram::merge(const LatencyHistogram & other){
+    for (int b = 0; b < BUCKETS; b++) buckets_[b] += other.buckets_[b];
+    count_ += other.count_;
+    sum_us_ += other.sum_us_;
+    if (other.max_us_ > max_us_) max_us_ = other.max_us_;
+  }
+
+  double LatencyHistogram::percentile(double p) const {
+    if (count_ == 0) return 0;
+    uint64_t rank = (uint64_t)std::ceil(p*count_);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++){
+      seen += buckets_[b];
+      if (seen >= rank){
+	uint64_t top = bucketTop(b);
+	return (top < max_us_ ? top : max_us_)/1e6; // The max is exact
+      }
+    }
+    return max();
+  }
+}
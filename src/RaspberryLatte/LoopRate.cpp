@@ -0,0 +1,27 @@
+#include "../../include/RaspberryLatte/LoopRate.hpp"
+
+#include <cmath>
+
+namespace RaspLatte{
+  LoopRate::LoopRateSettings LoopRate::defaultSettings(){
+    return {.adaptive = false, .fast_period_sec = 0.05, .slow_period_sec = 1, .band = 0.5, .slope_band = 0.05};
+  }
+
+  LoopRate::LoopRate(LoopRateSettings settings, double fixed_period_sec): settings_(settings),
+									  fixed_(fixed_period_sec){
+    period_ = (settings_.adaptive ? settings_.fast_period_sec : fixed_);
+  }
+
+  void LoopRate::setSettings(LoopRateSettings settings){
+    settings_ = settings;
+    period_ = (settings_.adaptive ? settings_.fast_period_sec : fixed_);
+  }
+
+  double LoopRate::update(double error, double slope, bool pump_on){
+    if (!settings_.adaptive) return period_ = fixed_;
+    bool busy = pump_on || std::fabs(error) > settings_.band || std::fabs(slope) > settings_.slope_band;
+    if (busy) period_ = settings_.fast_period_sec;
+    else period_ = std::fmin(2*period_, settings_.slow_period_sec);
+    return period_;
+  }
+}
@@ -0,0 +1,47 @@
+#include "../../include/RaspberryLatte/MAX31855Frame.hpp"
+
+#include <cstring>
+
+namespace RaspLatte{
+  namespace {
+    // 128 bit vectors: one SSE or NEON register each
+    const size_t LANES = 4;
+    typedef uint32_t U32s __attribute__((vector_size(4*LANES)));
+    typedef int32_t I32s __attribute__((vector_size(4*LANES)));
+    typedef float F32s __attribute__((vector_size(4*LANES)));
+    typedef uint8_t U8s __attribute__((vector_size(LANES)));
+
+    /** Decode LANES frames the same way as the MAX31855Frame functions */
+    inline void decodeLanes(U32s f, F32s & reading, F32s & chip, U8s & fault){
+      I32s thermo_counts = (I32s)((f >> 18) ^ 0x2000) - 0x2000;
+      I32s chip_counts = (I32s)(((f >> 4) & 0xFFF) ^ 0x800) - 0x800;
+      U32s faults = (f & 0x7) | ((U32s)(f == 0) & MAX31855_ERR_NO_DATA); // Comparisons give all ones for true
+      F32s thermo = __builtin_convertvector(thermo_counts, F32s) * 0.25f;
+      F32s unavailable = {MAX31855_TEMP_UNAVALIBLE, MAX31855_TEMP_UNAVALIBLE, MAX31855_TEMP_UNAVALIBLE,
+			  MAX31855_TEMP_UNAVALIBLE};
+      reading = (faults != 0 ? unavailable : thermo);
+      chip = __builtin_convertvector(chip_counts, F32s) * 0.0625f;
+      fault = __builtin_convertvector(faults, U8s);
+    }
+  }
+
+  void decodeFrames(const uint32_t * frames, size_t n, float * reading, float * chip, uint8_t * fault){
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES){
+      // memcpy since the arrays need not be aligned to a vector. It compiles to a plain load/store.
+      U32s f;
+      memcpy(&f, frames + i, sizeof(f));
+      F32s r, c;
+      U8s e;
+      decodeLanes(f, r, c, e);
+      if (reading) memcpy(reading + i, &r, sizeof(r));
+      if (chip) memcpy(chip + i, &c, sizeof(c));
+      if (fault) memcpy(fault + i, &e, sizeof(e));
+    }
+    for (; i < n; i++){
+      if (reading) reading[i] = MAX31855Frame::reading(frames[i]);
+      if (chip) chip[i] = MAX31855Frame::chipTemp(frames[i]);
+      if (fault) fault[i] = MAX31855Frame::fault(frames[i]);
+    }
+  }
+}
@@ -0,0 +1,99 @@
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace RaspLatte{
+  namespace {
+    /** The cores in this process's affinity mask, lowest first */
+    std::vector<int> allowedCores(){
+      std::vector<int> cores;
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      if (sched_getaffinity(0, sizeof(set), &set) == 0){
+	for (int c = 0; c < CPU_SETSIZE; c++){
+	  if (CPU_ISSET(c, &set)) cores.push_back(c);
+	}
+      }
+      if (cores.empty()) cores.push_back(0);
+      return cores;
+    }
+  }
+
+  MachineHost::MachineHost(double period_sec): period_sec_(period_sec){}
+
+  int MachineHost::cores(){
+    return (int)allowedCores().size();
+  }
+
+  bool MachineHost::pinCurrentThread(int core){
+    std::vector<int> allowed = allowedCores();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(allowed[core % allowed.size()], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+  }
+
+  void MachineHost::becomeServiceThread(){
+    pinCurrentThread(SERVICE_CORE);
+    // Nice is per thread on Linux and inherited by the threads this one starts
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+  }
+
+  void MachineHost::add(EspressoMachine * machine){
+    if (running_) throw "Error: Machines must be added before the host starts.";
+    int n = cores();
+    int core = (n == 1 ? 0 : 1 + (int)(machines_.size() % (n - 1)));
+    machines_.push_back({machine, core, std::thread()});
+  }
+
+  void MachineHost::start(){
+    if (running_) return;
+    running_ = true;
+    for (Hosted & h : machines_) h.thread = std::thread(&MachineHost::control, this, &h);
+  }
+
+  void MachineHost::control(Hosted * h){
+    pinCurrentThread(h->core);
+    // Ahead of everything but the supervisors. Needs privileges; pigpio already requires root.
+    sched_param param;
+    param.sched_priority = CONTROL_PRIORITY;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    SafetySupervisor * supervisor = h->machine->supervisor();
+    supervisor->start();
+    h->machine->run(period_sec_);
+    supervisor->stop();
+  }
+
+  void MachineHost::stop(){
+    if (!running_) return;
+    for (Hosted & h : machines_) h.machine->stop();
+    for (Hosted & h : machines_) h.thread.join();
+    running_ = false;
+  }
+
+  MachineHost::~MachineHost(){
+    stop();
+  }
+
+  SimulatedMachine::SimulatedMachine(const MachineConfig & config, double initial_temp, Clock * clock,
+				     BoilerPlant::PlantParams params):
+    config_(config), plant_(params, initial_temp), gpio_(clock, &plant_, config_.pins.boiler_pwm),
+    hw_(&gpio_, config_.pins, config_.cascade.enabled){
+    if (config_.cascade.enabled) gpio_.setGroupChannel(config_.pins.group_cs);
+    // Power on, pump and steam switches open (inverted inputs read 1 when open)
+    gpio_.setInputLevel(config_.pins.pwr_switch, 1);
+    gpio_.setInputLevel(config_.pins.pump_switch, 1);
+    gpio_.setInputLevel(config_.pins.steam_switch, 1);
+    hw_.bringUp();
+    machine_ = new EspressoMachine(config_, &hw_, clock);
+  }
+
+  SimulatedMachine::~SimulatedMachine(){
+    delete machine_;
+  }
+}
@@ -1,13 +1,17 @@
 #include "../../include/RaspberryLatte/PID.hpp"
+
+#include <cmath>
+
 namespace RaspLatte{   
   /** Add a point to the integral. Assume a linear change from the previous v to current*/
   void PID::DIntegral::addPoint(TimePoint t, double v){
     Duration delta_t = t - prev_time_;
     double avg_v = (v+prev_val_)/2.0;
 
-    area_ += (delta_t.count() * avg_v);
-
-    if(clamping_) clamp_.clamp(area_);
+    if (!holding_){
+      area_ += (delta_t.count() * avg_v);
+      if(clamping_) clamp_.clamp(area_);
+    }
 	
     prev_val_ = v;
     prev_time_ = t;
@@ -24,19 +28,31 @@ namespace RaspLatte{
     return area_;
   }
       
+  void PID::DIntegral::setArea(double area){
+    area_ = area;
+    if(clamping_) clamp_.clamp(area_);
+  }
+      
   void PID::DIntegral::resetArea(){
     area_ = 0;
   }
+
+  void PID::DIntegral::restart(TimePoint t, double v){
+    area_ = 0;
+    prev_time_ = t;
+    prev_val_ = v;
+  }
   
   /**
    * DDerivative implementation
    */   
   double PID::DDerivative::addPoint(TimePoint t, double v){
-    vals_.insert(vals_.begin(), v);
-    times_.insert(times_.begin(), t);
-	
-    // Dump points older than the period
-    cleanPoints();
+    // Overwrite the oldest point once the buffer is full
+    times_[next_] = t;
+    vals_[next_] = v;
+    next_ = (next_ + 1) % MAX_POINTS;
+    if (count_ < MAX_POINTS) count_++;
+    
     updateSlope();
     return slope_;
   }
@@ -48,65 +64,64 @@ namespace RaspLatte{
   }
 
   void PID::DDerivative::reset(){
-    vals_ = std::vector<double>();
-    times_ = std::vector<TimePoint>();
+    next_ = 0;
+    count_ = 0;
     slope_ = 0;
   }
       
   double PID::DDerivative::slope(){ return slope_; }
   
-  void PID::DDerivative::cleanPoints(){
-    while (times_.size() > 10) {//times_.front() - times_.back() > period_){
-      times_.pop_back();
-      vals_.pop_back();
-    }
-  }
-
   void PID::DDerivative::updateSlope(){
     // Can't get slope off one point.
-    if (vals_.size() <= 1){
+    if (count_ <= 1){
       slope_ = 0;
       return;
     }
 
+    // Newest first, back to the start of the window but never fewer than two points
+    int newest = (next_ + MAX_POINTS - 1) % MAX_POINTS;
+    TimePoint window_start = times_[newest] - period_;
+    int used = 2;
+    while (used < count_ && times_[(newest + MAX_POINTS - used) % MAX_POINTS] >= window_start) used++;
+
     // Find the average error and time
-    double avg_err = vals_[0];
-    Duration avg_t = times_[0].time_since_epoch();
-    for(unsigned int i = 1; i<vals_.size(); i++){
+    double avg_err = 0;
+    Duration avg_t(0);
+    for(int k = 0; k<used; k++){
+      int i = (newest + MAX_POINTS - k) % MAX_POINTS;
       avg_err += vals_[i];
       avg_t += times_[i].time_since_epoch();
     }
       
-    avg_err /= vals_.size();
-    avg_t /= vals_.size();
+    avg_err /= used;
+    avg_t /= used;
 	
-    //Find and return the slope
+    //Find and return the slope. Uneven spacing is fine for a least squares fit.
     double num = 0;
     double den = 0;
-    for(unsigned int i = 0; i<vals_.size(); i++){
+    for(int k = 0; k<used; k++){
+      int i = (newest + MAX_POINTS - k) % MAX_POINTS;
       double sqrt_den = (times_[i].time_since_epoch() - avg_t).count();
       num += sqrt_den * (vals_[i] - avg_err);
       den +=  sqrt_den * sqrt_den;
     }
 	
-    slope_ = num/den;
+    slope_ = (den > 0 ? num/den : 0);
   }
 
   // ========================= Constructors =========================
-  PID::PID(PIDGains gains, double * setpoint, Sensor<double> * sensor_ptr): sensor_(sensor_ptr), K_(gains), setpoint_(setpoint){
+  PID::PID(PIDGains gains, double * setpoint, Sensor<double> * sensor_ptr, Clock * clock):
+    sensor_(sensor_ptr), clock_(clock), K_(gains), setpoint_(setpoint){
     // Default settings
     min_t_between_updates_ = Duration(0.001);
     slope_.setPeriod(2);
     input_clamper_.setMin(0);
     input_clamper_.setMax(255);
       
-    last_update_time_ = std::chrono::steady_clock::now();
+    last_update_time_ = clock_->now();
 
-    // Init the slope and integral terms
-    double err = sensor_->read()- *setpoint_;
-    slope_ = DDerivative(last_update_time_, err);
-    int_sum_ = DIntegral(last_update_time_, err);
-      
+    // The sensor is not read here so building a controller never waits on hardware. The slope and
+    // integral terms are started from the first reading by reset() or the first update().
     prev_setpoint_ = *setpoint;
   }
 
@@ -126,7 +141,18 @@ namespace RaspLatte{
     
   double PID::setpoint(){ return *setpoint_; }
      
-  void PID::setGains(PIDGains gains){
+  void PID::setGains(PIDGains gains, bool bumpless){
+    if (bumpless){
+      // Solve Kp*e + Ki*I + Kd*D + offset for the I that keeps the output where it is. What the
+      // integral can't hold, because Ki is 0 or the area would be clamped, is carried as the offset.
+      double held = K_.p*last_err_ + K_.i*int_sum_.area() + K_.d*slope_.slope() + offset_;
+      double rest = held - gains.p*last_err_ - gains.d*slope_.slope();
+      if (gains.i > 0){
+	int_sum_.setArea(rest/gains.i);
+	rest -= gains.i*int_sum_.area();
+      }
+      offset_ = rest;
+    }
     K_ = gains;
   }
     
@@ -137,21 +163,30 @@ namespace RaspLatte{
   // ======================== Operation ============================
   void PID::reset(){
     // Reset slope and integral terms
-    int_sum_.resetArea();
     slope_.reset();
 
-    last_update_time_ = std::chrono::steady_clock::now();
+    last_update_time_ = clock_->now();
       
-    // Init the slope and integral terms
-    double err = sensor_->read()- *setpoint_;
+    // Init the slope and integral terms. Restart the integral from here so the time spent off is
+    // not integrated into it.
+    double err = *setpoint_ - sensor_->read();
+    last_err_ = err;
     slope_.addPoint(last_update_time_, err);
-    int_sum_.addPoint(last_update_time_, err);
+    int_sum_.restart(last_update_time_, err);
+    offset_ = 0;
+    started_ = true;
+    fresh_ = true;
   }
     
-  double PID::update(int feed_forward){
-    TimePoint current_time = std::chrono::steady_clock::now();
-    if (current_time - last_update_time_ < min_t_between_updates_) return u_;
-
+  double PID::update(double feed_forward){
+    if (!started_) reset();
+    TimePoint current_time = clock_->now();
+    // The first update after a reset always computes, or the output would be the one from before it
+    if (!fresh_ && current_time - last_update_time_ < min_t_between_updates_) return u_;
+    fresh_ = false;
+
+    // The offset from a gain change fades so the new gains take over smoothly
+    offset_ *= std::exp(-Duration(current_time - last_update_time_).count()/OFFSET_DECAY_SEC);
     last_update_time_ = current_time;
 
     // If setpoint changed, reset internal variables
@@ -161,11 +196,12 @@ namespace RaspLatte{
     }
       
     double err = *setpoint_ - sensor_->read();
+    last_err_ = err;
 
     int_sum_.addPoint(current_time, err);
     slope_.addPoint(current_time, err);
 
-    u_ = K_.p * err + K_.i * int_sum_.area()+ K_.d * slope_.slope() + feed_forward;
+    u_ = K_.p * err + K_.i * int_sum_.area()+ K_.d * slope_.slope() + offset_ + feed_forward;
 
     return input_clamper_.clamp(u_);
   }
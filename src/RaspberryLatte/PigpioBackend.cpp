@@ -0,0 +1,81 @@
+#include "../../include/RaspberryLatte/GPIOBackend.hpp"
+
+#include <pigpio.h>
+
+namespace RaspLatte{
+  bool PigpioBackend::initialise(){
+    return gpioInitialise() >= 0;
+  }
+
+  void PigpioBackend::setInput(PinIndex p, Pull pull){
+    gpioSetMode(p, PI_INPUT);
+    switch(pull){
+    case PULL_DOWN:
+      gpioSetPullUpDown(p, PI_PUD_DOWN);
+      break;
+    case PULL_UP:
+      gpioSetPullUpDown(p, PI_PUD_UP);
+      break;
+    default:
+      gpioSetPullUpDown(p, PI_PUD_OFF);
+    }
+  }
+
+  void PigpioBackend::setOutput(PinIndex p){ gpioSetMode(p, PI_OUTPUT); }
+  int PigpioBackend::read(PinIndex p){ return gpioRead(p); }
+  void PigpioBackend::write(PinIndex p, bool level){ gpioWrite(p, level); }
+  void PigpioBackend::setPWMFrequency(PinIndex p, unsigned int hz){ gpioSetPWMfrequency(p, hz); }
+  void PigpioBackend::pwm(PinIndex p, unsigned int duty){
+    if ((int)p == wave_pin_) stopWave();
+    gpioPWM(p, duty);
+  }
+
+  void PigpioBackend::stopWave(){
+    if (wave_id_ < 0) return;
+    gpioWaveTxStop();
+    gpioWaveDelete(wave_id_);
+    gpioWrite(wave_pin_, 0);
+    wave_id_ = -1;
+    wave_pin_ = -1;
+  }
+
+  bool PigpioBackend::wave(PinIndex p, const WavePulse * pulses, unsigned int count){
+    if (count == 0){
+      if ((int)p == wave_pin_) stopWave();
+      else gpioWrite(p, 0);
+      return true;
+    }
+    if (count > MAX_WAVE_PULSES || (wave_pin_ >= 0 && (int)p != wave_pin_)) return false;
+    gpioPulse_t out[MAX_WAVE_PULSES];
+    uint32_t mask = 1u << p;
+    for (unsigned int i = 0; i < count; i++){
+      out[i].gpioOn = (pulses[i].on ? mask : 0);
+      out[i].gpioOff = (pulses[i].on ? 0 : mask);
+      out[i].usDelay = pulses[i].us;
+    }
+    gpioWaveAddNew();
+    if (gpioWaveAddGeneric(count, out) < 0) return false;
+    int id = gpioWaveCreate();
+    if (id < 0) return false;
+    if (wave_pin_ < 0) gpioPWM(p, 0); // Hand the pin over from PWM
+    // Starts at once: the controller accounts for the part of the last waveform that played
+    if (gpioWaveTxSend(id, PI_WAVE_MODE_REPEAT) < 0){
+      gpioWaveDelete(id);
+      return false;
+    }
+    if (wave_id_ >= 0) gpioWaveDelete(wave_id_);
+    wave_id_ = id;
+    wave_pin_ = p;
+    return true;
+  }
+
+  int PigpioBackend::spiOpen(unsigned int channel, SPIBaud baud, unsigned int flags){
+    return ::spiOpen(channel, baud, flags);
+  }
+  
+  int PigpioBackend::spiRead(int handle, char * buf, unsigned int count){
+    return ::spiRead(handle, buf, count);
+  }
+  
+  void PigpioBackend::spiClose(int handle){ ::spiClose(handle); }
+}
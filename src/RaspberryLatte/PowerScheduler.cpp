@@ -0,0 +1,133 @@
+#include "../../include/RaspberryLatte/PowerScheduler.hpp"
+#include "../../include/RaspberryLatte/SafetySupervisor.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace RaspLatte{
+  namespace {
+    /** Brew first, then steam. Heaters that are off want nothing anyway */
+    int rank(MachineMode mode){
+      return (mode == BREW ? 0 : (mode == STEAM ? 1 : 2));
+    }
+  }
+
+  PowerScheduler::PowerBudget PowerScheduler::defaultBudget(){
+    return {.max_watts = 0, .window_sec = 0.5, .slots = 25};
+  }
+
+  PowerScheduler::PowerScheduler(PowerBudget budget): budget_(budget), load_(budget.slots, 0.){
+    if (!(budget_.slots > 0 && budget_.window_sec > 0 && budget_.max_watts >= 0)){
+      throw "Error: Power budget needs a positive window and slot count.";
+    }
+  }
+
+  int PowerScheduler::add(HeaterGate * gate, double watts){
+    if (running_) throw "Error: Heaters must be added before the power scheduler starts.";
+    Heater * h = new Heater();
+    h->id = (int)heaters_.size();
+    h->gate = gate;
+    h->watts = watts;
+    h->on.assign(budget_.slots, false);
+    heaters_.push_back(h);
+    order_.push_back(h);
+    gate->setScheduler(this, h->id);
+    return h->id;
+  }
+
+  double PowerScheduler::grantedDuty(int id){
+    return (double)heaters_[id]->granted/budget_.slots;
+  }
+
+  void PowerScheduler::plan(){
+    int n = budget_.slots;
+    for (int s = 0; s < n; s++) load_[s] = 0;
+    // Ties keep the order they were added in, so the layout only moves when a request does
+    std::sort(order_.begin(), order_.end(), [](Heater * a, Heater * b){
+	int ra = rank(a->mode.load(std::memory_order_relaxed)), rb = rank(b->mode.load(std::memory_order_relaxed));
+	if (ra != rb) return ra < rb;
+	return a->id < b->id;
+      });
+
+    int cursor = 0;
+    for (Heater * h : order_){
+      double want = h->duty.load(std::memory_order_relaxed)/255.*n + h->carry;
+      int target = std::min((int)want, n);
+      int granted = 0, last = cursor;
+      for (int j = 0; j < n; j++){
+	int s = (cursor + j) % n;
+	bool on = (granted < target && (budget_.max_watts == 0 || load_[s] + h->watts <= budget_.max_watts));
+	h->on[s] = on;
+	if (on){
+	  load_[s] += h->watts;
+	  granted++;
+	  last = s;
+	}
+      }
+      // Only the part slot is owed. Time the cap took is not, or the heater would catch up in a burst later
+      h->carry = (granted == target ? want - target : 0);
+      h->granted = granted;
+      if (granted > 0) cursor = (last + 1) % n;
+    }
+    double peak = *std::max_element(load_.begin(), load_.end());
+    if (peak > peak_watts_) peak_watts_ = peak;
+  }
+
+  void PowerScheduler::step(){
+    if (slot_ == 0) plan();
+    for (Heater * h : heaters_){
+      bool on = h->on[slot_];
+      // Everything is rewritten at the top of a window, so a heater released after a trip is back within one
+      if (on != h->driven || slot_ == 0){
+	h->gate->drive(on);
+	h->driven = on;
+      }
+    }
+    slot_ = (slot_ + 1) % budget_.slots;
+  }
+
+  void PowerScheduler::start(){
+    if (running_) return;
+    running_ = true;
+    thread_ = std::thread(&PowerScheduler::loop, this);
+
+    // Just below the supervisors, which can always cut a heater. Needs privileges like theirs.
+    sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    pthread_setschedparam(thread_.native_handle(), SCHED_FIFO, &param);
+  }
+
+  void PowerScheduler::stop(){
+    if (!running_) return;
+    running_ = false;
+    thread_.join();
+    // Nothing is switching them any more
+    for (Heater * h : heaters_){
+      h->gate->drive(false);
+      h->driven = false;
+    }
+  }
+
+  void PowerScheduler::loop(){
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration period =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(Duration(slotSec()));
+    while (running_){
+      step();
+      next += period;
+      std::this_thread::sleep_until(next);
+    }
+  }
+
+  PowerScheduler::~PowerScheduler(){
+    stop();
+    // The gates may outlive the scheduler and go back to plain PWM
+    for (Heater * h : heaters_){
+      h->gate->setScheduler(NULL, 0);
+      delete h;
+    }
+  }
+}
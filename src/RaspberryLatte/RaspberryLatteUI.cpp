@@ -1,9 +1,20 @@
 #include "../../include/RaspberryLatte/RaspberryLatteUI.hpp"
 #include "../../include/RaspberryLatte/EspressoMachine.hpp"
-#include "../../include/RaspberryLatte/Boiler.hpp"
 #include "../../include/RaspberryLatte/strings.h"
 
-namespace RaspLatte{    
+#include <algorithm>
+#include <cmath>
+
+namespace RaspLatte{
+  namespace {
+    // Trend chart geometry. One column per bucket, the newest on the right
+    const int TREND_ROWS = 6; /** Temperature rows */
+    const int TREND_LEFT = 10;
+    const int TREND_COLS = 68;
+    const int TREND_LINES = 11; /** Of the window, border included */
+    const char PWM_LEVELS[] = " .:-=+*#%@";
+  }
+
   void RaspberryLatteUI::updateGeneralWindow(bool init){
     if (init){
       // Clear, border and title
@@ -19,33 +30,33 @@ namespace RaspLatte{
       mvwaddstr(general_win_, 5, 10, "|-----------------------------|-----------------------------|");
     }
       
-    if(machine_->currentMode() == OFF) mvwaddstr(general_win_, 2, 16, "Off");
+    if(state_.mode == OFF) mvwaddstr(general_win_, 2, 16, "Off");
     else mvwaddstr(general_win_, 2, 16, "On ");
 
-    if(machine_->currentMode() == STEAM) mvwaddstr(general_win_, 2, 42, "Steam");
+    if(state_.mode == STEAM) mvwaddstr(general_win_, 2, 42, "Steam");
     else mvwaddstr(general_win_, 2, 42, "Brew ");
       
-    if(machine_->pumpOn()) mvwaddstr(general_win_, 2, 68, "On ");
+    if(state_.pump_on) mvwaddstr(general_win_, 2, 68, "On ");
     else mvwaddstr(general_win_, 2, 68, "Off");
 
     //Temp line
-    if(machine_->currentMode() == OFF){
-      mvwprintw(general_win_, 4, 33, "Setpoint - NA   ", machine_->setpoint());
+    if(state_.mode == OFF){
+      mvwprintw(general_win_, 4, 33, "Setpoint - NA   ", state_.setpoint);
     } else {
-      int display_range = (((int)(0.15 * machine_->setpoint())/5)+1)*5;
-      mvwprintw(general_win_, 4, 9, "%0.0fC ", machine_->setpoint() - display_range);
-      mvwprintw(general_win_, 4, 33, "Setpoint - %0.2fC", machine_->setpoint());
-      mvwprintw(general_win_, 4, 68, "%0.0fC ", machine_->setpoint() + display_range);
+      int display_range = (((int)(0.15 * state_.setpoint)/5)+1)*5;
+      mvwprintw(general_win_, 4, 9, "%0.0fC ", state_.setpoint - display_range);
+      mvwprintw(general_win_, 4, 33, "Setpoint - %0.2fC", state_.setpoint);
+      mvwprintw(general_win_, 4, 68, "%0.0fC ", state_.setpoint + display_range);
       mvwprintw(general_win_, 6, last_setpoint_slider_loc_, "         ");
 
       // Current temp pointer
-      double current_temp = boiler_->currentTemp();
+      double current_temp = state_.temp;
       if(current_temp == MAX31855_TEMP_UNAVALIBLE){
 	mvwaddch(general_win_, 6, 10, ACS_UARROW);
 	wprintw(general_win_, " NA C");
       } else {
 	double delta_t = 2*display_range/60.;
-	double err = current_temp - (machine_->setpoint()-display_range);
+	double err = current_temp - (state_.setpoint-display_range);
 	int offset = err/delta_t;
 	offset = (offset < 0 ? 0 : offset);
 	offset = (offset > 60 ? 60 : offset);
@@ -54,7 +65,11 @@ namespace RaspLatte{
 	last_setpoint_slider_loc_ = 10 + offset;
       }
     }
-    mvwprintw(general_win_, 7, 20, "%0.2fC", cpu_thermo_.getTemp());
+    if (health_ != NULL){
+      SystemHealth::HealthSnapshot s = health_->snapshot();
+      mvwprintw(general_win_, 7, 10, "CPU %0.1fC  Load %3.0f%%  RSS %0.1fMB  %-9s", s.cpu_temp, 100*s.load,
+		s.rss_kb/1024., (s.throttled ? "THROTTLED" : ""));
+    }
     wrefresh(general_win_);
   }
     
@@ -66,30 +81,136 @@ namespace RaspLatte{
       mvwaddstr(boiler_win_, 0, 34, " PID Status ");
 
       // PWM output line
-      mvwprintw(boiler_win_, 1, 32, "PWM Output - %0.0f  ", boiler_->currentPWM());
-      mvwprintw(boiler_win_, 3, 7, "Setpoint - %0.2f    ", boiler_->setpoint());
-      mvwprintw(boiler_win_, 3, 32, "Current - %0.2f    ", boiler_->currentTemp());
-      mvwprintw(boiler_win_, 3, 58, "Error - %0.2f    ", boiler_->setpoint() - boiler_->currentTemp());
-      mvwprintw(boiler_win_, 4, 7, "Error Sum - %0.2f    ", boiler_->errorSum());
-      mvwprintw(boiler_win_, 4, 32, "Slope - %0.2f    ", boiler_->errorSlope());
+      mvwprintw(boiler_win_, 1, 32, "PWM Output - %0.0f  ", state_.pwm);
+      mvwprintw(boiler_win_, 3, 7, "Setpoint - %0.2f    ", state_.boiler_setpoint);
+      mvwprintw(boiler_win_, 3, 32, "Current - %0.2f    ", state_.temp);
+      mvwprintw(boiler_win_, 3, 58, "Error - %0.2f    ", state_.boiler_setpoint - state_.temp);
+      mvwprintw(boiler_win_, 4, 7, "Error Sum - %0.2f    ", state_.error_sum);
+      mvwprintw(boiler_win_, 4, 32, "Slope - %0.2f    ", state_.slope);
     }
     else {
-      mvwprintw(boiler_win_, 1, 45, "%0.0f   ", boiler_->currentPWM());
-      mvwprintw(boiler_win_, 3, 18, "%0.2f    ", boiler_->setpoint());
-      mvwprintw(boiler_win_, 3, 42, "%0.2f    ", boiler_->currentTemp());
-      mvwprintw(boiler_win_, 3, 66, "%0.2f    ", boiler_->setpoint() - boiler_->currentTemp());
-      mvwprintw(boiler_win_, 4, 19, "%0.2f    ", boiler_->errorSum());
-      mvwprintw(boiler_win_, 4, 40, "%0.2f    ", boiler_->errorSlope());
+      mvwprintw(boiler_win_, 1, 45, "%0.0f   ", state_.pwm);
+      mvwprintw(boiler_win_, 3, 18, "%0.2f    ", state_.boiler_setpoint);
+      mvwprintw(boiler_win_, 3, 42, "%0.2f    ", state_.temp);
+      mvwprintw(boiler_win_, 3, 66, "%0.2f    ", state_.boiler_setpoint - state_.temp);
+      mvwprintw(boiler_win_, 4, 19, "%0.2f    ", state_.error_sum);
+      mvwprintw(boiler_win_, 4, 40, "%0.2f    ", state_.slope);
     }
+
+    // Safety trip line, blank unless the supervisor has cut the heater
+    SafetySupervisor * supervisor = machine_->supervisor();
+    if (supervisor->tripped())
+      mvwprintw(boiler_win_, 6, 7, "HEATER CUT - %-20s", SafetySupervisor::tripName(supervisor->trip()));
+    else
+      mvwprintw(boiler_win_, 6, 7, "%-33s", "");
       
     wrefresh(boiler_win_);
   }
+
+  void RaspberryLatteUI::updateTrendWindow(bool init){
+    if (trend_win_ == NULL) return;
+    const TrendHistory * trend = &trend_;
+    double res = TrendHistory::resolution(trend_level_);
+    if (init){
+      // Clear, border and title
+      wclear(trend_win_);
+      wborder(trend_win_, '#', '#', '-','=','#','#','#','#');
+      mvwprintw(trend_win_, 0, 31, " Trend - %0.0fs each ", res);
+      mvwaddstr(trend_win_, TREND_ROWS + 1, 5, "PWM");
+
+      // Time axis and key
+      double span = TREND_COLS*res;
+      if (span < 120) mvwprintw(trend_win_, TREND_ROWS + 2, TREND_LEFT, "-%0.0fs", span);
+      else if (span < 7200) mvwprintw(trend_win_, TREND_ROWS + 2, TREND_LEFT, "-%0.0f min", span/60);
+      else mvwprintw(trend_win_, TREND_ROWS + 2, TREND_LEFT, "-%0.1f h", span/3600);
+      mvwaddstr(trend_win_, TREND_ROWS + 2, TREND_LEFT + TREND_COLS - 3, "now");
+      mvwaddstr(trend_win_, TREND_ROWS + 3, TREND_LEFT, "* mean  : min to max  - setpoint        't' - resolution");
+    }
+
+    // Scale to the temperature and setpoint on screen, at least 2C
+    double lo, hi, sp_lo, sp_hi;
+    bool temps = trend->range(trend_level_, TrendHistory::TEMP, TREND_COLS, lo, hi);
+    if (trend->range(trend_level_, TrendHistory::SETPOINT, TREND_COLS, sp_lo, sp_hi)){
+      lo = (temps ? std::min(lo, sp_lo) : sp_lo);
+      hi = (temps ? std::max(hi, sp_hi) : sp_hi);
+    }
+    else if (!temps){
+      lo = 0;
+      hi = 0;
+    }
+    if (hi - lo < 2){
+      double mid = (hi + lo)/2;
+      lo = mid - 1;
+      hi = mid + 1;
+    }
+    double row_c = (hi - lo)/TREND_ROWS;
+    mvwprintw(trend_win_, 1, 2, "%6.1fC", hi);
+    mvwprintw(trend_win_, TREND_ROWS, 2, "%6.1fC", lo);
+
+    for (int col = 0; col < TREND_COLS; col++){
+      int x = TREND_LEFT + col;
+      int age = TREND_COLS - 1 - col;
+      char cells[TREND_ROWS + 1];
+      for (int r = 0; r <= TREND_ROWS; r++) cells[r] = ' ';
+      if (age < trend->size(trend_level_)){
+	const TrendHistory::Bucket & b = trend->bucket(trend_level_, age);
+	auto row = [&](double v){ return std::max(0, std::min(TREND_ROWS - 1, (int)((hi - v)/row_c))); };
+	const TrendHistory::Aggregate & t = b.series[TrendHistory::TEMP];
+	if (t.count){
+	  for (int r = row(t.max); r <= row(t.min); r++) cells[r] = ':';
+	  cells[row(t.mean())] = '*';
+	}
+	const TrendHistory::Aggregate & sp = b.series[TrendHistory::SETPOINT];
+	if (sp.count && cells[row(sp.mean())] == ' ') cells[row(sp.mean())] = '-';
+	const TrendHistory::Aggregate & pwm = b.series[TrendHistory::PWM];
+	if (pwm.count){
+	  int level = (int)std::lround(pwm.mean()/255*(sizeof(PWM_LEVELS) - 2));
+	  cells[TREND_ROWS] = PWM_LEVELS[std::max(0, std::min((int)sizeof(PWM_LEVELS) - 2, level))];
+	}
+      }
+      for (int r = 0; r <= TREND_ROWS; r++) mvwaddch(trend_win_, 1 + r, x, cells[r]);
+    }
+    wrefresh(trend_win_);
+  }
+    
+  void RaspberryLatteUI::handleKeyPress(int key){
+    double increment;
+    switch(key){
+    case KEY_UP:
+      increment = 1;
+      break;
+    case KEY_DOWN:
+      increment = -1;
+      break;
+    case KEY_LEFT:
+      increment = -0.25;
+      break;
+    case KEY_RIGHT:
+      increment = 0.25;
+      break;
+    case 't':
+      trend_level_ = (trend_level_ + 1) % TrendHistory::LEVELS;
+      updateTrendWindow();
+      return;
+    default:
+      return;
+    }
+    MachineMode mode = state_.mode;
+    if (mode != OFF) machine_->commands()->push({Command::ADJUST_SETPOINT, mode, increment, {0, 0, 0}}); // Dropped if full
+  }
     
-  RaspberryLatteUI::RaspberryLatteUI(EspressoMachine * machine, Boiler * boiler): machine_(machine), boiler_(boiler){}
+  RaspberryLatteUI::RaspberryLatteUI(EspressoMachine * machine, SystemHealth * health): machine_(machine),
+											  health_(health){}
+
+  void RaspberryLatteUI::readMachine(){
+    machine_->panelState()->read(state_);
+    machine_->panelTrend()->read(trend_);
+  }
 
   void RaspberryLatteUI::init(){
     //Set up stuff for ncurses
     initscr();
+    initialized_ = true;
     cbreak();
     noecho();
     curs_set(0);
@@ -98,23 +219,33 @@ namespace RaspLatte{
     header_win_ = newwin(11, 80, 0, 0);
     general_win_ = newwin(8, 80, 11, 0);
     boiler_win_ = newwin(8, 80, 19, 0);
+    if (LINES >= 27 + TREND_LINES) trend_win_ = newwin(TREND_LINES, 80, 27, 0);
 
     keypad(general_win_, TRUE);
 
     wtimeout(general_win_,500);
       
     //Init the screens and refresh
+    readMachine();
     mvwaddstr(header_win_, 0, 0, HEADER_STR[0]);
     wrefresh(header_win_);
 
     updateGeneralWindow();
     updateBoilerWindow();
+    updateTrendWindow();
   }
     
-  int RaspberryLatteUI::refresh(){
+  bool RaspberryLatteUI::refresh(){
     int key_press = wgetch(general_win_);
+    handleKeyPress(key_press);
+    readMachine();
     updateGeneralWindow(false);
     updateBoilerWindow(false);
-    return key_press;
+    updateTrendWindow(false);
+    return key_press != 'q';
+  }
+
+  RaspberryLatteUI::~RaspberryLatteUI(){
+    if (initialized_) endwin();
   }
 }
@@ -0,0 +1,163 @@
+#include "../../include/RaspberryLatte/SafetySupervisor.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cmath>
+
+namespace RaspLatte{
+  SafetySupervisor::SafetyLimits SafetySupervisor::defaultLimits(){
+    // The MAX31855 converts every ~100ms so there is nothing to gain from sampling faster
+    return {.period_sec = 0.1, .max_temp = 165, .max_rate = 15, .stale_sec = 0.5, .cpu_max = 80,
+	    .control_timeout_sec = 3, .recovery_sec = 2, .idle_period_sec = 0.25};
+  }
+
+  const char * SafetySupervisor::tripName(Trip trip){
+    switch(trip){
+    case SENSOR_FAULT: return "Thermocouple fault";
+    case RATE_OF_CHANGE: return "Temperature glitch";
+    case OVER_TEMP: return "Boiler over-temperature";
+    case STALE_DATA: return "No temperature data";
+    case CPU_TEMP: return "CPU over-temperature";
+    case CONTROL_STALL: return "Control loop stalled";
+    default: return "OK";
+    }
+  }
+
+  SafetySupervisor::SafetySupervisor(MAX31855 * sensor, HeaterGate * gate, SafetyLimits limits, Clock * clock):
+    thermo_(sensor), gate_(gate), limits_(limits), clock_(clock), sensor_(this){
+    TimePoint now = clock_->now();
+    last_good_time_ = now;
+    last_sample_time_ = now;
+    last_cpu_check_ = now;
+    heartbeat_s_ = seconds(now);
+    poll(); // Have a reading ready before the controller is built
+  }
+
+  void SafetySupervisor::poll(){
+    std::chrono::steady_clock::time_point wall_start = std::chrono::steady_clock::now();
+    TimePoint now = clock_->now();
+    Trip found = NONE;
+    TimePoint due = now; // When the condition found should have been caught
+
+    // (a)-(c) Check the new sample
+    bool good = false;
+    double t = thermo_->read();
+    if (t == MAX31855_TEMP_UNAVALIBLE){
+      // A failed SPI transfer is no data this pass. It is caught by the stale check if it persists.
+      uint8_t err = thermo_->readError();
+      if (err && err != MAX31855_ERR_SPI_READ) found = SENSOR_FAULT;
+    } else {
+      double dt = Duration(now - last_sample_time_).count();
+      bool glitch = have_last_ && dt > 0 && std::fabs(t - last_temp_)/dt > limits_.max_rate;
+      have_last_ = true;
+      last_temp_ = t;
+      last_sample_time_ = now;
+      if (glitch) found = RATE_OF_CHANGE;
+      else {
+	good = true;
+	last_good_time_ = now;
+	if (t > limits_.max_temp) found = OVER_TEMP;
+      }
+    }
+    // A missed or glitched sample leaves the last good one in place until it goes stale, so the
+    // controller never sees a gap as a cold boiler
+    bool stale = now - last_good_time_ > Duration(limits_.stale_sec);
+    if (good) temp_ = t;
+    else if (found == SENSOR_FAULT || stale) temp_ = MAX31855_TEMP_UNAVALIBLE;
+
+    // (d) Stale data, or no good sample yet
+    if (found == NONE && stale){
+      found = STALE_DATA;
+      due = last_good_time_ + Duration(limits_.stale_sec);
+    }
+    if (found == NONE && temp_ == MAX31855_TEMP_UNAVALIBLE) found = STALE_DATA;
+
+    // (e) CPU temp. It only changes about once a second (see SystemHealth)
+    if (cpu_ != NULL && now - last_cpu_check_ >= Duration(1)){
+      last_cpu_check_ = now;
+      cpu_hot_ = (cpu_->read() > limits_.cpu_max);
+    }
+    if (found == NONE && cpu_hot_) found = CPU_TEMP;
+
+    // (f) Control loop heartbeat
+    TimePoint heartbeat = TimePoint(Duration(heartbeat_s_.load()));
+    if (found == NONE && now - heartbeat > Duration(limits_.control_timeout_sec)){
+      found = CONTROL_STALL;
+      due = heartbeat + Duration(limits_.control_timeout_sec);
+    }
+
+    if (found != NONE){
+      recovering_ = false;
+      if (!gate_->tripped()) cut(found, due, wall_start);
+      trip_ = found;
+    } else if (gate_->tripped()){
+      // Hold the heater off until every check has passed for the recovery time
+      if (!recovering_){
+	recovering_ = true;
+	good_since_ = now;
+      }
+      if (now - good_since_ >= Duration(limits_.recovery_sec)){
+	recovering_ = false;
+	trip_ = NONE;
+	gate_->release();
+      }
+    }
+
+    if (watchdog_ != NULL) watchdog_->kick();
+  }
+
+  void SafetySupervisor::cut(Trip reason, TimePoint due, std::chrono::steady_clock::time_point wall_start){
+    gate_->trip();
+    double processing = Duration(std::chrono::steady_clock::now() - wall_start).count();
+    double late = Duration(clock_->now() - due).count();
+    double reaction = (late > 0 ? late : 0) + processing;
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.trips++;
+    stats_.last_sec = reaction;
+    stats_.max_sec = std::fmax(stats_.max_sec, reaction);
+    stats_.mean_sec += (reaction - stats_.mean_sec)/stats_.trips;
+    last_trip_time_ = clock_->now();
+  }
+
+  TimePoint SafetySupervisor::lastTripTime(){
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return last_trip_time_;
+  }
+
+  SafetySupervisor::ReactionStats SafetySupervisor::reactionStats(){
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return stats_;
+  }
+
+  void SafetySupervisor::start(){
+    if (running_) return;
+    running_ = true;
+    thread_ = std::thread(&SafetySupervisor::loop, this);
+
+    // Run ahead of the control loop and UI. Needs privileges; pigpio already requires root.
+    sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    pthread_setschedparam(thread_.native_handle(), SCHED_FIFO, &param);
+  }
+
+  void SafetySupervisor::stop(){
+    if (!running_) return;
+    running_ = false;
+    thread_.join();
+  }
+
+  void SafetySupervisor::loop(){
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    while (running_){
+      poll();
+      next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(Duration(periodSec()));
+      std::this_thread::sleep_until(next);
+    }
+  }
+
+  SafetySupervisor::~SafetySupervisor(){
+    stop();
+  }
+}
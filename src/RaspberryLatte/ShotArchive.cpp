@@ -0,0 +1,610 @@
+#include "../../include/RaspberryLatte/ShotArchive.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+namespace RaspLatte{
+  namespace {
+    const char ARCHIVE_MAGIC[8] = {'R','L','S','H','O','T','S','1'};
+    const char INDEX_MAGIC[8] = {'R','L','S','H','I','D','X','1'};
+    const uint32_t BLOCK_MAGIC = 0x544F4853; // "SHOT"
+    const size_t META_BYTES = 8+4+4+2+1+1+8*4+4*4;
+    const size_t INDEX_RECORD_BYTES = 8 + META_BYTES;
+    const size_t BLOCK_HEADER_BYTES = 8;
+
+    enum Codec {DELTA_VARINT = 1, DELTA2_VARINT = 2, GORILLA = 3};
+
+    // ========================= Fixed width fields =========================
+    template <typename T>
+    void put(std::string & out, T v){
+      out.append((const char *)&v, sizeof(T));
+    }
+
+    template <typename T>
+    T get(const uint8_t *& p){
+      T v;
+      memcpy(&v, p, sizeof(T));
+      p += sizeof(T);
+      return v;
+    }
+
+    void putMeta(std::string & out, const ShotMeta & m){
+      put<int64_t>(out, m.start_ms);
+      put<uint32_t>(out, m.period_ms);
+      put<uint32_t>(out, m.samples);
+      put<uint16_t>(out, m.machine_id);
+      put<uint8_t>(out, m.mode);
+      put<uint8_t>(out, m.flags);
+      put<double>(out, m.setpoint);
+      put<double>(out, m.gains.p);
+      put<double>(out, m.gains.i);
+      put<double>(out, m.gains.d);
+      put<float>(out, m.pump_sec);
+      put<float>(out, m.mean_err);
+      put<float>(out, m.min_temp);
+      put<float>(out, m.max_overshoot);
+    }
+
+    ShotMeta getMeta(const uint8_t *& p){
+      ShotMeta m;
+      m.start_ms = get<int64_t>(p);
+      m.period_ms = get<uint32_t>(p);
+      m.samples = get<uint32_t>(p);
+      m.machine_id = get<uint16_t>(p);
+      m.mode = get<uint8_t>(p);
+      m.flags = get<uint8_t>(p);
+      m.setpoint = get<double>(p);
+      m.gains.p = get<double>(p);
+      m.gains.i = get<double>(p);
+      m.gains.d = get<double>(p);
+      m.pump_sec = get<float>(p);
+      m.mean_err = get<float>(p);
+      m.min_temp = get<float>(p);
+      m.max_overshoot = get<float>(p);
+      return m;
+    }
+
+    // ========================= Integer columns =========================
+    inline uint64_t zigzag(int64_t v){ return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+    inline int64_t unzigzag(uint64_t v){ return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+    inline void putVarint(std::string & out, uint64_t v){
+      while (v >= 0x80){
+	out.push_back((char)(v | 0x80));
+	v >>= 7;
+      }
+      out.push_back((char)v);
+    }
+
+    inline bool getVarint(const uint8_t *& p, const uint8_t * end, uint64_t & v){
+      v = 0;
+      for (int shift = 0; shift < 64 && p < end; shift += 7){
+	uint8_t b = *p++;
+	v |= (uint64_t)(b & 0x7F) << shift;
+	if (!(b & 0x80)) return true;
+      }
+      return false;
+    }
+
+    /** order 1 stores deltas, order 2 deltas of deltas */
+    template <typename T>
+    void encodeInts(std::string & out, const T * v, uint32_t n, int order){
+      int64_t prev = 0, prev_delta = 0;
+      for (uint32_t i = 0; i < n; i++){
+	int64_t x = (int64_t)v[i];
+	int64_t delta = x - prev;
+	putVarint(out, zigzag(order == 2 ? delta - prev_delta : delta));
+	prev = x;
+	prev_delta = delta;
+      }
+    }
+
+    template <typename T>
+    bool decodeInts(const uint8_t * p, const uint8_t * end, T * v, uint32_t n, int order){
+      int64_t prev = 0, prev_delta = 0;
+      for (uint32_t i = 0; i < n; i++){
+	uint64_t z;
+	if (!getVarint(p, end, z)) return false;
+	int64_t delta = unzigzag(z) + (order == 2 ? prev_delta : 0);
+	prev += delta;
+	prev_delta = delta;
+	v[i] = (T)prev;
+      }
+      return true;
+    }
+
+    // ========================= Gorilla float columns =========================
+    class BitWriter{
+    public:
+      BitWriter(std::string & out): out_(out){}
+      void write(uint64_t bits, int n){
+	// Most significant bit first
+	while (n > 0){
+	  int take = (n < 8 - used_ ? n : 8 - used_);
+	  uint64_t chunk = (bits >> (n - take)) & ((1ULL << take) - 1);
+	  acc_ = (uint8_t)(acc_ | (chunk << (8 - used_ - take)));
+	  used_ += take;
+	  n -= take;
+	  if (used_ == 8){
+	    out_.push_back((char)acc_);
+	    acc_ = 0;
+	    used_ = 0;
+	  }
+	}
+      }
+      void finish(){
+	if (used_) out_.push_back((char)acc_);
+	acc_ = 0;
+	used_ = 0;
+      }
+    private:
+      std::string & out_;
+      uint8_t acc_ = 0;
+      int used_ = 0;
+    };
+
+    class BitReader{
+    public:
+      BitReader(const uint8_t * p, const uint8_t * end): p_(p), end_(end){}
+      /** Read n (<= 64) bits. Reading past the end sets overrun() */
+      uint64_t read(int n){
+	uint64_t v = 0;
+	while (n > 0){
+	  if (avail_ == 0){
+	    if (p_ >= end_){
+	      overrun_ = true;
+	      return 0;
+	    }
+	    cur_ = *p_++;
+	    avail_ = 8;
+	  }
+	  int take = (n < avail_ ? n : avail_);
+	  v = (v << take) | ((cur_ >> (avail_ - take)) & ((1u << take) - 1));
+	  avail_ -= take;
+	  n -= take;
+	}
+	return v;
+      }
+      bool overrun(){ return overrun_; }
+    private:
+      const uint8_t * p_;
+      const uint8_t * end_;
+      uint8_t cur_ = 0;
+      int avail_ = 0;
+      bool overrun_ = false;
+    };
+
+    inline uint64_t bitsOf(double d){
+      uint64_t u;
+      memcpy(&u, &d, 8);
+      return u;
+    }
+
+    inline double doubleOf(uint64_t u){
+      double d;
+      memcpy(&d, &u, 8);
+      return d;
+    }
+
+    inline int clz64(uint64_t v){ return v ? __builtin_clzll(v) : 64; }
+    inline int ctz64(uint64_t v){ return v ? __builtin_ctzll(v) : 64; }
+
+    /**
+     * First value in full, then the XOR with the previous value:
+     *   '0'                               same value
+     *   '10' + meaningful bits            fits in the previous leading/trailing zero window
+     *   '11' + 5 bit leading zeros + 6 bit length - 1 + meaningful bits
+     */
+    void encodeFloats(std::string & out, const double * v, uint32_t n){
+      if (n == 0) return;
+      BitWriter bits(out);
+      uint64_t prev = bitsOf(v[0]);
+      bits.write(prev, 64);
+      int prev_lead = -1, prev_trail = 0;
+      for (uint32_t i = 1; i < n; i++){
+	uint64_t cur = bitsOf(v[i]);
+	uint64_t x = cur ^ prev;
+	prev = cur;
+	if (x == 0){
+	  bits.write(0, 1);
+	  continue;
+	}
+	int lead = clz64(x), trail = ctz64(x);
+	if (lead > 31) lead = 31;
+	if (prev_lead >= 0 && lead >= prev_lead && trail >= prev_trail){
+	  bits.write(2, 2);
+	  bits.write(x >> prev_trail, 64 - prev_lead - prev_trail);
+	} else {
+	  int len = 64 - lead - trail;
+	  bits.write(3, 2);
+	  bits.write(lead, 5);
+	  bits.write(len - 1, 6);
+	  bits.write(x >> trail, len);
+	  prev_lead = lead;
+	  prev_trail = trail;
+	}
+      }
+      bits.finish();
+    }
+
+    bool decodeFloats(const uint8_t * p, const uint8_t * end, double * v, uint32_t n){
+      if (n == 0) return true;
+      BitReader bits(p, end);
+      uint64_t prev = bits.read(64);
+      v[0] = doubleOf(prev);
+      int lead = 0, trail = 0;
+      for (uint32_t i = 1; i < n; i++){
+	if (bits.read(1) == 0){
+	  v[i] = v[i-1];
+	  continue;
+	}
+	if (bits.read(1) == 1){
+	  lead = (int)bits.read(5);
+	  int len = (int)bits.read(6) + 1;
+	  trail = 64 - lead - len;
+	}
+	uint64_t x = bits.read(64 - lead - trail) << trail;
+	prev ^= x;
+	v[i] = doubleOf(prev);
+      }
+      return !bits.overrun();
+    }
+
+    void putColumn(std::string & block, uint8_t id, uint8_t codec, const std::string & bytes){
+      put<uint8_t>(block, id);
+      put<uint8_t>(block, codec);
+      put<uint32_t>(block, (uint32_t)bytes.size());
+      block += bytes;
+    }
+  }
+
+  // ========================= ShotArchiveWriter =========================
+  ShotArchiveWriter::ShotArchiveWriter(const std::string & path): path_(path){}
+
+  bool ShotArchiveWriter::open(std::string & err){
+    data_ = fopen(path_.c_str(), "ab");
+    index_ = fopen((path_ + ".idx").c_str(), "ab");
+    if (data_ == NULL || index_ == NULL){
+      err = "could not open " + path_ + " for appending";
+      return false;
+    }
+    // Append mode starts at the end. Write the headers if the files are new.
+    fseek(data_, 0, SEEK_END);
+    fseek(index_, 0, SEEK_END);
+    offset_ = ftell(data_);
+    if (offset_ == 0){
+      fwrite(ARCHIVE_MAGIC, 1, sizeof(ARCHIVE_MAGIC), data_);
+      offset_ = sizeof(ARCHIVE_MAGIC);
+    }
+    if (ftell(index_) == 0) fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC), index_);
+    fflush(data_);
+    fflush(index_);
+    return true;
+  }
+
+  bool ShotArchiveWriter::append(const ShotMeta & meta, const ShotColumns & cols){
+    return append(meta, (uint32_t)cols.t_ms.size(), cols.t_ms.data(), cols.temp.data(), cols.setpoint.data(),
+		  cols.pwm.data(), cols.pump.data(), cols.weight.data());
+  }
+
+  bool ShotArchiveWriter::append(ShotMeta meta, uint32_t n, const int64_t * t_ms, const double * temp,
+				 const double * setpoint, const double * pwm, const uint8_t * pump, const double * weight){
+    if (data_ == NULL) return false;
+
+    // Summary for the index
+    meta.samples = n;
+    double err_sum = 0, min_temp = 0, overshoot = 0;
+    uint32_t pumping = 0;
+    bool pumped = false;
+    for (uint32_t i = 0; i < n; i++){
+      if (pump[i]){
+	err_sum += temp[i] - setpoint[i];
+	min_temp = (pumping == 0 || temp[i] < min_temp ? temp[i] : min_temp);
+	pumping++;
+	pumped = true;
+      } else if (pumped){
+	overshoot = std::fmax(overshoot, temp[i] - setpoint[i]);
+      }
+    }
+    meta.mean_err = (pumping ? err_sum/pumping : 0);
+    meta.min_temp = min_temp;
+    meta.max_overshoot = overshoot;
+
+    block_.clear();
+    putMeta(block_, meta);
+    put<uint8_t>(block_, 6);
+    column_.clear();
+    encodeInts(column_, t_ms, n, 2);
+    putColumn(block_, ShotColumns::T, DELTA2_VARINT, column_);
+    column_.clear();
+    encodeFloats(column_, temp, n);
+    putColumn(block_, ShotColumns::TEMP, GORILLA, column_);
+    column_.clear();
+    encodeFloats(column_, setpoint, n);
+    putColumn(block_, ShotColumns::SETPOINT, GORILLA, column_);
+    column_.clear();
+    encodeFloats(column_, pwm, n);
+    putColumn(block_, ShotColumns::PWM, GORILLA, column_);
+    column_.clear();
+    encodeInts(column_, pump, n, 1);
+    putColumn(block_, ShotColumns::PUMP, DELTA_VARINT, column_);
+    column_.clear();
+    encodeFloats(column_, weight, n);
+    putColumn(block_, ShotColumns::WEIGHT, GORILLA, column_);
+
+    std::string header;
+    put<uint32_t>(header, BLOCK_MAGIC);
+    put<uint32_t>(header, (uint32_t)block_.size());
+    std::string record;
+    put<uint64_t>(record, offset_);
+    putMeta(record, meta);
+
+    // Data first so an index record never points past the end of the archive
+    if (fwrite(header.data(), 1, header.size(), data_) != header.size() ||
+	fwrite(block_.data(), 1, block_.size(), data_) != block_.size()) return false;
+    fflush(data_);
+    if (fwrite(record.data(), 1, record.size(), index_) != record.size()) return false;
+    fflush(index_);
+    offset_ += header.size() + block_.size();
+    bytes_ += header.size() + block_.size() + record.size();
+    return true;
+  }
+
+  ShotArchiveWriter::~ShotArchiveWriter(){
+    if (data_ != NULL) fclose(data_);
+    if (index_ != NULL) fclose(index_);
+  }
+
+  // ========================= ShotArchiveReader =========================
+  ShotArchiveReader::ShotArchiveReader(const std::string & path): path_(path){}
+
+  bool ShotArchiveReader::open(std::string & err){
+    int fd = ::open(path_.c_str(), O_RDONLY);
+    if (fd < 0){
+      err = "could not open " + path_;
+      return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_ = st.st_size;
+    if (size_ < sizeof(ARCHIVE_MAGIC)){
+      ::close(fd);
+      err = path_ + " is not a shot archive";
+      return false;
+    }
+    void * m = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED){
+      err = "could not map " + path_;
+      return false;
+    }
+    base_ = (const uint8_t *)m;
+    madvise(m, size_, MADV_SEQUENTIAL);
+    if (memcmp(base_, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC))){
+      err = path_ + " is not a shot archive";
+      return false;
+    }
+
+    // Load the index. Only records that point inside the archive are trusted.
+    FILE * idx = fopen((path_ + ".idx").c_str(), "rb");
+    char magic[sizeof(INDEX_MAGIC)];
+    if (idx != NULL && fread(magic, 1, sizeof(magic), idx) == sizeof(magic) && !memcmp(magic, INDEX_MAGIC, sizeof(magic))){
+      uint8_t rec[INDEX_RECORD_BYTES];
+      while (fread(rec, 1, sizeof(rec), idx) == sizeof(rec)){
+	const uint8_t * p = rec;
+	Entry e;
+	e.offset = get<uint64_t>(p);
+	e.meta = getMeta(p);
+	if (e.offset + BLOCK_HEADER_BYTES > size_) break;
+	shots_.push_back(e);
+      }
+    }
+    if (idx != NULL) fclose(idx);
+
+    // The index must cover the archive block by block. If it is missing, short (i.e. a crash
+    // between the two writes) or was recreated on its own, rebuild it from the blocks.
+    uint64_t end = sizeof(ARCHIVE_MAGIC);
+    for (const Entry & e : shots_){
+      const uint8_t * p = base_ + e.offset;
+      if (e.offset != end || get<uint32_t>(p) != BLOCK_MAGIC) return rebuildIndex(err);
+      end += BLOCK_HEADER_BYTES + get<uint32_t>(p);
+    }
+    if (end != size_) return rebuildIndex(err);
+    return true;
+  }
+
+  bool ShotArchiveReader::rebuildIndex(std::string & err){
+    shots_.clear();
+    rebuilt_ = true;
+    uint64_t off = sizeof(ARCHIVE_MAGIC);
+    while (off + BLOCK_HEADER_BYTES + META_BYTES <= size_){
+      const uint8_t * p = base_ + off;
+      uint32_t magic = get<uint32_t>(p);
+      uint32_t len = get<uint32_t>(p);
+      if (magic != BLOCK_MAGIC){
+	err = "corrupt block in " + path_;
+	return false;
+      }
+      if (off + BLOCK_HEADER_BYTES + len > size_) break; // Torn final write
+      shots_.push_back({off, getMeta(p)});
+      off += BLOCK_HEADER_BYTES + len;
+    }
+    return true;
+  }
+
+  bool ShotArchiveReader::read(const Entry & shot, unsigned int mask, ShotColumns & cols){
+    // Every read below is checked against the end of the block first. Lengths are compared with
+    // what is left rather than added to a pointer, so a corrupt one can't wrap.
+    if (shot.offset > size_ || size_ - shot.offset < BLOCK_HEADER_BYTES) return false;
+    const uint8_t * p = base_ + shot.offset;
+    if (get<uint32_t>(p) != BLOCK_MAGIC) return false;
+    uint32_t block_len = get<uint32_t>(p);
+    if (block_len > (size_t)(base_ + size_ - p)) return false;
+    const uint8_t * end = p + block_len;
+    if ((size_t)(end - p) < META_BYTES + 1) return false;
+
+    // The columns are sized from the index, so it must agree with the block's own count
+    uint32_t n = shot.meta.samples;
+    if (getMeta(p).samples != n) return false;
+    uint8_t n_cols = get<uint8_t>(p);
+    for (uint8_t c = 0; c < n_cols; c++){
+      if (end - p < 6) return false;
+      uint8_t id = get<uint8_t>(p);
+      uint8_t codec = get<uint8_t>(p);
+      uint32_t len = get<uint32_t>(p);
+      if (len > (size_t)(end - p)) return false;
+      const uint8_t * col_end = p + len;
+      if (mask & id){
+	// Every sample takes at least a bit, so don't size a column from a count it can't hold
+	if (n > 8*(uint64_t)len) return false;
+	bool ok = false;
+	switch(id){
+	case ShotColumns::T:
+	  cols.t_ms.resize(n);
+	  ok = decodeInts(p, col_end, cols.t_ms.data(), n, codec == DELTA2_VARINT ? 2 : 1);
+	  break;
+	case ShotColumns::TEMP:
+	  cols.temp.resize(n);
+	  ok = decodeFloats(p, col_end, cols.temp.data(), n);
+	  break;
+	case ShotColumns::SETPOINT:
+	  cols.setpoint.resize(n);
+	  ok = decodeFloats(p, col_end, cols.setpoint.data(), n);
+	  break;
+	case ShotColumns::PWM:
+	  cols.pwm.resize(n);
+	  ok = decodeFloats(p, col_end, cols.pwm.data(), n);
+	  break;
+	case ShotColumns::PUMP:
+	  cols.pump.resize(n);
+	  ok = decodeInts(p, col_end, cols.pump.data(), n, 1);
+	  break;
+	case ShotColumns::WEIGHT:
+	  cols.weight.resize(n);
+	  ok = decodeFloats(p, col_end, cols.weight.data(), n);
+	  break;
+	default:
+	  ok = true; // Column from a newer writer. Skip it.
+	}
+	if (!ok) return false;
+      }
+      p = col_end;
+    }
+    return true;
+  }
+
+  ShotArchiveReader::~ShotArchiveReader(){
+    if (base_ != NULL) munmap((void *)base_, size_);
+  }
+
+  // ========================= ShotRecorder =========================
+  ShotRecorder::ShotRecorder(ShotArchiveWriter * writer, int64_t unix_ms_at_zero, uint16_t machine_id):
+    writer_(writer), unix_ms_at_zero_(unix_ms_at_zero), machine_id_(machine_id), slots_(new Slot[SLOTS]){}
+
+  int64_t ShotRecorder::wallOffsetMs(Clock * clock){
+    int64_t unix_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+    return unix_ms - (int64_t)std::llround(Duration(clock->now().time_since_epoch()).count()*1000);
+  }
+
+  void ShotRecorder::update(TimePoint t, bool pump_on, double temp, double setpoint, double pwm, double weight,
+			    MachineMode mode, const PID::PIDGains & gains, bool scheduled){
+    bool started = (pump_on && !last_pump_);
+    if (!pump_on && last_pump_) pump_off_time_ = t;
+    last_pump_ = pump_on;
+
+    // A new shot, or the recovery window has run out
+    if (current_ != NULL && (started || (!pump_on && t - pump_off_time_ >= Duration(POST_SHOT_SEC)))) finish();
+    if (started){
+      for (int i = 0; i < SLOTS && current_ == NULL; i++){
+	int expected = FREE;
+	if (slots_[i].state.compare_exchange_strong(expected, FILLING)) current_ = &slots_[i];
+      }
+      if (current_ == NULL){
+	dropped_++;
+	return;
+      }
+      shot_start_ = t;
+      ShotMeta & m = current_->meta;
+      m = ShotMeta();
+      m.start_ms = unix_ms_at_zero_ + (int64_t)std::llround(Duration(t.time_since_epoch()).count()*1000);
+      m.machine_id = machine_id_;
+      m.mode = mode;
+      m.flags = (scheduled ? ShotMeta::FLAG_SCHEDULED : 0);
+      m.setpoint = setpoint;
+      m.gains = gains;
+      current_->n = 0;
+    }
+    if (current_ == NULL) return;
+
+    Slot & s = *current_;
+    if (s.n >= (uint32_t)MAX_SAMPLES) return;
+    uint32_t i = s.n++;
+    s.t_ms[i] = (int64_t)std::llround(Duration(t - shot_start_).count()*1000);
+    s.temp[i] = temp;
+    s.setpoint[i] = setpoint;
+    s.pwm[i] = pwm;
+    s.pump[i] = pump_on;
+    s.weight[i] = weight;
+    if (pump_on) s.meta.pump_sec = (float)Duration(t - shot_start_).count();
+    if (i == 1) s.meta.period_ms = (uint32_t)s.t_ms[1];
+  }
+
+  void ShotRecorder::finish(){
+    current_->state.store(READY, std::memory_order_release);
+    current_ = NULL;
+    ready_.notify_one();
+  }
+
+  void ShotRecorder::flush(){
+    for (int i = 0; i < SLOTS; i++){
+      Slot & s = slots_[i];
+      if (s.state.load(std::memory_order_acquire) != READY) continue;
+      if (writer_->append(s.meta, s.n, s.t_ms, s.temp, s.setpoint, s.pwm, s.pump, s.weight)) recorded_++;
+      else dropped_++;
+      s.state.store(FREE, std::memory_order_release);
+    }
+  }
+
+  void ShotRecorder::start(){
+    if (running_) return;
+    running_ = true;
+    thread_ = std::thread(&ShotRecorder::loop, this);
+  }
+
+  void ShotRecorder::stop(){
+    if (running_){
+      running_ = false;
+      ready_.notify_one();
+      thread_.join();
+    }
+    // Nothing is updating the shot still open, so it can be finished here
+    if (current_ != NULL){
+      current_->meta.flags |= ShotMeta::FLAG_CUT_SHORT;
+      finish();
+    }
+    flush();
+  }
+
+  void ShotRecorder::loop(){
+    while (running_){
+      {
+	// The control loop notifies without the lock so a missed wakeup is caught by the timeout
+	std::unique_lock<std::mutex> lock(mutex_);
+	ready_.wait_for(lock, std::chrono::seconds(1));
+      }
+      flush();
+    }
+  }
+
+  ShotRecorder::~ShotRecorder(){
+    stop();
+    delete [] slots_;
+  }
+}
@@ -0,0 +1,287 @@
+#include "../../include/RaspberryLatte/Simulation.hpp"
+
+#include <cmath>
+#include <thread>
+
+namespace RaspLatte{
+  // ========================= BoilerPlant =========================
+  BoilerPlant::PlantParams BoilerPlant::defaultParams(){
+    // 1300W element, boiler and group lumped together, ~70W idle loss at brew temp, 2ml/s of pump flow
+    return {.heater_watts = 1300, .heat_capacity = 2500, .loss_w_per_c = 1.0, .ambient = 20,
+	    .pump_w_per_c = 8.4, .inlet_temp = 20, .element_capacity = 0, .element_coupling = 0,
+	    .group_capacity = 0, .group_coupling = 0, .group_loss_w_per_c = 0};
+  }
+
+  BoilerPlant::PlantParams BoilerPlant::groupHeadParams(){
+    // A 1kg brass group bolted under the boiler. It sits about 10C under the water at brew temp
+    // and takes about 5 minutes to follow it.
+    PlantParams p = defaultParams();
+    p.heat_capacity = 2100;
+    p.loss_w_per_c = 0.6;
+    p.group_capacity = 400;
+    p.group_coupling = 1.1;
+    p.group_loss_w_per_c = 0.15;
+    return p;
+  }
+
+  BoilerPlant::BoilerPlant(PlantParams params, double initial_temp): params_(params), temp_(initial_temp),
+								     element_temp_(initial_temp), group_temp_(initial_temp){}
+
+  void BoilerPlant::advance(Duration dt, double heater_fraction, bool pump_on){
+    if (dt.count() <= 0) return;
+    double heat = params_.heater_watts * heater_fraction;
+    double pump = (pump_on ? params_.pump_w_per_c : 0);
+    // The group head is held where it is while the water moves, then follows the water. It is
+    // much slower than the steps the plant is advanced by.
+    double group = (params_.group_capacity > 0 ? params_.group_coupling : 0);
+    double water_before = temp_;
+    if (params_.element_capacity > 0){
+      advanceTwoNode(dt.count(), heat, pump, group);
+    } else {
+      // C dT/dt = heat - loss*(T - ambient) - pump*(T - inlet) - group*(T - group_temp), which
+      // relaxes exponentially to t_ss
+      double k = (params_.loss_w_per_c + pump + group) / params_.heat_capacity;
+      double b = (heat + params_.loss_w_per_c*params_.ambient + pump*params_.inlet_temp + group*group_temp_)
+	/ params_.heat_capacity;
+      if (k > 0){
+	double t_ss = b/k;
+	temp_ = t_ss + (temp_ - t_ss)*std::exp(-k*dt.count());
+      } else {
+	temp_ += b*dt.count();
+      }
+    }
+    if (params_.group_capacity > 0) advanceGroup(dt.count(), (water_before + temp_)/2, pump);
+    heater_joules_ += heat*dt.count();
+  }
+
+  void BoilerPlant::advanceGroup(double dt, double water_temp, double pump){
+    // Cg dTg/dt = (coupling + pump)*(Tw - Tg) - loss*(Tg - ambient)
+    double in = params_.group_coupling + pump;
+    double k = (in + params_.group_loss_w_per_c)/params_.group_capacity;
+    double t_ss = (in*water_temp + params_.group_loss_w_per_c*params_.ambient)/(in + params_.group_loss_w_per_c);
+    group_temp_ = t_ss + (group_temp_ - t_ss)*std::exp(-k*dt);
+  }
+
+  void BoilerPlant::advanceTwoNode(double dt, double heat, double pump, double group){
+    // x' = A x + b for x = (element, water). Both eigenvalues of A are real and negative.
+    double ce = params_.element_capacity, cw = params_.heat_capacity, h = params_.element_coupling;
+    double a11 = -h/ce, a12 = h/ce;
+    double a21 = h/cw, a22 = -(h + params_.loss_w_per_c + pump + group)/cw;
+    double b1 = heat/ce, b2 = (params_.loss_w_per_c*params_.ambient + pump*params_.inlet_temp + group*group_temp_)/cw;
+
+    // Steady state x_ss = -A^-1 b, then x(dt) = x_ss + e^(A dt) (x - x_ss)
+    double det = a11*a22 - a12*a21;
+    double ss1 = -(a22*b1 - a12*b2)/det, ss2 = -(-a21*b1 + a11*b2)/det;
+    double d1 = element_temp_ - ss1, d2 = temp_ - ss2;
+
+    // e^(A dt) = c0 I + c1 A by Sylvester's formula, or its limit when the eigenvalues meet
+    double tr = a11 + a22;
+    double disc = std::sqrt(std::fmax(tr*tr/4 - det, 0));
+    double l1 = tr/2 + disc, l2 = tr/2 - disc;
+    double c0, c1;
+    if (l1 - l2 > 1e-12){
+      double e1 = std::exp(l1*dt), e2 = std::exp(l2*dt);
+      c0 = (l1*e2 - l2*e1)/(l1 - l2);
+      c1 = (e1 - e2)/(l1 - l2);
+    } else {
+      double e = std::exp(l1*dt);
+      c0 = e*(1 - l1*dt);
+      c1 = e*dt;
+    }
+    element_temp_ = ss1 + (c0 + c1*a11)*d1 + c1*a12*d2;
+    temp_ = ss2 + c1*a21*d1 + (c0 + c1*a22)*d2;
+  }
+
+  // ========================= SimulatedBackend =========================
+  SimulatedBackend::SimulatedBackend(Clock * clock, BoilerPlant * plant, PinIndex heater_pin):
+    clock_(clock), plant_(plant), heater_pin_(heater_pin), last_sync_(clock->now()){}
+
+  void SimulatedBackend::sync(){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    TimePoint now = clock_->now();
+    if (now > last_sync_){
+      double dt = Duration(now - last_sync_).count();
+      double fraction = pwmDuty(heater_pin_)/255.;
+      auto wave = waves_.find(heater_pin_);
+      if (wave != waves_.end()){
+	const Wave & w = wave->second;
+	double from = Duration(last_sync_ - w.start).count(), to = Duration(now - w.start).count();
+	fraction = (w.onSec(to) - w.onSec(from))/dt;
+      }
+      plant_->advance(now - last_sync_, fraction, pump_on_);
+      heater_on_sec_ += fraction*dt;
+      last_sync_ = now;
+    }
+  }
+
+  double SimulatedBackend::Wave::onSec(double t) const{
+    double periods = std::floor(t/period_sec);
+    double on = periods*on_sec;
+    double rest = t - periods*period_sec;
+    for (const WavePulse & p : pulses){
+      if (rest <= 0) break;
+      double d = std::fmin(rest, p.us/1e6);
+      if (p.on) on += d;
+      rest -= d;
+    }
+    return on;
+  }
+  
+  void SimulatedBackend::setInput(PinIndex p, Pull pull){
+    // Floating inputs settle to their pull unless something has already set them
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (!levels_.count(p)) levels_[p] = (pull == PULL_UP);
+  }
+
+  int SimulatedBackend::read(PinIndex p){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto it = levels_.find(p);
+    return (it == levels_.end() ? 0 : it->second);
+  }
+
+  void SimulatedBackend::write(PinIndex p, bool level){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    levels_[p] = level;
+  }
+
+  void SimulatedBackend::pwm(PinIndex p, unsigned int duty){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    sync(); // The old duty applies up to now
+    waves_.erase(p);
+    duty_[p] = (duty > 255 ? 255 : duty);
+  }
+
+  bool SimulatedBackend::wave(PinIndex p, const WavePulse * pulses, unsigned int count){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    sync();
+    if (count == 0){
+      waves_.erase(p);
+      duty_[p] = 0;
+      return true;
+    }
+    if (count > MAX_WAVE_PULSES) return false;
+    Wave & w = waves_[p];
+    w.pulses.assign(pulses, pulses + count); // Keeps its capacity from the last waveform
+    w.period_sec = 0;
+    w.on_sec = 0;
+    for (unsigned int i = 0; i < count; i++){
+      w.period_sec += pulses[i].us/1e6;
+      if (pulses[i].on) w.on_sec += pulses[i].us/1e6;
+    }
+    w.start = clock_->now();
+    duty_[p] = (w.period_sec > 0 ? (unsigned int)std::lround(255*w.on_sec/w.period_sec) : 0);
+    return true;
+  }
+
+  int SimulatedBackend::spiRead(int handle, char * buf, unsigned int count){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    sync();
+    spi_reads_++;
+    if (spi_failures_ > 0){
+      spi_failures_--;
+      return -1;
+    }
+    bool group = (handle == group_channel_);
+    uint8_t fault = (group ? group_fault_ : fault_);
+    uint32_t frame;
+    if (fault){
+      frame = 0x10000 | (fault & 0x7); // Fault bit plus the cause
+    } else {
+      // 14 bit thermocouple temp in 0.25C steps and 12 bit chip temp in 0.0625C steps
+      long thermo = std::lround((group ? plant_->groupTemp() : plant_->temp())/0.25);
+      thermo = (thermo > 8191 ? 8191 : (thermo < -8192 ? -8192 : thermo));
+      long chip = std::lround(30/0.0625);
+      frame = ((uint32_t)(thermo & 0x3FFF) << 18) | ((uint32_t)(chip & 0xFFF) << 4);
+    }
+    for (unsigned int i = 0; i < count; i++){
+      buf[i] = (i < 4 ? (char)((frame >> (24 - 8*i)) & 0xFF) : 0);
+    }
+    return count;
+  }
+
+  void SimulatedBackend::setInputLevel(PinIndex p, bool level){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    levels_[p] = level;
+  }
+
+  void SimulatedBackend::setPump(bool on){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    sync();
+    pump_on_ = on;
+  }
+
+  bool SimulatedBackend::outputLevel(PinIndex p){
+    return read(p) == 1;
+  }
+  
+  unsigned int SimulatedBackend::pwmDuty(PinIndex p){
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto it = duty_.find(p);
+    return (it == duty_.end() ? 0 : it->second);
+  }
+
+  // ========================= PowerMeter =========================
+  void PowerMeter::add(SimulatedBackend * gpio, PinIndex heater_pin, double watts){
+    heaters_.push_back({gpio, heater_pin, watts});
+  }
+
+  void PowerMeter::sample(){
+    double peak = 0, mean = 0;
+    for (const Heater & h : heaters_){
+      unsigned int duty = h.gpio->pwmDuty(h.pin);
+      if (duty > 0) peak += h.watts;
+      mean += h.watts*duty/255.;
+    }
+    peak_ = peak;
+    if (peak > max_) max_ = peak;
+    watt_sum_ += mean;
+    samples_++;
+    if (limit_ > 0 && peak > limit_) over_++;
+  }
+
+  // ========================= Simulation =========================
+  void Simulation::at(TimePoint t, std::function<void()> fn){
+    events_.push({t, next_seq_++, fn});
+  }
+
+  void Simulation::after(double sec, std::function<void()> fn){
+    at(clock_->now() + Duration(sec), fn);
+  }
+
+  void Simulation::every(double period_sec, std::function<void()> fn){
+    periodic(clock_->now(), Duration(period_sec), 0, fn);
+  }
+
+  void Simulation::periodic(TimePoint start, Duration period, uint64_t n, std::function<void()> fn){
+    // Times are start + n*period rather than a running sum so they never drift
+    at(start + period*(double)n, [this, start, period, n, fn](){
+	fn();
+	periodic(start, period, n+1, fn);
+      });
+  }
+
+  void Simulation::runUntil(TimePoint end){
+    std::chrono::steady_clock::time_point wall_start = std::chrono::steady_clock::now();
+    TimePoint sim_start = clock_->now();
+    auto pace = [&](TimePoint t){
+      if (realtime_){
+	std::this_thread::sleep_until(wall_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(t - sim_start));
+      }
+    };
+    
+    while (!events_.empty() && events_.top().t <= end){
+      Event ev = events_.top();
+      events_.pop();
+      pace(ev.t);
+      clock_->advanceTo(ev.t);
+      ev.fn();
+      events_run_++;
+    }
+    pace(end);
+    clock_->advanceTo(end);
+  }
+
+  void Simulation::runFor(double sec){
+    runUntil(clock_->now() + Duration(sec));
+  }
+}
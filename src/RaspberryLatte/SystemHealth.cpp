@@ -0,0 +1,202 @@
+#include "../../include/RaspberryLatte/SystemHealth.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+namespace RaspLatte{
+  namespace {
+    const char * TEMP_PATH = "/class/thermal/thermal_zone0/temp";
+    const char * THROTTLE_PATH = "/devices/platform/soc/soc:firmware/get_throttled";
+    const char * FREQ_PATH = "/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq";
+    const char * MAX_FREQ_PATH = "/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq";
+    const char * STAT_PATH = "/stat";
+    const char * STATUS_PATH = "/self/status";
+    const int HEALTH_NICE = 19; // Below every other service
+
+    /** The number after key on its line, or -1 */
+    long long field(const char * text, const char * key){
+      const char * p = strstr(text, key);
+      if (p == NULL) return -1;
+      return strtoll(p + strlen(key), NULL, 10);
+    }
+  }
+
+  SystemHealth::HealthSettings SystemHealth::defaultSettings(){
+    return {.sys_root = "/sys", .proc_root = "/proc", .period_sec = 1, .throttle_temp = 80};
+  }
+
+  SystemHealth::SystemHealth(HealthSettings settings): settings_(settings){
+    temp_fd_ = openFile(settings_.sys_root, TEMP_PATH);
+    throttle_fd_ = openFile(settings_.sys_root, THROTTLE_PATH);
+    freq_fd_ = openFile(settings_.sys_root, FREQ_PATH);
+    max_freq_fd_ = openFile(settings_.sys_root, MAX_FREQ_PATH);
+    stat_fd_ = openFile(settings_.proc_root, STAT_PATH);
+    status_fd_ = openFile(settings_.proc_root, STATUS_PATH);
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd_ < 0) throw "Error: Could not set up system health sampler.";
+    memset(&next_, 0, sizeof(next_));
+    next_.cpu_temp = -1;
+    next_.throttle_flags = -1;
+    next_.rss_kb = -1;
+    published_ = next_;
+    last_sample_ = std::chrono::steady_clock::now();
+  }
+
+  int SystemHealth::openFile(const std::string & root, const char * path){
+    return open((root + path).c_str(), O_RDONLY | O_CLOEXEC);
+  }
+
+  ssize_t SystemHealth::readFile(int fd){
+    if (fd < 0) return -1;
+    // sysfs and procfs regenerate the file for a read from the start
+    ssize_t n = pread(fd, buf_, BUF_BYTES - 1, 0);
+    if (n < 0) return -1;
+    buf_[n] = '\0';
+    return n;
+  }
+
+  double SystemHealth::readNumber(int fd, double fallback){
+    if (readFile(fd) <= 0) return fallback;
+    char * end;
+    // get_throttled is hex with a 0x prefix. Everything else here is decimal.
+    double v = (double)strtoll(buf_, &end, 0);
+    return (end == buf_ ? fallback : v);
+  }
+
+  void SystemHealth::readStat(){
+    if (readFile(stat_fd_) <= 0){
+      next_.cores = 0;
+      return;
+    }
+    // "cpu  user nice system idle iowait irq softirq steal ..." for the total, then cpu0, cpu1...
+    int cores = 0;
+    for (char * line = buf_; line != NULL && strncmp(line, "cpu", 3) == 0; ){
+      char * p = line + 3;
+      int slot;
+      if (*p == ' ') slot = MAX_CORES;
+      else {
+	slot = (int)strtol(p, &p, 10);
+	if (slot >= MAX_CORES) slot = -1;
+	else cores = slot + 1;
+      }
+      if (slot >= 0){
+	unsigned long long v[8] = {0};
+	for (int i = 0; i < 8; i++) v[i] = strtoull(p, &p, 10);
+	unsigned long long idle = v[3] + v[4];
+	unsigned long long total = 0;
+	for (int i = 0; i < 8; i++) total += v[i];
+	unsigned long long busy = total - idle;
+	unsigned long long d_total = total - last_total_[slot];
+	float load = (d_total > 0 && last_total_[slot] > 0 ? (float)(busy - last_busy_[slot])/d_total : 0);
+	if (slot == MAX_CORES) next_.load = load;
+	else next_.core_load[slot] = load;
+	last_busy_[slot] = busy;
+	last_total_[slot] = total;
+      }
+      line = strchr(line, '\n');
+      if (line != NULL) line++;
+    }
+    next_.cores = cores;
+  }
+
+  void SystemHealth::readStatus(){
+    if (readFile(status_fd_) <= 0){
+      next_.rss_kb = -1;
+      return;
+    }
+    next_.rss_kb = (long)field(buf_, "VmRSS:");
+    long long voluntary = field(buf_, "\nvoluntary_ctxt_switches:");
+    long long involuntary = field(buf_, "nonvoluntary_ctxt_switches:");
+    next_.voluntary_switches = (voluntary < 0 ? 0 : voluntary);
+    next_.involuntary_switches = (involuntary < 0 ? 0 : involuntary);
+  }
+
+  void SystemHealth::sample(){
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - last_sample_).count();
+    last_sample_ = now;
+    unsigned long last_involuntary = next_.involuntary_switches;
+
+    double millideg = readNumber(temp_fd_, -1000);
+    next_.cpu_temp = millideg/1000;
+    next_.throttle_flags = (int)readNumber(throttle_fd_, -1);
+    next_.freq_mhz = readNumber(freq_fd_, 0)/1000;
+    next_.max_freq_mhz = readNumber(max_freq_fd_, 0)/1000;
+    readStat();
+    readStatus();
+    next_.involuntary_per_sec = (next_.seq > 0 && dt > 0 ? (next_.involuntary_switches - last_involuntary)/dt : 0);
+
+    bool was_throttled = next_.throttled;
+    if (next_.throttle_flags >= 0) next_.throttled = (next_.throttle_flags & THROTTLE_NOW_MASK) != 0;
+    else next_.throttled = (next_.cpu_temp >= settings_.throttle_temp);
+    if (next_.throttled && !was_throttled) next_.throttle_events++;
+    next_.seq++;
+
+    cpu_temp_.store(next_.cpu_temp, std::memory_order_relaxed);
+    throttled_.store(next_.throttled, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      published_ = next_;
+    }
+    if (log_ != NULL && next_.throttled != was_throttled){
+      if (next_.throttled){
+	fprintf(log_, "CPU throttled (flags 0x%x, %.1fC, %.0fMHz): control loop timing may suffer\n",
+		(unsigned int)(next_.throttle_flags < 0 ? 0 : next_.throttle_flags), next_.cpu_temp, next_.freq_mhz);
+      }
+      else fprintf(log_, "CPU no longer throttled (%.1fC)\n", next_.cpu_temp);
+      fflush(log_);
+    }
+  }
+
+  SystemHealth::HealthSnapshot SystemHealth::snapshot(){
+    std::lock_guard<std::mutex> lock(mutex_);
+    return published_;
+  }
+
+  void SystemHealth::format(const HealthSnapshot & s, char * buf, size_t len){
+    char temp[16] = "?";
+    if (s.cpu_temp >= 0) snprintf(temp, sizeof(temp), "%.1fC", s.cpu_temp);
+    int n = snprintf(buf, len, "cpu %s load %.0f%% rss %.1fMB preempt %.0f/s", temp, 100*s.load, s.rss_kb/1024.,
+		     s.involuntary_per_sec);
+    if (s.throttled && n >= 0 && (size_t)n < len) snprintf(buf + n, len - n, " THROTTLED");
+  }
+
+  void SystemHealth::start(){
+    if (!thread_.joinable()) thread_ = std::thread(&SystemHealth::loop, this);
+  }
+
+  void SystemHealth::stop(){
+    if (!thread_.joinable()) return;
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) < 0) return;
+    thread_.join();
+    uint64_t drained;
+    if (::read(stop_fd_, &drained, sizeof(drained)) < 0) return; // So it can start again
+  }
+
+  void SystemHealth::loop(){
+    // Nice is per thread on Linux
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), HEALTH_NICE);
+    pollfd fd = {stop_fd_, POLLIN, 0};
+    int timeout_ms = (int)(settings_.period_sec*1000);
+    while (true){
+      sample();
+      if (poll(&fd, 1, timeout_ms) > 0) return;
+    }
+  }
+
+  SystemHealth::~SystemHealth(){
+    stop();
+    int fds[] = {temp_fd_, throttle_fd_, freq_fd_, max_freq_fd_, stat_fd_, status_fd_, stop_fd_};
+    for (int fd : fds){
+      if (fd >= 0) close(fd);
+    }
+  }
+}
@@ -0,0 +1,497 @@
+#include "../../include/RaspberryLatte/SystemID.hpp"
+#include "../../include/RaspberryLatte/ShotArchive.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+namespace RaspLatte{
+  namespace {
+    const double NaN = std::numeric_limits<double>::quiet_NaN();
+    const double Z95 = 1.96;
+    const double PERIOD_TOLERANCE = 0.1; /** A gap more than this fraction off the period splits a segment */
+    const size_t MIN_SEGMENT = 4;
+    const int FILTER_PASSES = 2; /** First order filters in series. Two roll off the quantisation noise faster */
+    const double FILTER_SETTLE = 3; /** Filter time constants skipped at the start of each segment */
+
+    // Regressor columns of each model. The u columns move with the dead time.
+    const int F_T = 0, F_U = 1, F_PUMP = 2, F_ONE = 3, F_PARAMS = 4;
+    const int N_T = 0, N_T1 = 1, N_U = 2, N_U1 = 3, N_PUMP = 4, N_PUMP1 = 5, N_ONE = 6, N_PARAMS = 7;
+
+    double dot(const double * a, const double * b, size_t n){
+      double s = 0;
+      for (size_t i = 0; i < n; i++) s += a[i]*b[i];
+      return s;
+    }
+
+    /**
+     * Append evenly spaced runs of samples to log as segments, splitting where the time step is off
+     * the log's period. The heater and pump logged at a sample are what the loop acted on until the
+     * next one.
+     */
+    void appendSamples(ThermalLog & log, const double * t, const double * temp, const double * heater,
+		       const uint8_t * pump, size_t n){
+      size_t start = 0;
+      for (size_t i = 1; i <= n; i++){
+	bool split = (i == n || std::fabs(t[i] - t[i-1] - log.period_sec) > PERIOD_TOLERANCE*log.period_sec);
+	if (!split) continue;
+	if (i - start >= MIN_SEGMENT){
+	  ThermalSegment seg;
+	  seg.temp.assign(temp + start, temp + i);
+	  seg.heater.assign(heater + start, heater + i);
+	  seg.pump.assign(pump + start, pump + i);
+	  log.segments.push_back(std::move(seg));
+	}
+	start = i;
+      }
+    }
+
+    double median(std::vector<double> v){
+      if (v.empty()) return 0;
+      std::nth_element(v.begin(), v.begin() + v.size()/2, v.end());
+      return v[v.size()/2];
+    }
+  }
+
+  // ========================= ThermalLog =========================
+  bool ThermalLog::loadTrace(const std::string & path, ThermalLog & log, std::string & err){
+    FILE * f = fopen(path.c_str(), "r");
+    if (f == NULL){
+      err = "could not open " + path;
+      return false;
+    }
+    std::vector<double> t, temp, heater, dts;
+    std::vector<uint8_t> pump;
+    char line[256];
+    int line_num = 0;
+    while (fgets(line, sizeof(line), f)){
+      line_num++;
+      double tv, temp_v, sp, pwm;
+      int pump_v;
+      if (sscanf(line, "%lf,%lf,%lf,%lf,%d", &tv, &temp_v, &sp, &pwm, &pump_v) != 5){
+	if (line_num == 1) continue; // Header
+	fclose(f);
+	err = path + ":" + std::to_string(line_num) + ": expected t,temp,setpoint,pwm,pump";
+	return false;
+      }
+      if (!t.empty()) dts.push_back(tv - t.back());
+      t.push_back(tv);
+      temp.push_back(temp_v);
+      heater.push_back(pwm/255.);
+      pump.push_back(pump_v != 0);
+    }
+    fclose(f);
+    log.name = path;
+    log.period_sec = median(dts);
+    if (!(log.period_sec > 0)){
+      err = path + ": not enough samples";
+      return false;
+    }
+    appendSamples(log, t.data(), temp.data(), heater.data(), pump.data(), t.size());
+    return true;
+  }
+
+  bool ThermalLog::loadArchive(const std::string & path, ThermalLog & log, std::string & err){
+    ShotArchiveReader reader(path);
+    if (!reader.open(err)) return false;
+    log.name = path;
+    ShotColumns cols;
+    std::vector<double> t, heater;
+    for (const ShotArchiveReader::Entry & e : reader.shots()){
+      if (!reader.read(e, ShotColumns::T | ShotColumns::TEMP | ShotColumns::PWM | ShotColumns::PUMP, cols)){
+	err = path + ": corrupt shot at offset " + std::to_string(e.offset);
+	return false;
+      }
+      if (log.period_sec == 0) log.period_sec = e.meta.period_ms/1000.;
+      size_t n = e.meta.samples;
+      t.resize(n);
+      heater.resize(n);
+      for (size_t i = 0; i < n; i++){
+	t[i] = cols.t_ms[i]/1000.;
+	heater[i] = cols.pwm[i]/255.;
+      }
+      appendSamples(log, t.data(), cols.temp.data(), heater.data(), cols.pump.data(), n);
+    }
+    if (!(log.period_sec > 0)){
+      err = path + ": no shots";
+      return false;
+    }
+    return true;
+  }
+
+  size_t ThermalLog::samples() const{
+    size_t n = 0;
+    for (const ThermalSegment & s : segments) n += s.temp.size();
+    return n;
+  }
+
+  // ========================= LeastSquares =========================
+  LeastSquares::LeastSquares(int params): p_(params){
+    memset(xtx_, 0, sizeof(xtx_));
+    memset(xty_, 0, sizeof(xty_));
+  }
+
+  void LeastSquares::addRows(const double * const * cols, const double * y, size_t n){
+    for (int i = 0; i < p_; i++){
+      for (int j = 0; j <= i; j++){
+	double s = dot(cols[i], cols[j], n);
+	xtx_[i*MAX_PARAMS + j] += s;
+	if (i != j) xtx_[j*MAX_PARAMS + i] += s;
+      }
+      xty_[i] += dot(cols[i], y, n);
+    }
+    yty_ += dot(y, y, n);
+    n_ += n;
+  }
+
+  void LeastSquares::merge(const LeastSquares & o){
+    for (int i = 0; i < MAX_PARAMS*MAX_PARAMS; i++) xtx_[i] += o.xtx_[i];
+    for (int i = 0; i < MAX_PARAMS; i++) xty_[i] += o.xty_[i];
+    yty_ += o.yty_;
+    n_ += o.n_;
+  }
+
+  LeastSquares LeastSquares::subset(const int * use, int n_use) const{
+    LeastSquares s(n_use);
+    for (int i = 0; i < n_use; i++){
+      for (int j = 0; j < n_use; j++) s.xtx_[i*MAX_PARAMS + j] = xtx_[use[i]*MAX_PARAMS + use[j]];
+      s.xty_[i] = xty_[use[i]];
+    }
+    s.yty_ = yty_;
+    s.n_ = n_;
+    return s;
+  }
+
+  bool LeastSquares::solve(double * theta, double * cov, double * sse) const{
+    const int p = p_;
+    if (p == 0 || n_ <= (size_t)p) return false;
+    // Scale to a unit diagonal so the temperature and constant columns don't swamp the heater ones
+    double scale[MAX_PARAMS];
+    for (int i = 0; i < p; i++){
+      double d = xtx_[i*MAX_PARAMS + i];
+      if (!(d > 0)) return false;
+      scale[i] = 1/std::sqrt(d);
+    }
+    // Cholesky factor of the scaled X'X
+    double l[MAX_PARAMS][MAX_PARAMS] = {};
+    for (int i = 0; i < p; i++){
+      for (int j = 0; j <= i; j++){
+	double s = xtx_[i*MAX_PARAMS + j]*scale[i]*scale[j];
+	for (int k = 0; k < j; k++) s -= l[i][k]*l[j][k];
+	if (i == j){
+	  if (!(s > 1e-14)) return false;
+	  l[i][i] = std::sqrt(s);
+	} else {
+	  l[i][j] = s/l[j][j];
+	}
+      }
+    }
+    // Invert column by column, then undo the scaling: (X'X)^-1 = S M^-1 S
+    double inv[MAX_PARAMS][MAX_PARAMS];
+    for (int c = 0; c < p; c++){
+      double z[MAX_PARAMS];
+      for (int i = 0; i < p; i++){
+	double s = (i == c ? 1 : 0);
+	for (int k = 0; k < i; k++) s -= l[i][k]*z[k];
+	z[i] = s/l[i][i];
+      }
+      for (int i = p - 1; i >= 0; i--){
+	double s = z[i];
+	for (int k = i + 1; k < p; k++) s -= l[k][i]*inv[k][c];
+	inv[i][c] = s/l[i][i];
+      }
+    }
+    for (int i = 0; i < p; i++){
+      for (int j = 0; j < p; j++) inv[i][j] *= scale[i]*scale[j];
+    }
+    double fit = 0;
+    for (int i = 0; i < p; i++){
+      theta[i] = 0;
+      for (int j = 0; j < p; j++) theta[i] += inv[i][j]*xty_[j];
+      fit += theta[i]*xty_[i];
+    }
+    // At the solution the residual is y'y - theta'X'y
+    *sse = std::fmax(yty_ - fit, 0);
+    double var = *sse/(n_ - p);
+    for (int i = 0; i < p; i++){
+      for (int j = 0; j < p; j++) cov[i*p + j] = var*inv[i][j];
+    }
+    return true;
+  }
+
+  // ========================= SystemID =========================
+  double SystemID::Validation::oneStepRMSE() const{
+    return (samples ? std::sqrt(one_step_sse/samples) : NaN);
+  }
+
+  double SystemID::Validation::simRMSE() const{
+    return (samples ? std::sqrt(sim_sse/samples) : NaN);
+  }
+
+  void SystemID::Validation::add(const Validation & o){
+    samples += o.samples;
+    one_step_sse += o.one_step_sse;
+    sim_sse += o.sim_sse;
+  }
+
+  SystemID::SystemID(const Options & opts): opts_(opts){
+    max_delay_ = std::max(0, (int)std::lround(opts_.max_dead_time_sec/opts_.period_sec));
+    first_order_.assign(max_delay_ + 1, LeastSquares(F_PARAMS));
+    two_node_.assign(max_delay_ + 1, LeastSquares(N_PARAMS));
+  }
+
+  template <typename F>
+  void SystemID::chunks(const ThermalLog & log, F fn) const{
+    size_t len = std::max((size_t)std::lround(opts_.chunk_sec/opts_.period_sec), MIN_SEGMENT);
+    unsigned long n = 0;
+    for (const ThermalSegment & seg : log.segments){
+      for (size_t begin = 0; begin < seg.temp.size(); begin += len, n++){
+	bool held_out = (opts_.holdout_every > 0 && n%opts_.holdout_every == (unsigned long)opts_.holdout_every - 1);
+	fn(seg, begin, std::min(begin + len, seg.temp.size()), held_out);
+      }
+    }
+  }
+
+  bool SystemID::add(const ThermalLog & log){
+    if (std::fabs(log.period_sec - opts_.period_sec) > PERIOD_TOLERANCE*opts_.period_sec) return false;
+    // Every column goes through the same filter. The model is linear in them, so it holds just as
+    // well between the filtered columns, and the thermocouple's 0.25C steps are smoothed out.
+    double alpha = (opts_.filter_sec > 0 ? 1 - std::exp(-opts_.period_sec/opts_.filter_sec) : 1);
+    const ThermalSegment * filtered_seg = NULL;
+    std::vector<double> temp, heater, pump;
+    chunks(log, [&](const ThermalSegment & seg, size_t begin, size_t end, bool held_out){
+	if (held_out) return;
+	for (size_t k = begin; k < end; k++){
+	  min_temp_ = std::fmin(min_temp_, seg.temp[k]);
+	  max_temp_ = std::fmax(max_temp_, seg.temp[k]);
+	}
+	if (filtered_seg != &seg){
+	  size_t n = seg.temp.size();
+	  pump.resize(n);
+	  for (size_t k = 0; k < n; k++) pump[k] = seg.pump[k]*(seg.temp[k] - opts_.inlet_temp);
+	  temp = seg.temp;
+	  heater = seg.heater;
+	  for (std::vector<double> * col : {&temp, &heater, &pump}){
+	    for (int pass = 0; pass < FILTER_PASSES; pass++){
+	      double * x = col->data();
+	      for (size_t k = 1; k < n; k++) x[k] = x[k-1] + alpha*(x[k] - x[k-1]);
+	    }
+	  }
+	  filtered_seg = &seg;
+	}
+	addRows(temp, heater, pump, begin, end);
+      });
+    return true;
+  }
+
+  void SystemID::addRows(const std::vector<double> & temp_col, const std::vector<double> & heater_col,
+			 const std::vector<double> & pump_col, size_t begin, size_t end){
+    // Row k predicts T[k+1] and looks back to u[k - max_delay - 1], so every dead time sees the same
+    // rows. The filter starts from the first sample as if everything had been steady; skip that too.
+    size_t settle = (opts_.filter_sec > 0 ? (size_t)std::ceil(FILTER_SETTLE*opts_.filter_sec/opts_.period_sec) : 0);
+    size_t first = std::max(begin, std::max((size_t)max_delay_ + 1, settle));
+    size_t last = std::min(end, temp_col.size() - 1);
+    if (last <= first) return;
+    size_t n = last - first;
+    const double * temp = temp_col.data() + first;
+    const double * heater = heater_col.data() + first;
+    const double * pump = pump_col.data() + first;
+    std::vector<double> y(n), ones(n, 1.0);
+    for (size_t i = 0; i < n; i++) y[i] = temp[i+1] - temp[i];
+    for (int d = 0; d <= max_delay_; d++){
+      const double * fo[F_PARAMS] = {temp, heater - d, pump, ones.data()};
+      first_order_[d].addRows(fo, y.data(), n);
+      const double * tn[N_PARAMS] = {temp, temp - 1, heater - d, heater - d - 1, pump, pump - 1, ones.data()};
+      two_node_[d].addRows(tn, y.data(), n);
+    }
+  }
+
+  void SystemID::merge(const SystemID & o){
+    min_temp_ = std::fmin(min_temp_, o.min_temp_);
+    max_temp_ = std::fmax(max_temp_, o.max_temp_);
+    for (int d = 0; d <= max_delay_ && d < (int)o.first_order_.size(); d++){
+      first_order_[d].merge(o.first_order_[d]);
+      two_node_[d].merge(o.two_node_[d]);
+    }
+  }
+
+  size_t SystemID::rows() const{
+    return first_order_[0].rows();
+  }
+
+  double SystemID::tempRange() const{
+    return std::fmax(max_temp_ - min_temp_, 0);
+  }
+
+  bool SystemID::physical(int nodes, const double * th, bool pump, BoilerModel & model, double * values) const{
+    const double h = opts_.period_sec, w = opts_.heater_watts;
+    BoilerPlant::PlantParams & p = model.plant;
+    p.heater_watts = w;
+    double s, gain, ambient, pump_coef, tau, tau_fast = 0;
+    if (nodes == 1){
+      s = -th[F_T];
+      if (!(s > 0 && s < 1)) return false;
+      tau = -h/std::log(1 - s);
+      gain = th[F_U]/s;
+      ambient = th[F_ONE]/s;
+      pump_coef = th[F_PUMP];
+    } else {
+      // Poles of z^2 - a1 z - a2 must be real and in (0, 1): two decaying, non-oscillating modes
+      double a1 = 1 + th[N_T], a2 = th[N_T1];
+      double disc = a1*a1 + 4*a2;
+      if (!(disc > 0)) return false;
+      double z1 = (a1 + std::sqrt(disc))/2, z2 = (a1 - std::sqrt(disc))/2;
+      if (!(z1 < 1 && z2 > 0)) return false;
+      tau = -h/std::log(z1);
+      tau_fast = -h/std::log(z2);
+      s = -(th[N_T] + th[N_T1]);
+      gain = (th[N_U] + th[N_U1])/s;
+      ambient = th[N_ONE]/s;
+      pump_coef = th[N_PUMP] + th[N_PUMP1];
+    }
+    if (!(gain > 0)) return false;
+    p.loss_w_per_c = w/gain;
+    p.ambient = ambient;
+    if (pump){
+      // The pump term is to the loss term what the pump's W/C is to the loss W/C
+      p.pump_w_per_c = -p.loss_w_per_c*pump_coef/s;
+      p.inlet_temp = opts_.inlet_temp;
+    }
+    if (nodes == 1){
+      p.heat_capacity = p.loss_w_per_c*tau;
+      p.element_capacity = 0;
+      p.element_coupling = 0;
+      double v[] = {gain, tau, ambient, p.heat_capacity, p.loss_w_per_c, p.pump_w_per_c};
+      memcpy(values, v, sizeof(v));
+    } else {
+      // Element lump e feeding water lump w: h1 = H/Ce, h2 = H/Cw, l = L/Cw. The modes fix
+      // h1 + h2 + l = sum and h1 l = product, and Cw = r Ce closes it: q h1^2 - sum h1 + product = 0
+      double sum = 1/tau + 1/tau_fast, product = 1/(tau*tau_fast);
+      double r = opts_.water_share/(1 - opts_.water_share);
+      double q = std::fmin(1 + 1/r, sum*sum/(4*product)); // Past this split no realisation exists
+      r = 1/std::fmax(q - 1, 1e-9);
+      double h1 = (sum + std::sqrt(std::fmax(sum*sum - 4*q*product, 0)))/(2*q);
+      double l = product/h1;
+      p.heat_capacity = p.loss_w_per_c/l;
+      p.element_capacity = p.heat_capacity/r;
+      p.element_coupling = h1*p.element_capacity;
+      double v[] = {gain, tau, tau_fast, ambient, p.heat_capacity, p.element_capacity, p.element_coupling,
+		    p.loss_w_per_c, p.pump_w_per_c};
+      memcpy(values, v, sizeof(v));
+    }
+    return true;
+  }
+
+  SystemID::Fit SystemID::fit(int nodes) const{
+    Fit fit;
+    fit.nodes = nodes;
+    const std::vector<LeastSquares> & ls = (nodes == 1 ? first_order_ : two_node_);
+    const int p = (nodes == 1 ? F_PARAMS : N_PARAMS);
+    const int pc = (nodes == 1 ? F_PUMP : N_PUMP), pc1 = (nodes == 1 ? F_PUMP : N_PUMP1);
+    fit.pump_fitted = (ls[0].columnEnergy(pc) > 0);
+    int use[LeastSquares::MAX_PARAMS], n_use = 0;
+    for (int i = 0; i < p; i++){
+      if (fit.pump_fitted || (i != pc && i != pc1)) use[n_use++] = i;
+    }
+
+    // Dead time with the smallest residual
+    double best_sse = std::numeric_limits<double>::infinity();
+    double cov[LeastSquares::MAX_PARAMS*LeastSquares::MAX_PARAMS], best_cov[LeastSquares::MAX_PARAMS*LeastSquares::MAX_PARAMS];
+    double theta[LeastSquares::MAX_PARAMS];
+    for (int d = 0; d <= max_delay_; d++){
+      double sse;
+      if (!ls[d].subset(use, n_use).solve(theta, cov, &sse) || !(sse < best_sse)) continue;
+      best_sse = sse;
+      fit.delay = d;
+      for (int i = 0; i < p; i++) fit.theta[i] = 0;
+      for (int i = 0; i < n_use; i++) fit.theta[use[i]] = theta[i];
+      memcpy(best_cov, cov, sizeof(cov));
+    }
+    fit.rows = ls[0].rows();
+    if (!std::isfinite(best_sse)){
+      fit.err = "not enough data, or the heater never changed";
+      return fit;
+    }
+    fit.rmse = std::sqrt(best_sse/fit.rows);
+
+    double values[16];
+    if (!physical(nodes, fit.theta, fit.pump_fitted, fit.model, values)){
+      fit.err = "the fitted dynamics are not a stable, non-oscillating boiler";
+      return fit;
+    }
+    fit.model.dead_time_sec = fit.delay*opts_.period_sec;
+    fit.ok = true;
+
+    // 95% intervals by the delta method with a central difference Jacobian
+    const int n_values = (nodes == 1 ? 6 : 9);
+    double jac[16][LeastSquares::MAX_PARAMS];
+    for (int i = 0; i < n_use; i++){
+      // Small: the two node poles are close to 1 and a coarse step can push them over
+      double step = 1e-7*std::fabs(fit.theta[use[i]]) + 1e-15;
+      double hi[LeastSquares::MAX_PARAMS], lo[LeastSquares::MAX_PARAMS], v_hi[16], v_lo[16];
+      memcpy(hi, fit.theta, sizeof(hi));
+      memcpy(lo, fit.theta, sizeof(lo));
+      hi[use[i]] += step;
+      lo[use[i]] -= step;
+      BoilerModel scratch;
+      bool ok = physical(nodes, hi, fit.pump_fitted, scratch, v_hi) && physical(nodes, lo, fit.pump_fitted, scratch, v_lo);
+      for (int k = 0; k < n_values; k++) jac[k][i] = (ok ? (v_hi[k] - v_lo[k])/(2*step) : NaN);
+    }
+    std::vector<double> ci(n_values);
+    for (int k = 0; k < n_values; k++){
+      double var = 0;
+      for (int i = 0; i < n_use; i++){
+	for (int j = 0; j < n_use; j++) var += jac[k][i]*best_cov[i*n_use + j]*jac[k][j];
+      }
+      ci[k] = Z95*std::sqrt(var);
+    }
+
+    static const Estimate first_order[] = {
+      {"gain", "C", 0, 0}, {"time constant", "s", 0, 0}, {"ambient", "C", 0, 0}, {"heat capacity", "J/C", 0, 0},
+      {"loss", "W/C", 0, 0}, {"pump", "W/C", 0, 0}};
+    static const Estimate two_node[] = {
+      {"gain", "C", 0, 0}, {"slow time constant", "s", 0, 0}, {"fast time constant", "s", 0, 0},
+      {"ambient", "C", 0, 0}, {"water capacity", "J/C", 0, 0}, {"element capacity", "J/C", 0, 0},
+      {"element coupling", "W/C", 0, 0}, {"loss", "W/C", 0, 0}, {"pump", "W/C", 0, 0}};
+    const Estimate * names = (nodes == 1 ? first_order : two_node);
+    for (int k = 0; k < n_values; k++){
+      if (k == n_values - 1 && !fit.pump_fitted) continue;
+      fit.estimates.push_back({names[k].name, names[k].unit, values[k], ci[k]});
+    }
+    fit.estimates.push_back({"dead time", "s", fit.model.dead_time_sec, NaN});
+    return fit;
+  }
+
+  SystemID::Validation SystemID::validate(const Fit & fit, const ThermalLog & log) const{
+    Validation v;
+    if (!fit.ok || std::fabs(log.period_sec - opts_.period_sec) > PERIOD_TOLERANCE*opts_.period_sec) return v;
+    const double * th = fit.theta;
+    const int d = fit.delay;
+    // The fitted step from (T[k], T[k-1]) with the inputs of interval k
+    auto step = [&](const ThermalSegment & seg, size_t k, double t, double t1){
+      double pump = seg.pump[k]*(t - opts_.inlet_temp), pump1 = seg.pump[k-1]*(t1 - opts_.inlet_temp);
+      if (fit.nodes == 1) return th[F_T]*t + th[F_U]*seg.heater[k-d] + th[F_PUMP]*pump + th[F_ONE];
+      return th[N_T]*t + th[N_T1]*t1 + th[N_U]*seg.heater[k-d] + th[N_U1]*seg.heater[k-d-1] + th[N_PUMP]*pump
+	+ th[N_PUMP1]*pump1 + th[N_ONE];
+    };
+    chunks(log, [&](const ThermalSegment & seg, size_t begin, size_t end, bool held_out){
+	if (!held_out && opts_.holdout_every > 0) return;
+	size_t first = std::max(begin, (size_t)max_delay_ + 1);
+	size_t last = std::min(end, seg.temp.size() - 1);
+	double sim = (first < last ? seg.temp[first] : 0), sim1 = (first < last ? seg.temp[first - 1] : 0);
+	for (size_t k = first; k < last; k++){
+	  double measured = seg.temp[k+1];
+	  double one = seg.temp[k] + step(seg, k, seg.temp[k], seg.temp[k-1]);
+	  double next = sim + step(seg, k, sim, sim1);
+	  sim1 = sim;
+	  sim = next;
+	  v.one_step_sse += (one - measured)*(one - measured);
+	  v.sim_sse += (next - measured)*(next - measured);
+	  v.samples++;
+	}
+      });
+    return v;
+  }
+}
@@ -0,0 +1,697 @@
+#include "../../include/RaspberryLatte/TelemetryServer.hpp"
+#include "../../include/RaspberryLatte/Config.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <algorithm>
+
+namespace RaspLatte{
+  namespace {
+    const uint64_t LISTEN_TAG = 1;
+    const uint64_t TIMER_TAG = 2;
+    const uint64_t STOP_TAG = 3;
+
+    const size_t MAX_REQUEST_BYTES = 16384; /** Largest HTTP request or WebSocket message accepted */
+    const int MAX_EVENTS = 64;
+
+    const char * WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    /** SHA-1 digest. Only used for the WebSocket handshake. */
+    void sha1(const std::string & msg, uint8_t digest[20]){
+      uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+      std::string data = msg;
+      uint64_t bit_len = (uint64_t)msg.size() * 8;
+      data += (char)0x80;
+      while (data.size() % 64 != 56) data += (char)0;
+      for (int i = 7; i >= 0; i--) data += (char)((bit_len >> (8*i)) & 0xFF);
+
+      for (size_t chunk = 0; chunk < data.size(); chunk += 64){
+	uint32_t w[80];
+	for (int i = 0; i < 16; i++){
+	  w[i] = ((uint8_t)data[chunk+4*i] << 24) | ((uint8_t)data[chunk+4*i+1] << 16)
+	    | ((uint8_t)data[chunk+4*i+2] << 8) | (uint8_t)data[chunk+4*i+3];
+	}
+	for (int i = 16; i < 80; i++){
+	  uint32_t v = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+	  w[i] = (v << 1) | (v >> 31);
+	}
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (int i = 0; i < 80; i++){
+	  uint32_t f, k;
+	  if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+	  else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+	  else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+	  else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+	  uint32_t tmp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+	  e = d; d = c; c = (b << 30) | (b >> 2); b = a; a = tmp;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+      }
+      for (int i = 0; i < 20; i++) digest[i] = (h[i/4] >> (24 - 8*(i%4))) & 0xFF;
+    }
+
+    std::string base64(const uint8_t * data, size_t len){
+      const char * table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+      std::string out;
+      for (size_t i = 0; i < len; i += 3){
+	uint32_t v = data[i] << 16;
+	if (i+1 < len) v |= data[i+1] << 8;
+	if (i+2 < len) v |= data[i+2];
+	out += table[(v >> 18) & 0x3F];
+	out += table[(v >> 12) & 0x3F];
+	out += (i+1 < len ? table[(v >> 6) & 0x3F] : '=');
+	out += (i+2 < len ? table[v & 0x3F] : '=');
+      }
+      return out;
+    }
+
+    std::string lower(std::string s){
+      std::transform(s.begin(), s.end(), s.begin(), [](unsigned char ch){ return std::tolower(ch); });
+      return s;
+    }
+
+    /** Parse "a=1&b=2" into params. Existing keys are overwritten. */
+    void parseParams(const std::string & s, std::map<std::string, std::string> & params){
+      size_t start = 0;
+      while (start < s.size()){
+	size_t end = s.find('&', start);
+	if (end == std::string::npos) end = s.size();
+	size_t eq = s.find('=', start);
+	if (eq != std::string::npos && eq < end){
+	  params[s.substr(start, eq-start)] = s.substr(eq+1, end-eq-1);
+	}
+	start = end + 1;
+      }
+    }
+
+    bool parseNumber(const std::map<std::string, std::string> & params, const char * key, double & out){
+      auto it = params.find(key);
+      if (it == params.end()) return false;
+      char * end;
+      double v = strtod(it->second.c_str(), &end);
+      if (end == it->second.c_str() || *end != '\0' || !std::isfinite(v)) return false;
+      out = v;
+      return true;
+    }
+
+    bool parseMode(const std::string & s, MachineMode & mode){
+      if (s == "off") mode = OFF;
+      else if (s == "brew") mode = BREW;
+      else if (s == "steam") mode = STEAM;
+      else return false;
+      return true;
+    }
+
+    const char * modeName(MachineMode mode){
+      switch(mode){
+      case BREW: return "brew";
+      case STEAM: return "steam";
+      default: return "off";
+      }
+    }
+
+    std::string httpResponse(int code, const char * status, const std::string & body){
+      char header[160];
+      snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+	       "Content-Length: %zu\r\nConnection: close\r\n\r\n", code, status, body.size());
+      return header + body;
+    }
+
+    void putU32(std::string & s, uint32_t v){
+      for (int i = 0; i < 4; i++) s += (char)((v >> (8*i)) & 0xFF);
+    }
+
+    /** Flatten a state into the field order used by the WebSocket frames */
+    std::vector<float> packFields(const MachineState & s){
+      return {(float)s.time_s, (float)s.mode, (float)s.mode_overridden, (float)s.pump_on,
+	  (float)s.temp, (float)s.setpoint, (float)s.pwm, (float)s.error_sum, (float)s.slope,
+	  (float)s.setpoints.brew, (float)s.setpoints.steam,
+	  (float)s.gains.brew.p, (float)s.gains.brew.i, (float)s.gains.brew.d,
+	  (float)s.gains.steam.p, (float)s.gains.steam.i, (float)s.gains.steam.d};
+    }
+  }
+
+  TelemetryServer::TelemetryServer(TripleBuffer<MachineState> * state, CommandQueue * commands,
+				   TelemetrySettings settings): settings_(settings){
+    addMachine(state, commands);
+    // The destructor doesn't run for a constructor that throws, so close what is open first
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) throw "Error: Could not create telemetry socket.";
+
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(settings_.port);
+    if (inet_pton(AF_INET, settings_.address, &addr.sin_addr) != 1){
+      closeFds();
+      throw "Error: Invalid telemetry server address.";
+    }
+    if (bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 16) < 0){
+      closeFds();
+      throw "Error: Could not bind telemetry server socket.";
+    }
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd_, (sockaddr*)&addr, &addr_len);
+    port_ = ntohs(addr.sin_port);
+
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || timer_fd_ < 0 || stop_fd_ < 0){
+      closeFds();
+      throw "Error: Could not set up telemetry server events.";
+    }
+
+    long period_ns = (settings_.frame_rate_hz > 0 ? 1e9/settings_.frame_rate_hz : 1e8);
+    itimerspec period;
+    period.it_interval.tv_sec = period_ns / 1000000000;
+    period.it_interval.tv_nsec = period_ns % 1000000000;
+    period.it_value = period.it_interval;
+    timerfd_settime(timer_fd_, 0, &period, NULL);
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_TAG;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+    ev.data.u64 = TIMER_TAG;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev);
+    ev.data.u64 = STOP_TAG;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &ev);
+  }
+
+  size_t TelemetryServer::addMachine(TripleBuffer<MachineState> * state, CommandQueue * commands){
+    Endpoint e;
+    e.state = state;
+    e.commands = commands;
+    machines_.push_back(e);
+    return machines_.size() - 1;
+  }
+
+  void TelemetryServer::setStatusLog(FILE * out, double period_sec){
+    log_out_ = out;
+    log_period_sec_ = period_sec;
+    last_log_ = std::chrono::steady_clock::now();
+  }
+
+  void TelemetryServer::start(){
+    if (!thread_.joinable()) thread_ = std::thread(&TelemetryServer::loop, this);
+  }
+
+  void TelemetryServer::stop(){
+    if (!thread_.joinable()) return;
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) < 0) return;
+    thread_.join();
+  }
+
+  void TelemetryServer::loop(){
+    epoll_event events[MAX_EVENTS];
+    std::vector<Client*> dead;
+    while (true){
+      int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+      if (n < 0){
+	if (errno == EINTR) continue;
+	break;
+      }
+      for (int i = 0; i < n; i++){
+	uint64_t tag = events[i].data.u64;
+	if (tag == STOP_TAG){
+	  for (Client * c : clients_) closeClient(c);
+	  for (Client * c : clients_) delete c;
+	  clients_.clear();
+	  return;
+	} else if (tag == LISTEN_TAG){
+	  acceptClients();
+	} else if (tag == TIMER_TAG){
+	  uint64_t expirations;
+	  if (read(timer_fd_, &expirations, sizeof(expirations)) > 0){
+	    broadcast();
+	    logStatus();
+	  }
+	} else {
+	  Client * c = (Client*)events[i].data.ptr;
+	  if (c->fd < 0) continue; // Closed earlier in this batch
+	  if (events[i].events & (EPOLLERR | EPOLLHUP)) closeClient(c);
+	  else {
+	    if (events[i].events & EPOLLOUT) flush(c);
+	    if (c->fd >= 0 && (events[i].events & EPOLLIN)) handleReadable(c);
+	  }
+	}
+      }
+
+      // Free anything closed during this batch
+      auto split = std::partition(clients_.begin(), clients_.end(), [](Client * c){ return c->fd >= 0; });
+      dead.assign(split, clients_.end());
+      clients_.erase(split, clients_.end());
+      for (Client * c : dead) delete c;
+    }
+  }
+
+  void TelemetryServer::acceptClients(){
+    while (true){
+      int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) return;
+      if (clients_.size() >= settings_.max_clients){
+	close(fd);
+	continue;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      // Left alone the kernel grows this to megabytes, and a client that stops reading would take
+      // that much before client_buffer_bytes ever came into it.
+      int sndbuf = (int)std::min(settings_.client_buffer_bytes, (size_t)INT_MAX/2);
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+      Client * c = new Client;
+      c->fd = fd;
+      clients_.push_back(c);
+
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = c;
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+  }
+
+  void TelemetryServer::refresh(Endpoint & e){
+    if (e.state->read(e.latest)){
+      e.have_state = true;
+      e.changed = true;
+    }
+  }
+
+  void TelemetryServer::broadcast(){
+    for (size_t m = 0; m < machines_.size(); m++){
+      Endpoint & e = machines_[m];
+      refresh(e);
+      if (!e.have_state) continue;
+
+      std::string keyframe, delta;
+      if (e.changed && !e.last_fields.empty()) delta = encodeFrame(e, false);
+
+      // Clients that joined since the last frame need a keyframe. The rest get the delta.
+      for (Client * c : clients_){
+	if (c->fd < 0 || !c->websocket || c->closing || c->machine != m) continue;
+	if (!c->synced){
+	  if (keyframe.empty()) keyframe = encodeFrame(e, true);
+	  c->synced = true;
+	  queue(c, keyframe);
+	} else if (!delta.empty()){
+	  queue(c, delta);
+	}
+      }
+      if (e.changed) e.last_fields = packFields(e.latest);
+      e.changed = false;
+    }
+  }
+
+  void TelemetryServer::logStatus(){
+    if (log_out_ == NULL) return;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now - last_log_ < std::chrono::duration<double>(log_period_sec_)) return;
+    last_log_ = now;
+    for (size_t m = 0; m < machines_.size(); m++){
+      const Endpoint & e = machines_[m];
+      if (!e.have_state){
+	fprintf(log_out_, "machine %zu: no state yet\n", m);
+	continue;
+      }
+      const MachineState & s = e.latest;
+      fprintf(log_out_, "machine %zu: %-5s %7.2fC setpoint %6.2fC pwm %3.0f%s\n", m, modeName(s.mode), s.temp,
+	      s.setpoint, s.pwm, (s.pump_on ? " pumping" : ""));
+    }
+    fflush(log_out_);
+  }
+
+  void TelemetryServer::handleReadable(Client * c){
+    char buf[4096];
+    while (true){
+      ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+      if (n > 0){
+	c->in.append(buf, n);
+	if (c->in.size() > MAX_REQUEST_BYTES){
+	  closeClient(c);
+	  return;
+	}
+      } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+	closeClient(c);
+	return;
+      } else if (errno != EINTR){
+	break;
+      }
+    }
+    if (c->websocket) handleWebSocket(c);
+    else handleHTTP(c);
+  }
+
+  void TelemetryServer::handleHTTP(Client * c){
+    // Requests can come back to back (pipelined), and a WebSocket frame right behind its upgrade
+    while (c->fd >= 0 && !c->closing && !c->websocket && handleHTTPRequest(c)){}
+    if (c->fd >= 0 && c->websocket && !c->in.empty()) handleWebSocket(c);
+  }
+
+  bool TelemetryServer::handleHTTPRequest(Client * c){
+    size_t header_end = c->in.find("\r\n\r\n");
+    if (header_end == std::string::npos) return false; // Wait for the rest
+
+    // Request line
+    size_t line_end = c->in.find("\r\n");
+    std::string line = c->in.substr(0, line_end);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos){
+      queue(c, httpResponse(400, "Bad Request", "{\"error\":\"malformed request\"}"));
+      c->closing = true;
+      flush(c);
+      return false;
+    }
+    std::string method = line.substr(0, sp1);
+    std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string path = target.substr(0, target.find('?'));
+    std::string query = (target.find('?') == std::string::npos ? "" : target.substr(target.find('?') + 1));
+
+    // /m/<n>/... is machine n. Anything else is machine 0.
+    size_t machine = 0;
+    if (path.compare(0, 3, "/m/") == 0){
+      char * end;
+      unsigned long n = strtoul(path.c_str() + 3, &end, 10);
+      if (end == path.c_str() + 3 || *end != '/' || n >= machines_.size()){
+	queue(c, httpResponse(404, "Not Found", "{\"error\":\"unknown machine\"}"));
+	c->closing = true;
+	flush(c);
+	return false;
+      }
+      machine = n;
+      path = end;
+    }
+
+    // Headers
+    std::map<std::string, std::string> headers;
+    size_t pos = line_end + 2;
+    while (pos < header_end){
+      size_t end = c->in.find("\r\n", pos);
+      size_t colon = c->in.find(':', pos);
+      if (colon != std::string::npos && colon < end){
+	std::string value = c->in.substr(colon + 1, end - colon - 1);
+	value.erase(0, value.find_first_not_of(' '));
+	headers[lower(c->in.substr(pos, colon - pos))] = value;
+      }
+      pos = end + 2;
+    }
+
+    size_t body_len = 0;
+    if (headers.count("content-length")){
+      const char * value = headers["content-length"].c_str();
+      char * end;
+      body_len = strtoul(value, &end, 10);
+      end += strspn(end, " \t");
+      if (!isdigit((unsigned char)value[0]) || *end != '\0'){
+	queue(c, httpResponse(400, "Bad Request", "{\"error\":\"malformed request\"}"));
+	c->closing = true;
+	flush(c);
+	return false;
+      }
+    }
+    // Checked without adding, so a huge length can't wrap around
+    if (header_end + 4 > MAX_REQUEST_BYTES || body_len > MAX_REQUEST_BYTES - (header_end + 4)){
+      closeClient(c);
+      return false;
+    }
+    if (c->in.size() < header_end + 4 + body_len) return false; // Wait for the body
+    std::string body = c->in.substr(header_end + 4, body_len);
+    c->in.erase(0, header_end + 4 + body_len); // Only this request. What follows is the next one.
+
+    // WebSocket upgrade
+    if (path == "/ws" && lower(headers["upgrade"]) == "websocket" && headers.count("sec-websocket-key")){
+      uint8_t digest[20];
+      sha1(headers["sec-websocket-key"] + WS_GUID, digest);
+      queue(c, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: " + base64(digest, 20) + "\r\n\r\n");
+      c->websocket = true;
+      c->machine = machine;
+      return true;
+    }
+
+    if (!query.empty() && !body.empty()) query += '&';
+    handleRequest(c, machines_[machine], method, path, query + body);
+    // Responses say Connection: close, but answer anything pipelined behind this request first
+    if (c->in.empty()){
+      c->closing = true;
+      flush(c);
+    }
+    return true;
+  }
+
+  bool TelemetryServer::handleRequest(Client * c, Endpoint & e, const std::string & method,
+				      const std::string & path, const std::string & query){
+    std::map<std::string, std::string> params;
+    parseParams(query, params);
+
+    if (path == "/api/state" || path == "/api/machines"){
+      if (method != "GET") {
+	queue(c, httpResponse(405, "Method Not Allowed", "{\"error\":\"use GET\"}"));
+	return false;
+      }
+      if (path == "/api/machines"){
+	queue(c, httpResponse(200, "OK", "{\"machines\":" + std::to_string(machines_.size()) + "}"));
+	return true;
+      }
+      refresh(e);
+      if (!e.have_state){
+	queue(c, httpResponse(503, "Service Unavailable", "{\"error\":\"no state yet\"}"));
+	return false;
+      }
+      queue(c, httpResponse(200, "OK", stateJSON(e)));
+      return true;
+    }
+
+    if (path != "/api/setpoint" && path != "/api/gains" && path != "/api/mode"){
+      queue(c, httpResponse(404, "Not Found", "{\"error\":\"unknown endpoint\"}"));
+      return false;
+    }
+    if (method != "POST" && method != "PUT"){
+      queue(c, httpResponse(405, "Method Not Allowed", "{\"error\":\"use POST\"}"));
+      return false;
+    }
+
+    std::vector<Command> reqs;
+    if (path == "/api/setpoint"){
+      // POST /api/setpoint?brew=95.5&steam=150. The range a config may set. All or nothing.
+      const char * keys[] = {"brew", "steam"};
+      MachineMode modes[] = {BREW, STEAM};
+      for (int k = 0; k < 2; k++){
+	double v;
+	if (!params.count(keys[k])) continue;
+	if (!parseNumber(params, keys[k], v) || !(v > 0 && v <= MachineConfig::MAX_SETPOINT)){
+	  char body[64];
+	  snprintf(body, sizeof(body), "{\"error\":\"setpoints must be in (0, %.0f]\"}", MachineConfig::MAX_SETPOINT);
+	  queue(c, httpResponse(400, "Bad Request", body));
+	  return false;
+	}
+	reqs.push_back({Command::SET_SETPOINT, modes[k], v, {}});
+      }
+    }
+    else if (path == "/api/gains"){
+      // POST /api/gains?mode=brew&p=100&i=0.25&d=250. Missing gains keep their current value.
+      MachineMode mode;
+      if (params.count("mode") && parseMode(params["mode"], mode) && mode != OFF){
+	PID::PIDGains gains = {0, 0, 0};
+	if (e.have_state) gains = (mode == BREW ? e.latest.gains.brew : e.latest.gains.steam);
+	bool any = parseNumber(params, "p", gains.p);
+	any |= parseNumber(params, "i", gains.i);
+	any |= parseNumber(params, "d", gains.d);
+	if (any && (e.have_state || (params.count("p") && params.count("i") && params.count("d")))
+	    && gains.p >= 0 && gains.i >= 0 && gains.d >= 0){
+	  reqs.push_back({Command::SET_GAINS, mode, 0, gains});
+	}
+      }
+    }
+    else {
+      // POST /api/mode?mode=auto|off|brew|steam
+      MachineMode mode;
+      if (params["mode"] == "auto") reqs.push_back({Command::CLEAR_MODE, OFF, 0, {}});
+      else if (parseMode(params["mode"], mode)) reqs.push_back({Command::SET_MODE, mode, 0, {}});
+    }
+
+    if (reqs.empty()){
+      queue(c, httpResponse(400, "Bad Request", "{\"error\":\"missing or invalid parameters\"}"));
+      return false;
+    }
+    // Both setpoints or neither
+    if (!e.commands->pushAll(reqs.data(), reqs.size())){
+      queue(c, httpResponse(503, "Service Unavailable", "{\"error\":\"too many commands queued\"}"));
+      return false;
+    }
+    queue(c, httpResponse(202, "Accepted", "{\"ok\":true}"));
+    return true;
+  }
+
+  void TelemetryServer::handleWebSocket(Client * c){
+    while (c->fd >= 0 && c->in.size() >= 2){
+      const uint8_t * b = (const uint8_t*)c->in.data();
+      uint8_t opcode = b[0] & 0x0F;
+      bool masked = b[1] & 0x80;
+      uint64_t len = b[1] & 0x7F;
+      size_t header = 2;
+      if (len == 126){
+	if (c->in.size() < 4) return;
+	len = (b[2] << 8) | b[3];
+	header = 4;
+      } else if (len == 127){
+	closeClient(c); // Far larger than anything a client should send
+	return;
+      }
+      if (!masked || len > MAX_REQUEST_BYTES){
+	closeClient(c);
+	return;
+      }
+      if (c->in.size() < header + 4 + len) return;
+
+      std::string payload = c->in.substr(header + 4, len);
+      for (size_t i = 0; i < len; i++) payload[i] ^= b[header + (i % 4)];
+      c->in.erase(0, header + 4 + len);
+
+      if (opcode == 0x8){ // Close
+	queue(c, std::string("\x88\x00", 2));
+	c->closing = true;
+	flush(c);
+	return;
+      } else if (opcode == 0x9 && len < 126){ // Ping
+	queue(c, std::string(1, (char)0x8A) + (char)len + payload);
+      }
+      // Data frames from clients are ignored. Commands go through the REST API.
+    }
+  }
+
+  void TelemetryServer::queue(Client * c, const std::string & data){
+    if (c->fd < 0) return;
+    if (c->out.size() + data.size() > settings_.client_buffer_bytes){
+      // Slow client. Drop it rather than buffer without bound.
+      dropped_clients_++;
+      closeClient(c);
+      return;
+    }
+    c->out += data;
+    flush(c);
+  }
+
+  void TelemetryServer::flush(Client * c){
+    while (!c->out.empty()){
+      ssize_t n = send(c->fd, c->out.data(), c->out.size(), MSG_NOSIGNAL);
+      if (n > 0){
+	c->out.erase(0, n);
+      } else if (n < 0 && errno == EINTR){
+	continue;
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+	break;
+      } else {
+	closeClient(c);
+	return;
+      }
+    }
+
+    if (c->out.empty() && c->closing){
+      closeClient(c);
+      return;
+    }
+
+    bool want_write = !c->out.empty();
+    if (want_write != c->want_write){
+      epoll_event ev;
+      ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+      ev.data.ptr = c;
+      epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c->fd, &ev);
+      c->want_write = want_write;
+    }
+  }
+
+  void TelemetryServer::closeClient(Client * c){
+    if (c->fd < 0) return;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1; // Freed at the end of the event batch
+  }
+
+  std::string TelemetryServer::stateJSON(const Endpoint & e){
+    const MachineState & s = e.latest;
+    char buf[640];
+    snprintf(buf, sizeof(buf),
+	     "{\"seq\":%u,\"time\":%.3f,\"mode\":\"%s\",\"mode_overridden\":%s,\"pump\":%s,"
+	     "\"temp\":%.2f,\"setpoint\":%.2f,\"pwm\":%.0f,\"error_sum\":%.3f,\"slope\":%.3f,"
+	     "\"setpoints\":{\"brew\":%.2f,\"steam\":%.2f},"
+	     "\"gains\":{\"brew\":{\"p\":%g,\"i\":%g,\"d\":%g},\"steam\":{\"p\":%g,\"i\":%g,\"d\":%g}}}",
+	     s.seq, s.time_s, modeName(s.mode), s.mode_overridden ? "true" : "false", s.pump_on ? "true" : "false",
+	     s.temp, s.setpoint, s.pwm, s.error_sum, s.slope, s.setpoints.brew, s.setpoints.steam,
+	     s.gains.brew.p, s.gains.brew.i, s.gains.brew.d, s.gains.steam.p, s.gains.steam.i, s.gains.steam.d);
+    return buf;
+  }
+
+  std::string TelemetryServer::encodeFrame(const Endpoint & e, bool keyframe){
+    /* Payload layout (little endian)
+       | type (1) | seq (4) | field mask (4) | one float32 per set bit in the mask |
+       type is 'K' for a keyframe holding every field and 'D' for a delta holding only the fields
+       that changed since the previous frame. See doc/telemetry_api.txt for the field order.
+    */
+    std::vector<float> fields = packFields(e.latest);
+    uint32_t mask = 0;
+    for (size_t i = 0; i < fields.size(); i++){
+      if (keyframe || fields[i] != e.last_fields[i]) mask |= (1u << i);
+    }
+
+    std::string payload(1, keyframe ? 'K' : 'D');
+    putU32(payload, e.latest.seq);
+    putU32(payload, mask);
+    for (size_t i = 0; i < fields.size(); i++){
+      if (!(mask & (1u << i))) continue;
+      uint32_t bits;
+      memcpy(&bits, &fields[i], sizeof(bits));
+      putU32(payload, bits);
+    }
+
+    // Unmasked binary WebSocket frame
+    std::string frame(1, (char)0x82);
+    if (payload.size() < 126){
+      frame += (char)payload.size();
+    } else {
+      frame += (char)126;
+      frame += (char)((payload.size() >> 8) & 0xFF);
+      frame += (char)(payload.size() & 0xFF);
+    }
+    return frame + payload;
+  }
+
+  TelemetryServer::~TelemetryServer(){
+    stop();
+    for (Client * c : clients_){
+      closeClient(c);
+      delete c;
+    }
+    closeFds();
+  }
+
+  void TelemetryServer::closeFds(){
+    int * fds[] = {&listen_fd_, &epoll_fd_, &timer_fd_, &stop_fd_};
+    for (int * fd : fds){
+      if (*fd >= 0) close(*fd);
+      *fd = -1;
+    }
+  }
+}
@@ -0,0 +1,84 @@
+#include "../../include/RaspberryLatte/TrendHistory.hpp"
+
+#include "../../include/RaspberryLatte/MAX31855Frame.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace RaspLatte{
+  namespace {
+    const double RESOLUTION_SEC[TrendHistory::LEVELS] = {1, 10, 60};
+
+    void fold(TrendHistory::Aggregate & a, double value){
+      float v = (float)value;
+      if (a.count == 0){
+	a.min = v;
+	a.max = v;
+      }
+      else {
+	a.min = std::min(a.min, v);
+	a.max = std::max(a.max, v);
+      }
+      a.sum += value;
+      a.count++;
+    }
+  }
+
+  double TrendHistory::resolution(int level){ return RESOLUTION_SEC[level]; }
+
+  void TrendHistory::clear(){
+    for (Level & level : levels_){
+      level.head = CAPACITY - 1; // So the first bucket opened goes in slot 0
+      level.count = 0;
+    }
+  }
+
+  void TrendHistory::advance(Level & level){
+    level.head = (level.head + 1) % CAPACITY;
+    if (level.count < CAPACITY) level.count++;
+    Bucket & b = level.ring[level.head];
+    for (Aggregate & a : b.series) a = {0, 0, 0, 0};
+  }
+
+  void TrendHistory::add(double time_s, double temp, double setpoint, double pwm){
+    for (int l = 0; l < LEVELS; l++){
+      Level & level = levels_[l];
+      int64_t index = (int64_t)std::floor(time_s/RESOLUTION_SEC[l]);
+      if (level.count == 0){
+	advance(level);
+	level.ring[level.head].index = index;
+      }
+      else {
+	// Open a bucket for each step since the last sample, empty ones for any skipped. A long stall
+	// costs at most a ring's worth once.
+	int64_t last = level.ring[level.head].index;
+	for (int64_t i = std::max(last + 1, index - CAPACITY + 1); i <= index; i++){
+	  advance(level);
+	  level.ring[level.head].index = i;
+	}
+      }
+      Bucket & b = level.ring[level.head];
+      if (temp != MAX31855_TEMP_UNAVALIBLE) fold(b.series[TEMP], temp);
+      fold(b.series[SETPOINT], setpoint);
+      fold(b.series[PWM], pwm);
+    }
+  }
+
+  const TrendHistory::Bucket & TrendHistory::bucket(int level, int age) const{
+    const Level & l = levels_[level];
+    return l.ring[(l.head - age + CAPACITY) % CAPACITY];
+  }
+
+  bool TrendHistory::range(int level, Series series, int n, double & lo, double & hi) const{
+    bool any = false;
+    n = std::min(n, size(level));
+    for (int age = 0; age < n; age++){
+      const Aggregate & a = bucket(level, age).series[series];
+      if (a.count == 0) continue;
+      lo = (any ? std::min(lo, (double)a.min) : a.min);
+      hi = (any ? std::max(hi, (double)a.max) : a.max);
+      any = true;
+    }
+    return any;
+  }
+}
@@ -0,0 +1,49 @@
+#include "../../include/RaspberryLatte/Watchdog.hpp"
+
+#include <fcntl.h>
+#include <linux/watchdog.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace RaspLatte{
+  bool LinuxWatchdog::open(unsigned int timeout_sec){
+    if (fd_ >= 0) return true;
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd_ < 0) return false;
+    int timeout = timeout_sec;
+    ioctl(fd_, WDIOC_SETTIMEOUT, &timeout); // Not every driver supports this. Keep its default then
+    return true;
+  }
+
+  void LinuxWatchdog::kick(){
+    if (fd_ >= 0) ioctl(fd_, WDIOC_KEEPALIVE, 0);
+  }
+
+  void LinuxWatchdog::close(){
+    if (fd_ < 0) return;
+    // Magic close so a clean shutdown does not reboot the Pi
+    if (write(fd_, "V", 1) < 0){}
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  bool SimulatedWatchdog::open(unsigned int timeout_sec){
+    armed_ = true;
+    fired_ = false;
+    timeout_ = Duration(timeout_sec);
+    last_kick_ = clock_->now();
+    return true;
+  }
+
+  void SimulatedWatchdog::kick(){
+    if (!armed_) return;
+    expired(); // Latch a late kick before resetting the timer
+    last_kick_ = clock_->now();
+    kicks_++;
+  }
+
+  bool SimulatedWatchdog::expired(){
+    if (armed_ && clock_->now() - last_kick_ > timeout_) fired_ = true;
+    return fired_;
+  }
+}
@@ -0,0 +1,211 @@
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+#include "../../include/RaspberryLatte/ConfigWatcher.hpp"
+#include "../../include/RaspberryLatte/TelemetryServer.hpp"
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+  std::atomic<bool> stop_requested{false};
+
+  void requestStop(int){
+    stop_requested.store(true);
+  }
+
+  void usage(const char * name){
+    std::cerr<<"Usage: "<<name<<" [--local CONFIG] [--simulate N] [--sim-config CONFIG] [--period SEC] [--port PORT]"
+	     <<" [--status SEC] [--power-cap WATTS]\n";
+  }
+}
+
+/*
+ * Usage: RaspberryLatte-daemon [--local CONFIG] [--simulate N] [--sim-config CONFIG] [--period SEC]
+ *                              [--port PORT] [--status SEC] [--power-cap WATTS]
+ * Runs several machines in one process (see MachineHost). --local runs the machine wired to this
+ * Pi's GPIO with CONFIG, as bin/RaspberryLatte-headless would. --simulate adds N machines on
+ * simulated boilers, all with the --sim-config config or the defaults. Every machine ticks every
+ * --period seconds (or at its own rate if its config sets loop.adaptive) on a control thread
+ * pinned to its own core, and all of them are served by one telemetry server: the local machine is
+ * machine 0. It listens where the local config says (telemetry.address and telemetry.port, loopback
+ * by default), or the --sim-config config without --local; --port overrides the port. --status
+ * prints every machine's state and the Pi's health (see SystemHealth) that often. --power-cap puts
+ * every heater under a PowerScheduler that keeps their combined draw (power.heater_watts each)
+ * under WATTS, brew before steam. Stop it with SIGINT or SIGTERM; each machine's loop timing is
+ * printed on exit.
+ */
+int main(int argc, char ** argv){
+  const char * local_path = NULL;
+  int simulated = 0;
+  double period_sec = RaspLatte::EspressoMachine::LOOP_PERIOD_SEC;
+  int port = -1; // From the config unless given
+  double status_sec = 0;
+  double power_cap = -1;
+  RaspLatte::MachineConfig local_config, sim_config;
+  std::string err;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--local") && i+1 < argc) local_path = argv[++i];
+    else if (!strcmp(argv[i], "--simulate") && i+1 < argc) simulated = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--period") && i+1 < argc) period_sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--port") && i+1 < argc) port = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--status") && i+1 < argc) status_sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--power-cap") && i+1 < argc) power_cap = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--sim-config") && i+1 < argc){
+      if (!RaspLatte::MachineConfig::load(argv[++i], sim_config, err)){
+	std::cerr<<"Invalid config "<<argv[i]<<": "<<err<<"\n";
+	return 1;
+      }
+    }
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if ((local_path == NULL && simulated <= 0) || period_sec <= 0 || port == 0 || port > 65535){
+    usage(argv[0]);
+    return 2;
+  }
+  // The local config is optional like the single machine program's. Defaults are used if it does not exist yet.
+  if (local_path && access(local_path, F_OK) == 0 && !RaspLatte::MachineConfig::load(local_path, local_config, err)){
+    std::cerr<<"Invalid config "<<local_path<<": "<<err<<"\n";
+    return 1;
+  }
+
+  RaspLatte::MachineHost host(period_sec);
+
+  // The machine on this Pi, set up as in main.cpp. pigpio only allows one.
+  std::unique_ptr<RaspLatte::PigpioBackend> gpio;
+  std::unique_ptr<RaspLatte::HardwareContext> hw;
+  std::unique_ptr<RaspLatte::EspressoMachine> local;
+  std::unique_ptr<RaspLatte::ShotArchiveWriter> archive;
+  std::unique_ptr<RaspLatte::ShotRecorder> recorder;
+  // The Pi's health is shared by every machine. Its settings come from the local config.
+  RaspLatte::SystemHealth health(local_config.health);
+  RaspLatte::LinuxWatchdog watchdog;
+  if (local_path){
+    gpio.reset(new RaspLatte::PigpioBackend());
+    hw.reset(new RaspLatte::HardwareContext(gpio.get(), local_config.pins, local_config.cascade.enabled));
+    hw->bringUp();
+    local.reset(new RaspLatte::EspressoMachine(local_config, hw.get()));
+    RaspLatte::BoilerModel model;
+    if (!local_config.model_path.empty()){
+      if (RaspLatte::BoilerModel::load(local_config.model_path, model, err)) local->setBoilerModel(model);
+      else std::cerr<<"Not using the boiler model "<<local_config.model_path<<": "<<err<<"\n";
+    }
+    local->supervisor()->setCPUSensor(&health);
+    if (local_config.watchdog_enabled){
+      if (watchdog.open(5)) local->supervisor()->setWatchdog(&watchdog);
+      else std::cerr<<"Could not open /dev/watchdog, running without the watchdog\n";
+    }
+    archive.reset(new RaspLatte::ShotArchiveWriter(local_config.archive_path));
+    recorder.reset(new RaspLatte::ShotRecorder(archive.get(), RaspLatte::ShotRecorder::wallOffsetMs(RaspLatte::steadyClock()),
+					       local_config.machine_id));
+    if (!local_config.archive_path.empty()){
+      if (archive->open(err)) local->setShotRecorder(recorder.get());
+      else std::cerr<<"Not recording shots: "<<err<<"\n";
+    }
+    host.add(local.get());
+  }
+
+  std::vector<std::unique_ptr<RaspLatte::SimulatedMachine>> sims;
+  for (int i = 0; i < simulated; i++){
+    sims.emplace_back(new RaspLatte::SimulatedMachine(sim_config));
+    host.add(sims.back()->machine());
+  }
+  std::vector<RaspLatte::EspressoMachine*> machines;
+  if (local) machines.push_back(local.get());
+  for (std::unique_ptr<RaspLatte::SimulatedMachine> & s : sims) machines.push_back(s->machine());
+
+  // One circuit for every heater
+  std::unique_ptr<RaspLatte::PowerScheduler> power;
+  if (power_cap >= 0){
+    RaspLatte::PowerScheduler::PowerBudget budget = RaspLatte::PowerScheduler::defaultBudget();
+    budget.max_watts = power_cap;
+    power.reset(new RaspLatte::PowerScheduler(budget));
+    if (local) power->add(hw->heaterGate(), local_config.heater_watts);
+    for (std::unique_ptr<RaspLatte::SimulatedMachine> & s : sims) power->add(s->heaterGate(), sim_config.heater_watts);
+  }
+
+  // The services that can fail to come up are built before any control thread is running, so a
+  // failure unwinds with every heater still off. Their threads are started on the service core below.
+  std::unique_ptr<RaspLatte::ConfigWatcher> config_watcher;
+  std::unique_ptr<RaspLatte::TelemetryServer> telemetry;
+  // Served where the local config says, or the simulated machines' config without one
+  const RaspLatte::MachineConfig & served = (local_path ? local_config : sim_config);
+  RaspLatte::TelemetryServer::TelemetrySettings telemetry_settings = {.address = served.telemetry_address.c_str(),
+								      .port = (port > 0 ? (uint16_t)port : served.telemetry_port),
+								      .frame_rate_hz = 10, .max_clients = 16,
+								      .client_buffer_bytes = 64*1024};
+  if (served.telemetry_address.compare(0, 4, "127.") != 0){
+    std::cerr<<"Telemetry on "<<served.telemetry_address<<":"<<telemetry_settings.port
+	     <<" has no authentication: anyone who can reach it can change the setpoints\n";
+  }
+  try {
+    if (local) config_watcher.reset(new RaspLatte::ConfigWatcher(local_path, local->configPointer()));
+    telemetry.reset(new RaspLatte::TelemetryServer(machines[0]->stateBuffer(), machines[0]->commands(),
+						   telemetry_settings));
+  } catch (const char * e) {
+    std::cerr<<e<<"\n";
+    return 1;
+  }
+  for (size_t i = 1; i < machines.size(); i++) telemetry->addMachine(machines[i]->stateBuffer(), machines[i]->commands());
+  if (status_sec > 0) telemetry->setStatusLog(stdout, status_sec);
+
+  // Control threads first so they don't inherit the service thread's core and priority
+  host.start();
+  if (power) power->start();
+  RaspLatte::MachineHost::becomeServiceThread();
+  if (local) recorder->start();
+
+  // Everything from here on shares the service core
+  if (config_watcher) config_watcher->start();
+  telemetry->start();
+  health.setLog(stderr);
+  health.start();
+
+  signal(SIGINT, requestStop);
+  signal(SIGTERM, requestStop);
+  std::chrono::steady_clock::time_point next_status = std::chrono::steady_clock::now();
+  while (!stop_requested.load()){
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (status_sec > 0 && std::chrono::steady_clock::now() >= next_status){
+      next_status += std::chrono::duration_cast<std::chrono::steady_clock::duration>(RaspLatte::Duration(status_sec));
+      char line[128];
+      RaspLatte::SystemHealth::format(health.snapshot(), line, sizeof(line));
+      printf("health: %s\n", line);
+      fflush(stdout);
+    }
+  }
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  telemetry->stop();
+  health.stop();
+  if (config_watcher) config_watcher->stop();
+  host.stop();
+  if (power){
+    power->stop();
+    printf("Power: peak %.0fW laid out against a cap of %.0fW\n", power->peakWatts(), power_cap);
+  }
+  if (local){
+    local->setShotRecorder(NULL);
+    recorder->stop();
+  }
+
+  RaspLatte::SystemHealth::HealthSnapshot last_health = health.snapshot();
+  if (last_health.throttle_events > 0) printf("CPU throttled %u times while running\n", last_health.throttle_events);
+  for (size_t i = 0; i < machines.size(); i++){
+    const RaspLatte::LatencyHistogram & late = machines[i]->wakeLateness();
+    const RaspLatte::LatencyHistogram & tick = machines[i]->tickTime();
+    printf("machine %zu (core %d): %lu ticks, late p50 %.0fus p99 %.0fus max %.0fus, tick p99 %.0fus\n", i,
+	   host.core(i), (unsigned long)late.count(), late.percentile(0.5)*1e6, late.percentile(0.99)*1e6,
+	   late.max()*1e6, tick.percentile(0.99)*1e6);
+  }
+  return 0;
+}
@@ -1,9 +1,175 @@
 #include "../../include/RaspberryLatte/EspressoMachine.hpp"
+#include "../../include/RaspberryLatte/ConfigWatcher.hpp"
+#include "../../include/RaspberryLatte/TelemetryServer.hpp"
+#include "../../include/RaspberryLatte/FrameCapture.hpp"
+#ifndef RASPLATTE_HEADLESS
+#include "../../include/RaspberryLatte/RaspberryLatteUI.hpp"
+#endif
+#include <csignal>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <unistd.h>
 
-int main(void){
-  RaspLatte::EspressoMachine gaggia_classic(95, 150);
-  gaggia_classic.run();
-  return 0;
+namespace {
+  RaspLatte::EspressoMachine * running_machine = NULL;
+
+  void stopMachine(int){
+    if (running_machine != NULL) running_machine->stop();
+  }
+
+  /** The terminal UI, or NULL in the headless build */
+  RaspLatte::MachineUI * makeUI(RaspLatte::EspressoMachine * machine, RaspLatte::SystemHealth * health){
+#ifdef RASPLATTE_HEADLESS
+    (void)machine;
+    (void)health;
+    return NULL;
+#else
+    return new RaspLatte::RaspberryLatteUI(machine, health);
+#endif
+  }
 }
+
+/*
+ * Usage: RaspberryLatte [--headless] [CONFIG]
+ * --headless runs without the terminal UI; stop it with SIGINT or SIGTERM. The headless build
+ * (make headless) is always headless and does not link ncurses at all.
+ */
+int main(int argc, char ** argv){
+  // Config file is optional. Defaults are used if it does not exist yet.
+  std::string config_path = "/etc/raspberrylatte.conf";
+  bool headless = false;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--headless")) headless = true;
+    else config_path = argv[i];
+  }
+  RaspLatte::MachineConfig config;
+  std::string err;
+  if (access(config_path.c_str(), F_OK) == 0 && !RaspLatte::MachineConfig::load(config_path, config, err)){
+    std::cerr<<"Invalid config "<<config_path<<": "<<err<<"\n";
+    return 1;
+  }
+  RaspLatte::BoilerModel model;
+  bool have_model = false;
+  if (!config.model_path.empty()){
+    have_model = RaspLatte::BoilerModel::load(config.model_path, model, err);
+    if (!have_model) std::cerr<<"Not using the boiler model "<<config.model_path<<": "<<err<<"\n";
+  }
   
+  // The machine is scoped so the UI has been torn down before the summary is printed
+  RaspLatte::SafetySupervisor::ReactionStats stats;
+  RaspLatte::PigpioBackend gpio;
+  RaspLatte::HardwareContext hw(&gpio, config.pins, config.cascade.enabled);
+  {
+    // Hardware, controller, supervisor, then the first heater decision. Everything else can wait.
+    hw.bringUp();
+    RaspLatte::EspressoMachine gaggia_classic(config, &hw);
+    if (have_model) gaggia_classic.setBoilerModel(model);
+    RaspLatte::ShotArchiveWriter archive(config.archive_path);
+    int64_t unix_ms_at_zero = RaspLatte::ShotRecorder::wallOffsetMs(RaspLatte::steadyClock());
+    RaspLatte::ShotRecorder recorder(&archive, unix_ms_at_zero, config.machine_id);
+    RaspLatte::FrameCapture capture(config.capture_path, unix_ms_at_zero);
+
+    // The supervisor watches the boiler on its own thread and can cut the heater. It reads the CPU
+    // temperature from the health sampler, which is started with the other services.
+    RaspLatte::SystemHealth health(config.health);
+    RaspLatte::LinuxWatchdog watchdog;
+    RaspLatte::SafetySupervisor * supervisor = gaggia_classic.supervisor();
+    supervisor->setCPUSensor(&health);
+    if (config.watchdog_enabled){
+      // Long enough to ride out a supervisor that is briefly starved, short enough to catch a hang
+      if (watchdog.open(5)) supervisor->setWatchdog(&watchdog);
+      else std::cerr<<"Could not open /dev/watchdog, running without the watchdog\n";
+    }
+    supervisor->start();
+    gaggia_classic.start();
+    if (hw.phaseEnd("first decision") > RaspLatte::HardwareContext::FIRST_DECISION_TARGET_MS){
+      std::cerr<<"Slow start: first heater decision after "<<hw.phaseEnd("first decision")<<"ms\n";
+    }
+
+    // The services that can fail to come up are built before the loop has a thread of its own, so a
+    // failure unwinds the machine and the hardware context, which leaves the heater off. They are
+    // started once the loop is running.
+    RaspLatte::TelemetryServer::TelemetrySettings telemetry_settings = {.address = config.telemetry_address.c_str(),
+									.port = config.telemetry_port,
+									.frame_rate_hz = 10, .max_clients = 16,
+									.client_buffer_bytes = 64*1024};
+    if (config.telemetry_address.compare(0, 4, "127.") != 0){
+      std::cerr<<"Telemetry on "<<config.telemetry_address<<":"<<config.telemetry_port
+	       <<" has no authentication: anyone who can reach it can change the setpoints\n";
+    }
+    std::unique_ptr<RaspLatte::ConfigWatcher> config_watcher;
+    std::unique_ptr<RaspLatte::TelemetryServer> telemetry;
+    try {
+      // Reload the config whenever the file changes
+      config_watcher.reset(new RaspLatte::ConfigWatcher(config_path, gaggia_classic.configPointer()));
+      // Telemetry for remote clients. 10 frames a second is plenty for a phone.
+      telemetry.reset(new RaspLatte::TelemetryServer(gaggia_classic.stateBuffer(), gaggia_classic.commands(),
+						     telemetry_settings));
+    } catch (const char * e) {
+      std::cerr<<e<<"\n";
+      return 1;
+    }
+
+    // Stop cleanly on a signal so the heater is left off and the shot archive is flushed
+    running_machine = &gaggia_classic;
+    signal(SIGINT, stopMachine);
+    signal(SIGTERM, stopMachine);
+
+    // The control loop runs from here on its own thread, and the services and the UI come up around
+    // it. The UI only draws what the loop publishes for it and queues commands.
+    std::unique_ptr<RaspLatte::MachineUI> ui(headless ? NULL : makeUI(&gaggia_classic, &health));
+    if (ui) gaggia_classic.enablePanel();
+    std::thread control([&gaggia_classic](){ gaggia_classic.run(); });
+
+    // Shot history
+    if (!config.archive_path.empty()){
+      if (archive.open(err)){
+	recorder.start();
+	gaggia_classic.setShotRecorder(&recorder);
+      }
+      else std::cerr<<"Not recording shots: "<<err<<"\n";
+    }
+
+    // Raw thermocouple frames, read by the supervisor
+    if (!config.capture_path.empty()){
+      if (capture.open(err)){
+	capture.start();
+	hw.thermocouple()->setCapture(&capture);
+      }
+      else std::cerr<<"Not capturing thermocouple frames: "<<err<<"\n";
+    }
+
+    config_watcher->start();
+    telemetry->start();
+    health.setLog(stderr);
+    health.start();
+    hw.mark("services");
+    hw.printPhases(std::cout);
+    std::cout.flush();
+
+    if (ui){
+      gaggia_classic.runPanel(ui.get());
+      ui.reset();
+    }
+    control.join();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    running_machine = NULL;
+    telemetry->stop();
+    health.stop();
+    config_watcher->stop();
+    supervisor->stop();
+    hw.thermocouple()->setCapture(NULL);
+    capture.stop();
+    gaggia_classic.setShotRecorder(NULL);
+    recorder.stop();
+    stats = supervisor->reactionStats();
+  }
+  std::cout<<"Safety trips: "<<stats.trips;
+  if (stats.trips) std::cout<<", reaction last "<<stats.last_sec*1000<<"ms, max "<<stats.max_sec*1000
+			    <<"ms, mean "<<stats.mean_sec*1000<<"ms";
+  std::cout<<"\n";
+  return 0;
+}
@@ -0,0 +1,200 @@
+/**
+ * Checks that the control path never touches the heap once the machine is running. The global
+ * operator new is replaced with one that counts calls while armed, and only a control loop pass
+ * (EspressoMachine::tick) or a safety pass (SafetySupervisor::poll) is ever armed. Startup, the
+ * scenario script and the simulator itself allocate freely.
+ *
+ * The scenario covers everything the loop reacts to: warm-up, shots, steam, remote setpoint, gain
+ * and mode changes, config reloads with gain scheduling and the adaptive loop rate switched on and
+ * off, and a thermocouple fault. Shots are recorded to a scratch archive by a ShotRecorder on its
+ * own thread. Exits 1 if a single allocation happened while armed.
+ *
+ * Usage: alloc_check [--hours N]
+ */
+#include "../../include/RaspberryLatte/EspressoMachine.hpp"
+#include "../../include/RaspberryLatte/Simulation.hpp"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using namespace RaspLatte;
+
+namespace {
+  // Only the thread running the control path is armed. The shot writer may allocate meanwhile.
+  thread_local bool armed = false;
+  std::atomic<unsigned long> armed_news{0};
+
+  void * counted(size_t size){
+    if (armed) armed_news++;
+    void * p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+  }
+}
+
+void * operator new(size_t size){ return counted(size); }
+void * operator new[](size_t size){ return counted(size); }
+void * operator new(size_t size, const std::nothrow_t &) noexcept{
+  if (armed) armed_news++;
+  return malloc(size ? size : 1);
+}
+void * operator new[](size_t size, const std::nothrow_t & nt) noexcept{ return operator new(size, nt); }
+void operator delete(void * p) noexcept{ free(p); }
+void operator delete[](void * p) noexcept{ free(p); }
+void operator delete(void * p, size_t) noexcept{ free(p); }
+void operator delete[](void * p, size_t) noexcept{ free(p); }
+
+namespace {
+  const double TICK_SEC = 0.5;
+  const double WARMUP_SEC = 20*60;
+  const double SHOT_PERIOD_SEC = 120;
+  const double SHOT_SEC = 25;
+  const double STEAM_EVERY_SEC = 30*60; // Steam for STEAM_SEC at this period
+  const double STEAM_SEC = 180;
+  const double REMOTE_EVERY_SEC = 7*60;
+  const double RELOAD_EVERY_SEC = 11*60;
+
+  /** Counts allocations in the armed regions by where they happened */
+  struct Counts{
+    unsigned long ticks = 0;
+    unsigned long polls = 0;
+    unsigned long tick_news = 0;
+    unsigned long poll_news = 0;
+    double first_t = -1; /** Virtual time of the first armed allocation */
+  };
+
+  template <typename F>
+  unsigned long armedCall(F fn){
+    unsigned long before = armed_news;
+    armed = true;
+    fn();
+    armed = false;
+    return armed_news - before;
+  }
+}
+
+int main(int argc, char ** argv){
+  double hours = 4;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--hours") && i+1 < argc) hours = atof(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [--hours N]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  MachineConfig config;
+  VirtualClock clock;
+  BoilerPlant plant(BoilerPlant::defaultParams(), 20);
+  SimulatedBackend gpio(&clock, &plant, config.pins.boiler_pwm);
+  Simulation sim(&clock);
+  gpio.setInputLevel(config.pins.pwr_switch, 1);
+  gpio.setInputLevel(config.pins.pump_switch, 1);
+  gpio.setInputLevel(config.pins.steam_switch, 1);
+  HardwareContext hw(&gpio, config.pins);
+  hw.bringUp();
+  EspressoMachine machine(config, &hw, &clock);
+  SafetySupervisor * supervisor = machine.supervisor();
+  Counts counts;
+
+  char archive_path[] = "/tmp/alloc_check_XXXXXX";
+  int fd = mkstemp(archive_path);
+  if (fd < 0){
+    perror("mkstemp");
+    return 2;
+  }
+  close(fd);
+  unlink(archive_path); // The writer wants to create it
+  ShotArchiveWriter archive(archive_path);
+  std::string err;
+  if (!archive.open(err)){
+    fprintf(stderr, "%s\n", err.c_str());
+    return 2;
+  }
+  ShotRecorder recorder(&archive, 0, 0);
+  recorder.start();
+  machine.setShotRecorder(&recorder);
+
+  // The first tick is still startup (it turns the machine on). Everything after it is checked.
+  machine.start();
+  sim.every(config.safety.period_sec, [&](){
+      unsigned long n = armedCall([&](){ supervisor->poll(); });
+      counts.polls++;
+      counts.poll_news += n;
+      if (n && counts.first_t < 0) counts.first_t = Duration(clock.now().time_since_epoch()).count();
+    });
+  sim.every(TICK_SEC, [&](){
+      unsigned long n = armedCall([&](){ machine.tick(); });
+      counts.ticks++;
+      counts.tick_news += n;
+      if (n && counts.first_t < 0) counts.first_t = Duration(clock.now().time_since_epoch()).count();
+    });
+
+  double end = hours*3600;
+  for (double t = WARMUP_SEC; t + SHOT_SEC < end; t += SHOT_PERIOD_SEC){
+    sim.at(TimePoint(Duration(t)), [&](){
+	gpio.setInputLevel(config.pins.pump_switch, 0);
+	gpio.setPump(true);
+      });
+    sim.at(TimePoint(Duration(t + SHOT_SEC)), [&](){
+	gpio.setInputLevel(config.pins.pump_switch, 1);
+	gpio.setPump(false);
+      });
+  }
+  for (double t = STEAM_EVERY_SEC; t < end; t += STEAM_EVERY_SEC){
+    sim.at(TimePoint(Duration(t)), [&](){ gpio.setInputLevel(config.pins.steam_switch, 0); });
+    sim.at(TimePoint(Duration(t + STEAM_SEC)), [&](){ gpio.setInputLevel(config.pins.steam_switch, 1); });
+  }
+
+  // Remote clients cycle through every command type. More than a tick's worth at once on purpose.
+  int remote_round = 0;
+  sim.every(REMOTE_EVERY_SEC, [&](){
+      int r = remote_round++;
+      CommandQueue * q = machine.commands();
+      for (int i = 0; i < 40; i++){
+	q->push({Command::SET_SETPOINT, BREW, 93.0 + (r + i)%4, {0, 0, 0}});
+      }
+      q->push({Command::ADJUST_SETPOINT, BREW, (r%2 ? 0.25 : -0.25), {0, 0, 0}});
+      q->push({Command::SET_GAINS, (r%2 ? STEAM : BREW), 0, {90.0 + r%20, 0.2, 240}});
+      q->push({(r%3 ? Command::CLEAR_MODE : Command::SET_MODE), STEAM, 0, {0, 0, 0}});
+    });
+
+  // Config reloads, flipping gain scheduling and the adaptive loop rate each time. The watcher's reclaim runs here too.
+  int reloads = 0;
+  sim.every(RELOAD_EVERY_SEC, [&](){
+      MachineConfig * next = new MachineConfig(config);
+      next->version = ++reloads;
+      next->schedule_enabled = (reloads%2 == 1);
+      next->loop.adaptive = (reloads%2 == 1);
+      next->temps.brew = 94 + reloads%3;
+      machine.configPointer()->publish(next);
+    });
+  sim.every(1, [&](){ machine.configPointer()->reclaim(); });
+
+  // Open the thermocouple for a few seconds partway through so the trip and recovery paths run
+  sim.at(TimePoint(Duration(end/2)), [&](){ gpio.setThermocoupleFault(MAX31855_ERR_OPEN_CIRCUIT); });
+  sim.at(TimePoint(Duration(end/2 + 3)), [&](){ gpio.setThermocoupleFault(0); });
+
+  sim.runFor(end);
+  machine.setShotRecorder(NULL);
+  recorder.stop();
+  recorder.flush();
+  unlink(archive_path);
+  unlink((std::string(archive_path) + ".idx").c_str());
+
+  printf("%.1f hours simulated: %lu control ticks, %lu safety polls, %d config reloads, %lu trips, %lu shots recorded\n",
+	 hours, counts.ticks, counts.polls, reloads, (unsigned long)supervisor->reactionStats().trips,
+	 recorder.recorded());
+  printf("Allocations on the control path: %lu in ticks, %lu in safety polls\n", counts.tick_news, counts.poll_news);
+  if (counts.tick_news || counts.poll_news){
+    printf("FAIL: first allocation at t=%.1fs\n", counts.first_t);
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,238 @@
+/**
+ * Fits a model of the boiler to logged heater and temperature data (see SystemID) and writes it
+ * where the controller (model.path in doc/raspberrylatte.conf) and bin/simulate --model can load it.
+ * Logs are bin/simulate --trace CSV files or shot archives; anything not ending in .csv is read as
+ * an archive. Logs are loaded and fitted in parallel and pooled into one fit.
+ *
+ * Usage: boiler_ident [--out FILE] [--per-log] [--threads N] [--heater-watts W] [--max-dead-time SEC]
+ *                     [--holdout N] [--chunk-sec SEC] [--water-share F] [--inlet C] LOG...
+ *   --out            Write the better of the two models (by held-out error) here
+ *   --per-log        Also fit and print each log on its own
+ *   --heater-watts   Element power. The data only fixes the other powers and capacities relative to it
+ *   --holdout        Keep every N'th chunk of each log out of the fit to validate on (0 to not)
+ *   --chunk-sec      Length of those chunks
+ *   --water-share    Fraction of the heat capacity in the water for the two node model
+ *   --inlet          Temperature of the water the pump draws
+ * Suggested PID gains for the chosen model are printed too. They are a starting point for tuning.
+ */
+#include "../../include/RaspberryLatte/PID.hpp"
+#include "../../include/RaspberryLatte/SystemID.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+using namespace RaspLatte;
+
+namespace {
+  const double MIN_TEMP_RANGE = 30;
+
+  bool isTrace(const std::string & path){
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+  }
+
+  /** Run fn(thread, i) for i in [0, n) on up to threads threads */
+  template <typename F>
+  void parallelFor(size_t n, unsigned int threads, F fn){
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> pool;
+    for (unsigned int t = 0; t < std::min<size_t>(threads, n); t++){
+      pool.emplace_back([&, t](){
+	  for (size_t i; (i = next++) < n;) fn(t, i);
+	});
+    }
+    for (std::thread & th : pool) th.join();
+  }
+
+  void printFit(const SystemID::Fit & fit){
+    printf("%s model: ", (fit.nodes == 1 ? "First order plus dead time" : "Two node"));
+    if (!fit.ok){
+      printf("no fit, %s\n", fit.err.c_str());
+      return;
+    }
+    printf("%zu rows, one step rms %.4fC%s\n", fit.rows, fit.rmse, (fit.pump_fitted ? "" : ", no pump data"));
+    for (const SystemID::Estimate & e : fit.estimates){
+      printf("  %-20s %12.4g %-4s", e.name, e.value, e.unit);
+      if (std::isnan(e.ci95)) printf("\n");
+      else printf(" +- %.3g\n", e.ci95);
+    }
+    const SystemID::Validation & v = fit.validation;
+    if (v.samples) printf("  held out: %zu samples, one step rms %.4fC, simulated rms %.3fC\n", v.samples,
+			  v.oneStepRMSE(), v.simRMSE());
+  }
+
+  /** Held-out simulated error, or the training error if nothing was held out. Lower is better */
+  double score(const SystemID::Fit & fit){
+    return (fit.validation.samples ? fit.validation.simRMSE() : fit.rmse);
+  }
+
+  /** The fit that runs better on its own over data it was not fitted to. NULL if neither worked */
+  const SystemID::Fit * better(const SystemID::Fit & a, const SystemID::Fit & b){
+    if (!a.ok) return (b.ok ? &b : NULL);
+    if (!b.ok) return &a;
+    return (score(b) < score(a) ? &b : &a);
+  }
+
+  double estimate(const SystemID::Fit & fit, const char * name){
+    for (const SystemID::Estimate & e : fit.estimates){
+      if (!strcmp(e.name, name)) return e.value;
+    }
+    return 0;
+  }
+
+  /**
+   * Skogestad's SIMC PI rules on the model reduced to first order plus dead time, the fast mode
+   * split half into the lag and half into the dead time, and half a sample added for the loop.
+   * Returned in the controller's form: duty 0-255 out, C and seconds in.
+   */
+  PID::PIDGains suggestGains(const SystemID::Fit & fit, double period_sec){
+    const double MIN_CLOSED_LOOP_SEC = 10; // Any tighter and the 0.25C thermocouple steps dominate
+    double k = fit.model.gain()/255; // C per unit of duty
+    double fast = estimate(fit, "fast time constant");
+    double tau = estimate(fit, (fit.nodes == 1 ? "time constant" : "slow time constant")) + fast/2;
+    double theta = fit.model.dead_time_sec + fast/2 + period_sec/2;
+    double tc = std::fmax(theta, MIN_CLOSED_LOOP_SEC);
+    double kc = tau/(k*(tc + theta));
+    return {kc, kc/std::fmin(tau, 4*(tc + theta)), 0};
+  }
+}
+
+int main(int argc, char ** argv){
+  SystemID::Options opts;
+  const char * out_path = NULL;
+  bool per_log = false;
+  unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--out") && i+1 < argc) out_path = argv[++i];
+    else if (!strcmp(argv[i], "--per-log")) per_log = true;
+    else if (!strcmp(argv[i], "--threads") && i+1 < argc) threads = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--heater-watts") && i+1 < argc) opts.heater_watts = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--max-dead-time") && i+1 < argc) opts.max_dead_time_sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--holdout") && i+1 < argc) opts.holdout_every = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--chunk-sec") && i+1 < argc) opts.chunk_sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--water-share") && i+1 < argc) opts.water_share = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--inlet") && i+1 < argc) opts.inlet_temp = atof(argv[++i]);
+    else if (argv[i][0] == '-'){
+      fprintf(stderr, "Usage: %s [--out FILE] [--per-log] [--threads N] [--heater-watts W] [--max-dead-time SEC] "
+	      "[--holdout N] [--chunk-sec SEC] [--water-share F] [--inlet C] LOG...\n", argv[0]);
+      return 2;
+    }
+    else paths.push_back(argv[i]);
+  }
+  if (paths.empty()){
+    fprintf(stderr, "No logs given\n");
+    return 2;
+  }
+  if (!(opts.heater_watts > 0 && opts.water_share > 0 && opts.water_share < 1 && opts.chunk_sec > 0)){
+    fprintf(stderr, "--heater-watts and --chunk-sec must be positive and --water-share in (0, 1)\n");
+    return 2;
+  }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::vector<ThermalLog> logs(paths.size());
+  std::vector<std::string> errs(paths.size());
+  std::vector<char> loaded(paths.size());
+  parallelFor(paths.size(), threads, [&](unsigned int, size_t i){
+      loaded[i] = (isTrace(paths[i]) ? ThermalLog::loadTrace(paths[i], logs[i], errs[i])
+		   : ThermalLog::loadArchive(paths[i], logs[i], errs[i]));
+    });
+  size_t samples = 0;
+  for (size_t i = 0; i < paths.size(); i++){
+    if (!loaded[i]){
+      fprintf(stderr, "%s\n", errs[i].c_str());
+      return 1;
+    }
+    samples += logs[i].samples();
+  }
+  opts.period_sec = logs[0].period_sec;
+
+  // Each thread pools the logs it takes, then the pools are merged
+  std::vector<SystemID> pools(std::min<size_t>(threads, logs.size()), SystemID(opts));
+  std::vector<std::array<SystemID::Fit, 2>> log_fits(per_log ? logs.size() : 0);
+  std::vector<char> skipped(logs.size());
+  parallelFor(logs.size(), threads, [&](unsigned int t, size_t i){
+      if (!per_log){
+	skipped[i] = !pools[t].add(logs[i]);
+	return;
+      }
+      SystemID one(opts);
+      skipped[i] = !one.add(logs[i]);
+      for (int nodes = 1; nodes <= 2; nodes++){
+	SystemID::Fit & f = log_fits[i][nodes - 1];
+	f = one.fit(nodes);
+	f.validation = one.validate(f, logs[i]);
+      }
+      pools[t].merge(one);
+    });
+  for (size_t i = 1; i < pools.size(); i++) pools[0].merge(pools[i]);
+  const SystemID & id = pools[0];
+  for (size_t i = 0; i < logs.size(); i++){
+    if (skipped[i]) fprintf(stderr, "%s: sample period %.3fs is not %.3fs, skipped\n", logs[i].name.c_str(),
+			    logs[i].period_sec, opts.period_sec);
+  }
+
+  SystemID::Fit fits[2] = {id.fit(1), id.fit(2)};
+  for (SystemID::Fit & fit : fits){
+    std::vector<SystemID::Validation> parts(logs.size());
+    parallelFor(logs.size(), threads, [&](unsigned int, size_t i){ parts[i] = id.validate(fit, logs[i]); });
+    for (const SystemID::Validation & v : parts) fit.validation.add(v);
+  }
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (per_log){
+    for (size_t i = 0; i < logs.size(); i++){
+      if (skipped[i]) continue;
+      printf("%s: ", logs[i].name.c_str());
+      const SystemID::Fit * f = better(log_fits[i][0], log_fits[i][1]);
+      if (f == NULL){
+	printf("no fit, %s\n", log_fits[i][0].err.c_str());
+	continue;
+      }
+      printf("%s, gain %.4g C, time constant %.4g s", (f->nodes == 1 ? "first order" : "two node"),
+	     f->model.gain(), estimate(*f, (f->nodes == 1 ? "time constant" : "slow time constant")));
+      if (f->nodes == 2) printf(" and %.3g s", estimate(*f, "fast time constant"));
+      printf(", dead time %.3g s, ambient %.3g C, held out rms %.3fC\n", f->model.dead_time_sec,
+	     f->model.plant.ambient, f->validation.simRMSE());
+    }
+  }
+  printf("%zu logs, %zu samples at %.3fs, %zu training rows, every %d'th %.0fs chunk held out\n", logs.size(),
+	 samples, opts.period_sec, id.rows(), opts.holdout_every, opts.chunk_sec);
+  if (id.tempRange() < MIN_TEMP_RANGE){
+    printf("Warning: the logs only cover %.1fC. The loss and the slow time constant need a warm-up from cold "
+	   "in the logs; shots alone are not enough.\n", id.tempRange());
+  }
+  printFit(fits[0]);
+  printFit(fits[1]);
+
+  const SystemID::Fit * best = better(fits[0], fits[1]);
+  if (best == NULL){
+    fprintf(stderr, "Neither model could be fitted\n");
+    return 1;
+  }
+  PID::PIDGains k = suggestGains(*best, opts.period_sec);
+  printf("Using the %s model. Suggested gains p %.3g i %.3g d %.3g, pump feed-forward %.0f at 95C\n",
+	 (best->nodes == 1 ? "first order" : "two node"), k.p, k.i, k.d, best->model.pumpFeedForward(95));
+
+  if (out_path){
+    char comment[512];
+    snprintf(comment, sizeof(comment), "Fitted by boiler_ident from %zu logs (%zu samples at %.3fs)\n"
+	     "%s model, one step rms %.4fC, held out simulated rms %.3fC over %zu samples\n"
+	     "Suggested gains p %.3g i %.3g d %.3g", logs.size(), samples, opts.period_sec,
+	     (best->nodes == 1 ? "First order" : "Two node"), best->rmse, best->validation.simRMSE(),
+	     best->validation.samples, k.p, k.i, k.d);
+    std::string err;
+    if (!best->model.save(out_path, comment, err)){
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+    }
+  }
+  fprintf(stderr, "%zu samples fitted in %.3fs on %u threads\n", samples, sec, threads);
+  return 0;
+}
@@ -0,0 +1,222 @@
+/**
+ * Compares cascade control (cascade.enabled, see CascadeControl) with a single boiler loop on a
+ * simulated machine whose group head is a lump of its own (BoilerPlant::groupHeadParams()). The
+ * single loop holds the boiler at the group target plus a guessed offset, --guess C, as a barista
+ * would set it; the cascade holds the group at the target itself.
+ *
+ * Each run warms up from cold, idles, then pulls shots. Printed for each: when the group first
+ * came within 1C of the target and how far it overshot, its error at the end of the warm-up, and
+ * its mean error at the start of each shot; for the cascade also the time its outer integral was
+ * held, the group sensor reads per second and the CPU time per tick.
+ *
+ * A group thermocouple fault is then injected into the cascade while it idles. The boiler setpoint
+ * must hold through it and not jump when the sensor comes back.
+ *
+ * Fails if the cascade is not within 0.5C of the target at the end of the warm-up, overshoots by
+ * more than 1C, does worse than the single loop at the start of the shots, or mishandles the fault.
+ *
+ * Usage: cascade_check [--config FILE] [--target C] [--guess C] [--shots N]
+ */
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace RaspLatte;
+
+namespace {
+  const double WARMUP_SEC = 1800;
+  const double IDLE_SEC = 600;
+  const double SHOT_PERIOD_SEC = 120;
+  const double SHOT_SEC = 25;
+  const double METER_SEC = 0.5;
+  const double FAULT_AT_SEC = 300; /** Into the idle */
+  const double FAULT_SEC = 20;
+
+  int failures = 0;
+
+  void check(bool ok, const char * what){
+    if (!ok){
+      printf("FAIL: %s\n", what);
+      failures++;
+    }
+  }
+
+  struct RunResult{
+    double settle_sec = -1; /** When the group first came within 1C of the target */
+    double overshoot = 0; /** Furthest the group went over the target */
+    double warm_error = 0; /** Group error at the end of the warm-up */
+    double shot_error = 0; /** Mean absolute group error at the start of the shots */
+    double held_fraction = 0; /** Of outer updates with the integral held */
+    double group_reads = 0; /** Group thermocouple reads per second */
+    double tick_us = 0;
+    double fault_step = 0; /** Largest change in the boiler setpoint during the fault and after it */
+    unsigned long faulted_ticks = 0; /** Ticks the cascade saw the group sensor faulted */
+  };
+
+  class Run{
+  public:
+    Run(const MachineConfig & config, double target, int shots, bool fault):
+      config_(config), target_(target), shots_(shots), fault_(fault), sim_(&clock_),
+      machine_(config_, 20, &clock_, BoilerPlant::groupHeadParams()){}
+
+    RunResult go(){
+      EspressoMachine * m = machine_.machine();
+      SimulatedBackend * gpio = machine_.gpio();
+      SafetySupervisor * s = m->supervisor();
+      double shots_start = WARMUP_SEC + IDLE_SEC;
+
+      sim_.every(s->periodSec(), [s](){ s->poll(); });
+      sim_.every(EspressoMachine::LOOP_PERIOD_SEC, [this, m](){
+	  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	  m->tick();
+	  tick_ns_ += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	  ticks_++;
+	  CascadeControl * c = m->cascade();
+	  if (c != NULL && c->faulted()) r_.faulted_ticks++;
+	  else if (c != NULL){
+	    outer_updates_ += (c->groupTemp() != last_group_);
+	    held_ += (c->groupTemp() != last_group_ && c->holding());
+	    last_group_ = c->groupTemp();
+	  }
+	});
+      sim_.every(METER_SEC, [this, gpio, shots_start](){
+	  gpio->sync();
+	  double t = now(), g = machine_.plant()->groupTemp();
+	  if (r_.settle_sec < 0 && std::fabs(g - target_) <= 1) r_.settle_sec = t;
+	  if (t < shots_start) r_.overshoot = std::max(r_.overshoot, g - target_);
+	});
+      sim_.after(WARMUP_SEC, [this](){ r_.warm_error = machine_.plant()->groupTemp() - target_; });
+      for (int i = 0; i < shots_; i++){
+	double start = shots_start + i*SHOT_PERIOD_SEC;
+	sim_.after(start, [this, gpio](){
+	    r_.shot_error += std::fabs(machine_.plant()->groupTemp() - target_)/shots_;
+	    gpio->setInputLevel(config_.pins.pump_switch, 0);
+	    gpio->setPump(true);
+	  });
+	sim_.after(start + SHOT_SEC, [gpio, this](){
+	    gpio->setInputLevel(config_.pins.pump_switch, 1);
+	    gpio->setPump(false);
+	  });
+      }
+      if (fault_) injectFault(WARMUP_SEC + FAULT_AT_SEC);
+
+      unsigned long spi_before = gpio->spiReads();
+      sim_.runFor(shots_start + shots_*SHOT_PERIOD_SEC);
+      // Every read but the supervisor's is the group sensor's
+      double sec = now();
+      r_.group_reads = (gpio->spiReads() - spi_before - sec/s->periodSec())/sec;
+      r_.tick_us = tick_ns_/ticks_/1000;
+      r_.held_fraction = (outer_updates_ ? (double)held_/outer_updates_ : 0);
+      return r_;
+    }
+
+  private:
+    MachineConfig config_;
+    double target_;
+    int shots_;
+    bool fault_;
+    VirtualClock clock_;
+    Simulation sim_;
+    SimulatedMachine machine_;
+    RunResult r_;
+    double tick_ns_ = 0;
+    unsigned long ticks_ = 0;
+    unsigned long outer_updates_ = 0;
+    unsigned long held_ = 0;
+    double last_group_ = -1;
+
+    double now(){ return Duration(clock_.now().time_since_epoch()).count(); }
+
+    /** Open the group thermocouple for FAULT_SEC and watch the boiler setpoint until well after */
+    void injectFault(double at){
+      EspressoMachine * m = machine_.machine();
+      SimulatedBackend * gpio = machine_.gpio();
+      sim_.after(at, [this, m, gpio](){
+	  fault_setpoint_ = m->boiler()->setpoint();
+	  gpio->setGroupFault(MAX31855_ERR_OPEN_CIRCUIT);
+	});
+      sim_.after(at + FAULT_SEC, [gpio](){ gpio->setGroupFault(0); });
+      // Through the fault and a few outer updates after it
+      for (double t = at + METER_SEC; t < at + FAULT_SEC + 10; t += METER_SEC){
+	sim_.after(t, [this, m](){
+	    double sp = m->boiler()->setpoint();
+	    r_.fault_step = std::max(r_.fault_step, std::fabs(sp - fault_setpoint_));
+	    fault_setpoint_ = sp;
+	  });
+      }
+    }
+    double fault_setpoint_ = 0;
+  };
+
+  void print(const char * name, const RunResult & r, bool cascade){
+    printf("%s\n", name);
+    printf("  Group within 1C after %.0fs, overshoot %.2fC, error %+.2fC after the warm-up, %.2fC at shot starts\n",
+	   r.settle_sec, r.overshoot, r.warm_error, r.shot_error);
+    printf("  %.2fus per tick", r.tick_us);
+    if (cascade) printf(", %.2f group reads/s, outer integral held %.0f%% of updates", r.group_reads,
+			100*r.held_fraction);
+    printf("\n");
+  }
+}
+
+int main(int argc, char ** argv){
+  MachineConfig config;
+  std::string err;
+  double target = 93;
+  double guess = 8;
+  int shots = 5;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--config") && i+1 < argc){
+      if (!MachineConfig::load(argv[++i], config, err)){
+	fprintf(stderr, "Invalid config %s: %s\n", argv[i], err.c_str());
+	return 2;
+      }
+    }
+    else if (!strcmp(argv[i], "--target") && i+1 < argc) target = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--guess") && i+1 < argc) guess = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--shots") && i+1 < argc) shots = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [--config FILE] [--target C] [--guess C] [--shots N]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (shots < 1){
+    fprintf(stderr, "Need at least one shot\n");
+    return 2;
+  }
+
+  MachineConfig single = config;
+  single.cascade.enabled = false;
+  single.temps.brew = target + guess;
+  MachineConfig cascade = config;
+  cascade.cascade.enabled = true;
+  cascade.temps.brew = target;
+  if (!single.validate(err) || !cascade.validate(err)){
+    fprintf(stderr, "Invalid settings: %s\n", err.c_str());
+    return 2;
+  }
+
+  RunResult s = Run(single, target, shots, false).go();
+  char name[64];
+  snprintf(name, sizeof(name), "Single loop, boiler at %.1fC", single.temps.brew);
+  print(name, s, false);
+  RunResult c = Run(cascade, target, shots, false).go();
+  snprintf(name, sizeof(name), "Cascade, group at %.1fC", target);
+  print(name, c, true);
+  RunResult f = Run(cascade, target, shots, true).go();
+  printf("Group sensor open for %.0fs: faulted for %.1fs, boiler setpoint moved at most %.2fC\n", FAULT_SEC,
+	 f.faulted_ticks*EspressoMachine::LOOP_PERIOD_SEC, f.fault_step);
+
+  check(std::fabs(c.warm_error) <= 0.5, "cascade within 0.5C of the target after the warm-up");
+  check(c.overshoot <= 1, "cascade overshoots the group by at most 1C");
+  check(c.shot_error <= s.shot_error, "cascade no worse than the single loop at the start of the shots");
+  check(f.faulted_ticks > 0, "the cascade sees the group sensor fault");
+  check(f.fault_step <= 0.5, "boiler setpoint holds through a group sensor fault and its recovery");
+  printf("%s\n", (failures ? "FAIL" : "OK"));
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,358 @@
+/**
+ * Closed loop control benchmarks. Each scenario drives a simulated machine on a virtual clock
+ * through a script and scores the water temperature over a measured window:
+ *
+ *   cold_start     Power on from 20C and heat to the brew setpoint
+ *   brew_steam     Switch a warm machine to steam, then back to brew with a flush to cool it
+ *   back_to_back   Five shots in quick succession
+ *   tc_glitch      Open the thermocouple for two seconds at the brew setpoint
+ *   p_only_shots   The five shots again, with a gain schedule that drops the integral while the
+ *                  pump runs, so every shot moves the output between the integral and P only
+ *
+ * The warm scenarios start with an unscored warm-up from cold. For each scenario it reports
+ *
+ *   settling_sec   Longest time after a scripted event before the water stayed within BAND_C of
+ *                  the setpoint (the whole segment if it never did)
+ *   overshoot_c    Furthest past the setpoint, on the far side from the one a segment's disturbance
+ *                  took it to, once it had come back within BAND_C
+ *   iae_c_s        Integral of the absolute temperature error over the window
+ *   energy_wh      Heater energy used in the window
+ *   cpu_us         Mean CPU time of a control loop pass
+ *
+ * The simulation is deterministic, so everything but the CPU time comes out the same on every
+ * run and any change to PID, Boiler or EspressoMachine that moves the control shows up here.
+ * --golden compares the results against a file of golden values with tolerances and exits 1 if
+ * any is out, which is how `make bench` blocks a release. Each golden line is
+ *
+ *   <scenario>.<metric> <value> <tolerance>
+ *
+ * where the tolerance is absolute, or relative with a trailing %, and a leading + only fails values
+ * above the golden one (used for CPU time, which varies with the machine). After a deliberate
+ * change, --update rewrites the golden file with the new results, keeping the tolerances.
+ *
+ * Usage: control_bench [--config FILE] [--golden FILE [--update]] [--trace DIR]
+ *   --trace   Write each scenario's trace (t,temp,setpoint,pwm,pump) to DIR/<scenario>.csv
+ */
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace RaspLatte;
+
+namespace {
+  const double BAND_C = 0.5;
+  const double METER_SEC = 0.1; // How often the water temperature is scored
+  const double WARMUP_SEC = 1200; // Unscored warm-up before the warm scenarios
+  const double SHOT_SEC = 25;
+
+  const char * METRICS[] = {"settling_sec", "overshoot_c", "iae_c_s", "energy_wh", "cpu_us"};
+  const int NUM_METRICS = sizeof(METRICS)/sizeof(METRICS[0]);
+  /** Tolerances --update gives metrics new to the golden file */
+  const char * DEFAULT_TOLERANCES[] = {"1", "0.05", "2%", "1%", "+200%"};
+
+  struct Sample{
+    double t;
+    double temp;
+    double setpoint;
+    double pwm;
+    bool pump;
+  };
+
+  /** A scenario's script, as switch flips at times relative to the start of the scored window */
+  class Bench{
+  public:
+    Bench(const MachineConfig & config, bool warm, double window_sec):
+      config_(config), warm_(warm), window_sec_(window_sec), sim_(&clock_), machine_(config_, 20, &clock_){
+      start_ = (warm_ ? WARMUP_SEC : 0);
+      EspressoMachine * m = machine_.machine();
+      pollSupervisor();
+      double period = (config_.loop.adaptive ? m->pollPeriod() : EspressoMachine::LOOP_PERIOD_SEC);
+      sim_.every(period, [this, m](){
+	  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	  bool ticked = true;
+	  if (config_.loop.adaptive) ticked = m->poll();
+	  else m->tick();
+	  if (!ticked || now() < start_) return;
+	  cpu_ns_ += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+	  ticks_++;
+	});
+      sim_.every(METER_SEC, [this, m](){
+	  if (now() < start_) return;
+	  machine_.gpio()->sync();
+	  trace_.push_back({now() - start_, machine_.plant()->temp(), m->setpoint(),
+		(double)machine_.gpio()->pwmDuty(config_.pins.boiler_pwm), m->pumpOn()});
+	});
+      segment(0);
+    }
+
+    /** Score settling from t in the window, e.g. just after a switch flip */
+    void segment(double t){ segments_.push_back(t); }
+
+    void at(double t, std::function<void()> fn){ sim_.at(TimePoint(Duration(start_ + t)), fn); }
+
+    void pump(bool on){
+      machine_.gpio()->setInputLevel(config_.pins.pump_switch, !on);
+      machine_.gpio()->setPump(on);
+    }
+    void steam(bool on){ machine_.gpio()->setInputLevel(config_.pins.steam_switch, !on); }
+    void fault(bool on){ machine_.gpio()->setThermocoupleFault(on ? 1 : 0); }
+
+    /** Control with schedule in place of the config's gains */
+    void schedule(const GainSchedule & schedule){
+      schedule_ = schedule;
+      machine_.machine()->boiler()->setGainSchedule(&schedule_);
+    }
+
+    std::map<std::string, double> run(){
+      sim_.runFor(start_);
+      double joules = machine_.plant()->heaterEnergy();
+      sim_.runFor(window_sec_);
+      joules = machine_.plant()->heaterEnergy() - joules;
+
+      std::map<std::string, double> r;
+      double settling = 0, overshoot = 0, iae = 0;
+      int side = 0; // Which side of the setpoint the segment's disturbance went. 0 until it leaves the band
+      bool back = false;
+      size_t seg = 0;
+      double seg_start = 0, seg_end = (segments_.size() > 1 ? segments_[1] : window_sec_), last_out = 0;
+      for (const Sample & s : trace_){
+	while (seg + 1 < segments_.size() && s.t >= seg_end){
+	  settling = std::max(settling, last_out - seg_start);
+	  seg++;
+	  seg_start = segments_[seg];
+	  seg_end = (seg + 1 < segments_.size() ? segments_[seg + 1] : window_sec_);
+	  last_out = seg_start;
+	  side = 0;
+	  back = false;
+	}
+	double err = s.temp - s.setpoint;
+	iae += std::fabs(err)*METER_SEC;
+	if (std::fabs(err) > BAND_C){
+	  last_out = s.t + METER_SEC;
+	  if (side == 0) side = (err > 0 ? 1 : -1);
+	}
+	else if (side != 0) back = true;
+	if (back) overshoot = std::max(overshoot, -side*err);
+      }
+      settling = std::max(settling, last_out - seg_start);
+      r["settling_sec"] = settling;
+      r["overshoot_c"] = overshoot;
+      r["iae_c_s"] = iae;
+      r["energy_wh"] = joules/3600;
+      r["cpu_us"] = (ticks_ ? cpu_ns_/ticks_/1000 : 0);
+      return r;
+    }
+
+    const std::vector<Sample> & trace(){ return trace_; }
+    const MachineConfig & config(){ return config_; }
+
+  private:
+    MachineConfig config_;
+    bool warm_;
+    double window_sec_;
+    double start_;
+    VirtualClock clock_;
+    Simulation sim_;
+    SimulatedMachine machine_;
+    GainSchedule schedule_;
+    std::vector<Sample> trace_;
+    std::vector<double> segments_;
+    double cpu_ns_ = 0;
+    unsigned long ticks_ = 0;
+
+    double now(){ return Duration(clock_.now().time_since_epoch()).count(); }
+
+    void pollSupervisor(){
+      SafetySupervisor * s = machine_.machine()->supervisor();
+      s->poll();
+      sim_.after(s->periodSec(), [this](){ pollSupervisor(); });
+    }
+  };
+
+  struct Scenario{
+    const char * name;
+    bool warm;
+    double window_sec;
+    void (*script)(Bench & b);
+  };
+
+  void shots(Bench & b){
+    for (int i = 0; i < 5; i++){
+      double start = 30 + 45*i;
+      b.segment(start);
+      b.at(start, [&b](){ b.pump(true); });
+      b.at(start + SHOT_SEC, [&b](){ b.pump(false); });
+    }
+  }
+
+  const Scenario SCENARIOS[] = {
+    {"cold_start", false, 900, [](Bench &){}},
+    {"brew_steam", true, 1000, [](Bench & b){
+	b.at(0, [&b](){ b.steam(true); });
+	// Back to brew, flushing to bring the water down as at the machine
+	b.segment(300);
+	b.at(300, [&b](){ b.steam(false); b.pump(true); });
+	b.at(440, [&b](){ b.pump(false); });
+      }},
+    {"back_to_back", true, 600, shots},
+    {"tc_glitch", true, 300, [](Bench & b){
+	b.segment(30);
+	b.at(30, [&b](){ b.fault(true); });
+	b.at(32, [&b](){ b.fault(false); });
+      }},
+    {"p_only_shots", true, 600, [](Bench & b){
+	// The brew gains, with no Ki while pumping
+	PID::PIDGains k = b.config().gains.brew;
+	const double temp = 0, err = 0;
+	GainSchedule schedule;
+	schedule.setAxes(&temp, 1, &err, 1);
+	schedule.setGains(0, 0, false, k);
+	schedule.setGains(0, 0, true, {k.p, 0, k.d});
+	schedule.build();
+	b.schedule(schedule);
+	shots(b);
+      }},
+  };
+
+  struct Golden{
+    double value;
+    std::string tolerance;
+  };
+
+  bool loadGolden(const char * path, std::map<std::string, Golden> & golden){
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)){
+      if (line.empty() || line[0] == '#') continue;
+      std::istringstream fields(line);
+      std::string name;
+      Golden g;
+      if (fields >> name >> g.value >> g.tolerance) golden[name] = g;
+    }
+    return true;
+  }
+
+  bool writeGolden(const char * path, const std::map<std::string, Golden> & golden){
+    FILE * f = fopen(path, "w");
+    if (f == NULL) return false;
+    fprintf(f, "# Golden control benchmark results: <scenario>.<metric> <value> <tolerance>\n");
+    fprintf(f, "# Absolute tolerance, or relative with a trailing %%. A leading + only fails higher values.\n");
+    fprintf(f, "# Regenerate with bin/control_bench --golden FILE --update after a deliberate change.\n");
+    for (const Scenario & s : SCENARIOS){
+      for (int m = 0; m < NUM_METRICS; m++){
+	std::string name = std::string(s.name) + "." + METRICS[m];
+	std::map<std::string, Golden>::const_iterator g = golden.find(name);
+	if (g != golden.end()) fprintf(f, "%s %.6g %s\n", name.c_str(), g->second.value, g->second.tolerance.c_str());
+      }
+    }
+    return fclose(f) == 0;
+  }
+
+  /** True if value is within the golden tolerance */
+  bool within(double value, const Golden & g){
+    const char * tol = g.tolerance.c_str();
+    bool upper_only = (*tol == '+');
+    if (upper_only) tol++;
+    double t = atof(tol);
+    if (strchr(tol, '%') != NULL) t *= std::fabs(g.value)/100;
+    if (upper_only) return value <= g.value + t;
+    return std::fabs(value - g.value) <= t;
+  }
+
+  void writeTrace(const std::string & path, const std::vector<Sample> & trace){
+    FILE * f = fopen(path.c_str(), "w");
+    if (f == NULL){
+      fprintf(stderr, "Can't write %s\n", path.c_str());
+      return;
+    }
+    fprintf(f, "t,temp,setpoint,pwm,pump\n");
+    for (const Sample & s : trace) fprintf(f, "%.1f,%.3f,%.2f,%.0f,%d\n", s.t, s.temp, s.setpoint, s.pwm, (int)s.pump);
+    fclose(f);
+  }
+}
+
+int main(int argc, char ** argv){
+  MachineConfig config;
+  std::string err;
+  const char * golden_path = NULL;
+  const char * trace_dir = NULL;
+  bool update = false;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--config") && i+1 < argc){
+      if (!MachineConfig::load(argv[++i], config, err)){
+	fprintf(stderr, "Invalid config %s: %s\n", argv[i], err.c_str());
+	return 2;
+      }
+    }
+    else if (!strcmp(argv[i], "--golden") && i+1 < argc) golden_path = argv[++i];
+    else if (!strcmp(argv[i], "--update")) update = true;
+    else if (!strcmp(argv[i], "--trace") && i+1 < argc) trace_dir = argv[++i];
+    else {
+      fprintf(stderr, "Usage: %s [--config FILE] [--golden FILE [--update]] [--trace DIR]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (update && golden_path == NULL){
+    fprintf(stderr, "--update needs --golden FILE\n");
+    return 2;
+  }
+
+  std::map<std::string, Golden> golden;
+  if (golden_path != NULL && !loadGolden(golden_path, golden) && !update){
+    fprintf(stderr, "Can't read %s\n", golden_path);
+    return 2;
+  }
+
+  int failed = 0;
+  printf("%-28s %12s %12s %10s\n", "metric", "result", "golden", "tolerance");
+  for (const Scenario & s : SCENARIOS){
+    Bench bench(config, s.warm, s.window_sec);
+    s.script(bench);
+    std::map<std::string, double> r = bench.run();
+    if (trace_dir != NULL) writeTrace(std::string(trace_dir) + "/" + s.name + ".csv", bench.trace());
+
+    for (int m = 0; m < NUM_METRICS; m++){
+      std::string name = std::string(s.name) + "." + METRICS[m];
+      double value = r[name.substr(name.find('.') + 1)];
+      std::map<std::string, Golden>::iterator g = golden.find(name);
+      if (update){
+	if (g == golden.end()) golden[name] = {value, DEFAULT_TOLERANCES[m]};
+	else g->second.value = value;
+	printf("%-28s %12.4g\n", name.c_str(), value);
+      }
+      else if (g == golden.end()){
+	printf("%-28s %12.4g\n", name.c_str(), value);
+      }
+      else {
+	bool ok = within(value, g->second);
+	failed += !ok;
+	printf("%-28s %12.4g %12.4g %10s%s\n", name.c_str(), value, g->second.value, g->second.tolerance.c_str(),
+	       (ok ? "" : "  REGRESSED"));
+      }
+    }
+  }
+
+  if (update){
+    if (!writeGolden(golden_path, golden)){
+      fprintf(stderr, "Can't write %s\n", golden_path);
+      return 2;
+    }
+    printf("Updated %s\n", golden_path);
+    return 0;
+  }
+  if (golden_path == NULL) return 0;
+  if (failed) printf("FAIL: %d metrics out of tolerance\n", failed);
+  else printf("OK\n");
+  return (failed ? 1 : 0);
+}
@@ -0,0 +1,244 @@
+/**
+ * Checks SystemHealth against a fake sysfs and procfs tree written to a scratch directory: CPU
+ * temperature, throttle flags and clock, per core load from two /proc/stat samples, resident memory
+ * and context switches. It flips the firmware's throttle flags and checks the flag, the event count
+ * and the log line follow; checks the fallback to throttle_temp where the firmware does not report;
+ * and checks a missing tree reads as unknown. Exits 1 on the first wrong value.
+ *
+ * It then samples the real /sys and /proc once, prints the summary, and times a sample against
+ * opening, scanning and closing the temperature file the way the UI used to on every refresh.
+ *
+ * Usage: health_check [--samples N]
+ */
+#include "../../include/RaspberryLatte/SystemHealth.hpp"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+using namespace RaspLatte;
+
+namespace {
+  int failures = 0;
+
+  void check(bool ok, const char * what){
+    if (!ok){
+      printf("FAIL: %s\n", what);
+      failures++;
+    }
+  }
+
+  bool near(double a, double b){ return std::fabs(a - b) < 1e-3; }
+
+  void makeDirs(const std::string & path){
+    for (size_t i = 1; i <= path.size(); i++){
+      if (i == path.size() || path[i] == '/') mkdir(path.substr(0, i).c_str(), 0755);
+    }
+  }
+
+  /** Rewrite in place, as sysfs does, so descriptors SystemHealth holds see the new text */
+  void writeFile(const std::string & path, const std::string & text){
+    makeDirs(path.substr(0, path.find_last_of('/')));
+    FILE * f = fopen(path.c_str(), "w");
+    if (f == NULL){
+      perror(path.c_str());
+      exit(2);
+    }
+    fputs(text.c_str(), f);
+    fclose(f);
+  }
+
+  /** /proc/stat with four cores, each with the given busy and idle jiffies */
+  std::string statText(const unsigned long busy[4], const unsigned long idle[4]){
+    char line[128];
+    unsigned long total_busy = 0, total_idle = 0;
+    std::string cores;
+    for (int i = 0; i < 4; i++){
+      // user nice system idle iowait irq softirq steal
+      snprintf(line, sizeof(line), "cpu%d %lu 0 0 %lu 0 0 0 0 0 0\n", i, busy[i], idle[i]);
+      cores += line;
+      total_busy += busy[i];
+      total_idle += idle[i];
+    }
+    snprintf(line, sizeof(line), "cpu  %lu 0 0 %lu 0 0 0 0 0 0\n", total_busy, total_idle);
+    return line + cores + "intr 12345 0 0 0\nctxt 999\n";
+  }
+
+  std::string statusText(long rss_kb, unsigned long voluntary, unsigned long involuntary){
+    char text[256];
+    snprintf(text, sizeof(text), "Name:\tRaspberryLatte\nVmPeak:\t  9000 kB\nVmRSS:\t  %ld kB\nThreads:\t6\n"
+	     "voluntary_ctxt_switches:\t%lu\nnonvoluntary_ctxt_switches:\t%lu\n", rss_kb, voluntary, involuntary);
+    return text;
+  }
+
+  void checkFakeTree(){
+    char dir_template[] = "/tmp/health_check_XXXXXX";
+    if (mkdtemp(dir_template) == NULL){
+      perror("mkdtemp");
+      exit(2);
+    }
+    std::string root = dir_template;
+    std::string sys = root + "/sys", proc = root + "/proc";
+    std::string temp = sys + "/class/thermal/thermal_zone0/temp";
+    std::string throttle = sys + "/devices/platform/soc/soc:firmware/get_throttled";
+    std::string freq = sys + "/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq";
+    std::string max_freq = sys + "/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq";
+    std::string stat = proc + "/stat", status = proc + "/self/status";
+
+    unsigned long busy[4] = {100, 200, 300, 400}, idle[4] = {900, 800, 700, 600};
+    writeFile(temp, "52100\n");
+    writeFile(throttle, "0x0\n");
+    writeFile(freq, "600000\n");
+    writeFile(max_freq, "1500000\n");
+    writeFile(stat, statText(busy, idle));
+    writeFile(status, statusText(4096, 10, 2));
+
+    SystemHealth::HealthSettings settings = SystemHealth::defaultSettings();
+    settings.sys_root = sys;
+    settings.proc_root = proc;
+    SystemHealth health(settings);
+    char log_path[] = "/tmp/health_check_log_XXXXXX";
+    int log_fd = mkstemp(log_path);
+    FILE * log = fdopen(log_fd, "w+");
+    health.setLog(log);
+
+    health.sample();
+    SystemHealth::HealthSnapshot s = health.snapshot();
+    check(s.seq == 1, "first sample is counted");
+    check(near(s.cpu_temp, 52.1) && near(health.read(), 52.1), "CPU temperature in C");
+    check(s.throttle_flags == 0 && !s.throttled && !health.throttled(), "not throttled at 0x0");
+    check(near(s.freq_mhz, 600) && near(s.max_freq_mhz, 1500), "clock in MHz");
+    check(s.cores == 4 && s.load == 0, "four cores, no load until a second sample");
+    check(s.rss_kb == 4096 && s.voluntary_switches == 10 && s.involuntary_switches == 2, "status fields");
+
+    // Core i does 100*(i+1) more busy jiffies out of 400
+    for (int i = 0; i < 4; i++){
+      busy[i] += 100*(i+1);
+      idle[i] += 400 - 100*(i+1);
+    }
+    writeFile(stat, statText(busy, idle));
+    writeFile(status, statusText(5120, 15, 7));
+    writeFile(throttle, "0x50005\n"); // Under-voltage and throttled now, plus the sticky bits
+    writeFile(temp, "81250\n");
+    health.sample();
+    s = health.snapshot();
+    check(near(s.core_load[0], 0.25) && near(s.core_load[1], 0.5) && near(s.core_load[2], 0.75)
+	  && near(s.core_load[3], 1), "per core load from the /proc/stat deltas");
+    check(near(s.load, 0.625), "total load");
+    check(s.rss_kb == 5120 && s.involuntary_switches == 7 && s.involuntary_per_sec > 0, "preemptions counted");
+    check(s.throttle_flags == 0x50005 && s.throttled && health.throttled() && s.throttle_events == 1,
+	  "throttled at 0x50005");
+
+    writeFile(throttle, "0x50000\n"); // Only the sticky bits: it has passed
+    health.sample();
+    health.sample();
+    s = health.snapshot();
+    check(!s.throttled && s.throttle_events == 1, "throttling ends when only the sticky bits are left");
+
+    fflush(log);
+    rewind(log);
+    char line[256];
+    int starts = 0, ends = 0;
+    while (fgets(line, sizeof(line), log) != NULL){
+      if (strstr(line, "CPU throttled (flags 0x50005") != NULL) starts++;
+      if (strstr(line, "no longer throttled") != NULL) ends++;
+    }
+    check(starts == 1 && ends == 1, "throttling logged once when it starts and once when it stops");
+    fclose(log);
+    unlink(log_path);
+
+    char summary[128];
+    SystemHealth::format(s, summary, sizeof(summary));
+    check(strstr(summary, "cpu 81.2C") != NULL && strstr(summary, "rss 5.0MB") != NULL, "summary line");
+
+    // No firmware flags: a hot CPU counts as throttled
+    unlink(throttle.c_str());
+    SystemHealth fallback(settings);
+    fallback.sample();
+    s = fallback.snapshot();
+    check(s.throttle_flags == -1 && s.throttled, "throttle_temp stands in for missing firmware flags");
+
+    // Nothing there at all
+    settings.sys_root = root + "/missing";
+    settings.proc_root = root + "/missing";
+    SystemHealth missing(settings);
+    missing.sample();
+    s = missing.snapshot();
+    check(s.cpu_temp == -1 && s.throttle_flags == -1 && !s.throttled && s.cores == 0 && s.rss_kb == -1,
+	  "a missing tree reads as unknown");
+
+    // A started sampler samples on its own
+    settings.sys_root = sys;
+    settings.proc_root = proc;
+    settings.period_sec = 0.01;
+    SystemHealth threaded(settings);
+    threaded.start();
+    std::chrono::steady_clock::time_point give_up = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (threaded.snapshot().seq < 3 && std::chrono::steady_clock::now() < give_up){
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    threaded.stop();
+    check(threaded.snapshot().seq >= 3, "the thread samples every period");
+
+    const std::string files[] = {temp, freq, max_freq, stat, status};
+    for (const std::string & f : files) unlink(f.c_str());
+    std::string dirs[] = {"/proc/self", "/proc", "/sys/devices/system/cpu/cpu0/cpufreq", "/sys/devices/system/cpu/cpu0",
+			  "/sys/devices/system/cpu", "/sys/devices/platform/soc/soc:firmware", "/sys/devices/platform/soc",
+			  "/sys/devices/platform", "/sys/devices/system", "/sys/devices", "/sys/class/thermal/thermal_zone0",
+			  "/sys/class/thermal", "/sys/class", "/sys", ""};
+    for (const std::string & d : dirs) rmdir((root + d).c_str());
+  }
+
+  /** The old way: open, scan and close on every read */
+  double fopenTemp(const char * path){
+    float millideg;
+    FILE * f = fopen(path, "r");
+    if (f == NULL) return -1;
+    int n = fscanf(f, "%f", &millideg);
+    fclose(f);
+    return (n == 1 ? millideg/1000 : -1);
+  }
+}
+
+int main(int argc, char ** argv){
+  int samples = 10000;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--samples") && i+1 < argc) samples = std::max(1, atoi(argv[++i]));
+    else {
+      fprintf(stderr, "Usage: %s [--samples N]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  checkFakeTree();
+
+  SystemHealth health;
+  health.sample();
+  char summary[128];
+  SystemHealth::format(health.snapshot(), summary, sizeof(summary));
+  printf("This machine: %s\n", summary);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < samples; i++) health.sample();
+  double sample_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()/samples;
+  // Where there is no thermal zone, time the same thing on a file that is always there
+  const char * temp_path = "/sys/class/thermal/thermal_zone0/temp";
+  if (access(temp_path, R_OK) != 0) temp_path = "/proc/self/status";
+  start = std::chrono::steady_clock::now();
+  volatile double sink = 0; // Keep the reads
+  for (int i = 0; i < samples; i++) sink = sink + fopenTemp(temp_path);
+  double fopen_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()/samples;
+  printf("Full sample (6 files by pread): %.1fus. Temperature alone by fopen (%s): %.1fus\n", sample_us, temp_path,
+	 fopen_us);
+
+  printf("%s\n", (failures ? "FAIL" : "OK"));
+  return (failures ? 1 : 0);
+}
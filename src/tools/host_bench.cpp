@@ -0,0 +1,120 @@
+/**
+ * Scaling benchmark for MachineHost. Runs 1, 2, 4, ... up to --max simulated machines, each ticking
+ * every --period seconds for --sec seconds, with a telemetry server on the service core reading
+ * every machine's state as clients would. For each size it prints how late machine 0 woke and how
+ * long its ticks took, and the worst p99 lateness of any machine.
+ *
+ * While every machine has a core of its own, adding machines should leave machine 0 alone. With
+ * --check the run fails if machine 0's p99 lateness at any such size is more than twice its
+ * lateness running alone, give or take CHECK_SLACK_US of timer noise. Sizes where machines share
+ * cores are reported but not checked.
+ *
+ * Usage: host_bench [--max N] [--period SEC] [--sec SEC] [--check]
+ */
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+#include "../../include/RaspberryLatte/TelemetryServer.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace RaspLatte;
+
+namespace {
+  const double CHECK_SLACK_US = 200;
+
+  struct Result{
+    int machines;
+    bool dedicated; /** Every machine had a core to itself */
+    double late_p50_us, late_p99_us, late_max_us;
+    double tick_p99_us;
+    double worst_p99_us;
+  };
+
+  Result run(int n, double period_sec, double sec){
+    MachineConfig config;
+    std::vector<std::unique_ptr<SimulatedMachine>> sims;
+    MachineHost host(period_sec);
+    for (int i = 0; i < n; i++){
+      sims.emplace_back(new SimulatedMachine(config));
+      host.add(sims.back()->machine());
+    }
+    TelemetryServer::TelemetrySettings settings = {.address = "127.0.0.1", .port = 0, .frame_rate_hz = 10,
+						   .max_clients = 4, .client_buffer_bytes = 64*1024};
+    TelemetryServer telemetry(sims[0]->machine()->stateBuffer(), sims[0]->machine()->commands(), settings);
+    for (int i = 1; i < n; i++) telemetry.addMachine(sims[i]->machine()->stateBuffer(), sims[i]->machine()->commands());
+
+    host.start();
+    // From a throwaway thread so the next size's control threads don't inherit the service priority
+    std::thread([&telemetry](){
+	MachineHost::becomeServiceThread();
+	telemetry.start();
+      }).join();
+    std::this_thread::sleep_for(std::chrono::duration<double>(sec));
+    host.stop();
+    telemetry.stop();
+
+    const LatencyHistogram & late = sims[0]->machine()->wakeLateness();
+    Result r = {n, n < MachineHost::cores(), late.percentile(0.5)*1e6, late.percentile(0.99)*1e6, late.max()*1e6,
+		sims[0]->machine()->tickTime().percentile(0.99)*1e6, 0};
+    for (std::unique_ptr<SimulatedMachine> & s : sims){
+      double p99 = s->machine()->wakeLateness().percentile(0.99)*1e6;
+      if (p99 > r.worst_p99_us) r.worst_p99_us = p99;
+    }
+    return r;
+  }
+}
+
+int main(int argc, char ** argv){
+  int max_machines = 48;
+  double period_sec = 0.01;
+  double sec = 3;
+  bool check = false;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--max") && i+1 < argc) max_machines = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--period") && i+1 < argc) period_sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--sec") && i+1 < argc) sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--check")) check = true;
+    else {
+      fprintf(stderr, "Usage: %s [--max N] [--period SEC] [--sec SEC] [--check]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (max_machines < 1 || period_sec <= 0 || sec <= 0){
+    fprintf(stderr, "--max, --period and --sec must be positive\n");
+    return 2;
+  }
+
+  int cores = MachineHost::cores();
+  printf("%d cores: core %d for services, %d for control. Tick every %.1fms for %.1fs\n", cores,
+	 MachineHost::SERVICE_CORE, (cores > 1 ? cores - 1 : 1), period_sec*1e3, sec);
+  printf("machines  own core  machine 0 late p50/p99/max (us)  tick p99 (us)  worst p99 late (us)\n");
+  std::vector<Result> results;
+  for (int n = 1; ; n = (n*2 > max_machines && n < max_machines ? max_machines : n*2)){
+    Result r = run(n, period_sec, sec);
+    results.push_back(r);
+    printf("%8d  %8s  %9.0f %6.0f %8.0f         %13.0f  %19.0f\n", r.machines, (r.dedicated ? "yes" : "no"),
+	   r.late_p50_us, r.late_p99_us, r.late_max_us, r.tick_p99_us, r.worst_p99_us);
+    fflush(stdout);
+    if (n >= max_machines) break;
+  }
+  if (!check) return 0;
+
+  double alone = results[0].late_p99_us;
+  int checked = 0, failed = 0;
+  for (const Result & r : results){
+    if (!r.dedicated) continue;
+    checked++;
+    if (r.late_p99_us > 2*alone + CHECK_SLACK_US){
+      printf("%d machines: machine 0 p99 lateness %.0fus against %.0fus alone\n", r.machines, r.late_p99_us, alone);
+      failed++;
+    }
+  }
+  if (checked == 0) printf("No size had a core per machine, nothing to check\n");
+  printf("%s\n", (failed ? "FAIL" : "OK"));
+  return (failed ? 1 : 0);
+}
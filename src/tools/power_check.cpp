@@ -0,0 +1,173 @@
+/**
+ * Checks the PowerScheduler against a simulated power meter. Several simulated machines on one
+ * circuit start from cold, some brewing and some steaming, first each on its own hardware PWM and
+ * then with every heater under a PowerScheduler capped at --cap watts. For each run the meter's
+ * peak and mean draw and how long each machine took to come within 1C of its setpoint are printed.
+ * The run fails if the scheduled peak ever goes over the cap.
+ *
+ * It then times step() with more and more heaters, which is what the scheduler costs per slot.
+ *
+ * Usage: power_check [--machines N] [--steam N] [--cap WATTS] [--minutes MIN] [--config FILE]
+ */
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+#include "../../include/RaspberryLatte/PowerScheduler.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace RaspLatte;
+
+namespace {
+  const double TICK_SEC = 0.5; // Matches EspressoMachine::LOOP_PERIOD_SEC
+
+  /** Accepts every write and reads nothing, for timing the scheduler on its own */
+  class NullBackend : public GPIOBackend{
+  public:
+    bool initialise(){ return true; }
+    void setInput(PinIndex, Pull){}
+    void setOutput(PinIndex){}
+    int read(PinIndex){ return 0; }
+    void write(PinIndex, bool){}
+    void setPWMFrequency(PinIndex, unsigned int){}
+    void pwm(PinIndex, unsigned int){}
+    int spiOpen(unsigned int, SPIBaud, unsigned int){ return 0; }
+    int spiRead(int, char *, unsigned int count){ return count; }
+    void spiClose(int){}
+  };
+
+  struct RunResult{
+    double max_watts;
+    double mean_watts;
+    unsigned long over;
+    unsigned long samples;
+    std::vector<double> ready_sec; /** When each machine first came within 1C of its setpoint. -1 if never */
+  };
+
+  RunResult run(const MachineConfig & config, int machines, int steam, double cap, double sec, bool scheduled){
+    VirtualClock clock;
+    Simulation sim(&clock);
+    PowerMeter meter(cap);
+    std::vector<std::unique_ptr<SimulatedMachine>> sims;
+    PowerScheduler::PowerBudget budget = PowerScheduler::defaultBudget();
+    budget.max_watts = cap;
+    PowerScheduler capped(budget);
+    RunResult r = {0, 0, 0, 0, std::vector<double>(machines, -1)};
+
+    for (int i = 0; i < machines; i++){
+      sims.emplace_back(new SimulatedMachine(config, 20, &clock));
+      SimulatedMachine * s = sims.back().get();
+      // The last few steam. Inverted input, 0 is closed.
+      if (i >= machines - steam) s->gpio()->setInputLevel(config.pins.steam_switch, 0);
+      meter.add(s->gpio(), config.pins.boiler_pwm, config.heater_watts);
+      if (scheduled) capped.add(s->heaterGate(), config.heater_watts);
+      sim.every(config.safety.period_sec, [s](){ s->machine()->supervisor()->poll(); });
+      sim.every(TICK_SEC, [s, i, &clock, &r](){
+	  EspressoMachine * m = s->machine();
+	  m->tick();
+	  if (r.ready_sec[i] < 0 && std::fabs(s->plant()->temp() - m->setpoint()) < 1){
+	    r.ready_sec[i] = Duration(clock.now().time_since_epoch()).count();
+	  }
+	});
+    }
+    // The meter reads every slot either way, so both runs are sampled alike
+    sim.every(capped.slotSec(), [&](){
+	if (scheduled) capped.step();
+	for (std::unique_ptr<SimulatedMachine> & s : sims) s->gpio()->sync();
+	meter.sample();
+      });
+    sim.runFor(sec);
+
+    r.max_watts = meter.maxWatts();
+    r.mean_watts = meter.meanWatts();
+    r.over = meter.samplesOverLimit();
+    r.samples = meter.samples();
+    return r;
+  }
+
+  void print(const char * name, const RunResult & r, int steam){
+    printf("%s: peak %.0fW, mean %.0fW, %lu of %lu samples over the cap\n", name, r.max_watts, r.mean_watts, r.over,
+	   r.samples);
+    int machines = (int)r.ready_sec.size();
+    for (int i = 0; i < machines; i++){
+      if (r.ready_sec[i] < 0) printf("  machine %d (%s): not at setpoint\n", i, (i >= machines - steam ? "steam" : "brew"));
+      else printf("  machine %d (%s): at setpoint after %.0fs\n", i, (i >= machines - steam ? "steam" : "brew"),
+		  r.ready_sec[i]);
+    }
+  }
+
+  /** Mean cost of step() in ns with n heaters asking for random duties that change every window */
+  double stepCost(int n, double cap_watts){
+    NullBackend gpio;
+    std::vector<std::unique_ptr<HeaterGate>> gates;
+    PowerScheduler::PowerBudget budget = PowerScheduler::defaultBudget();
+    budget.max_watts = cap_watts;
+    PowerScheduler scheduler(budget);
+    for (int i = 0; i < n; i++){
+      gates.emplace_back(new HeaterGate(&gpio, 0));
+      scheduler.add(gates.back().get(), 1300);
+      gates.back()->setMode(i % 3 ? BREW : STEAM);
+    }
+    std::mt19937 rng(39);
+    const int WINDOWS = 20000;
+    const int slots = budget.slots;
+    std::chrono::steady_clock::duration spent(0);
+    for (int w = 0; w < WINDOWS; w++){
+      for (std::unique_ptr<HeaterGate> & g : gates) g->set(rng() % 256);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int s = 0; s < slots; s++) scheduler.step();
+      spent += std::chrono::steady_clock::now() - start;
+    }
+    return std::chrono::duration<double, std::nano>(spent).count()/WINDOWS/slots;
+  }
+}
+
+int main(int argc, char ** argv){
+  int machines = 4;
+  int steam = 1;
+  double cap = 3000;
+  double minutes = 15;
+  MachineConfig config;
+  std::string err;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--machines") && i+1 < argc) machines = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--steam") && i+1 < argc) steam = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--cap") && i+1 < argc) cap = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--minutes") && i+1 < argc) minutes = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--config") && i+1 < argc){
+      if (!MachineConfig::load(argv[++i], config, err)){
+	fprintf(stderr, "Invalid config %s: %s\n", argv[i], err.c_str());
+	return 2;
+      }
+    }
+    else {
+      fprintf(stderr, "Usage: %s [--machines N] [--steam N] [--cap WATTS] [--minutes MIN] [--config FILE]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (machines < 1 || steam < 0 || steam > machines || cap <= 0 || minutes <= 0){
+    fprintf(stderr, "Need at least one machine, at most that many steaming, and a positive cap and run time\n");
+    return 2;
+  }
+
+  printf("%d machines (%d steaming) of %.0fW on a %.0fW circuit for %.0f minutes\n", machines, steam,
+	 config.heater_watts, cap, minutes);
+  RunResult free_run = run(config, machines, steam, cap, minutes*60, false);
+  print("Hardware PWM", free_run, steam);
+  RunResult sched_run = run(config, machines, steam, cap, minutes*60, true);
+  print("Scheduled", sched_run, steam);
+
+  int sizes[] = {1, 4, 16, 64};
+  for (int n : sizes){
+    printf("step() with %2d heaters: %.0fns a slot\n", n, stepCost(n, cap));
+  }
+
+  bool ok = (sched_run.over == 0);
+  printf("%s\n", (ok ? "OK" : "FAIL"));
+  return (ok ? 0 : 1);
+}
@@ -0,0 +1,101 @@
+/**
+ * Hammers an MPSCQueue of the same size as the CommandQueue from several producer threads while
+ * one consumer drains it, and checks nothing is lost, duplicated or reordered: every producer's
+ * items must come out in the order it pushed them. Every other producer pushes its items in pairs
+ * with pushAll(), and each pair must come out whole and back to back. Producers retry when the queue
+ * is full, so the full path is exercised too. Exits 1 on the first item out of order.
+ *
+ * Usage: queue_check [--producers N] [--items N]
+ */
+#include "../../include/RaspberryLatte/MachineState.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace RaspLatte;
+
+namespace {
+  struct Item{
+    uint32_t producer;
+    uint32_t seq;
+  };
+}
+
+int main(int argc, char ** argv){
+  unsigned int producers = 4;
+  uint32_t items = 1000000;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--producers") && i+1 < argc) producers = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--items") && i+1 < argc) items = (uint32_t)std::max(1, atoi(argv[++i]));
+    else {
+      fprintf(stderr, "Usage: %s [--producers N] [--items N]\n", argv[0]);
+      return 2;
+    }
+  }
+  items = std::max(2u, items & ~1u); // Whole pairs
+
+  static MPSCQueue<Item, CommandQueue::capacity()> queue;
+  std::vector<unsigned long> full(producers);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned int p = 0; p < producers; p++){
+    threads.emplace_back([&, p](){
+	for (uint32_t s = 0; s < items; s++){
+	  if (p % 2){
+	    Item pair[2] = {{p, s}, {p, s + 1}};
+	    while (!queue.pushAll(pair, 2)){
+	      full[p]++;
+	      std::this_thread::yield();
+	    }
+	    s++;
+	  }
+	  else {
+	    while (!queue.push({p, s})){
+	      full[p]++;
+	      std::this_thread::yield();
+	    }
+	  }
+	}
+      });
+  }
+
+  std::vector<uint32_t> next(producers, 0);
+  long pair_from = -1; // Producer whose pair is half out
+  unsigned long total = (unsigned long)producers*items;
+  Item item;
+  for (unsigned long n = 0; n < total;){
+    if (!queue.pop(item)){
+      std::this_thread::yield();
+      continue;
+    }
+    if (item.producer >= producers || item.seq != next[item.producer]){
+      printf("FAIL: item %u from producer %u after %lu items, expected %u\n", item.seq, item.producer, n,
+	     (item.producer < producers ? next[item.producer] : 0));
+      for (std::thread & t : threads) t.detach();
+      return 1;
+    }
+    if (pair_from >= 0 && item.producer != pair_from){
+      printf("FAIL: item %u from producer %u split producer %ld's pair\n", item.seq, item.producer, pair_from);
+      for (std::thread & t : threads) t.detach();
+      return 1;
+    }
+    pair_from = (item.producer % 2 && item.seq % 2 == 0 ? (long)item.producer : -1);
+    next[item.producer]++;
+    n++;
+  }
+  for (std::thread & t : threads) t.join();
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  unsigned long full_total = 0;
+  for (unsigned long f : full) full_total += f;
+  bool empty = !queue.pop(item);
+  printf("%lu items from %u producers in %.3fs (%.1f M/s), queue full %lu times\n", total, producers, sec,
+	 total/sec/1e6, full_total);
+  printf("%s\n", (empty ? "OK" : "FAIL: items left over"));
+  return empty ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+/**
+ * Compares the fixed control loop with the adaptive one (loop.adaptive, see LoopRate) on a simulated
+ * machine. Each run warms up from cold, idles at the brew setpoint, pulls a few shots and then
+ * steams. For every phase it prints control ticks and thermocouple reads per second, the mean
+ * heater duty, how much of the time the loop ran at its fast rate and the CPU time per tick (polls
+ * that did not tick included).
+ * It also prints how long the loop took to react to the pump and steam switches and how far the
+ * shots pulled the temperature down.
+ *
+ * Fails if the adaptive loop ticks more than the fixed one at idle, reacts slower, or lets the
+ * shots sag more than --sag-margin C further, or if either loop's first heater decision from cold
+ * leaves the heater off.
+ *
+ * Usage: rate_check [--config FILE] [--shots N] [--sag-margin C]
+ */
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace RaspLatte;
+
+namespace {
+  const double WARMUP_SEC = 600;
+  const double IDLE_SEC = 600;
+  const double SHOT_PERIOD_SEC = 120;
+  const double SHOT_SEC = 25;
+  const double STEAM_SEC = 240;
+  const double METER_SEC = 0.05; // How often duty and loop rate are sampled, the same for both runs
+  const double FLIP_OFFSET_SEC = 0.37; // Switches flip between ticks of either loop, as a person would
+
+  enum Phase{ WARMUP_PHASE, IDLE_PHASE, SHOT_PHASE, STEAM_PHASE, PHASES };
+  const char * PHASE_NAMES[PHASES] = {"warm-up", "idle", "shots", "steam"};
+
+  struct PhaseStats{
+    double sec = 0;
+    unsigned long ticks = 0;
+    unsigned long spi = 0;
+    double duty = 0; /** Sum of duty samples */
+    unsigned long fast = 0; /** Samples taken while the loop ran at its fast rate */
+    unsigned long samples = 0;
+    double tick_ns = 0; /** Sum of tick CPU times */
+  };
+
+  struct RunResult{
+    PhaseStats phases[PHASES];
+    double pump_reaction_max = 0; /** Longest from a pump switch flip to the tick that saw it */
+    double pump_reaction_sum = 0;
+    int pump_flips = 0;
+    double steam_reaction = -1;
+    double max_sag = 0; /** Furthest the water fell below the setpoint during a shot */
+    unsigned int first_duty = 0; /** Heater duty from start(), with the boiler cold */
+  };
+
+  class Run{
+  public:
+    Run(const MachineConfig & config, int shots): config_(config), shots_(shots), sim_(&clock_),
+						   machine_(config_, 20, &clock_){
+      shots_end_ = WARMUP_SEC + IDLE_SEC + shots_*SHOT_PERIOD_SEC;
+    }
+
+    RunResult go(){
+      EspressoMachine * m = machine_.machine();
+      SimulatedBackend * gpio = machine_.gpio();
+      // Steam and pump switches open. Inverted inputs, 0 is closed.
+      gpio->setInputLevel(config_.pins.steam_switch, 1);
+      gpio->setInputLevel(config_.pins.pump_switch, 1);
+      gpio->setPump(false);
+
+      pollSupervisor();
+      m->start(); // As run() would
+      r_.first_duty = gpio->pwmDuty(config_.pins.boiler_pwm);
+      if (config_.loop.adaptive) sim_.every(m->pollPeriod(), [this, m](){ control([m](){ return m->poll(); }); });
+      else sim_.every(EspressoMachine::LOOP_PERIOD_SEC, [this, m](){ control([m](){ m->tick(); return true; }); });
+      sim_.every(METER_SEC, [this, m, gpio](){
+	  gpio->sync();
+	  PhaseStats & p = r_.phases[phase()];
+	  p.duty += gpio->pwmDuty(config_.pins.boiler_pwm)/255.;
+	  p.fast += (m->tickPeriod() <= config_.loop.fast_period_sec);
+	  p.samples++;
+	  if (pumping_){
+	    double sag = m->setpoint() - machine_.plant()->temp();
+	    if (sag > r_.max_sag) r_.max_sag = sag;
+	  }
+	});
+
+      for (int i = 0; i < shots_; i++){
+	double start = WARMUP_SEC + IDLE_SEC + i*SHOT_PERIOD_SEC + FLIP_OFFSET_SEC;
+	sim_.after(start, [this](){ flipPump(true); });
+	sim_.after(start + SHOT_SEC, [this](){ flipPump(false); });
+      }
+      sim_.after(shots_end_ + FLIP_OFFSET_SEC, [this, gpio](){
+	  gpio->setInputLevel(config_.pins.steam_switch, 0);
+	  steam_flipped_ = now();
+	});
+
+      // Phases are split on the meter's clock, which also attributes ticks and reads
+      double end = shots_end_ + STEAM_SEC;
+      sim_.runFor(end);
+      for (int i = 0; i < PHASES; i++) r_.phases[i].sec = r_.phases[i].samples*METER_SEC;
+      return r_;
+    }
+
+  private:
+    MachineConfig config_;
+    int shots_;
+    double shots_end_;
+    VirtualClock clock_;
+    Simulation sim_;
+    SimulatedMachine machine_;
+    RunResult r_;
+    bool pumping_ = false;
+    double pump_flipped_ = -1;
+    double steam_flipped_ = -1;
+    unsigned long last_spi_ = 0;
+
+    double now(){ return Duration(clock_.now().time_since_epoch()).count(); }
+
+    Phase phase(){
+      double t = now();
+      if (t < WARMUP_SEC) return WARMUP_PHASE;
+      if (t < WARMUP_SEC + IDLE_SEC) return IDLE_PHASE;
+      if (t < shots_end_) return SHOT_PHASE;
+      return STEAM_PHASE;
+    }
+
+    /** The supervisor picks its own period, which the adaptive loop lengthens while idle */
+    void pollSupervisor(){
+      SafetySupervisor * s = machine_.machine()->supervisor();
+      s->poll();
+      PhaseStats & p = r_.phases[phase()];
+      unsigned long spi = machine_.gpio()->spiReads();
+      p.spi += spi - last_spi_;
+      last_spi_ = spi;
+      sim_.after(s->periodSec(), [this](){ pollSupervisor(); });
+    }
+
+    void flipPump(bool on){
+      SimulatedBackend * gpio = machine_.gpio();
+      gpio->setInputLevel(config_.pins.pump_switch, !on);
+      gpio->setPump(on);
+      pumping_ = on;
+      pump_flipped_ = now();
+    }
+
+    /** step ticks the machine, or polls it and returns whether that ticked */
+    template <typename F>
+    void control(F step){
+      EspressoMachine * m = machine_.machine();
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      bool ticked = step();
+      double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      PhaseStats & p = r_.phases[phase()];
+      p.tick_ns += ns; // Polls that did not tick count too: they are what the adaptive loop costs between ticks
+      if (!ticked) return;
+      p.ticks++;
+      if (pump_flipped_ >= 0){
+	double reaction = now() - pump_flipped_;
+	r_.pump_reaction_sum += reaction;
+	r_.pump_reaction_max = std::max(r_.pump_reaction_max, reaction);
+	r_.pump_flips++;
+	pump_flipped_ = -1;
+      }
+      if (steam_flipped_ >= 0 && m->currentMode() == STEAM){
+	r_.steam_reaction = now() - steam_flipped_;
+	steam_flipped_ = -1;
+      }
+    }
+  };
+
+  void print(const char * name, const RunResult & r){
+    printf("%s\n", name);
+    printf("  %-8s %8s %8s %8s %8s %10s\n", "phase", "ticks/s", "reads/s", "duty", "fast", "CPU/tick");
+    for (int i = 0; i < PHASES; i++){
+      const PhaseStats & p = r.phases[i];
+      if (p.samples == 0) continue;
+      printf("  %-8s %8.2f %8.2f %7.1f%% %7.1f%% %8.1fus\n", PHASE_NAMES[i], p.ticks/p.sec, p.spi/p.sec,
+	     100*p.duty/p.samples, 100.*p.fast/p.samples, (p.ticks ? p.tick_ns/p.ticks/1000 : 0));
+    }
+    printf("  Pump reaction: mean %.0fms, max %.0fms over %d flips\n",
+	   (r.pump_flips ? 1000*r.pump_reaction_sum/r.pump_flips : 0), 1000*r.pump_reaction_max, r.pump_flips);
+    printf("  Steam reaction: %.0fms\n", 1000*r.steam_reaction);
+    printf("  Shot sag: %.2fC below setpoint\n", r.max_sag);
+    printf("  First heater decision from cold: duty %u\n", r.first_duty);
+  }
+}
+
+int main(int argc, char ** argv){
+  MachineConfig config;
+  std::string err;
+  int shots = 3;
+  double sag_margin = 0.5;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--config") && i+1 < argc){
+      if (!MachineConfig::load(argv[++i], config, err)){
+	fprintf(stderr, "Invalid config %s: %s\n", argv[i], err.c_str());
+	return 2;
+      }
+    }
+    else if (!strcmp(argv[i], "--shots") && i+1 < argc) shots = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--sag-margin") && i+1 < argc) sag_margin = atof(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [--config FILE] [--shots N] [--sag-margin C]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (shots < 1){
+    fprintf(stderr, "Need at least one shot\n");
+    return 2;
+  }
+
+  MachineConfig fixed = config;
+  fixed.loop.adaptive = false;
+  MachineConfig adaptive = config;
+  adaptive.loop.adaptive = true;
+  if (!adaptive.validate(err)){
+    fprintf(stderr, "Invalid adaptive loop settings: %s\n", err.c_str());
+    return 2;
+  }
+
+  RunResult f = Run(fixed, shots).go();
+  print("Fixed", f);
+  RunResult a = Run(adaptive, shots).go();
+  print("Adaptive", a);
+
+  const PhaseStats & fi = f.phases[IDLE_PHASE], & ai = a.phases[IDLE_PHASE];
+  bool ok = (ai.ticks/ai.sec <= fi.ticks/fi.sec && a.pump_reaction_max <= f.pump_reaction_max
+	     && a.steam_reaction >= 0 && a.steam_reaction <= f.steam_reaction && a.max_sag <= f.max_sag + sag_margin
+	     && f.first_duty > 0 && a.first_duty > 0);
+  printf("%s\n", (ok ? "OK" : "FAIL"));
+  return (ok ? 0 : 1);
+}
@@ -0,0 +1,150 @@
+/**
+ * Checks how the safety supervisor handles thermocouple reads that fail on a simulated machine.
+ *
+ * The machine warms up from cold and holds the brew setpoint, then single SPI reads fail a couple
+ * of seconds apart, one for each place a poll can fall between two control ticks. The control loop
+ * should go on seeing the last good temperature: the heater duty must stay within --margin of the
+ * same run without the failures, the published temperature must never read as unavailable and
+ * nothing may trip. Reads that keep failing past safety.stale_sec must trip the heater off and hold
+ * it off until good reads have come back for the recovery time. A supervisor whose very first read
+ * fails must hold the heater off until it has a good sample.
+ *
+ * Usage: safety_check [--config FILE] [--margin DUTY]
+ */
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace RaspLatte;
+
+namespace {
+  const double WARMUP_SEC = 900;
+  const double WATCH_SEC = 12;
+  const unsigned int SPACING = 21; // Polls between injected failures. Each lands one poll later against the ticks
+
+  int failures = 0;
+
+  void check(bool ok, const char * what){
+    if (!ok){
+      printf("FAIL: %s\n", what);
+      failures++;
+    }
+  }
+
+  struct Watch{
+    unsigned int max_duty = 0;
+    unsigned int duty_while_tripped = 0; /** Highest duty seen while the gate was tripped */
+    bool unavailable = false; /** The published temperature read as unavailable */
+    bool tripped = false;
+    SafetySupervisor::Trip trip = SafetySupervisor::NONE;
+    bool tripped_at_end = false;
+  };
+
+  /** Warm up and hold the setpoint, then watch for WATCH_SEC failing `fail` reads in a row, `times` times */
+  Watch run(const MachineConfig & config, unsigned int fail, unsigned int times){
+    VirtualClock clock;
+    Simulation sim(&clock);
+    SimulatedMachine machine(config, 20, &clock);
+    EspressoMachine * m = machine.machine();
+    SafetySupervisor * s = m->supervisor();
+    HeaterGate * gate = machine.heaterGate();
+    SimulatedBackend * gpio = machine.gpio();
+    PinIndex pin = config.pins.boiler_pwm;
+    Watch w;
+    bool watching = false;
+    unsigned long polls = 0;
+
+    sim.every(s->periodSec(), [&](){
+	if (watching && polls % SPACING == 0 && polls/SPACING < times) gpio->failSPIReads(fail);
+	if (watching) polls++;
+	s->poll();
+	if (!watching) return;
+	if (s->temp() == MAX31855_TEMP_UNAVALIBLE) w.unavailable = true;
+	if (gate->tripped()){
+	  w.tripped = true;
+	  if (w.trip == SafetySupervisor::NONE) w.trip = s->trip();
+	}
+      });
+    sim.every(EspressoMachine::LOOP_PERIOD_SEC, [&](){
+	m->tick();
+	if (!watching) return;
+	unsigned int duty = gpio->pwmDuty(pin);
+	w.max_duty = std::max(w.max_duty, duty);
+	if (gate->tripped()) w.duty_while_tripped = std::max(w.duty_while_tripped, duty);
+      });
+    sim.runFor(WARMUP_SEC);
+    watching = true;
+    sim.runFor(WATCH_SEC);
+    w.tripped_at_end = gate->tripped();
+    return w;
+  }
+
+  /** A supervisor whose first read fails holds the heater off until a good sample comes in */
+  void checkFirstRead(const MachineConfig & config){
+    VirtualClock clock;
+    BoilerPlant plant(BoilerPlant::defaultParams(), 20);
+    SimulatedBackend gpio(&clock, &plant, config.pins.boiler_pwm);
+    HeaterGate gate(&gpio, config.pins.boiler_pwm);
+    MAX31855 thermo(&gpio, config.pins.thermo_cs);
+    gpio.failSPIReads(1);
+    SafetySupervisor s(&thermo, &gate, config.safety, &clock);
+    check(s.temp() == MAX31855_TEMP_UNAVALIBLE, "a failed first read publishes no temperature");
+    gate.set(255);
+    check(gate.tripped() && gpio.pwmDuty(config.pins.boiler_pwm) == 0,
+	  "the heater is held off until the first good sample");
+    for (double t = 0; t <= config.safety.recovery_sec + config.safety.period_sec; t += config.safety.period_sec){
+      clock.advance(Duration(config.safety.period_sec));
+      s.heartbeat();
+      s.poll();
+    }
+    check(!gate.tripped() && s.temp() != MAX31855_TEMP_UNAVALIBLE, "the heater is released once good samples come in");
+  }
+}
+
+int main(int argc, char ** argv){
+  MachineConfig config;
+  std::string err;
+  unsigned int margin = 5;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--config") && i+1 < argc){
+      if (!MachineConfig::load(argv[++i], config, err)){
+	fprintf(stderr, "Invalid config %s: %s\n", argv[i], err.c_str());
+	return 2;
+      }
+    }
+    else if (!strcmp(argv[i], "--margin") && i+1 < argc) margin = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [--config FILE] [--margin DUTY]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  // Enough failed reads to go stale, but not so many it can't recover within the watch
+  unsigned int stale_reads = (unsigned int)(config.safety.stale_sec/config.safety.period_sec) + 3;
+  unsigned int phases = (unsigned int)(EspressoMachine::LOOP_PERIOD_SEC/config.safety.period_sec + 0.5);
+  Watch clean = run(config, 0, 0);
+  Watch missed = run(config, 1, phases);
+  Watch stale = run(config, stale_reads, 1);
+
+  printf("Holding %.0fC, highest heater duty over %.0fs: %u clean, %u with %u single failed reads\n",
+	 config.temps.brew, WATCH_SEC, clean.max_duty, missed.max_duty, phases);
+  check(missed.max_duty <= clean.max_duty + margin, "one failed read leaves the heater duty where it was");
+  check(!missed.unavailable, "one failed read keeps the last good temperature published");
+  check(!missed.tripped, "one failed read does not trip");
+
+  printf("%u failed reads: %s, heater duty %u while tripped, %s at the end\n", stale_reads,
+	 (stale.tripped ? SafetySupervisor::tripName(stale.trip) : "no trip"), stale.duty_while_tripped,
+	 (stale.tripped_at_end ? "still tripped" : "released"));
+  check(stale.tripped && stale.trip == SafetySupervisor::STALE_DATA, "failed reads past the stale time trip");
+  check(stale.unavailable, "stale data publishes no temperature");
+  check(stale.duty_while_tripped == 0, "the heater is off while tripped");
+  check(!stale.tripped_at_end, "the heater is released once good reads come back");
+
+  checkFirstRead(config);
+
+  printf("%s\n", (failures ? "FAIL" : "OK"));
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,176 @@
+/**
+ * Scans shot archives written by ShotArchiveWriter (see archive.path in doc/raspberrylatte.conf) and
+ * aggregates the history. Only the columns a query needs are decoded.
+ *
+ * Usage: shot_query [--list] [--daily-error] [--overshoot] [--gains P,I,D] [--machine N] ARCHIVE...
+ *   --list          One line per shot, from the index alone
+ *   --daily-error   Mean and RMS of temp - setpoint while the pump ran, per UTC day (the default)
+ *   --overshoot     Worst temp - setpoint after the pump stopped, per gain set
+ *   --gains         Only shots pulled with these gains
+ *   --machine       Only shots from this machine
+ * The number of samples decoded and the scan rate go to stderr.
+ */
+#include "../../include/RaspberryLatte/ShotArchive.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <tuple>
+
+using namespace RaspLatte;
+
+namespace {
+  const int64_t DAY_MS = 86400000;
+
+  struct DayStats{
+    unsigned long shots = 0;
+    unsigned long samples = 0;
+    double err_sum = 0;
+    double err_sq_sum = 0;
+  };
+
+  struct GainStats{
+    unsigned long shots = 0;
+    double overshoot_sum = 0;
+    double overshoot_max = 0;
+  };
+
+  typedef std::tuple<double, double, double> GainKey;
+
+  void printDate(int64_t day){
+    time_t t = (time_t)(day*(DAY_MS/1000));
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    printf("%04d-%02d-%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+  }
+}
+
+int main(int argc, char ** argv){
+  bool list = false, daily = false, overshoot = false;
+  bool filter_gains = false;
+  PID::PIDGains gains = {0, 0, 0};
+  int machine = -1;
+  std::vector<const char *> paths;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--list")) list = true;
+    else if (!strcmp(argv[i], "--daily-error")) daily = true;
+    else if (!strcmp(argv[i], "--overshoot")) overshoot = true;
+    else if (!strcmp(argv[i], "--gains") && i+1 < argc){
+      if (sscanf(argv[++i], "%lf,%lf,%lf", &gains.p, &gains.i, &gains.d) != 3){
+	fprintf(stderr, "--gains takes P,I,D\n");
+	return 2;
+      }
+      filter_gains = true;
+    }
+    else if (!strcmp(argv[i], "--machine") && i+1 < argc) machine = atoi(argv[++i]);
+    else if (argv[i][0] == '-'){
+      fprintf(stderr, "Usage: %s [--list] [--daily-error] [--overshoot] [--gains P,I,D] [--machine N] ARCHIVE...\n", argv[0]);
+      return 2;
+    }
+    else paths.push_back(argv[i]);
+  }
+  if (paths.empty()){
+    fprintf(stderr, "No archives given\n");
+    return 2;
+  }
+  if (!list && !overshoot) daily = true;
+
+  std::map<int64_t, DayStats> days;
+  std::map<GainKey, GainStats> gain_sets;
+  ShotColumns cols;
+  unsigned long shots = 0, samples = 0;
+  size_t bytes = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (const char * path : paths){
+    ShotArchiveReader reader(path);
+    std::string err;
+    if (!reader.open(err)){
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+    }
+    if (reader.indexRebuilt()) fprintf(stderr, "%s: index missing or stale, rebuilt from the archive\n", path);
+    bytes += reader.archiveBytes();
+
+    for (const ShotArchiveReader::Entry & e : reader.shots()){
+      const ShotMeta & m = e.meta;
+      if (machine >= 0 && m.machine_id != machine) continue;
+      if (filter_gains && (m.gains.p != gains.p || m.gains.i != gains.i || m.gains.d != gains.d)) continue;
+      shots++;
+
+      if (list){
+	time_t t = (time_t)(m.start_ms/1000);
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	printf("%04d-%02d-%02d %02d:%02d:%02d machine %u %s setpoint %.2f gains %g,%g,%g%s pump %.1fs "
+	       "mean err %+.2f min %.2f overshoot %.2f (%u samples%s)\n",
+	       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, m.machine_id,
+	       (m.mode == STEAM ? "steam" : "brew"), m.setpoint, m.gains.p, m.gains.i, m.gains.d,
+	       (m.flags & ShotMeta::FLAG_SCHEDULED ? " scheduled" : ""), m.pump_sec, m.mean_err, m.min_temp,
+	       m.max_overshoot, m.samples, (m.flags & ShotMeta::FLAG_CUT_SHORT ? ", cut short" : ""));
+      }
+      if (!daily && !overshoot) continue;
+
+      if (!reader.read(e, ShotColumns::TEMP | ShotColumns::SETPOINT | ShotColumns::PUMP, cols)){
+	fprintf(stderr, "%s: corrupt shot at offset %llu\n", path, (unsigned long long)e.offset);
+	return 1;
+      }
+      uint32_t n = m.samples;
+      samples += n;
+      const double * temp = cols.temp.data();
+      const double * sp = cols.setpoint.data();
+      const uint8_t * pump = cols.pump.data();
+
+      if (daily){
+	DayStats & d = days[m.start_ms/DAY_MS];
+	d.shots++;
+	for (uint32_t i = 0; i < n; i++){
+	  if (!pump[i]) continue;
+	  double err = temp[i] - sp[i];
+	  d.samples++;
+	  d.err_sum += err;
+	  d.err_sq_sum += err*err;
+	}
+      }
+      if (overshoot){
+	double worst = 0;
+	bool pumped = false;
+	for (uint32_t i = 0; i < n; i++){
+	  pumped |= (pump[i] != 0);
+	  if (pumped && !pump[i]) worst = std::fmax(worst, temp[i] - sp[i]);
+	}
+	GainStats & g = gain_sets[GainKey(m.gains.p, m.gains.i, m.gains.d)];
+	g.shots++;
+	g.overshoot_sum += worst;
+	g.overshoot_max = std::fmax(g.overshoot_max, worst);
+      }
+    }
+  }
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (daily){
+    printf("%-10s %7s %9s %10s %9s\n", "day", "shots", "samples", "mean err", "rms err");
+    for (const auto & kv : days){
+      const DayStats & d = kv.second;
+      printDate(kv.first);
+      printf(" %7lu %9lu %+10.3f %9.3f\n", d.shots, d.samples, (d.samples ? d.err_sum/d.samples : 0),
+	     (d.samples ? std::sqrt(d.err_sq_sum/d.samples) : 0));
+    }
+  }
+  if (overshoot){
+    printf("%-24s %7s %15s %14s\n", "gains (p,i,d)", "shots", "mean overshoot", "max overshoot");
+    for (const auto & kv : gain_sets){
+      char key[64];
+      snprintf(key, sizeof(key), "%g,%g,%g", std::get<0>(kv.first), std::get<1>(kv.first), std::get<2>(kv.first));
+      const GainStats & g = kv.second;
+      printf("%-24s %7lu %15.3f %14.3f\n", key, g.shots, g.overshoot_sum/g.shots, g.overshoot_max);
+    }
+  }
+  fprintf(stderr, "%lu shots, %lu samples decoded in %.3fs (%.1fM samples/s), archive %.2f bytes/sample\n",
+	  shots, samples, sec, (sec > 0 ? samples/sec/1e6 : 0), (samples ? (double)bytes/samples : 0));
+  return 0;
+}
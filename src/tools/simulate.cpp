@@ -0,0 +1,306 @@
+/**
+ * Runs the espresso machine controller against a simulated boiler on a virtual clock. The default
+ * scenario is a cold start, a long warm-up, and a series of shots. Because time jumps straight from
+ * one event to the next, a 30 minute warm-up plus ten shots takes milliseconds.
+ *
+ * After the shots the steam switch is turned on for a few minutes to time the brew to steam change.
+ * The safety supervisor is polled at its configured period and kicks a simulated watchdog.
+ *
+ * Usage: simulate [--config FILE] [--warmup-min N] [--shots N] [--trace FILE] [--realtime] [--check-realtime SEC]
+ *                 [--fault-at SEC] [--archive FILE] [--model FILE]
+ *                 [--capture FILE]
+ *   --config            Machine config to use (see doc/raspberrylatte.conf)
+ *   --model             Simulate this boiler (see bin/boiler_ident) and give the controller the model
+ *   --realtime          Pace the run to wall time
+ *   --check-realtime    Run the first SEC seconds both virtually and paced to wall time and check
+ *                       the traces are identical
+ *   --fault-at          Open the thermocouple at SEC for a couple of seconds and report how quickly
+ *                       the heater was cut
+ *   --archive           Append the shots to a shot archive (see bin/shot_query). Shot times start
+ *                       at 2024-01-01 00:00 UTC
+ *   --capture           Capture the raw thermocouple frames (see bin/frame_decode)
+ */
+#include "../../include/RaspberryLatte/EspressoMachine.hpp"
+#include "../../include/RaspberryLatte/FrameCapture.hpp"
+#include "../../include/RaspberryLatte/Simulation.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace RaspLatte;
+
+namespace {
+  const double TICK_SEC = 0.5; // Matches the UI timeout that paces EspressoMachine::run()
+  const double SHOT_PERIOD_SEC = 120;
+  const double SHOT_SEC = 25;
+  const double STEAM_SEC = 240;
+  const double FAULT_SEC = 2;
+  const unsigned int WATCHDOG_TIMEOUT_SEC = 5; // Same as main.cpp
+  const int64_t ARCHIVE_EPOCH_MS = 1704067200000LL; // 2024-01-01 00:00 UTC
+
+  /** The model's boiler if there is one. Cascade control needs a group head of its own */
+  BoilerPlant::PlantParams plantParams(const MachineConfig & config, const BoilerModel * model){
+    if (model) return model->plant;
+    return (config.cascade.enabled ? BoilerPlant::groupHeadParams() : BoilerPlant::defaultParams());
+  }
+
+  struct Sample{
+    double t;
+    double temp;
+    double setpoint;
+    double pwm;
+    bool pump;
+  };
+
+  /**
+   * One simulated machine plus the scripted switch flips
+   */
+  class Scenario{
+  public:
+    Scenario(const MachineConfig & config, const BoilerModel * model):
+      config_(config), plant_(plantParams(config, model), 20),
+					    gpio_(&clock_, &plant_, config_.pins.boiler_pwm),
+					    hw_(&gpio_, config_.pins, config_.cascade.enabled), sim_(&clock_),
+					    watchdog_(&clock_){
+      if (config_.cascade.enabled) gpio_.setGroupChannel(config_.pins.group_cs);
+      // Power off, pump and steam switches open (inverted inputs read 1 when open)
+      gpio_.setInputLevel(config_.pins.pwr_switch, 0);
+      gpio_.setInputLevel(config_.pins.pump_switch, 1);
+      gpio_.setInputLevel(config_.pins.steam_switch, 1);
+      hw_.bringUp();
+      machine_ = new EspressoMachine(config_, &hw_, &clock_);
+      if (model) machine_->setBoilerModel(*model);
+      watchdog_.open(WATCHDOG_TIMEOUT_SEC);
+      machine_->supervisor()->setWatchdog(&watchdog_);
+    }
+
+    void schedule(double warmup_sec, int shots){
+      gpio_.setInputLevel(config_.pins.pwr_switch, 1);
+      sim_.every(config_.safety.period_sec, [this](){ machine_->supervisor()->poll(); });
+      sim_.every(TICK_SEC, [this](){
+	  machine_->tick();
+	  gpio_.sync();
+	  trace_.push_back({Duration(clock_.now().time_since_epoch()).count(), plant_.temp(),
+		machine_->setpoint(), (double)gpio_.pwmDuty(config_.pins.boiler_pwm), machine_->pumpOn()});
+	});
+      for (int i = 0; i < shots; i++){
+	double start = warmup_sec + i*SHOT_PERIOD_SEC;
+	sim_.at(TimePoint(Duration(start)), [this](){ pump(true); });
+	sim_.at(TimePoint(Duration(start + SHOT_SEC)), [this](){ pump(false); });
+      }
+      double steam_start = warmup_sec + shots*SHOT_PERIOD_SEC;
+      sim_.at(TimePoint(Duration(steam_start)), [this](){ gpio_.setInputLevel(config_.pins.steam_switch, 0); });
+      sim_.at(TimePoint(Duration(steam_start + STEAM_SEC)), [this](){ gpio_.setInputLevel(config_.pins.steam_switch, 1); });
+    }
+
+    /** Record shots. Finished shots are written once a simulated second so runs stay deterministic */
+    void record(ShotRecorder * recorder){
+      machine_->setShotRecorder(recorder);
+      sim_.every(1, [recorder](){ recorder->flush(); });
+    }
+
+    /** Capture thermocouple frames. Full blocks are written once a simulated second like record() */
+    void capture(FrameCapture * capture){
+      hw_.thermocouple()->setCapture(capture);
+      sim_.every(1, [capture](){ capture->flush(); });
+    }
+
+    /** Open circuit the thermocouple for FAULT_SEC starting at sec */
+    void injectFault(double sec){
+      sim_.at(TimePoint(Duration(sec)), [this](){ gpio_.setThermocoupleFault(1); });
+      sim_.at(TimePoint(Duration(sec + FAULT_SEC)), [this](){ gpio_.setThermocoupleFault(0); });
+    }
+
+    void run(double sec, bool realtime){
+      sim_.setRealtime(realtime);
+      sim_.runFor(sec);
+    }
+
+    const std::vector<Sample> & trace(){ return trace_; }
+    double heaterEnergy(){ return plant_.heaterEnergy(); }
+    uint64_t events(){ return sim_.eventsRun(); }
+    SafetySupervisor * supervisor(){ return machine_->supervisor(); }
+    bool watchdogExpired(){ return watchdog_.expired(); }
+    Clock * clock(){ return &clock_; }
+
+    ~Scenario(){ delete machine_; }
+    
+  private:
+    MachineConfig config_;
+    VirtualClock clock_;
+    BoilerPlant plant_;
+    SimulatedBackend gpio_;
+    HardwareContext hw_;
+    Simulation sim_;
+    SimulatedWatchdog watchdog_;
+    EspressoMachine * machine_;
+    std::vector<Sample> trace_;
+
+    void pump(bool on){
+      gpio_.setInputLevel(config_.pins.pump_switch, !on);
+      gpio_.setPump(on);
+    }
+  };
+
+  bool sameTrace(const std::vector<Sample> & a, const std::vector<Sample> & b){
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++){
+      if (memcmp(&a[i].t, &b[i].t, sizeof(double)) || memcmp(&a[i].temp, &b[i].temp, sizeof(double))
+	  || a[i].pwm != b[i].pwm || a[i].pump != b[i].pump) return false;
+    }
+    return true;
+  }
+}
+
+int main(int argc, char ** argv){
+  double warmup_min = 30;
+  int shots = 10;
+  bool realtime = false;
+  double check_sec = 0;
+  double fault_sec = -1;
+  const char * archive_path = NULL;
+  const char * capture_path = NULL;
+  const char * trace_path = NULL;
+  MachineConfig config;
+  BoilerModel model;
+  const BoilerModel * plant_model = NULL;
+  std::string err;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--config") && i+1 < argc){
+      if (!MachineConfig::load(argv[++i], config, err)){
+	fprintf(stderr, "Invalid config %s: %s\n", argv[i], err.c_str());
+	return 2;
+      }
+    }
+    else if (!strcmp(argv[i], "--warmup-min") && i+1 < argc) warmup_min = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--shots") && i+1 < argc) shots = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--trace") && i+1 < argc) trace_path = argv[++i];
+    else if (!strcmp(argv[i], "--realtime")) realtime = true;
+    else if (!strcmp(argv[i], "--check-realtime") && i+1 < argc) check_sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--fault-at") && i+1 < argc) fault_sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--archive") && i+1 < argc) archive_path = argv[++i];
+    else if (!strcmp(argv[i], "--capture") && i+1 < argc) capture_path = argv[++i];
+    else if (!strcmp(argv[i], "--model") && i+1 < argc){
+      if (!BoilerModel::load(argv[++i], model, err)){
+	fprintf(stderr, "Invalid model %s: %s\n", argv[i], err.c_str());
+	return 2;
+      }
+      plant_model = &model;
+    }
+    else {
+      fprintf(stderr, "Usage: %s [--config FILE] [--warmup-min N] [--shots N] [--trace FILE] [--realtime] [--check-realtime SEC] [--fault-at SEC] [--archive FILE] [--model FILE] [--capture FILE]\n", argv[0]);
+      return 2;
+    }
+  }
+  double warmup_sec = warmup_min*60;
+
+  if (check_sec > 0){
+    Scenario virt(config, plant_model), paced(config, plant_model);
+    virt.schedule(warmup_sec, shots);
+    paced.schedule(warmup_sec, shots);
+    virt.run(check_sec, false);
+    paced.run(check_sec, true);
+    bool same = sameTrace(virt.trace(), paced.trace());
+    printf("%zu samples over %.1fs: virtual and real time traces %s\n", virt.trace().size(), check_sec,
+	   same ? "are identical" : "DIFFER");
+    return same ? 0 : 1;
+  }
+
+  Scenario scenario(config, plant_model);
+  scenario.schedule(warmup_sec, shots);
+  if (fault_sec >= 0) scenario.injectFault(fault_sec);
+  ShotArchiveWriter * archive = NULL;
+  ShotRecorder * recorder = NULL;
+  if (archive_path){
+    archive = new ShotArchiveWriter(archive_path);
+    if (!archive->open(err)){
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+    }
+    recorder = new ShotRecorder(archive, ARCHIVE_EPOCH_MS, config.machine_id);
+    scenario.record(recorder);
+  }
+  FrameCapture * capture = NULL;
+  if (capture_path){
+    capture = new FrameCapture(capture_path, ARCHIVE_EPOCH_MS, scenario.clock());
+    if (!capture->open(err)){
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+    }
+    scenario.capture(capture);
+  }
+  double steam_start = warmup_sec + shots*SHOT_PERIOD_SEC;
+  double total_sec = steam_start + STEAM_SEC;
+  std::chrono::steady_clock::time_point wall_start = std::chrono::steady_clock::now();
+  scenario.run(total_sec, realtime);
+  double wall_sec = Duration(std::chrono::steady_clock::now() - wall_start).count();
+  const std::vector<Sample> & trace = scenario.trace();
+
+  // Warm-up: time to first get within 1C and the worst overshoot before the first shot
+  double settle_t = -1, overshoot = 0;
+  for (const Sample & s : trace){
+    if (s.t >= warmup_sec) break;
+    if (settle_t < 0 && std::fabs(s.temp - s.setpoint) <= 1) settle_t = s.t;
+    overshoot = std::fmax(overshoot, s.temp - s.setpoint);
+  }
+  printf("Simulated %.0fs (%zu ticks, %lu events) in %.3fs wall time, %.0fx real time\n",
+	 total_sec, trace.size(), (unsigned long)scenario.events(), wall_sec, total_sec/wall_sec);
+  printf("Warm-up: within 1C after %.1fs, max overshoot %.2fC\n", settle_t, overshoot);
+
+  // Shots: worst sag during the shot and how long until back within 1C
+  for (int i = 0; i < shots; i++){
+    double start = warmup_sec + i*SHOT_PERIOD_SEC;
+    double min_temp = 1e9, recovered_t = -1;
+    for (const Sample & s : trace){
+      if (s.t < start || s.t >= start + SHOT_PERIOD_SEC) continue;
+      if (s.t < start + SHOT_SEC) min_temp = std::fmin(min_temp, s.temp);
+      else if (recovered_t < 0 && std::fabs(s.temp - s.setpoint) <= 1) recovered_t = s.t - start - SHOT_SEC;
+    }
+    printf("Shot %2d: min %.2fC, back within 1C %.1fs after the pump stopped\n", i+1, min_temp, recovered_t);
+  }
+  // Brew to steam: time to get within 2C of the steam setpoint and the worst overshoot after that
+  double steam_t = -1, steam_overshoot = 0;
+  for (const Sample & s : trace){
+    if (s.t < steam_start) continue;
+    if (steam_t < 0 && std::fabs(s.temp - config.temps.steam) <= 2) steam_t = s.t - steam_start;
+    if (steam_t >= 0) steam_overshoot = std::fmax(steam_overshoot, s.temp - config.temps.steam);
+  }
+  printf("Brew to steam: within 2C after %.1fs, max overshoot %.2fC\n", steam_t, steam_overshoot);
+  printf("Heater energy: %.1f Wh\n", scenario.heaterEnergy()/3600);
+
+  // Safety: trips, how long after the fault the heater was cut, and whether the watchdog was starved
+  SafetySupervisor::ReactionStats stats = scenario.supervisor()->reactionStats();
+  printf("Safety: %lu trips", stats.trips);
+  if (fault_sec >= 0 && stats.trips){
+    double cut_sec = Duration(scenario.supervisor()->lastTripTime().time_since_epoch()).count();
+    printf(", heater cut %.0fms after the fault (%.3fms processing)", (cut_sec - fault_sec)*1000, stats.last_sec*1000);
+  }
+  printf(", watchdog %s\n", scenario.watchdogExpired() ? "EXPIRED" : "ok");
+  if (recorder){
+    recorder->flush();
+    printf("Archive: %lu shots recorded, %lu dropped, %lu bytes\n", recorder->recorded(), recorder->dropped(),
+	   (unsigned long)archive->bytesWritten());
+  }
+  if (capture){
+    capture->stop();
+    printf("Capture: %lu frames, %lu dropped\n", capture->captured(), capture->dropped());
+  }
+
+  if (trace_path){
+    FILE * f = fopen(trace_path, "w");
+    if (!f){
+      fprintf(stderr, "Could not open %s\n", trace_path);
+      return 1;
+    }
+    fprintf(f, "t,temp,setpoint,pwm,pump\n");
+    for (const Sample & s : trace) fprintf(f, "%.3f,%.4f,%.2f,%.0f,%d\n", s.t, s.temp, s.setpoint, s.pwm, s.pump);
+    fclose(f);
+  }
+  delete capture;
+  delete recorder;
+  delete archive;
+  return 0;
+}
@@ -0,0 +1,353 @@
+/**
+ * Checks TelemetryServer over loopback. It binds 127.0.0.1 on a free port and, as a client would:
+ * reads the state as JSON; sets setpoints, gains and the mode and checks the Commands that land in
+ * the CommandQueue; checks out of range setpoints and bad parameters are refused with nothing
+ * queued, and that a request that doesn't fit in the queue is refused whole; sends two pipelined
+ * requests and expects both answered; checks a huge or malformed Content-Length is refused; and opens a WebSocket, with a ping right behind the upgrade,
+ * and expects the pong, a keyframe and then deltas of only what changed.
+ *
+ * A WebSocket client that never reads is then left connected while a writer thread stands in for
+ * the control loop and publishes state every millisecond. The client must be dropped once its
+ * buffer fills, a new client must still be served, and the writer must never have waited.
+ *
+ * Also checks the constructor leaves no descriptors open when it throws. Exits 1 if anything fails.
+ *
+ * Usage: telemetry_check
+ */
+#include "../../include/RaspberryLatte/TelemetryServer.hpp"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+using namespace RaspLatte;
+
+namespace {
+  const size_t CLIENT_BUFFER_BYTES = 4096;
+  const int TIMEOUT_MS = 2000;
+
+  int failures = 0;
+
+  void check(bool ok, const char * what){
+    if (!ok){
+      printf("FAIL: %s\n", what);
+      failures++;
+    }
+  }
+
+  int openFds(){
+    int n = 0;
+    DIR * d = opendir("/proc/self/fd");
+    if (d == NULL) return -1;
+    while (readdir(d) != NULL) n++;
+    closedir(d);
+    return n;
+  }
+
+  int connectTo(uint16_t port, int rcvbuf = 0){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    timeval tv = {TIMEOUT_MS/1000, (TIMEOUT_MS % 1000)*1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0){
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  bool sendAll(int fd, const std::string & data){
+    return send(fd, data.data(), data.size(), MSG_NOSIGNAL) == (ssize_t)data.size();
+  }
+
+  /** Everything until the server closes (or the timeout) */
+  std::string readAll(int fd){
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) out.append(buf, n);
+    return out;
+  }
+
+  /** One request on its own connection, the whole response back */
+  std::string request(uint16_t port, const std::string & method, const std::string & target){
+    int fd = connectTo(port);
+    if (fd < 0) return "";
+    sendAll(fd, method + " " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    std::string response = readAll(fd);
+    close(fd);
+    return response;
+  }
+
+  bool status(const std::string & response, int code){
+    return response.compare(0, 12, "HTTP/1.1 " + std::to_string(code)) == 0;
+  }
+
+  int drain(CommandQueue & commands){
+    Command c;
+    int n = 0;
+    while (commands.pop(c)) n++;
+    return n;
+  }
+
+  MachineState sampleState(){
+    MachineState s;
+    s.seq = 1;
+    s.time_s = 12.5;
+    s.mode = BREW;
+    s.temp = 93.5;
+    s.setpoint = 95;
+    s.pwm = 120;
+    s.setpoints = {95, 150};
+    s.gains = {{100, 0.25, 250}, {100, 0, 250}};
+    return s;
+  }
+
+  void checkREST(TripleBuffer<MachineState> & state, CommandQueue & commands, uint16_t port){
+    state.write(sampleState());
+    std::string r = request(port, "GET", "/api/state");
+    size_t body = r.find("\r\n\r\n");
+    check(status(r, 200) && body != std::string::npos && r[body + 4] == '{' && r.back() == '}'
+	  && r.find("\"temp\":93.50") != std::string::npos && r.find("\"mode\":\"brew\"") != std::string::npos,
+	  "GET /api/state returns the state as JSON");
+    check(status(request(port, "POST", "/api/state"), 405), "POST /api/state is refused");
+    check(status(request(port, "GET", "/api/nothing"), 404), "unknown endpoints are 404");
+
+    Command c;
+    r = request(port, "POST", "/api/setpoint?brew=94.5&steam=140");
+    bool ok = status(r, 202) && commands.pop(c) && c.type == Command::SET_SETPOINT && c.mode == BREW && c.setpoint == 94.5
+      && commands.pop(c) && c.type == Command::SET_SETPOINT && c.mode == STEAM && c.setpoint == 140 && !commands.pop(c);
+    check(ok, "POST /api/setpoint queues a SET_SETPOINT for each mode");
+    const char * bad[] = {"/api/setpoint?brew=500", "/api/setpoint?brew=94&steam=-40", "/api/setpoint?brew=0",
+			  "/api/setpoint?brew=abc", "/api/setpoint?brew=nan", "/api/setpoint",
+			  "/api/gains?mode=brew&p=-1", "/api/gains?mode=off&p=1", "/api/mode?mode=espresso"};
+    for (const char * target : bad){
+      char what[96];
+      snprintf(what, sizeof(what), "POST %s is a 400 with nothing queued", target);
+      check(status(request(port, "POST", target), 400) && drain(commands) == 0, what);
+    }
+
+    r = request(port, "POST", "/api/gains?mode=steam&p=50");
+    ok = status(r, 202) && commands.pop(c) && c.type == Command::SET_GAINS && c.mode == STEAM && c.gains.p == 50
+      && c.gains.i == 0 && c.gains.d == 250 && !commands.pop(c);
+    check(ok, "POST /api/gains queues a SET_GAINS keeping the gains not given");
+
+    r = request(port, "POST", "/api/mode?mode=steam");
+    ok = status(r, 202) && commands.pop(c) && c.type == Command::SET_MODE && c.mode == STEAM;
+    r = request(port, "POST", "/api/mode?mode=auto");
+    ok &= status(r, 202) && commands.pop(c) && c.type == Command::CLEAR_MODE && !commands.pop(c);
+    check(ok, "POST /api/mode queues SET_MODE, and CLEAR_MODE for auto");
+
+    // One free slot: a request for two is refused whole
+    size_t fill = CommandQueue::capacity() - 1;
+    for (size_t i = 0; i < fill; i++) commands.push({Command::CLEAR_MODE, OFF, 0, {0, 0, 0}});
+    r = request(port, "POST", "/api/setpoint?brew=94&steam=140");
+    check(status(r, 503) && drain(commands) == (int)fill, "a request that doesn't fit is a 503 with nothing queued");
+
+    // Two requests in one write
+    int fd = connectTo(port);
+    sendAll(fd, "GET /api/state HTTP/1.1\r\n\r\nGET /api/machines HTTP/1.1\r\n\r\n");
+    r = readAll(fd);
+    close(fd);
+    check(status(r, 200) && r.find("HTTP/1.1 200", 12) != std::string::npos && r.find("\"machines\":1") != std::string::npos,
+	  "pipelined requests are both answered");
+
+    // A length that would wrap the request size is dropped, and one that isn't a number refused
+    fd = connectTo(port);
+    sendAll(fd, "POST /api/mode?mode=brew HTTP/1.1\r\nContent-Length: 18446744073709551615\r\n\r\n");
+    r = readAll(fd);
+    close(fd);
+    check(r.empty() && drain(commands) == 0, "a Content-Length too big for a request closes the connection");
+    const char * lengths[] = {"-1", "abc", "12x"};
+    bool refused = true;
+    for (const char * length : lengths){
+      fd = connectTo(port);
+      sendAll(fd, std::string("POST /api/mode?mode=brew HTTP/1.1\r\nContent-Length: ") + length + "\r\n\r\n");
+      refused = refused && status(readAll(fd), 400);
+      close(fd);
+    }
+    check(refused && drain(commands) == 0, "a Content-Length that isn't a number is a 400");
+  }
+
+  /** Read one server frame. False on timeout */
+  bool readFrame(int fd, uint8_t & opcode, std::string & payload){
+    uint8_t h[2];
+    if (recv(fd, h, 2, MSG_WAITALL) != 2) return false;
+    size_t len = h[1] & 0x7F;
+    if (len == 126){
+      uint8_t ext[2];
+      if (recv(fd, ext, 2, MSG_WAITALL) != 2) return false;
+      len = (ext[0] << 8) | ext[1];
+    }
+    opcode = h[0] & 0x0F;
+    payload.resize(len);
+    return len == 0 || recv(fd, &payload[0], len, MSG_WAITALL) == (ssize_t)len;
+  }
+
+  uint32_t getU32(const std::string & s, size_t at){
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= (uint32_t)(uint8_t)s[at + i] << (8*i);
+    return v;
+  }
+
+  /** A masked client frame */
+  std::string clientFrame(uint8_t opcode, const std::string & payload){
+    const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+    std::string f(1, (char)(0x80 | opcode));
+    f += (char)(0x80 | payload.size());
+    f.append((const char*)mask, 4);
+    for (size_t i = 0; i < payload.size(); i++) f += (char)(payload[i] ^ mask[i % 4]);
+    return f;
+  }
+
+  /** Open a WebSocket. Returns the fd, or -1, with the handshake response in response */
+  int openWebSocket(uint16_t port, const std::string & after, std::string & response, int rcvbuf = 0){
+    int fd = connectTo(port, rcvbuf);
+    if (fd < 0) return -1;
+    // The key and accept from RFC 6455
+    sendAll(fd, "GET /ws HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n" + after);
+    response.clear();
+    char ch;
+    while (response.find("\r\n\r\n") == std::string::npos && recv(fd, &ch, 1, 0) == 1) response += ch;
+    return fd;
+  }
+
+  void checkWebSocket(TripleBuffer<MachineState> & state, uint16_t port){
+    MachineState s = sampleState();
+    state.write(s);
+    std::string response;
+    int fd = openWebSocket(port, clientFrame(0x9, "hi"), response);
+    check(status(response, 101) && response.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") != std::string::npos,
+	  "WebSocket handshake");
+
+    uint8_t opcode;
+    std::string payload;
+    bool pong = false, key = false;
+    // The pong and the keyframe, in either order
+    for (int i = 0; i < 2 && readFrame(fd, opcode, payload); i++){
+      if (opcode == 0xA) pong = (payload == "hi");
+      else if (opcode == 0x2 && payload.size() >= 9 && payload[0] == 'K'){
+	uint32_t mask = getU32(payload, 5);
+	float temp;
+	uint32_t bits = getU32(payload, 9 + 4*4);
+	memcpy(&temp, &bits, sizeof(temp));
+	key = (mask == 0x1FFFF && payload.size() == 9 + 17*4 && temp == 93.5f);
+      }
+    }
+    check(pong, "a ping sent right behind the upgrade is answered");
+    check(key, "a new WebSocket client gets a keyframe of every field first");
+
+    s.seq++;
+    s.temp = 94.25;
+    state.write(s);
+    bool delta = readFrame(fd, opcode, payload) && opcode == 0x2 && payload.size() == 13 && payload[0] == 'D'
+      && getU32(payload, 1) == s.seq && getU32(payload, 5) == (1u << 4);
+    float temp = 0;
+    if (delta){
+      uint32_t bits = getU32(payload, 9);
+      memcpy(&temp, &bits, sizeof(temp));
+    }
+    check(delta && temp == 94.25f, "then deltas of only the fields that changed");
+    close(fd);
+  }
+
+  void checkSlowClient(TripleBuffer<MachineState> & state, TelemetryServer & server, uint16_t port){
+    std::string response;
+    int slow = openWebSocket(port, "", response, 1024);
+    check(status(response, 101), "slow client connects");
+
+    // The control loop: every field changed, each millisecond. Spinning would starve the server on one core.
+    std::atomic<bool> done{false};
+    double worst_us = 0;
+    unsigned long writes = 0;
+    std::thread writer([&](){
+	MachineState s = sampleState();
+	while (!done.load()){
+	  s.seq++;
+	  s.time_s += 0.5;
+	  s.temp += 0.01;
+	  s.pwm = (s.seq % 255);
+	  s.error_sum += 0.1;
+	  s.slope = -s.slope + 0.01;
+	  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	  state.write(s);
+	  worst_us = std::max(worst_us, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+	  writes++;
+	  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+      });
+    std::chrono::steady_clock::time_point give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (server.droppedClients() == 0 && std::chrono::steady_clock::now() < give_up){
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    done.store(true);
+    writer.join();
+    check(server.droppedClients() == 1, "a WebSocket client that never reads is dropped once its buffer fills");
+    check(status(request(port, "GET", "/api/state"), 200), "other clients are still served");
+    printf("Slow client dropped after %lu state writes, slowest write %.1fus\n", writes, worst_us);
+    // Publishing is a copy and a swap. Anything near a millisecond means it waited on the server.
+    check(worst_us < 1000, "the control side never waits on the server");
+    close(slow);
+  }
+
+  void checkConstructorFds(uint16_t port_in_use){
+    TripleBuffer<MachineState> state;
+    CommandQueue commands;
+    int before = openFds();
+    const char * addresses[] = {"not an address", "127.0.0.1"}; // The second on a port in use
+    for (const char * address : addresses){
+      TelemetryServer::TelemetrySettings settings = {.address = address, .port = port_in_use, .frame_rate_hz = 10,
+						     .max_clients = 4, .client_buffer_bytes = CLIENT_BUFFER_BYTES};
+      bool threw = false;
+      try {
+	TelemetryServer server(&state, &commands, settings);
+      } catch (const char *){
+	threw = true;
+      }
+      check(threw, "a bad address or a port in use throws");
+    }
+    check(openFds() == before, "a constructor that throws leaves no descriptors open");
+  }
+}
+
+int main(int argc, char ** argv){
+  if (argc > 1){
+    fprintf(stderr, "Usage: %s\n", argv[0]);
+    return 2;
+  }
+
+  TripleBuffer<MachineState> state;
+  CommandQueue commands;
+  // A fast frame rate so a client that doesn't read falls behind quickly
+  TelemetryServer::TelemetrySettings settings = {.address = "127.0.0.1", .port = 0, .frame_rate_hz = 1000,
+						 .max_clients = 8, .client_buffer_bytes = CLIENT_BUFFER_BYTES};
+  TelemetryServer server(&state, &commands, settings);
+  uint16_t port = server.port();
+  check(port != 0, "port() is the port bound");
+  server.start();
+
+  checkREST(state, commands, port);
+  checkWebSocket(state, port);
+  checkSlowClient(state, server, port);
+  checkConstructorFds(port);
+  server.stop();
+
+  printf("%s\n", (failures ? "FAIL" : "OK"));
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,198 @@
+/**
+ * Checks TrendHistory against the raw samples it was fed. --hours of samples at uneven intervals,
+ * with loop stalls and unreadable temperatures, go into a TrendHistory and are kept on the side;
+ * every bucket it still holds at each resolution is then compared with the min, max, mean and count
+ * worked out again from those samples, and each ring must be full and evenly spaced. Exits 1 on the
+ * first wrong bucket.
+ *
+ * It then runs a simulated machine for a few minutes and checks its trend follows the ticks, and
+ * prints the fixed size of a TrendHistory, what add() costs, and what drawing a chart's worth of
+ * columns from buckets costs against scanning the raw samples for the same span.
+ *
+ * Usage: trend_check [--hours N]
+ */
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+#include "../../include/RaspberryLatte/TrendHistory.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace RaspLatte;
+
+namespace {
+  const int CHART_COLS = 68; /** As in RaspberryLatteUI */
+
+  int failures = 0;
+
+  void check(bool ok, const char * what){
+    if (!ok){
+      printf("FAIL: %s\n", what);
+      failures++;
+    }
+  }
+
+  struct Sample{
+    double t;
+    double v[TrendHistory::SERIES];
+  };
+
+  /** Deterministic, so a failure can be reproduced */
+  class Random{
+  public:
+    double next(){
+      state_ = state_*6364136223846793005ULL + 1442695040888963407ULL;
+      return (state_ >> 11)*(1.0/9007199254740992.0);
+    }
+  private:
+    uint64_t state_ = 1;
+  };
+
+  std::vector<Sample> feed(TrendHistory & trend, double hours){
+    std::vector<Sample> samples;
+    Random rnd;
+    double t = 0;
+    double setpoint = 93;
+    while (t < hours*3600){
+      Sample s;
+      s.t = t;
+      if (rnd.next() < 0.001) setpoint = (setpoint == 93 ? 130 : 93);
+      s.v[TrendHistory::TEMP] = (rnd.next() < 0.01 ? MAX31855_TEMP_UNAVALIBLE
+				 : setpoint + 2*std::sin(t/37) + rnd.next() - 0.5);
+      s.v[TrendHistory::SETPOINT] = setpoint;
+      s.v[TrendHistory::PWM] = std::floor(255*rnd.next());
+      trend.add(s.t, s.v[0], s.v[1], s.v[2]);
+      samples.push_back(s);
+      // Mostly the fast and slow loop periods, now and then a stall of up to a few minutes
+      double r = rnd.next();
+      t += (r < 0.0005 ? 300*rnd.next() : r < 0.5 ? 0.05 : 0.5 + 0.5*rnd.next());
+    }
+    return samples;
+  }
+
+  void checkBuckets(const TrendHistory & trend, const std::vector<Sample> & samples){
+    for (int level = 0; level < TrendHistory::LEVELS; level++){
+      double res = TrendHistory::resolution(level);
+      int n = trend.size(level);
+      char what[128];
+      snprintf(what, sizeof(what), "%.0fs ring is full", res);
+      check(n == TrendHistory::CAPACITY, what);
+      int64_t newest = trend.bucket(level, 0).index;
+      // Samples are in time order, so walk back from the end once per level
+      size_t end = samples.size();
+      for (int age = 0; age < n; age++){
+	const TrendHistory::Bucket & b = trend.bucket(level, age);
+	if (b.index != newest - age){
+	  snprintf(what, sizeof(what), "%.0fs bucket %d is %lld, not %lld", res, age, (long long)b.index,
+		   (long long)(newest - age));
+	  check(false, what);
+	  return;
+	}
+	size_t begin = end;
+	while (begin > 0 && (int64_t)std::floor(samples[begin - 1].t/res) >= b.index) begin--;
+	for (int s = 0; s < TrendHistory::SERIES; s++){
+	  double lo = INFINITY, hi = -INFINITY, sum = 0;
+	  uint32_t count = 0;
+	  for (size_t i = begin; i < end; i++){
+	    double v = samples[i].v[s];
+	    if (s == TrendHistory::TEMP && v == MAX31855_TEMP_UNAVALIBLE) continue;
+	    lo = std::min(lo, v);
+	    hi = std::max(hi, v);
+	    sum += v;
+	    count++;
+	  }
+	  const TrendHistory::Aggregate & a = b.series[s];
+	  bool ok = (a.count == count);
+	  if (ok && count) ok = (a.min == (float)lo && a.max == (float)hi && std::fabs(a.mean() - sum/count) < 1e-9);
+	  if (!ok){
+	    snprintf(what, sizeof(what), "%.0fs bucket %d series %d: %u samples %.3f to %.3f mean %.3f, expected %u %.3f to %.3f mean %.3f",
+		     res, age, s, a.count, a.min, a.max, a.mean(), count, lo, hi, (count ? sum/count : 0));
+	    check(false, what);
+	    return;
+	  }
+	}
+	end = begin;
+      }
+    }
+  }
+
+  /** A simulated machine's trend gets every tick */
+  void checkMachine(){
+    MachineConfig config;
+    VirtualClock clock;
+    Simulation sim(&clock);
+    SimulatedMachine machine(config, 20, &clock);
+    EspressoMachine * m = machine.machine();
+    SafetySupervisor * s = m->supervisor();
+    sim.every(s->periodSec(), [s](){ s->poll(); });
+    sim.every(EspressoMachine::LOOP_PERIOD_SEC, [m](){ m->tick(); });
+    sim.runFor(600);
+    const TrendHistory * trend = m->trend();
+    const TrendHistory::Bucket & last = trend->bucket(0, 1);
+    check(trend->size(0) == TrendHistory::CAPACITY && trend->size(2) == 11, "ten minutes of buckets");
+    check(last.series[TrendHistory::TEMP].count == (uint32_t)std::lround(1/EspressoMachine::LOOP_PERIOD_SEC),
+	  "a second's bucket holds a second of ticks");
+    check(std::fabs(last.series[TrendHistory::TEMP].mean() - m->boiler()->currentTemp()) < 1
+	  && last.series[TrendHistory::SETPOINT].mean() == m->boiler()->setpoint(), "the trend follows the boiler");
+  }
+}
+
+int main(int argc, char ** argv){
+  double hours = 8;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--hours") && i+1 < argc) hours = atof(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [--hours N]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (!(hours >= 5)){
+    fprintf(stderr, "Need --hours of at least 5 to fill the 1 minute ring\n");
+    return 2;
+  }
+
+  TrendHistory * trend = new TrendHistory;
+  std::vector<Sample> samples = feed(*trend, hours);
+  checkBuckets(*trend, samples);
+  checkMachine();
+  printf("%zu samples over %.0f hours in %zu bytes (fixed)\n", samples.size(), hours, sizeof(TrendHistory));
+
+  const int adds = 1000000;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < adds; i++) trend->add(hours*3600 + i*0.05, 93 + (i % 7)*0.1, 93, i % 256);
+  double add_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()/adds;
+
+  // A 1 minute chart both ways: its buckets, or the samples of the same span folded per column
+  const int draws = 1000;
+  volatile double sink = 0; // Keep the work
+  start = std::chrono::steady_clock::now();
+  for (int d = 0; d < draws; d++){
+    double lo, hi;
+    trend->range(2, TrendHistory::TEMP, CHART_COLS, lo, hi);
+    for (int age = 0; age < CHART_COLS; age++) sink = sink + trend->bucket(2, age).series[TrendHistory::TEMP].mean();
+  }
+  double bucket_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()/draws;
+  double span = CHART_COLS*TrendHistory::resolution(2);
+  size_t first = samples.size();
+  while (first > 0 && samples[first - 1].t >= samples.back().t - span) first--;
+  start = std::chrono::steady_clock::now();
+  for (int d = 0; d < draws/10; d++){
+    double cols[CHART_COLS] = {0};
+    for (size_t i = first; i < samples.size(); i++){
+      int col = std::min(CHART_COLS - 1, (int)((samples[i].t - samples[first].t)/TrendHistory::resolution(2)));
+      cols[col] = std::max(cols[col], samples[i].v[TrendHistory::TEMP]);
+    }
+    sink = sink + cols[0];
+  }
+  double raw_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()/(draws/10);
+  printf("add(): %.1fns. A %d column chart of %.0f min: %.2fus from buckets, %.0fus from %zu raw samples\n", add_ns,
+	 CHART_COLS, span/60, bucket_us, raw_us, samples.size() - first);
+  delete trend;
+
+  printf("%s\n", (failures ? "FAIL" : "OK"));
+  return (failures ? 1 : 0);
+}
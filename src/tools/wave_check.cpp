@@ -0,0 +1,192 @@
+/**
+ * Compares 8 bit PWM with the sigma-delta heater waveform (heater.waveform, see HeaterWaveform) on a
+ * simulated backend.
+ *
+ * Open loop, a HeaterGate is asked for duties with fractions, over and over at the control loop
+ * period, and the heater's mean on time is compared with what was asked. PWM drops the fraction;
+ * the waveform should carry it. The same is done with ticks at the adaptive loop's fast rate and
+ * with ticks late enough that patterns repeat, which the waveform has to account for. It fails if
+ * the waveform resolves less than --bits bits of the duty over --sec seconds, or if tripping the
+ * gate leaves the waveform running.
+ *
+ * Closed loop, a simulated machine holds the brew setpoint with each and the mean error and spread
+ * of the water temperature are printed, along with what a waveform costs per tick.
+ *
+ * Usage: wave_check [--config FILE] [--sec S] [--bits B]
+ */
+#include "../../include/RaspberryLatte/MachineHost.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace RaspLatte;
+
+namespace {
+  const PinIndex HEATER_PIN = 12;
+  const double DUTIES[] = {0.3, 1.5, 37.25, 100, 100.125, 100.5, 100.875, 180.6, 254.9};
+  const double WARMUP_SEC = 900;
+  const double HOLD_SEC = 600;
+  const double SAMPLE_SEC = 0.1;
+
+  int failures = 0;
+
+  void check(bool ok, const char * what){
+    if (!ok){
+      printf("FAIL: %s\n", what);
+      failures++;
+    }
+  }
+
+  /** Accepts every write, for timing the waveform on its own */
+  class NullBackend : public GPIOBackend{
+  public:
+    bool initialise(){ return true; }
+    void setInput(PinIndex, Pull){}
+    void setOutput(PinIndex){}
+    int read(PinIndex){ return 0; }
+    void write(PinIndex, bool){}
+    void setPWMFrequency(PinIndex, unsigned int){}
+    void pwm(PinIndex, unsigned int){}
+    bool wave(PinIndex, const WavePulse *, unsigned int){ return true; }
+    int spiOpen(unsigned int, SPIBaud, unsigned int){ return 0; }
+    int spiRead(int, char *, unsigned int count){ return count; }
+    void spiClose(int){}
+  };
+
+  /**
+   * Largest error in the mean duty, in 1/255ths, over sec of ticks every tick_sec, across DUTIES.
+   * wave NULL for PWM.
+   */
+  double worstError(const HeaterWaveform::WaveformSettings * wave, double tick_sec, double sec){
+    double worst = 0;
+    for (double duty : DUTIES){
+      VirtualClock clock;
+      BoilerPlant plant(BoilerPlant::defaultParams(), 20);
+      SimulatedBackend gpio(&clock, &plant, HEATER_PIN);
+      HeaterGate gate(&gpio, HEATER_PIN);
+      if (wave != NULL) gate.setWaveform(*wave, &clock);
+      long ticks = std::lround(sec/tick_sec);
+      for (long i = 0; i < ticks; i++){
+	gate.set(duty);
+	clock.advance(Duration(tick_sec));
+      }
+      double mean = 255*gpio.heaterOnSec()/(ticks*tick_sec);
+      worst = std::max(worst, std::fabs(mean - duty));
+    }
+    return worst;
+  }
+
+  double bits(double error){ return (error > 0 ? std::log2(255/error) : INFINITY); }
+
+  void checkTrip(const HeaterWaveform::WaveformSettings & wave){
+    VirtualClock clock;
+    BoilerPlant plant(BoilerPlant::defaultParams(), 20);
+    SimulatedBackend gpio(&clock, &plant, HEATER_PIN);
+    HeaterGate gate(&gpio, HEATER_PIN);
+    gate.setWaveform(wave, &clock);
+    gate.set(200.5);
+    clock.advance(Duration(1));
+    check(gpio.heaterOnSec() > 0.5, "the waveform heats");
+    gate.trip();
+    double on = gpio.heaterOnSec();
+    gate.set(200.5);
+    clock.advance(Duration(2));
+    check(gpio.heaterOnSec() == on && gpio.pwmDuty(HEATER_PIN) == 0, "a trip stops the waveform and holds it off");
+    gate.release();
+    gate.set(255);
+    clock.advance(Duration(1));
+    check(std::fabs(gpio.heaterOnSec() - on - 1) < 1e-6, "the waveform starts again after a release");
+  }
+
+  /** Mean error and peak to peak of the water temperature while holding the brew setpoint */
+  void hold(const MachineConfig & config, double & offset, double & spread){
+    VirtualClock clock;
+    Simulation sim(&clock);
+    SimulatedMachine machine(config, 20, &clock);
+    EspressoMachine * m = machine.machine();
+    SafetySupervisor * s = m->supervisor();
+    sim.every(s->periodSec(), [s](){ s->poll(); });
+    sim.every(EspressoMachine::LOOP_PERIOD_SEC, [m](){ m->tick(); });
+    sim.runFor(WARMUP_SEC);
+    double sum = 0, lo = INFINITY, hi = -INFINITY;
+    unsigned long n = 0;
+    sim.every(SAMPLE_SEC, [&](){
+	machine.gpio()->sync();
+	double t = machine.plant()->temp();
+	sum += t - m->setpoint();
+	lo = std::min(lo, t);
+	hi = std::max(hi, t);
+	n++;
+      });
+    sim.runFor(HOLD_SEC);
+    offset = sum/n;
+    spread = hi - lo;
+  }
+}
+
+int main(int argc, char ** argv){
+  MachineConfig config;
+  std::string err;
+  double sec = 60;
+  double min_bits = 11;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--config") && i+1 < argc){
+      if (!MachineConfig::load(argv[++i], config, err)){
+	fprintf(stderr, "Invalid config %s: %s\n", argv[i], err.c_str());
+	return 2;
+      }
+    }
+    else if (!strcmp(argv[i], "--sec") && i+1 < argc) sec = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--bits") && i+1 < argc) min_bits = atof(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [--config FILE] [--sec S] [--bits B]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (!(sec > 0)){
+    fprintf(stderr, "Need a positive --sec\n");
+    return 2;
+  }
+  HeaterWaveform::WaveformSettings wave = config.heater_wave;
+  wave.enabled = true;
+
+  printf("Worst mean duty error over %.0fs, in 1/255ths (effective bits)\n", sec);
+  struct { const char * name; double tick_sec; } runs[] = {
+    {"loop period", EspressoMachine::LOOP_PERIOD_SEC}, {"fast loop", config.loop.fast_period_sec},
+    {"late ticks", 1.7*wave.pattern_sec}};
+  for (auto & r : runs){
+    double pwm = worstError(NULL, r.tick_sec, sec);
+    double w = worstError(&wave, r.tick_sec, sec);
+    printf("  %-12s every %.2fs: PWM %.4f (%.1f), waveform %.4f (%.1f)\n", r.name, r.tick_sec, pwm, bits(pwm), w,
+	   bits(w));
+    char what[96];
+    snprintf(what, sizeof(what), "waveform resolves %.0f bits with ticks every %.2fs", min_bits, r.tick_sec);
+    check(bits(w) >= min_bits, what);
+  }
+
+  checkTrip(wave);
+
+  MachineConfig pwm_config = config, wave_config = config;
+  pwm_config.heater_wave.enabled = false;
+  wave_config.heater_wave = wave;
+  double pwm_offset, pwm_spread, wave_offset, wave_spread;
+  hold(pwm_config, pwm_offset, pwm_spread);
+  hold(wave_config, wave_offset, wave_spread);
+  printf("Holding %.0fC for %.0fs, mean error and peak to peak: PWM %+.3fC %.3fC, waveform %+.3fC %.3fC\n",
+	 config.temps.brew, HOLD_SEC, pwm_offset, pwm_spread, wave_offset, wave_spread);
+
+  NullBackend null;
+  HeaterWaveform timed(&null, HEATER_PIN, wave);
+  const int calls = 100000;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) timed.set(100 + (i % 100)*0.01);
+  double set_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()/calls;
+  printf("Building a %u slot pattern: %.2fus per tick, nothing between ticks\n", timed.slots(), set_us);
+
+  printf("%s\n", (failures ? "FAIL" : "OK"));
+  return (failures ? 1 : 0);
+}